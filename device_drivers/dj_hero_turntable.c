@@ -3,6 +3,9 @@
 #include "usb.h"
 #include "usb_hid.h"
 #include "wiimote.h"
+
+#define TURNTABLE_PS3_DEADZONE 2
+
 struct turntable_input_report {
     uint8_t : 4;
     uint8_t triangle_euphoria : 1;
@@ -110,12 +113,15 @@ bool turntable_report_input(const struct turntable_input_report *report, usb_inp
         device->wpadData.extension_data.turntable.stick[0] = 10;
     }
 
-    int8_t ltt = (report->left_turn_table_velocity - 126) >> 2;
-    device->wpadData.extension_data.turntable.ltt_sign = ltt >= 0;
-    device->wpadData.extension_data.turntable.ltt = ltt;
-    int8_t rtt = (report->right_turn_table_velocity - 126) >> 2;
-    device->wpadData.extension_data.turntable.rtt_sign = rtt < 0;
-    device->wpadData.extension_data.turntable.rtt = rtt;
+    // Platters rest at 0x80 and jitter by one either side of it
+    int32_t ltt = report->left_turn_table_velocity - 0x80;
+    if (ltt >= TURNTABLE_PS3_DEADZONE || ltt <= -TURNTABLE_PS3_DEADZONE) {
+        turntable_platter_add(&device->platters, TURNTABLE_PLATTER_LEFT, (ltt * (1 << TURNTABLE_FRAC_BITS)) >> game_profile->turntable_shift);
+    }
+    int32_t rtt = report->right_turn_table_velocity - 0x80;
+    if (rtt >= TURNTABLE_PS3_DEADZONE || rtt <= -TURNTABLE_PS3_DEADZONE) {
+        turntable_platter_add(&device->platters, TURNTABLE_PLATTER_RIGHT, (rtt * (1 << TURNTABLE_FRAC_BITS)) >> game_profile->turntable_shift);
+    }
     device->wpadData.extension_data.turntable.crossFader = __builtin_bswap16(report->cross_fader) >> 6;
     device->wpadData.extension_data.turntable.effectsDial = __builtin_bswap16(report->effects_knob) >> 5;
 
@@ -154,6 +160,7 @@ int turntable_driver_ops_usb_async_resp(usb_input_device_t *device) {
 const usb_device_driver_t turntable_usb_device_driver = {
     .probe = turntable_driver_ops_probe,
     .hid = true,
+    .report_interval_ms = 10,
     .init = turntable_driver_ops_init,
     .disconnect = turntable_driver_ops_disconnect,
     .usb_async_resp = turntable_driver_ops_usb_async_resp,
@@ -79,42 +79,27 @@ bool gh_drum_report_input(const struct drum_input_report *report, usb_input_devi
     uint8_t velocity = 0x7F;
     uint8_t note = 0x7F;
     if (report->greenVelocity) {
-        note = GREEN;
+        note = game_profile->drum_notes[DRUM_PAD_GREEN];
         velocity = report->greenVelocity;
     } else if (report->redVelocity) {
-        note = RED;
+        note = game_profile->drum_notes[DRUM_PAD_RED];
         velocity = report->redVelocity;
     } else if (report->yellowVelocity) {
-        note = YELLOW;
+        note = game_profile->drum_notes[DRUM_PAD_YELLOW];
         velocity = report->yellowVelocity;
     } else if (report->blueVelocity) {
-        note = BLUE;
+        note = game_profile->drum_notes[DRUM_PAD_BLUE];
         velocity = report->blueVelocity;
     } else if (report->orangeVelocity) {
-        note = ORANGE;
+        note = game_profile->drum_notes[DRUM_PAD_ORANGE];
         velocity = report->orangeVelocity;
     } else if (report->kickVelocity) {
-        note = KICK_PEDAL;
+        note = game_profile->drum_notes[DRUM_PAD_KICK];
         velocity = report->kickVelocity;
     } else {
         device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
     }
-    velocity = 0x7F - velocity;
-    note = 0x7F - note;
-    device->wpadData.extension_data.drum.velocity0 = ~velocity;
-    device->wpadData.extension_data.drum.velocity1 = ~velocity >> 1;
-    device->wpadData.extension_data.drum.velocity2 = velocity >> 2;
-    device->wpadData.extension_data.drum.velocity3 = velocity >> 3;
-    device->wpadData.extension_data.drum.velocity4 = velocity >> 4;
-    device->wpadData.extension_data.drum.velocity5 = velocity >> 5;
-    device->wpadData.extension_data.drum.velocity6 = velocity >> 6;
-    device->wpadData.extension_data.drum.note0 = note;
-    device->wpadData.extension_data.drum.note1 = note >> 1;
-    device->wpadData.extension_data.drum.note2 = note >> 2;
-    device->wpadData.extension_data.drum.note3 = note >> 3;
-    device->wpadData.extension_data.drum.note4 = note >> 4;
-    device->wpadData.extension_data.drum.note5 = note >> 5;
-    device->wpadData.extension_data.drum.note6 = note >> 6;
+    wiimote_drum_hit(&device->wpadData, note, velocity);
 
 	// UP
 	if (report->hat == 0 || report->hat == 1 || report->hat == 7) {
@@ -148,6 +133,7 @@ int gh_drum_driver_ops_usb_async_resp(usb_input_device_t *device) {
 const usb_device_driver_t gh_drum_usb_device_driver = {
     .probe = gh_drum_driver_ops_probe,
     .hid = true,
+    .report_interval_ms = 10,
     .init = gh_drum_driver_ops_init,
     .disconnect = gh_drum_driver_ops_disconnect,
     .usb_async_resp = gh_drum_driver_ops_usb_async_resp,
@@ -116,10 +116,7 @@ bool gh_guitar_report_input(const struct guitar_input_report *report, usb_input_
         device->wpadData.extension_data.guitar.stick[0] = 10;
     }
 
-    device->wpadData.extension_data.guitar.whammy = report->whammy_bar;
-    if (device->old_wpad) {
-        device->wpadData.extension_data.guitar.whammy = report->whammy_bar - 0x80;
-    }
+    device->wpadData.extension_data.guitar.whammy = report->whammy_bar - 0x80 + game_profile->whammy_base;
     device->wpadData.status = WPAD_STATUS_OK;
 
     // TODO: tap bar
@@ -136,6 +133,7 @@ int gh_guitar_driver_ops_usb_async_resp(usb_input_device_t *device) {
 const usb_device_driver_t gh_guitar_usb_device_driver = {
     .probe = gh_guitar_driver_ops_probe,
     .hid = true,
+    .report_interval_ms = 10,
     .init = gh_guitar_driver_ops_init,
     .disconnect = gh_guitar_driver_ops_disconnect,
     .usb_async_resp = gh_guitar_driver_ops_usb_async_resp,
@@ -0,0 +1,154 @@
+#include <string.h>
+
+#include "rvl/WPAD.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+
+/* USB-MIDI event packets, from the USB MIDI Devices 1.0 spec: a cable number
+ * and code index in the first byte, then the MIDI message itself. A bulk
+ * transfer carries as many as fit, a kit sends several per hit. */
+#define MIDI_PACKET_SIZE 64
+#define MIDI_CIN_NOTE_ON 0x9
+
+struct midi_event_packet {
+    uint8_t cable : 4;
+    uint8_t code_index : 4;
+    uint8_t status;
+    uint8_t note;
+    uint8_t velocity;
+} __attribute__((packed));
+
+/* Velocity curves, applied per pad */
+enum {
+    MIDI_DRUM_CURVE_LINEAR,
+    MIDI_DRUM_CURVE_SOFT,
+    MIDI_DRUM_CURVE_HARD,
+    MIDI_DRUM_CURVE_COUNT
+};
+
+/* Cymbals are struck glancingly and read low, so quiet hits are lifted. Kick
+ * triggers read high from the beater's weight, so they are brought down. */
+static const uint8_t midi_drum_pad_curve[DRUM_PAD_COUNT] = {
+    [DRUM_PAD_GREEN] = MIDI_DRUM_CURVE_LINEAR,
+    [DRUM_PAD_RED] = MIDI_DRUM_CURVE_LINEAR,
+    [DRUM_PAD_YELLOW] = MIDI_DRUM_CURVE_SOFT,
+    [DRUM_PAD_BLUE] = MIDI_DRUM_CURVE_LINEAR,
+    [DRUM_PAD_ORANGE] = MIDI_DRUM_CURVE_SOFT,
+    [DRUM_PAD_KICK] = MIDI_DRUM_CURVE_HARD,
+};
+
+static uint8_t midi_drum_curves[MIDI_DRUM_CURVE_COUNT][128];
+
+static void midi_drum_curves_init(void) {
+    for (int i = 0; i < 128; i++) {
+        // Integer square root of i/127, scaled back up to 0-127
+        int r = 0;
+        while ((r + 1) * (r + 1) <= i * 127)
+            r++;
+        midi_drum_curves[MIDI_DRUM_CURVE_LINEAR][i] = i;
+        midi_drum_curves[MIDI_DRUM_CURVE_SOFT][i] = r;
+        midi_drum_curves[MIDI_DRUM_CURVE_HARD][i] = i * i / 127;
+    }
+}
+
+/* General MIDI percussion notes, as most kits send them by default, and the
+ * pad of a five pad kit that sits in the same place. -1 for notes to ignore. */
+static int midi_drum_pad_from_note(uint8_t note) {
+    switch (note) {
+        case 35: // Acoustic bass drum
+        case 36: // Bass drum
+            return DRUM_PAD_KICK;
+        case 37: // Side stick
+        case 38: // Snare
+        case 40: // Electric snare
+            return DRUM_PAD_RED;
+        case 22: // Hi-hat edge, closed (Roland)
+        case 26: // Hi-hat edge, open (Roland)
+        case 42: // Closed hi-hat
+        case 46: // Open hi-hat
+        case 49: // Crash 1
+            return DRUM_PAD_YELLOW;
+        case 45: // Low tom
+        case 47: // Low-mid tom
+        case 48: // Hi-mid tom
+        case 50: // High tom
+            return DRUM_PAD_BLUE;
+        case 41: // Low floor tom
+        case 43: // High floor tom
+            return DRUM_PAD_GREEN;
+        case 51: // Ride
+        case 52: // China
+        case 53: // Ride bell
+        case 55: // Splash
+        case 57: // Crash 2
+        case 59: // Ride 2
+            return DRUM_PAD_ORANGE;
+        default:
+            // Includes the hi-hat pedal (44), which isn't a hit
+            return -1;
+    }
+}
+
+static inline int midi_drum_request_data(usb_input_device_t *device) {
+    // Only the bytes that were sent are written, and we aren't told how many
+    memset(device->usb_async_resp, 0, MIDI_PACKET_SIZE);
+    return usb_device_driver_issue_bulk_transfer_async(device, false, device->usb_async_resp,
+                                                       MIDI_PACKET_SIZE);
+}
+
+bool midi_drum_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    // Any vendor's kit will do, main.c finds them by their MIDI streaming interface
+    return false;
+}
+
+int midi_drum_driver_ops_init(usb_input_device_t *device) {
+    if (!midi_drum_curves[MIDI_DRUM_CURVE_LINEAR][127])
+        midi_drum_curves_init();
+
+    device->extension = WPAD_EXTENSION_DRUM;
+    device->wpadData.extension = WPAD_EXTENSION_DRUM;
+    device->format = WPAD_FORMAT_DRUM;
+    device->wpadData.buttons = 0;
+    device->wpadData.extension_data.drum.buttons = 0;
+    device->wpadData.extension_data.drum.stick[0] = 0;
+    device->wpadData.extension_data.drum.stick[1] = 0;
+    // Hits come from the queue, on the read that takes them
+    device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
+    device->wpadData.status = WPAD_STATUS_OK;
+
+    // Kept in flight from here on, the kit only answers when it is hit
+    return midi_drum_request_data(device);
+}
+
+int midi_drum_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+void midi_drum_report_input(const uint8_t *packet, usb_input_device_t *device) {
+    const struct midi_event_packet *event = (const struct midi_event_packet *)packet;
+    const struct midi_event_packet *end = event + MIDI_PACKET_SIZE / sizeof(*event);
+    for (; event < end; event++) {
+        // A note on with no velocity is how running status sends a note off
+        if (event->code_index != MIDI_CIN_NOTE_ON || !event->velocity)
+            continue;
+        int pad = midi_drum_pad_from_note(event->note & 0x7F);
+        if (pad < 0)
+            continue;
+        drum_hit_push(&device->drum_hits, pad, midi_drum_curves[midi_drum_pad_curve[pad]][event->velocity & 0x7F]);
+    }
+}
+
+int midi_drum_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    midi_drum_report_input(device->usb_async_resp, device);
+    return midi_drum_request_data(device);
+}
+
+const usb_device_driver_t midi_drum_usb_device_driver = {
+    .probe = midi_drum_driver_ops_probe,
+    .hid = false,
+    // Only reports when hit
+    .report_interval_ms = 0,
+    .init = midi_drum_driver_ops_init,
+    .disconnect = midi_drum_driver_ops_disconnect,
+    .usb_async_resp = midi_drum_driver_ops_usb_async_resp,
+};
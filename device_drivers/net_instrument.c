@@ -0,0 +1,154 @@
+#include "rvl/WPAD.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+
+/* Instruments played over the network. main.c puts each datagram into
+ * usb_async_resp as though it were a report, and there is no next one to ask
+ * for. The type picked when the instrument appeared is the pid. */
+
+bool net_instrument_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    // Never a USB device
+    return false;
+}
+
+int net_instrument_driver_ops_init(usb_input_device_t *device) {
+    switch (device->pid) {
+        case NET_INSTRUMENT_GUITAR:
+            device->extension = WPAD_EXTENSION_GUITAR;
+            device->format = WPAD_FORMAT_GUITAR;
+            device->gravityUnit[0].acceleration[0] = ACCEL_G_UNIT;
+            device->gravityUnit[0].acceleration[1] = ACCEL_G_UNIT;
+            device->gravityUnit[0].acceleration[2] = ACCEL_G_UNIT;
+            break;
+        case NET_INSTRUMENT_DRUM:
+            device->extension = WPAD_EXTENSION_DRUM;
+            device->format = WPAD_FORMAT_DRUM;
+            break;
+        case NET_INSTRUMENT_TURNTABLE:
+            device->extension = WPAD_EXTENSION_TURNTABLE;
+            device->format = WPAD_FORMAT_TURNTABLE;
+            break;
+        default:
+            return -1;
+    }
+    device->wpadData.extension = device->extension;
+    return 0;
+}
+
+int net_instrument_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+static int16_t net_instrument_stick(int8_t stick, uint32_t buttons, uint32_t minus, uint32_t plus) {
+    if (buttons & minus) {
+        return -10;
+    }
+    if (buttons & plus) {
+        return 10;
+    }
+    return stick;
+}
+
+static void net_guitar_report_input(const struct net_instrument_packet *packet, usb_input_device_t *device) {
+    uint32_t buttons = packet->buttons;
+
+    device->wpadData.acceleration[0] = packet->tilt * ACCEL_G_UNIT / 127;
+    device->wpadData.acceleration[1] = 0;
+    device->wpadData.acceleration[2] = 0;
+
+    device->wpadData.extension_data.guitar.buttons = 0;
+    device->wpadData.extension_data.guitar.green = (buttons & NET_BUTTON_GREEN) != 0;
+    device->wpadData.extension_data.guitar.red = (buttons & NET_BUTTON_RED) != 0;
+    device->wpadData.extension_data.guitar.yellow = (buttons & NET_BUTTON_YELLOW) != 0;
+    device->wpadData.extension_data.guitar.blue = (buttons & NET_BUTTON_BLUE) != 0;
+    device->wpadData.extension_data.guitar.orange = (buttons & NET_BUTTON_ORANGE) != 0;
+    device->wpadData.extension_data.guitar.plus = (buttons & NET_BUTTON_PLUS) != 0;
+    device->wpadData.extension_data.guitar.minus = (buttons & NET_BUTTON_MINUS) != 0;
+    device->wpadData.extension_data.guitar.dpadUp = (buttons & NET_BUTTON_UP) != 0;
+    device->wpadData.extension_data.guitar.dpadDown = (buttons & NET_BUTTON_DOWN) != 0;
+    device->wpadData.extension_data.guitar.stick[0] = net_instrument_stick(packet->stick[0], buttons, NET_BUTTON_LEFT, NET_BUTTON_RIGHT);
+    device->wpadData.extension_data.guitar.stick[1] = packet->stick[1];
+
+    device->wpadData.extension_data.guitar.whammy = (packet->whammy >> 1) + game_profile->whammy_base;
+    device->wpadData.extension_data.guitar.tapbar = 0x1E0;
+}
+
+static void net_drum_report_input(const struct net_instrument_packet *packet, usb_input_device_t *device) {
+    uint32_t buttons = packet->buttons;
+
+    device->wpadData.extension_data.drum.buttons = 0;
+    device->wpadData.extension_data.drum.green = (buttons & NET_BUTTON_GREEN) != 0;
+    device->wpadData.extension_data.drum.red = (buttons & NET_BUTTON_RED) != 0;
+    device->wpadData.extension_data.drum.yellow = (buttons & NET_BUTTON_YELLOW) != 0;
+    device->wpadData.extension_data.drum.blue = (buttons & NET_BUTTON_BLUE) != 0;
+    device->wpadData.extension_data.drum.orange = (buttons & NET_BUTTON_ORANGE) != 0;
+    device->wpadData.extension_data.drum.pedal = (buttons & NET_BUTTON_KICK) != 0;
+    device->wpadData.extension_data.drum.plus = (buttons & NET_BUTTON_PLUS) != 0;
+    device->wpadData.extension_data.drum.minus = (buttons & NET_BUTTON_MINUS) != 0;
+    device->wpadData.extension_data.drum.stick[0] = net_instrument_stick(packet->stick[0], buttons, NET_BUTTON_LEFT, NET_BUTTON_RIGHT);
+    device->wpadData.extension_data.drum.stick[1] = net_instrument_stick(packet->stick[1], buttons, NET_BUTTON_DOWN, NET_BUTTON_UP);
+
+    // One hit per report, the first pad with a velocity
+    device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
+    for (int pad = 0; pad < DRUM_PAD_COUNT; pad++) {
+        if (packet->velocity[pad]) {
+            device->wpadData.extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
+            wiimote_drum_hit(&device->wpadData, game_profile->drum_notes[pad], packet->velocity[pad] >> 1);
+            return;
+        }
+    }
+    wiimote_drum_hit(&device->wpadData, 0x7F, 0x7F);
+}
+
+static void net_turntable_report_input(const struct net_instrument_packet *packet, usb_input_device_t *device) {
+    uint32_t buttons = packet->buttons;
+
+    device->wpadData.extension_data.turntable.buttons = 0;
+    device->wpadData.extension_data.turntable.leftGreen = (buttons & NET_BUTTON_GREEN) != 0;
+    device->wpadData.extension_data.turntable.leftRed = (buttons & NET_BUTTON_RED) != 0;
+    device->wpadData.extension_data.turntable.leftBlue = (buttons & NET_BUTTON_BLUE) != 0;
+    device->wpadData.extension_data.turntable.rightGreen = (buttons & NET_BUTTON_RIGHT_GREEN) != 0;
+    device->wpadData.extension_data.turntable.rightRed = (buttons & NET_BUTTON_RIGHT_RED) != 0;
+    device->wpadData.extension_data.turntable.rightBlue = (buttons & NET_BUTTON_RIGHT_BLUE) != 0;
+    device->wpadData.extension_data.turntable.euphoria = (buttons & NET_BUTTON_EUPHORIA) != 0;
+    device->wpadData.extension_data.turntable.plus = (buttons & NET_BUTTON_PLUS) != 0;
+    device->wpadData.extension_data.turntable.minus = (buttons & NET_BUTTON_MINUS) != 0;
+    device->wpadData.extension_data.turntable.stick[0] = net_instrument_stick(packet->stick[0], buttons, NET_BUTTON_LEFT, NET_BUTTON_RIGHT);
+    device->wpadData.extension_data.turntable.stick[1] = net_instrument_stick(packet->stick[1], buttons, NET_BUTTON_DOWN, NET_BUTTON_UP);
+
+    // Already a delta, so no deadzone, unlike a platter's velocity
+    turntable_platter_add(&device->platters, TURNTABLE_PLATTER_LEFT, (packet->platter[0] * (1 << TURNTABLE_FRAC_BITS)) >> game_profile->turntable_shift);
+    turntable_platter_add(&device->platters, TURNTABLE_PLATTER_RIGHT, (packet->platter[1] * (1 << TURNTABLE_FRAC_BITS)) >> game_profile->turntable_shift);
+    device->wpadData.extension_data.turntable.crossFader = packet->cross_fader >> 4;
+    device->wpadData.extension_data.turntable.effectsDial = packet->effects_dial >> 3;
+}
+
+int net_instrument_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    const struct net_instrument_packet *packet = (const void *)device->usb_async_resp;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = (packet->buttons & NET_BUTTON_HOME) != 0;
+    switch (device->pid) {
+        case NET_INSTRUMENT_GUITAR:
+            net_guitar_report_input(packet, device);
+            break;
+        case NET_INSTRUMENT_DRUM:
+            net_drum_report_input(packet, device);
+            break;
+        case NET_INSTRUMENT_TURNTABLE:
+            net_turntable_report_input(packet, device);
+            break;
+    }
+    device->wpadData.status = WPAD_STATUS_OK;
+    return 0;
+}
+
+const usb_device_driver_t net_instrument_usb_device_driver = {
+    .probe = net_instrument_driver_ops_probe,
+    .hid = false,
+    // No interval, so the watchdog leaves it alone
+    .report_interval_ms = 0,
+    .init = net_instrument_driver_ops_init,
+    .disconnect = net_instrument_driver_ops_disconnect,
+    .usb_async_resp = net_instrument_driver_ops_usb_async_resp,
+};
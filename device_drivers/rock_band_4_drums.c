@@ -0,0 +1,161 @@
+#include "rvl/WPAD.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+
+/* PS4 Rock Band 4 kits, through their dongles. A DS4 report, with a velocity
+ * per head after where the DS4 keeps its touchpad. Hits also press the face
+ * buttons and the d-pad, the velocities are what tells pads from cymbals. */
+struct rb4_drum_input_report {
+    uint8_t report_id;
+    uint8_t left_x;
+    uint8_t left_y;
+    uint8_t right_x;
+    uint8_t right_y;
+
+    uint8_t triangle : 1;
+    uint8_t circle : 1;
+    uint8_t cross : 1;
+    uint8_t square : 1;
+    uint8_t dpad : 4;
+
+    uint8_t r3 : 1;
+    uint8_t l3 : 1;
+    uint8_t options : 1;
+    uint8_t share : 1;
+    uint8_t r2 : 1;
+    uint8_t l2 : 1;
+    uint8_t r1 : 1;  // second kick pedal
+    uint8_t l1 : 1;  // kick pedal
+
+    uint8_t cnt1 : 6;
+    uint8_t tpad : 1;
+    uint8_t ps : 1;
+
+    uint8_t unused0[35];
+
+    uint8_t redVelocity;
+    uint8_t blueVelocity;
+    uint8_t yellowVelocity;
+    uint8_t greenVelocity;
+    uint8_t yellowCymbalVelocity;
+    uint8_t blueCymbalVelocity;
+    uint8_t greenCymbalVelocity;
+
+    uint8_t unused1[14];
+} __attribute__((packed));
+
+static inline int rb4_drum_request_data(usb_input_device_t *device) {
+    return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp,
+                                                       sizeof(struct rb4_drum_input_report));
+}
+
+bool rb4_drum_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    static const struct device_id_t compatible[] = {
+        {MADCATZ_VID, RB4_MADCATZ_DRUM_PID},
+        {PDP_VID, RB4_PDP_DRUM_PID}};
+
+    return usb_driver_is_comaptible(vid, pid, compatible, ARRAY_SIZE(compatible));
+}
+
+int rb4_drum_driver_ops_init(usb_input_device_t *device) {
+    device->extension = WPAD_EXTENSION_DRUM;
+    device->wpadData.extension = WPAD_EXTENSION_DRUM;
+    device->format = WPAD_FORMAT_DRUM;
+
+    // The dongle has no LEDs to set, start reading straight away
+    return rb4_drum_request_data(device);
+}
+
+int rb4_drum_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+bool rb4_drum_report_input(const struct rb4_drum_input_report *report, usb_input_device_t *device) {
+    // Red has no cymbal. Cymbals all go to orange, as on the 360 kits.
+    bool cymbal = report->yellowCymbalVelocity || report->blueCymbalVelocity || report->greenCymbalVelocity;
+    bool kick = report->l1 || report->r1;
+    bool hit = cymbal || report->redVelocity || report->yellowVelocity || report->blueVelocity || report->greenVelocity;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = report->ps;
+    device->wpadData.extension_data.drum.buttons = 0;
+    device->wpadData.extension_data.drum.red = report->redVelocity != 0;
+    device->wpadData.extension_data.drum.yellow = report->yellowVelocity != 0;
+    device->wpadData.extension_data.drum.blue = report->blueVelocity != 0;
+    device->wpadData.extension_data.drum.green = report->greenVelocity != 0;
+    device->wpadData.extension_data.drum.orange = cymbal;
+    device->wpadData.extension_data.drum.pedal = kick;
+    device->wpadData.extension_data.drum.plus = report->options;
+    device->wpadData.extension_data.drum.minus = report->share;
+    device->wpadData.extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
+
+    uint8_t velocity = 0x7F;
+    uint8_t note = 0x7F;
+    if (report->redVelocity) {
+        note = game_profile->drum_notes[DRUM_PAD_RED];
+        velocity = report->redVelocity >> 1;
+    } else if (report->yellowVelocity) {
+        note = game_profile->drum_notes[DRUM_PAD_YELLOW];
+        velocity = report->yellowVelocity >> 1;
+    } else if (report->blueVelocity) {
+        note = game_profile->drum_notes[DRUM_PAD_BLUE];
+        velocity = report->blueVelocity >> 1;
+    } else if (report->greenVelocity) {
+        note = game_profile->drum_notes[DRUM_PAD_GREEN];
+        velocity = report->greenVelocity >> 1;
+    } else if (cymbal) {
+        note = game_profile->drum_notes[DRUM_PAD_ORANGE];
+        velocity = report->yellowCymbalVelocity;
+        if (report->blueCymbalVelocity > velocity)
+            velocity = report->blueCymbalVelocity;
+        if (report->greenCymbalVelocity > velocity)
+            velocity = report->greenCymbalVelocity;
+        velocity >>= 1;
+    } else if (kick) {
+        // The pedal has no velocity sensor
+        note = game_profile->drum_notes[DRUM_PAD_KICK];
+    } else {
+        device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
+    }
+    wiimote_drum_hit(&device->wpadData, note, velocity);
+
+    // Hits also press the d-pad, it only navigates when nothing was hit
+    device->wpadData.extension_data.drum.stick[0] = 0;
+    device->wpadData.extension_data.drum.stick[1] = 0;
+    if (!hit) {
+        // UP
+        if (report->dpad == 0 || report->dpad == 1 || report->dpad == 7) {
+            device->wpadData.extension_data.drum.stick[1] = 10;
+        }
+        // DOWN
+        if (report->dpad == 3 || report->dpad == 4 || report->dpad == 5) {
+            device->wpadData.extension_data.drum.stick[1] = -10;
+        }
+        // LEFT
+        if (report->dpad == 5 || report->dpad == 6 || report->dpad == 7) {
+            device->wpadData.extension_data.drum.stick[0] = -10;
+        }
+        // RIGHT
+        if (report->dpad == 1 || report->dpad == 2 || report->dpad == 3) {
+            device->wpadData.extension_data.drum.stick[0] = 10;
+        }
+    }
+
+    device->wpadData.status = WPAD_STATUS_OK;
+    return true;
+}
+
+int rb4_drum_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    struct rb4_drum_input_report *report = (void *)device->usb_async_resp;
+    rb4_drum_report_input(report, device);
+    return rb4_drum_request_data(device);
+}
+
+const usb_device_driver_t rb4_drum_usb_device_driver = {
+    .probe = rb4_drum_driver_ops_probe,
+    .hid = true,
+    .report_interval_ms = 4,
+    .init = rb4_drum_driver_ops_init,
+    .disconnect = rb4_drum_driver_ops_disconnect,
+    .usb_async_resp = rb4_drum_driver_ops_usb_async_resp,
+};
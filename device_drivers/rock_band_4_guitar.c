@@ -0,0 +1,136 @@
+#include "rvl/WPAD.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+
+/* Frets are a mask, the upper and lower (solo) ones separately */
+#define RB4_FRET_GREEN 0x01
+#define RB4_FRET_RED 0x02
+#define RB4_FRET_YELLOW 0x04
+#define RB4_FRET_BLUE 0x08
+#define RB4_FRET_ORANGE 0x10
+
+/* PS4 Rock Band 4 guitars, through their dongles. A DS4 report, with the
+ * guitar's own state after where the DS4 keeps its touchpad. */
+struct rb4_guitar_input_report {
+    uint8_t report_id;
+    uint8_t left_x;
+    uint8_t left_y;
+    uint8_t right_x;
+    uint8_t right_y;
+
+    uint8_t triangle : 1;
+    uint8_t circle : 1;
+    uint8_t cross : 1;
+    uint8_t square : 1;
+    uint8_t dpad : 4;
+
+    uint8_t r3 : 1;
+    uint8_t l3 : 1;
+    uint8_t options : 1;
+    uint8_t share : 1;
+    uint8_t r2 : 1;
+    uint8_t l2 : 1;
+    uint8_t r1 : 1;
+    uint8_t l1 : 1;
+
+    uint8_t cnt1 : 6;
+    uint8_t tpad : 1;
+    uint8_t ps : 1;
+
+    uint8_t unused0[35];
+
+    // Five detents, GH has no effects switch to put it on
+    uint8_t pickup;
+    uint8_t whammy;
+    uint8_t tilt;
+    uint8_t upper_frets;
+    uint8_t lower_frets;
+
+    uint8_t unused1[16];
+} __attribute__((packed));
+
+static inline int rb4_guitar_request_data(usb_input_device_t *device) {
+    return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp,
+                                                       sizeof(struct rb4_guitar_input_report));
+}
+
+bool rb4_guitar_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    static const struct device_id_t compatible[] = {
+        {MADCATZ_VID, RB4_MADCATZ_GUITAR_PID},
+        {PDP_VID, RB4_PDP_GUITAR_PID}};
+
+    return usb_driver_is_comaptible(vid, pid, compatible, ARRAY_SIZE(compatible));
+}
+
+int rb4_guitar_driver_ops_init(usb_input_device_t *device) {
+    device->extension = WPAD_EXTENSION_GUITAR;
+    device->wpadData.extension = WPAD_EXTENSION_GUITAR;
+    device->format = WPAD_FORMAT_GUITAR;
+
+    device->gravityUnit[0].acceleration[0] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[1] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[2] = ACCEL_G_UNIT;
+
+    // The dongle has no LEDs to set, start reading straight away
+    return rb4_guitar_request_data(device);
+}
+
+int rb4_guitar_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+bool rb4_guitar_report_input(const struct rb4_guitar_input_report *report, usb_input_device_t *device) {
+    uint8_t frets = report->upper_frets | report->lower_frets;
+
+    // 0 flat to 0xFF with the neck straight up, scaled to a 360 guitar's
+    device->wpadData.acceleration[0] = (report->tilt << 2) - 511;
+    device->wpadData.acceleration[1] = 0;
+    device->wpadData.acceleration[2] = 0;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = report->ps;
+    device->wpadData.extension_data.guitar.buttons = 0;
+    device->wpadData.extension_data.guitar.green = (frets & RB4_FRET_GREEN) != 0;
+    device->wpadData.extension_data.guitar.red = (frets & RB4_FRET_RED) != 0;
+    device->wpadData.extension_data.guitar.yellow = (frets & RB4_FRET_YELLOW) != 0;
+    device->wpadData.extension_data.guitar.blue = (frets & RB4_FRET_BLUE) != 0;
+    device->wpadData.extension_data.guitar.orange = (frets & RB4_FRET_ORANGE) != 0;
+    device->wpadData.extension_data.guitar.plus = report->options;
+    device->wpadData.extension_data.guitar.minus = report->share;
+
+    device->wpadData.extension_data.guitar.stick[0] = 0;
+    device->wpadData.extension_data.guitar.stick[1] = 0;
+    device->wpadData.extension_data.guitar.dpadUp = report->dpad == 0 || report->dpad == 1 || report->dpad == 7;
+    device->wpadData.extension_data.guitar.dpadDown = report->dpad == 3 || report->dpad == 4 || report->dpad == 5;
+
+    // LEFT
+    if (report->dpad == 5 || report->dpad == 6 || report->dpad == 7) {
+        device->wpadData.extension_data.guitar.stick[0] = -10;
+    }
+
+    // RIGHT
+    if (report->dpad == 1 || report->dpad == 2 || report->dpad == 3) {
+        device->wpadData.extension_data.guitar.stick[0] = 10;
+    }
+
+    device->wpadData.extension_data.guitar.whammy = (report->whammy >> 1) + game_profile->whammy_base;
+    device->wpadData.extension_data.guitar.tapbar = 0x1E0;
+    device->wpadData.status = WPAD_STATUS_OK;
+
+    return true;
+}
+
+int rb4_guitar_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    struct rb4_guitar_input_report *report = (void *)device->usb_async_resp;
+    rb4_guitar_report_input(report, device);
+    return rb4_guitar_request_data(device);
+}
+
+const usb_device_driver_t rb4_guitar_usb_device_driver = {
+    .probe = rb4_guitar_driver_ops_probe,
+    .hid = true,
+    .report_interval_ms = 4,
+    .init = rb4_guitar_driver_ops_init,
+    .disconnect = rb4_guitar_driver_ops_disconnect,
+    .usb_async_resp = rb4_guitar_driver_ops_usb_async_resp,
+};
@@ -0,0 +1,160 @@
+#include "rvl/WPAD.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+
+#define RB_DRUM_HAT_UP 0
+#define RB_DRUM_HAT_DOWN 4
+
+/* PS3 and Wii Rock Band kits. A hit presses its colour and flags whether it
+ * was a pad or a cymbal. Pro kits also press up on the hat for the yellow
+ * cymbal and down for the blue one, which is how a cymbal and a pad of two
+ * colours hit together are told apart. */
+struct rb_drum_input_report {
+    uint8_t : 2;
+    uint8_t kick2 : 1;
+    uint8_t kick1 : 1;
+    uint8_t yellow : 1;
+    uint8_t red : 1;
+    uint8_t green : 1;
+    uint8_t blue : 1;
+
+    uint8_t : 3;
+    uint8_t ps : 1;
+    uint8_t cymbal : 1;
+    uint8_t pad : 1;
+    uint8_t start : 1;
+    uint8_t select : 1;
+
+    uint8_t hat;
+    uint8_t unused1[8];
+
+    uint8_t yellowVelocity;
+    uint8_t redVelocity;
+    uint8_t greenVelocity;
+    uint8_t blueVelocity;
+    uint8_t unused2[4];
+    uint16_t unused3[4];
+} __attribute__((packed));
+
+static inline int rb_drum_request_data(usb_input_device_t *device) {
+    return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp,
+                                                       sizeof(struct rb_drum_input_report));
+}
+
+bool rb_drum_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    static const struct device_id_t compatible[] = {
+        {SONY_INST_VID, RB_DRUM_PID},
+        {HARMONIX_VID, RB_WII_DRUM_PID},
+        {HARMONIX_VID, RB2_WII_DRUM_PID}};
+
+    return usb_driver_is_comaptible(vid, pid, compatible, ARRAY_SIZE(compatible));
+}
+
+int rb_drum_driver_ops_init(usb_input_device_t *device) {
+    int ret;
+    device->extension = WPAD_EXTENSION_DRUM;
+    device->wpadData.extension = WPAD_EXTENSION_DRUM;
+    device->format = WPAD_FORMAT_DRUM;
+
+    ret = ps3_set_leds(device);
+    if (ret < 0)
+        return ret;
+
+    return 0;
+}
+
+int rb_drum_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+/* Kits that don't sense velocity leave it at 0 */
+static inline uint8_t rb_drum_velocity(uint8_t raw) {
+    return raw ? raw >> 1 : 0x7F;
+}
+
+bool rb_drum_report_input(const struct rb_drum_input_report *report, usb_input_device_t *device) {
+    // Red has no cymbal. Cymbals all go to orange, as on the 360 kits.
+    bool yellow_cymbal = report->cymbal && report->yellow && report->hat == RB_DRUM_HAT_UP;
+    bool blue_cymbal = report->cymbal && report->blue && report->hat == RB_DRUM_HAT_DOWN;
+    bool green_cymbal = report->cymbal && report->green && !yellow_cymbal && !blue_cymbal;
+    bool yellow = report->yellow && !yellow_cymbal;
+    bool blue = report->blue && !blue_cymbal;
+    bool green = report->green && !green_cymbal;
+    bool kick = report->kick1 || report->kick2;
+    bool hit = report->red || report->yellow || report->blue || report->green;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = report->ps;
+    device->wpadData.extension_data.drum.buttons = 0;
+    device->wpadData.extension_data.drum.red = report->red;
+    device->wpadData.extension_data.drum.yellow = yellow;
+    device->wpadData.extension_data.drum.blue = blue;
+    device->wpadData.extension_data.drum.green = green;
+    device->wpadData.extension_data.drum.orange = yellow_cymbal || blue_cymbal || green_cymbal;
+    device->wpadData.extension_data.drum.pedal = kick;
+    device->wpadData.extension_data.drum.plus = report->start;
+    device->wpadData.extension_data.drum.minus = report->select;
+    device->wpadData.extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
+
+    uint8_t velocity = 0x7F;
+    uint8_t note = 0x7F;
+    if (report->red) {
+        note = game_profile->drum_notes[DRUM_PAD_RED];
+        velocity = rb_drum_velocity(report->redVelocity);
+    } else if (report->yellow) {
+        note = game_profile->drum_notes[yellow ? DRUM_PAD_YELLOW : DRUM_PAD_ORANGE];
+        velocity = rb_drum_velocity(report->yellowVelocity);
+    } else if (report->blue) {
+        note = game_profile->drum_notes[blue ? DRUM_PAD_BLUE : DRUM_PAD_ORANGE];
+        velocity = rb_drum_velocity(report->blueVelocity);
+    } else if (report->green) {
+        note = game_profile->drum_notes[green ? DRUM_PAD_GREEN : DRUM_PAD_ORANGE];
+        velocity = rb_drum_velocity(report->greenVelocity);
+    } else if (kick) {
+        // The pedal has no velocity sensor
+        note = game_profile->drum_notes[DRUM_PAD_KICK];
+    } else {
+        device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
+    }
+    wiimote_drum_hit(&device->wpadData, note, velocity);
+
+    // Hits also press the hat, it only navigates when nothing was hit
+    device->wpadData.extension_data.drum.stick[0] = 0;
+    device->wpadData.extension_data.drum.stick[1] = 0;
+    if (!hit) {
+        // UP
+        if (report->hat == 0 || report->hat == 1 || report->hat == 7) {
+            device->wpadData.extension_data.drum.stick[1] = 10;
+        }
+        // DOWN
+        if (report->hat == 3 || report->hat == 4 || report->hat == 5) {
+            device->wpadData.extension_data.drum.stick[1] = -10;
+        }
+        // LEFT
+        if (report->hat == 5 || report->hat == 6 || report->hat == 7) {
+            device->wpadData.extension_data.drum.stick[0] = -10;
+        }
+        // RIGHT
+        if (report->hat == 1 || report->hat == 2 || report->hat == 3) {
+            device->wpadData.extension_data.drum.stick[0] = 10;
+        }
+    }
+
+    device->wpadData.status = WPAD_STATUS_OK;
+    return true;
+}
+
+int rb_drum_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    struct rb_drum_input_report *report = (void *)device->usb_async_resp;
+    rb_drum_report_input(report, device);
+    return rb_drum_request_data(device);
+}
+
+const usb_device_driver_t rb_drum_usb_device_driver = {
+    .probe = rb_drum_driver_ops_probe,
+    .hid = true,
+    .report_interval_ms = 10,
+    .init = rb_drum_driver_ops_init,
+    .disconnect = rb_drum_driver_ops_disconnect,
+    .usb_async_resp = rb_drum_driver_ops_usb_async_resp,
+};
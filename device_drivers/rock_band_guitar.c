@@ -0,0 +1,122 @@
+#include "rvl/WPAD.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+
+/* PS3 and Wii Rock Band guitars. The solo frets press the same colours as the
+ * upper ones, with the solo flag. Tilt is a switch, not an accelerometer. */
+struct rb_guitar_input_report {
+    uint8_t : 1;
+    uint8_t solo : 1;
+    uint8_t tilt : 1;
+    uint8_t orange : 1;
+    uint8_t yellow : 1;
+    uint8_t red : 1;
+    uint8_t green : 1;
+    uint8_t blue : 1;
+
+    uint8_t : 3;
+    uint8_t ps : 1;
+    uint8_t : 2;
+    uint8_t start : 1;
+    uint8_t select : 1;
+
+    uint8_t hat;
+
+    uint8_t unused0;
+    uint8_t unused1;
+    uint8_t whammy_bar;
+    // Five detents, GH has no effects switch to put it on
+    uint8_t pickup;
+
+    uint8_t pressure[12];
+    uint16_t unused2[4];
+} __attribute__((packed));
+
+static inline int rb_guitar_request_data(usb_input_device_t *device) {
+    return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp,
+                                                       sizeof(struct rb_guitar_input_report));
+}
+
+bool rb_guitar_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    static const struct device_id_t compatible[] = {
+        {SONY_INST_VID, RB_GUITAR_PID},
+        {HARMONIX_VID, RB_WII_GUITAR_PID},
+        {HARMONIX_VID, RB2_WII_GUITAR_PID}};
+
+    return usb_driver_is_comaptible(vid, pid, compatible, ARRAY_SIZE(compatible));
+}
+
+int rb_guitar_driver_ops_init(usb_input_device_t *device) {
+    int ret;
+    device->extension = WPAD_EXTENSION_GUITAR;
+    device->wpadData.extension = WPAD_EXTENSION_GUITAR;
+    device->format = WPAD_FORMAT_GUITAR;
+
+    device->gravityUnit[0].acceleration[0] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[1] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[2] = ACCEL_G_UNIT;
+    ret = ps3_set_leds(device);
+    if (ret < 0)
+        return ret;
+
+    return 0;
+}
+
+int rb_guitar_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+bool rb_guitar_report_input(const struct rb_guitar_input_report *report, usb_input_device_t *device) {
+    // The neck pointing straight up, as far as the game can tell
+    device->wpadData.acceleration[0] = report->tilt ? ACCEL_G_UNIT : 0;
+    device->wpadData.acceleration[1] = 0;
+    device->wpadData.acceleration[2] = 0;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = report->ps;
+    device->wpadData.extension_data.guitar.buttons = 0;
+    device->wpadData.extension_data.guitar.green = report->green;
+    device->wpadData.extension_data.guitar.red = report->red;
+    device->wpadData.extension_data.guitar.yellow = report->yellow;
+    device->wpadData.extension_data.guitar.blue = report->blue;
+    device->wpadData.extension_data.guitar.orange = report->orange;
+    device->wpadData.extension_data.guitar.plus = report->start;
+    device->wpadData.extension_data.guitar.minus = report->select;
+
+    device->wpadData.extension_data.guitar.stick[0] = 0;
+    device->wpadData.extension_data.guitar.stick[1] = 0;
+    device->wpadData.extension_data.guitar.dpadUp = report->hat == 0 || report->hat == 1 || report->hat == 7;
+    device->wpadData.extension_data.guitar.dpadDown = report->hat == 3 || report->hat == 4 || report->hat == 5;
+
+    // LEFT
+    if (report->hat == 5 || report->hat == 6 || report->hat == 7) {
+        device->wpadData.extension_data.guitar.stick[0] = -10;
+    }
+
+    // RIGHT
+    if (report->hat == 1 || report->hat == 2 || report->hat == 3) {
+        device->wpadData.extension_data.guitar.stick[0] = 10;
+    }
+
+    // Rests at 0, unlike the GH guitar's
+    device->wpadData.extension_data.guitar.whammy = (report->whammy_bar >> 1) + game_profile->whammy_base;
+    device->wpadData.extension_data.guitar.tapbar = 0x1E0;
+    device->wpadData.status = WPAD_STATUS_OK;
+
+    return true;
+}
+
+int rb_guitar_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    struct rb_guitar_input_report *report = (void *)device->usb_async_resp;
+    rb_guitar_report_input(report, device);
+    return rb_guitar_request_data(device);
+}
+
+const usb_device_driver_t rb_guitar_usb_device_driver = {
+    .probe = rb_guitar_driver_ops_probe,
+    .hid = true,
+    .report_interval_ms = 10,
+    .init = rb_guitar_driver_ops_init,
+    .disconnect = rb_guitar_driver_ops_disconnect,
+    .usb_async_resp = rb_guitar_driver_ops_usb_async_resp,
+};
@@ -7,6 +7,7 @@
 #include "wiimote.h"
 
 #define DS3_ACC_RES_PER_G 113
+#define DS3_ACC_ZERO 511
 
 struct ds3_input_report {
     uint8_t report_id;
@@ -113,9 +114,9 @@ int ds3_driver_ops_init(usb_input_device_t *device) {
     device->format = WPAD_FORMAT_CLASSIC;
     device->led_state = 1;
 
-    device->gravityUnit[0].acceleration[0] = ACCEL_ONE_G;
-    device->gravityUnit[0].acceleration[1] = ACCEL_ONE_G;
-    device->gravityUnit[0].acceleration[2] = ACCEL_ONE_G;
+    device->gravityUnit[0].acceleration[0] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[1] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[2] = ACCEL_G_UNIT;
     ret = ds3_set_operational(device);
     if (ret < 0)
         return ret;
@@ -205,6 +206,15 @@ bool ds3_report_input(const struct ds3_input_report *report, usb_input_device_t
     device->wpadData.extension_data.classic.rightStick[0] = (report->right_x << 2) - 512;
     device->wpadData.extension_data.classic.rightStick[1] = (report->right_y << 2) - 512;
 
+    // The sixaxis reports big endian, its X axis points left and Y away from the player
+    if (WPADDataFormatHasAcc(device->currentFormat)) {
+        wiimote_acc_from_pad(&device->wpadData,
+                             DS3_ACC_ZERO - (int16_t)report->acc_x,
+                             (int16_t)report->acc_y - DS3_ACC_ZERO,
+                             (int16_t)report->acc_z - DS3_ACC_ZERO,
+                             ACCEL_SCALE(DS3_ACC_RES_PER_G));
+    }
+
     return true;
 }
 int ds3_driver_ops_usb_async_resp(usb_input_device_t *device) {
@@ -224,6 +234,7 @@ int ds3_driver_ops_usb_async_resp(usb_input_device_t *device) {
 const usb_device_driver_t ds3_usb_device_driver = {
     .probe = ds3_driver_ops_probe,
     .hid = true,
+    .report_interval_ms = 10,
     .init = ds3_driver_ops_init,
     .disconnect = ds3_driver_ops_disconnect,
     .usb_async_resp = ds3_driver_ops_usb_async_resp,
@@ -10,6 +10,16 @@
 #define DS4_TOUCHPAD_H 940
 #define DS4_ACC_RES_PER_G 8192
 
+/* Touchpad and stick units to pointer units, see IR_FRAC_BITS */
+#define DS4_TOUCH_SCALE_X (IR_POINTER_W / DS4_TOUCHPAD_W)
+#define DS4_TOUCH_SCALE_Y (IR_POINTER_H / DS4_TOUCHPAD_H)
+#define DS4_STICK_SCALE_X (IR_POINTER_W / 255)
+#define DS4_STICK_SCALE_Y (IR_POINTER_H / 255)
+/* Pointer speed at full deflection in relative stick mode, about one screen
+ * width a second at the DS4's 250Hz report rate. */
+#define DS4_STICK_SPEED (IR_POINTER_W / 250 / 127)
+#define DS4_STICK_DEADZONE 16
+
 struct ds4_input_report {
     uint8_t report_id;
     uint8_t left_x;
@@ -89,21 +99,6 @@ struct ds4_input_report {
     uint8_t finger2_x_hi : 4;
     uint8_t finger2_y_hi;
 } ATTRIBUTE_PACKED;
-enum bm_ir_emulation_mode_e {
-    BM_IR_EMULATION_MODE_NONE,
-    BM_IR_EMULATION_MODE_DIRECT,
-    BM_IR_EMULATION_MODE_RELATIVE_ANALOG_AXIS,
-    BM_IR_EMULATION_MODE_ABSOLUTE_ANALOG_AXIS,
-};
-enum bm_ir_axis_e {
-    BM_IR_AXIS_NONE,
-    BM_IR_AXIS_X,
-    BM_IR_AXIS_Y,
-    BM_IR_AXIS__NUM = BM_IR_AXIS_Y,
-};
-struct bm_ir_emulation_state_t {
-    uint16_t position[BM_IR_AXIS__NUM];
-};
 
 static inline int ds4_request_data(usb_input_device_t *device) {
     return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp,
@@ -165,9 +160,10 @@ int ds4_driver_ops_init(usb_input_device_t *device) {
     device->wpadData.extension = WPAD_EXTENSION_CLASSIC;
     device->format = WPAD_FORMAT_CLASSIC;
 
-    device->gravityUnit[0].acceleration[0] = ACCEL_ONE_G;
-    device->gravityUnit[0].acceleration[1] = ACCEL_ONE_G;
-    device->gravityUnit[0].acceleration[2] = ACCEL_ONE_G;
+    device->gravityUnit[0].acceleration[0] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[1] = ACCEL_G_UNIT;
+    device->gravityUnit[0].acceleration[2] = ACCEL_G_UNIT;
+    bm_ir_emulation_state_reset(&device->ir_emulation, BM_IR_EMULATION_MODE_DIRECT);
 
     return ds4_driver_update_leds_rumble(device);
 }
@@ -175,6 +171,61 @@ int ds4_driver_ops_disconnect(usb_input_device_t *device) {
     return 0;
 }
 
+static inline int ds4_stick_deflection(uint8_t value) {
+    int deflection = value - 128;
+    if (deflection > -DS4_STICK_DEADZONE && deflection < DS4_STICK_DEADZONE)
+        return 0;
+    return deflection;
+}
+
+/* Clicking the touchpad steps through the pointer modes: the touchpad as the
+ * screen, the touchpad as a trackpad, the right stick moving the pointer and
+ * the right stick as the screen. */
+static void ds4_report_ir(const struct ds4_input_report *report, usb_input_device_t *device) {
+    struct bm_ir_emulation_state_t *ir = &device->ir_emulation;
+    bool touching = !report->finger1_nactive;
+    uint16_t touch_x = report->finger1_x_lo | (report->finger1_x_hi << 8);
+    uint16_t touch_y = report->finger1_y_lo | (report->finger1_y_hi << 4);
+
+    if (report->tpad && !ir->mode_held) {
+        ir->mode++;
+        if (ir->mode == BM_IR_EMULATION_MODE__NUM)
+            ir->mode = BM_IR_EMULATION_MODE_DIRECT;
+    }
+    ir->mode_held = report->tpad;
+
+    switch (ir->mode) {
+    case BM_IR_EMULATION_MODE_DIRECT:
+        if (touching) {
+            ir->position[BM_IR_AXIS_X] = touch_x * DS4_TOUCH_SCALE_X;
+            ir->position[BM_IR_AXIS_Y] = touch_y * DS4_TOUCH_SCALE_Y;
+            bm_ir_emulation_move(ir, 0, 0);
+        }
+        break;
+    case BM_IR_EMULATION_MODE_RELATIVE_TOUCH:
+        if (touching && ir->touching) {
+            bm_ir_emulation_move(ir,
+                                 (touch_x - ir->last_touch[BM_IR_AXIS_X]) * DS4_TOUCH_SCALE_X,
+                                 (touch_y - ir->last_touch[BM_IR_AXIS_Y]) * DS4_TOUCH_SCALE_Y);
+        }
+        break;
+    case BM_IR_EMULATION_MODE_RELATIVE_ANALOG_AXIS:
+        bm_ir_emulation_move(ir,
+                             ds4_stick_deflection(report->right_x) * DS4_STICK_SPEED,
+                             ds4_stick_deflection(report->right_y) * DS4_STICK_SPEED);
+        break;
+    case BM_IR_EMULATION_MODE_ABSOLUTE_ANALOG_AXIS:
+        ir->position[BM_IR_AXIS_X] = report->right_x * DS4_STICK_SCALE_X;
+        ir->position[BM_IR_AXIS_Y] = report->right_y * DS4_STICK_SCALE_Y;
+        break;
+    }
+    ir->touching = touching;
+    ir->last_touch[BM_IR_AXIS_X] = touch_x;
+    ir->last_touch[BM_IR_AXIS_Y] = touch_y;
+
+    bm_ir_dots_set_from_state(&device->wpadData, ir);
+}
+
 bool ds4_report_input(const struct ds4_input_report *report, usb_input_device_t *device) {
     // DS3 to GH3 wiimote mappings
     // device->wpadData.buttons = 0;
@@ -211,6 +262,20 @@ bool ds4_report_input(const struct ds4_input_report *report, usb_input_device_t
     device->wpadData.extension_data.classic.rightStick[0] = (report->right_x << 2) - 512;
     device->wpadData.extension_data.classic.rightStick[1] = (report->right_y << 2) - 512;
 
+    // The DS4's Y axis points out of its face and Z towards the player
+    if (WPADDataFormatHasAcc(device->currentFormat)) {
+        wiimote_acc_from_pad(&device->wpadData,
+                             (int16_t)le16toh(report->accel_x),
+                             -(int16_t)le16toh(report->accel_z),
+                             (int16_t)le16toh(report->accel_y),
+                             ACCEL_SCALE(DS4_ACC_RES_PER_G));
+    }
+
+    // Only worth the effort when the game is reading the pointer
+    if (WPADDataFormatHasIR(device->currentFormat)) {
+        ds4_report_ir(report, device);
+    }
+
     return true;
 }
 int ds4_driver_ops_usb_async_resp(usb_input_device_t *device) {
@@ -227,6 +292,7 @@ int ds4_driver_ops_usb_async_resp(usb_input_device_t *device) {
 const usb_device_driver_t ds4_usb_device_driver = {
     .probe = ds4_driver_ops_probe,
     .hid = true,
+    .report_interval_ms = 4,
     .init = ds4_driver_ops_init,
     .disconnect = ds4_driver_ops_disconnect,
     .usb_async_resp = ds4_driver_ops_usb_async_resp,
@@ -91,6 +91,7 @@ int switch_taiko_driver_ops_usb_async_resp(usb_input_device_t *device) {
 const usb_device_driver_t switch_taiko_usb_device_driver = {
     .probe = switch_taiko_driver_ops_probe,
     .hid = true,
+    .report_interval_ms = 10,
     .init = switch_taiko_driver_ops_init,
     .disconnect = switch_taiko_driver_ops_disconnect,
     .usb_async_resp = switch_taiko_driver_ops_usb_async_resp,
@@ -6,235 +6,24 @@
 #include "usb.h"
 #include "usb_hid.h"
 #include "wiimote.h"
+#include "xinput.h"
 
 #define GUITAR_ACC_RES_PER_G 113
-#define XINPUT_GAMEPAD 1
-#define XINPUT_WHEEL 2
-#define XINPUT_ARCADE_STICK 3
-#define XINPUT_FLIGHT_STICK 4
-#define XINPUT_DANCE_PAD 5
-#define XINPUT_GUITAR 6
-#define XINPUT_GUITAR_ALTERNATE 7
-#define XINPUT_DRUMS 8
-#define XINPUT_STAGE_KIT 9
-#define XINPUT_GUITAR_BASS 11
-#define XINPUT_PRO_KEYS 15
-#define XINPUT_ARCADE_PAD 19
-#define XINPUT_TURNTABLE 23
-#define XINPUT_PRO_GUITAR 25
-#define XINPUT_GUITAR_WT 26
-
-typedef struct {
-    uint8_t rid;
-    uint8_t rsize;
-
-    uint8_t rightThumbClick : 1;
-    uint8_t leftThumbClick : 1;
-    uint8_t back : 1;
-    uint8_t start : 1;
-
-    uint8_t dpadRight : 1;
-    uint8_t dpadLeft : 1;
-    uint8_t dpadDown : 1;
-    uint8_t dpadUp : 1;
-
-    uint8_t y : 1;
-    uint8_t x : 1;
-    uint8_t b : 1;
-    uint8_t a : 1;
-
-    uint8_t : 1;
-    uint8_t guide : 1;
-    uint8_t rightShoulder : 1;
-    uint8_t leftShoulder : 1;
-
-    uint8_t leftTrigger;
-    uint8_t rightTrigger;
-    int16_t leftStickX;
-    int16_t leftStickY;
-    int16_t rightStickX;
-    int16_t rightStickY;
-    uint8_t reserved_1[6];
-} __attribute__((packed)) XInputGamepad_Data_t;
-
-typedef struct
-{
-    uint8_t rid;
-    uint8_t rsize;
-
-    uint8_t padFlag : 1;  // right thumb click
-    uint8_t pedal2 : 1;   // pedal2
-    uint8_t back : 1;
-    uint8_t start : 1;
-
-    uint8_t dpadRight : 1;
-    uint8_t dpadLeft : 1;
-    uint8_t dpadDown : 1;
-    uint8_t dpadUp : 1;
-
-    uint8_t yellow : 1;  // yellow
-    uint8_t blue : 1;    // blue
-    uint8_t red : 1;     // red
-    uint8_t green : 1;   // green
-
-    uint8_t : 1;
-    uint8_t guide : 1;
-    uint8_t cymbalFlag : 1;  // right shoulder click
-    uint8_t pedal1 : 1;      // pedal1
-
-    uint8_t unused[2];
-    int16_t redVelocity;
-    int16_t yellowVelocity;
-    int16_t blueVelocity;
-    int16_t greenVelocity;
-    uint8_t reserved_1[6];
-} __attribute__((packed)) XInputRockBandDrums_Data_t;
-
-typedef struct
-{
-    uint8_t rid;
-    uint8_t rsize;
-    uint8_t : 1;
-    uint8_t leftThumbClick : 1;  // isGuitarHero
-    uint8_t start : 1;
-    uint8_t back : 1;
-
-    uint8_t dpadRight : 1;
-    uint8_t dpadLeft : 1;
-    uint8_t dpadDown : 1;
-    uint8_t dpadUp : 1;
-
-    uint8_t yellow : 1;  // yellow
-    uint8_t blue : 1;    // blue
-    uint8_t red : 1;     // red
-    uint8_t green : 1;   // green
-
-    uint8_t : 1;
-    uint8_t guide : 1;
-    uint8_t orange : 1;  // orange
-    uint8_t kick : 1;    // kick
-
-    // TODO: The hi-hat pedal data is probably here somewhere
-    uint8_t unused1[2];
-    int16_t unused2;
-    uint8_t greenVelocity;
-    uint8_t redVelocity;
-    uint8_t yellowVelocity;
-    uint8_t blueVelocity;
-    uint8_t orangeVelocity;
-    uint8_t kickVelocity;
-    uint8_t reserved_1[6];
-} __attribute__((packed)) XInputGuitarHeroDrums_Data_t;
-
-typedef struct
-{
-    uint8_t rid;
-    uint8_t rsize;
-
-    uint8_t : 1;
-    uint8_t : 1;
-    uint8_t back : 1;
-    uint8_t start : 1;
-
-    uint8_t dpadRight : 1;
-    uint8_t dpadLeft : 1;
-    uint8_t dpadDown : 1;  // dpadStrumDown
-    uint8_t dpadUp : 1;    // dpadStrumUp
-
-    uint8_t yellow : 1;  // yellow
-    uint8_t blue : 1;    // blue
-    uint8_t red : 1;     // red
-    uint8_t green : 1;   // green
-
-    uint8_t : 1;
-    uint8_t guide : 1;
-    uint8_t pedal : 1;   // pedal
-    uint8_t orange : 1;  // orange
-
-    uint8_t accelZ;
-    uint8_t accelX;
-    int16_t slider;
-    int16_t unused;
-    int16_t whammy;
-    int16_t tilt;
-    uint8_t reserved_1[6];
-} __attribute__((packed)) XInputGuitarHeroGuitar_Data_t;
-
-typedef struct
-{
-    uint8_t rid;
-    uint8_t rsize;
-    uint8_t : 1;
-    uint8_t solo : 1;  // leftThumbClick
-    uint8_t back : 1;
-    uint8_t start : 1;
-
-    uint8_t dpadRight : 1;
-    uint8_t dpadLeft : 1;
-    uint8_t dpadDown : 1;  // dpadStrumDown
-    uint8_t dpadUp : 1;    // dpadStrumUp
-
-    uint8_t yellow : 1;  // yellow
-    uint8_t blue : 1;    // blue
-    uint8_t red : 1;     // red
-    uint8_t green : 1;   // green
-
-    uint8_t : 1;
-    uint8_t guide : 1;
-    uint8_t : 1;
-    uint8_t orange : 1;  // orange
-
-    uint8_t pickup;
-    uint8_t unused1;
-    int16_t calibrationSensor;
-    int16_t unused2;
-    int16_t whammy;
-    int16_t tilt;
-    uint8_t reserved_1[6];
-} __attribute__((packed)) XInputRockBandGuitar_Data_t;
-
-typedef struct
-{
-    uint8_t rid;
-    uint8_t rsize;
-
-    uint8_t : 1;
-    uint8_t : 1;
-    uint8_t back : 1;
-    uint8_t start : 1;
-
-    uint8_t dpadRight : 1;
-    uint8_t dpadLeft : 1;
-    uint8_t dpadDown : 1;
-    uint8_t dpadUp : 1;
-
-    uint8_t y : 1;  // euphoria
-    uint8_t x : 1;
-    uint8_t b : 1;
-    uint8_t a : 1;
-
-    uint8_t : 1;
-    uint8_t guide : 1;
-    uint8_t : 1;
-    uint8_t : 1;
-
-    uint8_t : 5;
-    uint8_t leftBlue : 1;
-    uint8_t leftRed : 1;
-    uint8_t leftGreen : 1;
-
-    uint8_t : 5;
-    uint8_t rightBlue : 1;
-    uint8_t rightRed : 1;
-    uint8_t rightGreen : 1;
-
-    int16_t leftTableVelocity;
-    int16_t rightTableVelocity;
-
-    int16_t effectsKnob;  // Whether or not this is signed doesn't really matter, as either way it's gonna loop over when it reaches min/max
-    int16_t crossfader;
-    uint8_t reserved_1[6];
-} __attribute__((packed)) XInputTurntable_Data_t;
+
+/* Rock Band pads report velocity as a signed 16-bit value, this maps its
+ * magnitude (0-127) to the hit strength we hand to the game so that light
+ * hits still register. Filled on first use. */
+static uint8_t rb_drum_velocity_curve[128];
+
+static void xbox_controller_rb_drum_curve_init(void) {
+    for (int i = 0; i < ARRAY_SIZE(rb_drum_velocity_curve); i++) {
+        // isqrt(i * 127)
+        uint32_t n = i * 127, r = 0;
+        while ((r + 1) * (r + 1) <= n)
+            r++;
+        rb_drum_velocity_curve[i] = r;
+    }
+}
 
 static inline int xbox_controller_request_data(usb_input_device_t *device) {
     return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp, device->max_packet_len_in);
@@ -281,6 +70,27 @@ static uint8_t led[12] IOS_ALIGN = {0x00, 0x00, 0x08, 0x41};
 static uint8_t led_wired[3] IOS_ALIGN = {0x01, 0x03, 0x00};
 static uint8_t capabilities[12] IOS_ALIGN = {0x00, 0x00, 0x02, 0x80};
 
+void xbox_controller_set_extension(usb_input_device_t *device, uint8_t sub_type) {
+    uint8_t ext = WPAD_EXTENSION_CLASSIC;
+    uint8_t df = WPAD_FORMAT_CLASSIC;
+    if (sub_type == XINPUT_GUITAR || sub_type == XINPUT_GUITAR_ALTERNATE || sub_type == XINPUT_GUITAR_BASS) {
+        ext = WPAD_EXTENSION_GUITAR;
+        df = WPAD_FORMAT_GUITAR;
+    }
+    if (sub_type == XINPUT_TURNTABLE) {
+        ext = WPAD_EXTENSION_TURNTABLE;
+        df = WPAD_FORMAT_TURNTABLE;
+    }
+    if (sub_type == XINPUT_DRUMS || sub_type == XINPUT_DRUMS_GH || sub_type == XINPUT_DRUMS_RB) {
+        ext = WPAD_EXTENSION_DRUM;
+        df = WPAD_FORMAT_DRUM;
+    }
+    device->drums_gh_reports = 0;
+    device->extension = ext;
+    device->wpadData.extension = ext;
+    device->format = df;
+}
+
 int xbox_controller_driver_ops_init(usb_input_device_t *device) {
     int ret;
 
@@ -296,20 +106,7 @@ int xbox_controller_driver_ops_init(usb_input_device_t *device) {
         return 0;
     }
 
-    uint8_t ext = WPAD_EXTENSION_CLASSIC;
-    uint8_t df = WPAD_FORMAT_CLASSIC;
-    if (device->sub_type == XINPUT_GUITAR || device->sub_type == XINPUT_GUITAR_ALTERNATE || device->sub_type == XINPUT_GUITAR_BASS) {
-        ext = WPAD_EXTENSION_GUITAR;
-        df = WPAD_FORMAT_GUITAR;
-    }
-    if (device->sub_type == XINPUT_TURNTABLE) {
-        ext = WPAD_EXTENSION_TURNTABLE;
-        df = WPAD_FORMAT_TURNTABLE;
-    }
-
-    device->extension = ext;
-    device->wpadData.extension = ext;
-    device->format = df;
+    xbox_controller_set_extension(device, device->sub_type);
     device->gravityUnit[0].acceleration[0] = ACCEL_ONE_G;
     device->gravityUnit[0].acceleration[1] = ACCEL_ONE_G;
     device->gravityUnit[0].acceleration[2] = ACCEL_ONE_G;
@@ -353,12 +150,11 @@ bool xbox_controller_report_turntable_input(const XInputTurntable_Data_t *report
         device->wpadData.extension_data.guitar.stick[0] = 10;
     }
     device->wpadData.status = WPAD_STATUS_OK;
-    int8_t ltt = ((int16_t)__builtin_bswap16(report->leftTableVelocity)) >> 1;
-    device->wpadData.extension_data.turntable.ltt_sign = ltt >= 0;
-    device->wpadData.extension_data.turntable.ltt = ltt;
-    int8_t rtt = ((int16_t)__builtin_bswap16(report->rightTableVelocity)) >> 1;
-    device->wpadData.extension_data.turntable.rtt_sign = rtt < 0;
-    device->wpadData.extension_data.turntable.rtt = rtt;
+    // Platter velocities are halved on the way to the game
+    int32_t ltt = (int16_t)__builtin_bswap16(report->leftTableVelocity);
+    turntable_platter_add(&device->platters, TURNTABLE_PLATTER_LEFT, ltt * (1 << (TURNTABLE_FRAC_BITS - 1)));
+    int32_t rtt = (int16_t)__builtin_bswap16(report->rightTableVelocity);
+    turntable_platter_add(&device->platters, TURNTABLE_PLATTER_RIGHT, rtt * (1 << (TURNTABLE_FRAC_BITS - 1)));
     device->wpadData.extension_data.turntable.crossFader = (__builtin_bswap16(report->crossfader) + INT16_MAX) >> 12;
     device->wpadData.extension_data.turntable.effectsDial = (__builtin_bswap16(report->effectsKnob) + INT16_MAX) >> 11;
 
@@ -394,10 +190,7 @@ bool xbox_controller_report_gh_guitar_input(const XInputGuitarHeroGuitar_Data_t
     }
     int16_t whammy = __builtin_bswap16(report->whammy);
 
-    device->wpadData.extension_data.guitar.whammy = ((whammy >> 8) + 0x80) >> 1;
-    if (!device->old_wpad) {
-        device->wpadData.extension_data.guitar.whammy += 0x80;
-    }
+    device->wpadData.extension_data.guitar.whammy = (((whammy >> 8) + 0x80) >> 1) + game_profile->whammy_base;
     // TODO: tap bar
     device->wpadData.extension_data.guitar.tapbar = 0x1E0;
     device->wpadData.status = WPAD_STATUS_OK;
@@ -433,69 +226,142 @@ bool xbox_controller_report_rb_guitar_input(const XInputRockBandGuitar_Data_t *r
 
     int16_t whammy = __builtin_bswap16(report->whammy);
 
-    device->wpadData.extension_data.guitar.whammy = ((whammy >> 8) + 0x80) >> 1;
-    if (!device->old_wpad) {
-        device->wpadData.extension_data.guitar.whammy += 0x80;
-    }
+    device->wpadData.extension_data.guitar.whammy = (((whammy >> 8) + 0x80) >> 1) + game_profile->whammy_base;
     device->wpadData.status = WPAD_STATUS_OK;
 
     return true;
 }
 bool xbox_controller_report_drums_input(const XInputGuitarHeroDrums_Data_t *report, usb_input_device_t *device) {
     device->wpadData.buttons = 0;
+    device->wpadData.home = report->guide;
     device->wpadData.extension_data.drum.buttons = 0;
     device->wpadData.extension_data.drum.green = report->green;
     device->wpadData.extension_data.drum.red = report->red;
     device->wpadData.extension_data.drum.yellow = report->yellow;
     device->wpadData.extension_data.drum.blue = report->blue;
     device->wpadData.extension_data.drum.orange = report->orange;
+    device->wpadData.extension_data.drum.pedal = report->kick;
     device->wpadData.extension_data.drum.plus = report->start;
     device->wpadData.extension_data.drum.minus = report->back;
     device->wpadData.extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
     uint8_t velocity = 0x7F;
     uint8_t note = 0x7F;
     if (report->greenVelocity) {
-        note = GREEN;
+        note = game_profile->drum_notes[DRUM_PAD_GREEN];
         velocity = report->greenVelocity;
     } else if (report->redVelocity) {
-        note = RED;
+        note = game_profile->drum_notes[DRUM_PAD_RED];
         velocity = report->redVelocity;
     } else if (report->yellowVelocity) {
-        note = YELLOW;
+        note = game_profile->drum_notes[DRUM_PAD_YELLOW];
         velocity = report->yellowVelocity;
     } else if (report->blueVelocity) {
-        note = BLUE;
+        note = game_profile->drum_notes[DRUM_PAD_BLUE];
         velocity = report->blueVelocity;
     } else if (report->orangeVelocity) {
-        note = ORANGE;
+        note = game_profile->drum_notes[DRUM_PAD_ORANGE];
         velocity = report->orangeVelocity;
     } else if (report->kickVelocity) {
-        note = KICK_PEDAL;
+        note = game_profile->drum_notes[DRUM_PAD_KICK];
         velocity = report->kickVelocity;
     } else {
         device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
     }
-    velocity = 0x7F - velocity;
-    note = 0x7F - note;
-    device->wpadData.extension_data.drum.velocity0 = ~velocity;
-    device->wpadData.extension_data.drum.velocity1 = ~velocity >> 1;
-    device->wpadData.extension_data.drum.velocity2 = velocity >> 2;
-    device->wpadData.extension_data.drum.velocity3 = velocity >> 3;
-    device->wpadData.extension_data.drum.velocity4 = velocity >> 4;
-    device->wpadData.extension_data.drum.velocity5 = velocity >> 5;
-    device->wpadData.extension_data.drum.velocity6 = velocity >> 6;
-    device->wpadData.extension_data.drum.note0 = note;
-    device->wpadData.extension_data.drum.note1 = note >> 1;
-    device->wpadData.extension_data.drum.note2 = note >> 2;
-    device->wpadData.extension_data.drum.note3 = note >> 3;
-    device->wpadData.extension_data.drum.note4 = note >> 4;
-    device->wpadData.extension_data.drum.note5 = note >> 5;
-    device->wpadData.extension_data.drum.note6 = note >> 6;
+    wiimote_drum_hit(&device->wpadData, note, velocity);
+
+    device->wpadData.status = WPAD_STATUS_OK;
+
+    return true;
+}
+
+static inline uint8_t xbox_controller_rb_drum_velocity(int16_t raw) {
+    // The sign depends on the pad, only the magnitude matters. Kits that don't
+    // sense velocity leave it at 0.
+    int32_t magnitude = (int16_t)__builtin_bswap16(raw);
+    if (!magnitude)
+        return 0x7F;
+    if (magnitude < 0)
+        magnitude = -magnitude;
+    magnitude >>= 8;
+    if (magnitude > 0x7F)
+        magnitude = 0x7F;
+    return rb_drum_velocity_curve[magnitude];
+}
+
+bool xbox_controller_report_rb_drums_input(const XInputRockBandDrums_Data_t *report, usb_input_device_t *device) {
+    if (!rb_drum_velocity_curve[0x7F]) {
+        xbox_controller_rb_drum_curve_init();
+    }
+    // As on the PS3 and Wii kits, a hit presses its colour and flags whether
+    // it was a pad or a cymbal, and the yellow and blue cymbals also press up
+    // and down on the d-pad. Red has no cymbal. Cymbals all go to orange.
+    bool yellow_cymbal = report->cymbalFlag && report->yellow && report->dpadUp;
+    bool blue_cymbal = report->cymbalFlag && report->blue && report->dpadDown;
+    bool green_cymbal = report->cymbalFlag && report->green && !yellow_cymbal && !blue_cymbal;
+    bool yellow = report->yellow && !yellow_cymbal;
+    bool blue = report->blue && !blue_cymbal;
+    bool green = report->green && !green_cymbal;
+    bool kick = report->pedal1 || report->pedal2;
+    bool hit = report->padFlag || report->cymbalFlag;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = report->guide;
+    device->wpadData.extension_data.drum.buttons = 0;
+    device->wpadData.extension_data.drum.red = report->red;
+    device->wpadData.extension_data.drum.yellow = yellow;
+    device->wpadData.extension_data.drum.blue = blue;
+    device->wpadData.extension_data.drum.green = green;
+    device->wpadData.extension_data.drum.orange = yellow_cymbal || blue_cymbal || green_cymbal;
+    device->wpadData.extension_data.drum.pedal = kick;
+    device->wpadData.extension_data.drum.plus = report->start;
+    device->wpadData.extension_data.drum.minus = report->back;
+    device->wpadData.extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
+
+    // Hits also press the d-pad, it only navigates when nothing was hit
+    device->wpadData.extension_data.drum.stick[0] = 0;
+    device->wpadData.extension_data.drum.stick[1] = 0;
+    if (!hit) {
+        if (report->dpadUp) {
+            device->wpadData.extension_data.drum.stick[1] = 10;
+        }
+        if (report->dpadDown) {
+            device->wpadData.extension_data.drum.stick[1] = -10;
+        }
+        if (report->dpadLeft) {
+            device->wpadData.extension_data.drum.stick[0] = -10;
+        }
+        if (report->dpadRight) {
+            device->wpadData.extension_data.drum.stick[0] = 10;
+        }
+    }
+
+    uint8_t velocity = 0x7F;
+    uint8_t note = 0x7F;
+    if (report->red) {
+        note = game_profile->drum_notes[DRUM_PAD_RED];
+        velocity = xbox_controller_rb_drum_velocity(report->redVelocity);
+    } else if (report->yellow) {
+        note = game_profile->drum_notes[yellow ? DRUM_PAD_YELLOW : DRUM_PAD_ORANGE];
+        velocity = xbox_controller_rb_drum_velocity(report->yellowVelocity);
+    } else if (report->blue) {
+        note = game_profile->drum_notes[blue ? DRUM_PAD_BLUE : DRUM_PAD_ORANGE];
+        velocity = xbox_controller_rb_drum_velocity(report->blueVelocity);
+    } else if (report->green) {
+        note = game_profile->drum_notes[green ? DRUM_PAD_GREEN : DRUM_PAD_ORANGE];
+        velocity = xbox_controller_rb_drum_velocity(report->greenVelocity);
+    } else if (kick) {
+        // The pedal has no velocity sensor
+        note = game_profile->drum_notes[DRUM_PAD_KICK];
+    } else {
+        device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
+    }
+    wiimote_drum_hit(&device->wpadData, note, velocity);
 
     device->wpadData.status = WPAD_STATUS_OK;
 
     return true;
 }
+
 bool xbox_controller_report_gamepad_input(const XInputGamepad_Data_t *report, usb_input_device_t *device) {
     device->wpadData.buttons = 0;
     device->wpadData.extension_data.classic.buttons = 0;
@@ -554,19 +420,7 @@ int xbox_controller_driver_ops_usb_async_resp(usb_input_device_t *device) {
                             return usb_device_driver_issue_intr_transfer_async(device, true, capabilities, sizeof(capabilities));
                         }
 
-                        uint8_t ext = WPAD_EXTENSION_CLASSIC;
-                        uint8_t df = WPAD_FORMAT_CLASSIC;
-                        if (sub_type == XINPUT_GUITAR || sub_type == XINPUT_GUITAR_ALTERNATE || sub_type == XINPUT_GUITAR_BASS) {
-                            ext = WPAD_EXTENSION_GUITAR;
-                            df = WPAD_FORMAT_GUITAR;
-                        }
-                        if (sub_type == XINPUT_TURNTABLE) {
-                            ext = WPAD_EXTENSION_TURNTABLE;
-                            df = WPAD_FORMAT_TURNTABLE;
-                        }
-                        device->extension = ext;
-                        device->wpadData.extension = ext;
-                        device->format = df;
+                        xbox_controller_set_extension(device, sub_type);
                         if (device->extensionCallback) {
                             printf_v("ext callback! %02x\r\n", device->wiimote);
                             device->extensionCallback(device->wiimote, device->extension);
@@ -616,8 +470,28 @@ int xbox_controller_driver_ops_usb_async_resp(usb_input_device_t *device) {
             xbox_controller_report_rb_guitar_input((XInputRockBandGuitar_Data_t *)device->usb_async_resp, device);
         } else if (device->sub_type == XINPUT_TURNTABLE) {
             xbox_controller_report_turntable_input((XInputTurntable_Data_t *)device->usb_async_resp, device);
-        } else if (device->sub_type == XINPUT_DRUMS) {
-            xbox_controller_report_drums_input((XInputGuitarHeroDrums_Data_t *)device->usb_async_resp, device);
+        } else if (device->sub_type == XINPUT_DRUMS || device->sub_type == XINPUT_DRUMS_GH || device->sub_type == XINPUT_DRUMS_RB) {
+            if (device->sub_type == XINPUT_DRUMS) {
+                // GH kits hold the left stick click down for as long as they are
+                // connected, RB kits only press it for the second kick pedal.
+                // One report without it is an RB kit, it takes a good while
+                // of reports with it to be sure of a GH one.
+                XInputGuitarHeroDrums_Data_t *report = (XInputGuitarHeroDrums_Data_t *)device->usb_async_resp;
+                if (!report->leftThumbClick) {
+                    device->sub_type = XINPUT_DRUMS_RB;
+                } else if (++device->drums_gh_reports >= XINPUT_DRUMS_GH_REPORTS) {
+                    device->sub_type = XINPUT_DRUMS_GH;
+                }
+                if (device->sub_type != XINPUT_DRUMS) {
+                    printf_v("Found %s drums\r\n", device->sub_type == XINPUT_DRUMS_GH ? "GH" : "RB");
+                }
+            }
+            // Until then it reads as whichever it looks like
+            if (device->sub_type == XINPUT_DRUMS_GH || device->sub_type == XINPUT_DRUMS) {
+                xbox_controller_report_drums_input((XInputGuitarHeroDrums_Data_t *)device->usb_async_resp, device);
+            } else {
+                xbox_controller_report_rb_drums_input((XInputRockBandDrums_Data_t *)device->usb_async_resp, device);
+            }
         } else {
             xbox_controller_report_gamepad_input((XInputGamepad_Data_t *)device->usb_async_resp, device);
         }
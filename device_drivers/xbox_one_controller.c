@@ -0,0 +1,394 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rvl/WPAD.h"
+#include "usb.h"
+#include "usb_hid.h"
+#include "wiimote.h"
+#include "xinput.h"
+
+/* Xbox One controllers and instruments speak GIP. Every packet has a command,
+ * and those flagged GIP_OPT_ACKNOWLEDGE have to be acknowledged. Before it
+ * sends any input a device has to be powered on, and some also want their LED
+ * set and to be told authentication is done. */
+#define GIP_CMD_ACKNOWLEDGE 0x01
+#define GIP_CMD_ANNOUNCE 0x02
+#define GIP_CMD_STATUS 0x03
+#define GIP_CMD_POWER 0x05
+#define GIP_CMD_AUTHENTICATE 0x06
+#define GIP_CMD_VIRTUAL_KEY 0x07
+#define GIP_CMD_RUMBLE 0x09
+#define GIP_CMD_LED 0x0A
+#define GIP_CMD_INPUT 0x20
+
+#define GIP_OPT_ACKNOWLEDGE 0x10
+#define GIP_OPT_INTERNAL 0x20
+
+#define GIP_POWER_ON 0x00
+#define GIP_LED_ON 0x01
+#define GIP_LED_BRIGHTNESS 0x14
+#define GIP_MOTOR_ALL 0x0F
+
+/* Handshake packets, sent in this order one completion after the other */
+enum {
+    GIP_STAGE_POWER_ON,
+    GIP_STAGE_LED,
+    GIP_STAGE_AUTHENTICATED,
+    GIP_STAGE_READY,
+};
+
+/* Reads land at the start of usb_async_resp, what we send is built after them */
+#define GIP_IN_SIZE 64
+#define GIP_OUT_OFFSET 64
+
+typedef struct {
+    gipheader header;
+
+    uint8_t y : 1;
+    uint8_t x : 1;
+    uint8_t b : 1;
+    uint8_t a : 1;
+    uint8_t back : 1;
+    uint8_t start : 1;
+    uint8_t : 1;
+    uint8_t sync : 1;
+
+    uint8_t rightThumbClick : 1;
+    uint8_t leftThumbClick : 1;
+    uint8_t rightShoulder : 1;
+    uint8_t leftShoulder : 1;
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;
+    uint8_t dpadUp : 1;
+} __attribute__((packed)) GipButtons_t;
+
+typedef struct {
+    GipButtons_t buttons;
+    uint16_t leftTrigger;  // 0-1023
+    uint16_t rightTrigger;
+    int16_t leftStickX;
+    int16_t leftStickY;
+    int16_t rightStickX;
+    int16_t rightStickY;
+} __attribute__((packed)) GipGamepad_Data_t;
+
+/* Rock Band 4 guitars. Frets are a mask, upper and lower (solo) separately. */
+#define GIP_FRET_GREEN 0x01
+#define GIP_FRET_RED 0x02
+#define GIP_FRET_YELLOW 0x04
+#define GIP_FRET_BLUE 0x08
+#define GIP_FRET_ORANGE 0x10
+typedef struct {
+    GipButtons_t buttons;  // a/b/y/x/leftShoulder are also the frets
+    uint8_t tilt;
+    uint8_t whammy;
+    uint8_t pickup;
+    uint8_t upperFrets;
+    uint8_t lowerFrets;
+} __attribute__((packed)) GipRockBandGuitar_Data_t;
+
+/* Rock Band 4 drums. Velocities are a nibble per head, only 0-7 are used. */
+typedef struct {
+    GipButtons_t buttons;  // leftShoulder and rightShoulder are the kick pedals
+    uint8_t redYellowPad;
+    uint8_t blueGreenPad;
+    uint8_t yellowBlueCymbal;
+    uint8_t greenCymbal;
+} __attribute__((packed)) GipRockBandDrums_Data_t;
+#define GIP_DRUM_VELOCITY_MAX 7
+
+static inline int xbox_one_request_data(usb_input_device_t *device) {
+    return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp, GIP_IN_SIZE);
+}
+
+/* Sends a packet built at GIP_OUT_OFFSET; its completion comes back to
+ * xbox_one_driver_ops_usb_async_resp like a read would. */
+static int xbox_one_send(usb_input_device_t *device, uint8_t command, uint8_t flags, uint8_t sequence, const uint8_t *payload, uint8_t length) {
+    uint8_t *packet = device->usb_async_resp + GIP_OUT_OFFSET;
+    gipheader *header = (gipheader *)packet;
+    header->command = command;
+    header->flags = flags;
+    header->sequence = sequence;
+    header->length = length;
+    memcpy(packet + sizeof(gipheader), payload, length);
+    device->gip.writing = true;
+    return usb_device_driver_issue_intr_transfer_async(device, true, packet, sizeof(gipheader) + length);
+}
+
+static inline uint8_t xbox_one_next_sequence(usb_input_device_t *device) {
+    // 0 is left to acknowledgements
+    if (++device->gip.sequence == 0)
+        device->gip.sequence = 1;
+    return device->gip.sequence;
+}
+
+/* Picks what goes out next: an acknowledgement first, then the rest of the
+ * handshake, then anything the game changed. Otherwise we go back to reading. */
+static int xbox_one_send_next(usb_input_device_t *device) {
+    gip_state_t *gip = &device->gip;
+    if (gip->ack) {
+        uint8_t ack[] = {0x00, gip->ack_command, gip->ack_flags & GIP_OPT_INTERNAL, gip->ack_length, 0x00, 0x00, 0x00, 0x00, 0x00};
+        gip->ack = false;
+        return xbox_one_send(device, GIP_CMD_ACKNOWLEDGE, GIP_OPT_INTERNAL, gip->ack_sequence, ack, sizeof(ack));
+    }
+    switch (gip->stage) {
+        case GIP_STAGE_POWER_ON: {
+            static const uint8_t power[] = {GIP_POWER_ON};
+            gip->stage = GIP_STAGE_LED;
+            return xbox_one_send(device, GIP_CMD_POWER, GIP_OPT_INTERNAL, xbox_one_next_sequence(device), power, sizeof(power));
+        }
+        case GIP_STAGE_LED: {
+            static const uint8_t led[] = {0x00, GIP_LED_ON, GIP_LED_BRIGHTNESS};
+            gip->stage = GIP_STAGE_AUTHENTICATED;
+            return xbox_one_send(device, GIP_CMD_LED, GIP_OPT_INTERNAL, xbox_one_next_sequence(device), led, sizeof(led));
+        }
+        case GIP_STAGE_AUTHENTICATED: {
+            // PDP instruments wait for this before sending input
+            static const uint8_t authenticated[] = {0x01, 0x00};
+            gip->stage = GIP_STAGE_READY;
+            return xbox_one_send(device, GIP_CMD_AUTHENTICATE, GIP_OPT_INTERNAL, xbox_one_next_sequence(device), authenticated, sizeof(authenticated));
+        }
+    }
+    if (device->sub_type == XINPUT_GAMEPAD && device->rumble_on != device->last_rumble_on) {
+        uint8_t strength = device->rumble_on * 0xFF;
+        uint8_t rumble[] = {0x00, GIP_MOTOR_ALL, 0x00, 0x00, strength, strength, 0xFF, 0x00, 0xFF};
+        device->last_rumble_on = device->rumble_on;
+        return xbox_one_send(device, GIP_CMD_RUMBLE, 0x00, xbox_one_next_sequence(device), rumble, sizeof(rumble));
+    }
+    return xbox_one_request_data(device);
+}
+
+bool xbox_one_driver_ops_probe(uint16_t vid, uint16_t pid) {
+    // main.c finds these by their GIP interface, whoever made them
+    return false;
+}
+
+/* Instruments look like any other GIP device until they report, so they are
+ * told apart by who made them */
+static uint8_t xbox_one_sub_type(uint16_t vid, uint16_t pid) {
+    static const struct device_id_t guitars[] = {
+        {0x0738, 0x4161},  // Mad Catz Rock Band 4 Stratocaster
+        {0x0e6f, 0x0170},  // PDP Rock Band 4 Jaguar
+        {0x0e6f, 0x0248},  // PDP Riffmaster
+    };
+    static const struct device_id_t drums[] = {
+        {0x0738, 0x4262},  // Mad Catz Rock Band 4 drums
+        {0x0e6f, 0x0171},  // PDP Rock Band 4 drums
+    };
+    if (usb_driver_is_comaptible(vid, pid, guitars, ARRAY_SIZE(guitars)))
+        return XINPUT_GUITAR;
+    if (usb_driver_is_comaptible(vid, pid, drums, ARRAY_SIZE(drums)))
+        return XINPUT_DRUMS;
+    return XINPUT_GAMEPAD;
+}
+
+int xbox_one_driver_ops_init(usb_input_device_t *device) {
+    memset(&device->gip, 0, sizeof(device->gip));
+    device->sub_type = xbox_one_sub_type(device->vid, device->pid);
+    xbox_controller_set_extension(device, device->sub_type);
+    device->gravityUnit[0].acceleration[0] = ACCEL_ONE_G;
+    device->gravityUnit[0].acceleration[1] = ACCEL_ONE_G;
+    device->gravityUnit[0].acceleration[2] = ACCEL_ONE_G;
+    // The handshake runs from the completions, starting with powering on
+    return xbox_one_send_next(device);
+}
+
+int xbox_one_driver_ops_disconnect(usb_input_device_t *device) {
+    return 0;
+}
+
+static void xbox_one_report_gamepad_input(const GipGamepad_Data_t *packet, usb_input_device_t *device) {
+    XInputGamepad_Data_t report = {0};
+    report.a = packet->buttons.a;
+    report.b = packet->buttons.b;
+    report.x = packet->buttons.x;
+    report.y = packet->buttons.y;
+    report.start = packet->buttons.start;
+    report.back = packet->buttons.back;
+    report.guide = device->gip.guide;
+    report.dpadUp = packet->buttons.dpadUp;
+    report.dpadDown = packet->buttons.dpadDown;
+    report.dpadLeft = packet->buttons.dpadLeft;
+    report.dpadRight = packet->buttons.dpadRight;
+    report.leftShoulder = packet->buttons.leftShoulder;
+    report.rightShoulder = packet->buttons.rightShoulder;
+    report.leftThumbClick = packet->buttons.leftThumbClick;
+    report.rightThumbClick = packet->buttons.rightThumbClick;
+    report.leftTrigger = le16toh(packet->leftTrigger) >> 2;
+    report.rightTrigger = le16toh(packet->rightTrigger) >> 2;
+    // Both little endian, as the XInput translation expects
+    report.leftStickX = packet->leftStickX;
+    report.leftStickY = packet->leftStickY;
+    report.rightStickX = packet->rightStickX;
+    report.rightStickY = packet->rightStickY;
+    xbox_controller_report_gamepad_input(&report, device);
+}
+
+static void xbox_one_report_guitar_input(const GipRockBandGuitar_Data_t *packet, usb_input_device_t *device) {
+    XInputRockBandGuitar_Data_t report = {0};
+    uint8_t frets = packet->upperFrets | packet->lowerFrets;
+    report.green = (frets & GIP_FRET_GREEN) != 0;
+    report.red = (frets & GIP_FRET_RED) != 0;
+    report.yellow = (frets & GIP_FRET_YELLOW) != 0;
+    report.blue = (frets & GIP_FRET_BLUE) != 0;
+    report.orange = (frets & GIP_FRET_ORANGE) != 0;
+    report.solo = packet->lowerFrets != 0;
+    report.start = packet->buttons.start;
+    report.back = packet->buttons.back;
+    report.guide = device->gip.guide;
+    report.dpadUp = packet->buttons.dpadUp;
+    report.dpadDown = packet->buttons.dpadDown;
+    report.dpadLeft = packet->buttons.dpadLeft;
+    report.dpadRight = packet->buttons.dpadRight;
+    report.pickup = packet->pickup;
+    // Scaled up to what a 360 guitar reports
+    report.tilt = htole16(packet->tilt << 2);
+    report.whammy = htole16((packet->whammy - 0x80) * 0x100);
+    xbox_controller_report_rb_guitar_input(&report, device);
+}
+
+/* A 0-7 velocity as the 0-127 one the game wants */
+static inline uint8_t xbox_one_drum_velocity(uint8_t velocity) {
+    if (velocity > GIP_DRUM_VELOCITY_MAX)
+        velocity = GIP_DRUM_VELOCITY_MAX;
+    return velocity * 0x7F / GIP_DRUM_VELOCITY_MAX;
+}
+
+/* Every pad and cymbal has a velocity of its own, so unlike the 360 kits there
+ * is nothing to work out about which was hit. Red has no cymbal. Cymbals all
+ * go to orange. */
+static void xbox_one_report_drums_input(const GipRockBandDrums_Data_t *packet, usb_input_device_t *device) {
+    uint8_t red = packet->redYellowPad >> 4;
+    uint8_t yellow = packet->redYellowPad & 0x0F;
+    uint8_t blue = packet->blueGreenPad >> 4;
+    uint8_t green = packet->blueGreenPad & 0x0F;
+    uint8_t yellowCymbal = packet->yellowBlueCymbal >> 4;
+    uint8_t blueCymbal = packet->yellowBlueCymbal & 0x0F;
+    uint8_t greenCymbal = packet->greenCymbal >> 4;
+    bool kick = packet->buttons.leftShoulder || packet->buttons.rightShoulder;
+    bool hit = red || yellow || blue || green || yellowCymbal || blueCymbal || greenCymbal;
+
+    device->wpadData.buttons = 0;
+    device->wpadData.home = device->gip.guide;
+    device->wpadData.extension_data.drum.buttons = 0;
+    device->wpadData.extension_data.drum.red = red != 0;
+    device->wpadData.extension_data.drum.yellow = yellow != 0;
+    device->wpadData.extension_data.drum.blue = blue != 0;
+    device->wpadData.extension_data.drum.green = green != 0;
+    device->wpadData.extension_data.drum.orange = yellowCymbal || blueCymbal || greenCymbal;
+    device->wpadData.extension_data.drum.pedal = kick;
+    device->wpadData.extension_data.drum.plus = packet->buttons.start;
+    device->wpadData.extension_data.drum.minus = packet->buttons.back;
+    device->wpadData.extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
+
+    // Hits don't press the d-pad on these, but keep it to navigation anyway
+    device->wpadData.extension_data.drum.stick[0] = 0;
+    device->wpadData.extension_data.drum.stick[1] = 0;
+    if (!hit) {
+        if (packet->buttons.dpadUp) {
+            device->wpadData.extension_data.drum.stick[1] = 10;
+        }
+        if (packet->buttons.dpadDown) {
+            device->wpadData.extension_data.drum.stick[1] = -10;
+        }
+        if (packet->buttons.dpadLeft) {
+            device->wpadData.extension_data.drum.stick[0] = -10;
+        }
+        if (packet->buttons.dpadRight) {
+            device->wpadData.extension_data.drum.stick[0] = 10;
+        }
+    }
+
+    uint8_t velocity = 0x7F;
+    uint8_t note = 0x7F;
+    if (red) {
+        note = game_profile->drum_notes[DRUM_PAD_RED];
+        velocity = xbox_one_drum_velocity(red);
+    } else if (yellow) {
+        note = game_profile->drum_notes[DRUM_PAD_YELLOW];
+        velocity = xbox_one_drum_velocity(yellow);
+    } else if (yellowCymbal) {
+        note = game_profile->drum_notes[DRUM_PAD_ORANGE];
+        velocity = xbox_one_drum_velocity(yellowCymbal);
+    } else if (blue) {
+        note = game_profile->drum_notes[DRUM_PAD_BLUE];
+        velocity = xbox_one_drum_velocity(blue);
+    } else if (blueCymbal) {
+        note = game_profile->drum_notes[DRUM_PAD_ORANGE];
+        velocity = xbox_one_drum_velocity(blueCymbal);
+    } else if (green) {
+        note = game_profile->drum_notes[DRUM_PAD_GREEN];
+        velocity = xbox_one_drum_velocity(green);
+    } else if (greenCymbal) {
+        note = game_profile->drum_notes[DRUM_PAD_ORANGE];
+        velocity = xbox_one_drum_velocity(greenCymbal);
+    } else if (kick) {
+        // The pedals have no velocity sensor
+        note = game_profile->drum_notes[DRUM_PAD_KICK];
+    } else {
+        device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
+    }
+    wiimote_drum_hit(&device->wpadData, note, velocity);
+
+    device->wpadData.status = WPAD_STATUS_OK;
+}
+
+static void xbox_one_handle_packet(usb_input_device_t *device, const uint8_t *packet) {
+    const gipheader *header = (const gipheader *)packet;
+    gip_state_t *gip = &device->gip;
+    if (header->flags & GIP_OPT_ACKNOWLEDGE) {
+        gip->ack = true;
+        gip->ack_command = header->command;
+        gip->ack_flags = header->flags;
+        gip->ack_sequence = header->sequence;
+        gip->ack_length = header->length;
+    }
+    switch (header->command) {
+        case GIP_CMD_ANNOUNCE:
+            // Plugged back in or power cycled, it has forgotten the handshake
+            printf_v("GIP announce %d\r\n", device->wiimote);
+            gip->stage = GIP_STAGE_POWER_ON;
+            break;
+        case GIP_CMD_VIRTUAL_KEY:
+            // The guide button has a packet of its own
+            gip->guide = packet[sizeof(gipheader)] & 0x01;
+            if (device->sub_type == XINPUT_GAMEPAD) {
+                device->wpadData.extension_data.classic.home = gip->guide;
+            } else {
+                device->wpadData.home = gip->guide;
+            }
+            break;
+        case GIP_CMD_INPUT:
+            if (device->sub_type == XINPUT_GUITAR) {
+                xbox_one_report_guitar_input((const GipRockBandGuitar_Data_t *)packet, device);
+            } else if (device->sub_type == XINPUT_DRUMS) {
+                xbox_one_report_drums_input((const GipRockBandDrums_Data_t *)packet, device);
+            } else {
+                xbox_one_report_gamepad_input((const GipGamepad_Data_t *)packet, device);
+            }
+            break;
+        default:
+            // Status heartbeats and the like, only acknowledged
+            break;
+    }
+}
+
+int xbox_one_driver_ops_usb_async_resp(usb_input_device_t *device) {
+    if (device->gip.writing) {
+        // One of ours went out, there is nothing to read
+        device->gip.writing = false;
+    } else {
+        xbox_one_handle_packet(device, device->usb_async_resp);
+    }
+    return xbox_one_send_next(device);
+}
+
+const usb_device_driver_t xbox_one_usb_device_driver = {
+    .probe = xbox_one_driver_ops_probe,
+    .hid = false,
+    .init = xbox_one_driver_ops_init,
+    .disconnect = xbox_one_driver_ops_disconnect,
+    .usb_async_resp = xbox_one_driver_ops_usb_async_resp,
+};
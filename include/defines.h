@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #define IOS_ALIGN __attribute__((aligned(32)))
 #ifndef ATTRIBUTE_ALIGN
 # define ATTRIBUTE_ALIGN(v)	__attribute__((aligned(v)))
@@ -12,6 +13,12 @@
 
 #define le16toh(x) __builtin_bswap16(x)
 #define htole16(x) __builtin_bswap16(x)
+/* The timebase ticks at a quarter of the bus clock, which the IPL leaves at 0x800000F8. */
+#define OS_BUS_CLOCK (*(volatile uint32_t *)0x800000F8)
+#define OS_TIMER_CLOCK (OS_BUS_CLOCK / 4)
+/* In 32 bits, a 64 bit divide would need __udivdi3, which nothing provides */
+#define us_to_ticks(us) ((uint32_t)((us) * (OS_TIMER_CLOCK / 1000000)))
+#define ms_to_ticks(ms) ((uint32_t)((ms) * (OS_TIMER_CLOCK / 1000)))
 #define BE16(i) ((((i) & 0xFF) << 8 | ((i) >> 8) & 0xFF) & 0xFFFF)
 void printf_v ( const char * format, ... );
 void snprintf_v ( char* dest, size_t len, const char * format,  ... );
\ No newline at end of file
@@ -367,4 +367,24 @@ static inline size_t WPADDataFormatSize(WPADDataFormat_t format) {
     }
 }
 
+static inline bool WPADDataFormatHasAcc(WPADDataFormat_t format) {
+    switch (format) {
+        case WPAD_FORMAT_ACC:
+        case WPAD_FORMAT_ACC_IR:
+        case WPAD_FORMAT_NUNCHUCK_ACC:
+        case WPAD_FORMAT_NUNCHUCK_ACC_IR:
+        case WPAD_FORMAT_CLASSIC_ACC:
+        case WPAD_FORMAT_CLASSIC_ACC_IR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool WPADDataFormatHasIR(WPADDataFormat_t format) {
+    return format == WPAD_FORMAT_ACC_IR ||
+           format == WPAD_FORMAT_NUNCHUCK_ACC_IR ||
+           format == WPAD_FORMAT_CLASSIC_ACC_IR;
+}
+
 #endif /* _RVL_WPAD_H_ */
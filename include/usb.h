@@ -9,6 +9,8 @@
 #define USB_OK				0
 #define USB_FAILED			1
 
+#define USB_CLASS_AUDIO			0x01
+#define USB_SUBCLASS_AUDIO_MIDISTREAMING	0x03
 #define USB_CLASS_HID			0x03
 #define USB_SUBCLASS_BOOT		0x01
 #define USB_PROTOCOL_KEYBOARD		0x01
@@ -74,6 +76,8 @@
 
 #define USB_FEATURE_ENDPOINT_HALT	0
 
+#define USB_ENDPOINT_TYPE_MASK		0x03
+#define USB_ENDPOINT_BULK		0x02
 #define USB_ENDPOINT_INTERRUPT		0x03
 #define USB_ENDPOINT_IN			0x80
 #define USB_ENDPOINT_OUT		0x00
@@ -149,6 +153,15 @@ typedef struct {
     uint8_t reserved4[2];
 } ATTRIBUTE_PACKED xboxiddesc;
 
+/* Every Xbox One (GIP) packet starts with this. The length is that of the
+ * payload after it, which for anything we read fits in one byte. */
+typedef struct {
+    uint8_t command;
+    uint8_t flags;
+    uint8_t sequence;
+    uint8_t length;
+} ATTRIBUTE_PACKED gipheader;
+
 /* Structures */
 typedef struct _usbendpointdesc
 {
@@ -1,6 +1,7 @@
 #include "stdint.h"
 #include "defines.h"
 #include "rvl/WPAD.h"
+#include "wiimote.h"
 #include <rvl/ipc.h>
 
 /* List of Vendor IDs */
@@ -8,11 +9,26 @@
 #define SONY_INST_VID			0x12ba
 #define SANTROLLER_VID			0x1209
 #define HORI_VID				0x0f0d
+#define HARMONIX_VID			0x1bad
+#define MADCATZ_VID				0x0738
+#define PDP_VID					0x0e6f
 
 /* List of Product IDs */
 #define GH_GUITAR_PID			0x0100
 #define GH_DRUM_PID				0x0120
 #define DJ_TURNTABLE_PID		0x0140
+/* Rock Band instruments send PS3 style reports on the Wii too */
+#define RB_GUITAR_PID			0x0200
+#define RB_DRUM_PID				0x0210
+#define RB_WII_GUITAR_PID		0x0004
+#define RB_WII_DRUM_PID			0x0005
+#define RB2_WII_GUITAR_PID		0x3010
+#define RB2_WII_DRUM_PID		0x3110
+/* Rock Band 4 instruments' PS4 dongles, DS4 style reports */
+#define RB4_MADCATZ_GUITAR_PID	0x8261
+#define RB4_MADCATZ_DRUM_PID	0x8262
+#define RB4_PDP_GUITAR_PID		0x0173
+#define RB4_PDP_DRUM_PID		0x0174
 #define SANTROLLER_PID			0x2882
 #define HORI_SWITCH_TAIKO_PID	0x00f0
 #define DS3_PID					0x0268
@@ -26,6 +42,45 @@
 #define API_TYPE_OH0 2
 #define API_TYPE_HIDV4 3
 #define API_TYPE_HIDV5 4
+/* Not USB at all, instruments played over the network */
+#define API_TYPE_NET 5
+
+#define WATCHDOG_IDLE 0
+#define WATCHDOG_CANCELLED 1
+#define WATCHDOG_RESET 2
+/* Reset after a transfer failed, detached if that doesn't work */
+#define WATCHDOG_FAILED 3
+
+/* Where an error happened. The numbers are the errorMethod values they
+ * replace, so old logs still read the same. */
+#define USB_STAGE_OPEN 1
+#define USB_STAGE_VERSION 2
+#define USB_STAGE_CHANGE 4
+#define USB_STAGE_ATTACH 5
+#define USB_STAGE_RESUME 6
+#define USB_STAGE_PARAMS 7
+#define USB_STAGE_DESCRIPTOR 8
+#define USB_STAGE_POLL 9
+#define USB_STAGE_WATCHDOG 10
+#define USB_STAGE_INIT 11
+#define USB_STAGE__NUM 12
+
+#define USB_ERROR_RING_SIZE 8
+
+typedef struct {
+	/* What IOS returned */
+	int32_t ret;
+	uint32_t tick;
+	uint8_t stage;
+} usb_error_t;
+
+/* The most recent errors, the oldest is overwritten first */
+typedef struct {
+	uint8_t head;
+	/* How many were ever recorded, saturating */
+	uint16_t count;
+	usb_error_t entries[USB_ERROR_RING_SIZE];
+} usb_error_ring_t;
 
 
 typedef struct usb_device_driver_t usb_device_driver_t;
@@ -34,6 +89,8 @@ typedef struct usb_input_device_t usb_input_device_t;
 typedef struct usb_device_driver_t {
 	bool (*probe)(uint16_t vid, uint16_t pid);
 	bool hid;
+	/* Expected time between input reports, 0 if the device only reports on change */
+	uint16_t report_interval_ms;
 	int (*init)(usb_input_device_t *device);
 	int (*disconnect)(usb_input_device_t *device);
 	int (*usb_async_resp)(usb_input_device_t *device);
@@ -58,6 +115,12 @@ struct usb_hid_v5_transfer {
 			uint8_t bEndpoint;
 		} intr;
 
+		struct {
+			void *rpData;
+			uint16_t wLength;
+			uint8_t pad[4];
+			uint8_t bEndpoint;
+		} bulk;
 
 		struct {
 			uint32_t out;
@@ -95,11 +158,70 @@ struct device_id_t {
 
 
 
+/* Drum pads, in the order game_profile_t.drum_notes lists them */
+enum {
+	DRUM_PAD_GREEN,
+	DRUM_PAD_RED,
+	DRUM_PAD_YELLOW,
+	DRUM_PAD_BLUE,
+	DRUM_PAD_ORANGE,
+	DRUM_PAD_KICK,
+	DRUM_PAD_COUNT
+};
+
+/* How a particular game wants to be fed, picked once at startup so the
+ * drivers don't need to know about games. */
+typedef struct game_profile_t {
+	/* Prefix of the game ID: 3 characters for every region, 4 for one
+	 * region, 6 for one release. The empty default matches everything. */
+	const char *id;
+	/* Added to the 0-0x7F whammy position. GH3 and GH:A predate WPADGtr and
+	 * want it from 0, everything later from 0x80. */
+	uint8_t whammy_base;
+	/* Right shift from a turntable's 8 bit velocity to what the game reads */
+	uint8_t turntable_shift;
+	/* Note reported for each pad, indexed by DRUM_PAD_* */
+	uint8_t drum_notes[DRUM_PAD_COUNT];
+} game_profile_t;
+
+extern const game_profile_t *game_profile;
+
+/* One step of merging an accessory's report into its host's: which bytes of
+ * WPADData_t, and how the two values combine */
+enum {
+	AGGREGATE_OR,
+	AGGREGATE_MAX,
+	AGGREGATE_MAX_ABS,
+};
+#define AGGREGATE_PLAN_MAX 8
+#define AGGREGATE_NO_HOST 0xFF
+typedef struct aggregate_field_t {
+	uint8_t offset;
+	uint8_t size;
+	uint8_t op;
+	/* Bits taken from the accessory, for AGGREGATE_OR */
+	uint16_t mask;
+} aggregate_field_t;
+
+/* Where an Xbox One (GIP) device's handshake is up to, and what it still has
+ * to be sent. Owned by its driver, one transfer is in flight at a time. */
+typedef struct gip_state_t {
+	uint8_t stage;
+	uint8_t sequence;
+	/* The transfer in flight is one of ours going out, not a read */
+	bool writing;
+	bool guide;
+	/* The last packet asked to be acknowledged */
+	bool ack;
+	uint8_t ack_command;
+	uint8_t ack_flags;
+	uint8_t ack_sequence;
+	uint8_t ack_length;
+} gip_state_t;
+
 typedef struct usb_input_device_t {
 	bool valid;
-	bool real;
 	bool suspended;
-	bool old_wpad;
 	/* VID and PID */
 	uint16_t vid;
 	uint16_t pid;
@@ -111,11 +233,31 @@ typedef struct usb_input_device_t {
 	uint8_t type;
 	uint8_t state;
 	uint8_t api_type;
+    /* The WPAD channel the game sees this device on. A device on standby
+     * has none, this is then the channel it backs up. */
     uint8_t wiimote;
 	/* Used to communicate with Wii's USB module */
 	ios_fd_t host_fd;
-    bool dpdEnabled;
 	bool waiting;
+	bool attaching;
+	bool latched;
+	/* A report has landed since the game last read this device, and when */
+	bool report_unread;
+	uint32_t report_tick;
+	/* On standby, a report is waiting for the next slow poll, and when the
+	 * last one was taken */
+	bool report_deferred;
+	uint32_t standby_tick;
+	uint8_t watchdog_stage;
+	uint8_t watchdog_swallow;
+	uint32_t watchdog_tick;
+	/* Transfers completing into onDevUsbPoll, and how many of those were
+	 * issued before the device was last detached */
+	uint8_t transfers_pending;
+	uint8_t transfers_stale;
+	/* Kept across a reattach, so the error that cost a device its slot is
+	 * still there to look at */
+	usb_error_ring_t errors;
 	int led_state;
 	bool last_rumble_on;
 	bool rumble_on;
@@ -128,20 +270,42 @@ typedef struct usb_input_device_t {
     WPADStatus_t status;
     WPADExtension_t extension;
     WPADData_t input;
+    /* Pointer emulation, for devices that have a way to point */
+    struct bm_ir_emulation_state_t ir_emulation;
+    /* Platter motion the game hasn't read yet, for turntables */
+    struct turntable_platter_state_t platters;
+    /* Hits the game hasn't read yet, for kits that report hits as events */
+    struct drum_hit_queue_t drum_hits;
+    /* Handshake state, for Xbox One devices */
+    gip_state_t gip;
+    /* Reports in a row that looked like a GH kit's, for 360 kits not yet
+     * told apart */
+    uint8_t drums_gh_reports;
+    /* An accessory adds its input to its host's wiimote instead of getting
+     * one of its own. The plan says how, and is made when the two meet. */
+    bool accessory;
+    uint8_t aggregate_host;
+    uint8_t aggregate_plan_len;
+    aggregate_field_t aggregate_plan[AGGREGATE_PLAN_MAX];
+    /* On a host, one bit per device of the accessories merged into it */
+    uint32_t aggregate_accessories;
     WPADAccGravityUnit_t gravityUnit[2]; 
-    WPADConnectCallback_t connectCallback;
+    /* The game's, copied from the channel while the device is on one */
     WPADExtensionCallback_t extensionCallback;
-    WPADSamplingCallback_t samplingCallback;
-    WPADControlDpdCallback_t controlDpdCallback;
-    void *autoSamplingBuffer;
-    int autoSamplingBufferCount;
-    int autoSamplingBufferIndex;
 	/* Driver that handles this device */
 	const usb_device_driver_t *driver;
 	/* Buffer where we store the USB async respones */
 	uint8_t usb_async_resp[128] IOS_ALIGN;
 	struct usb_hid_v4_transfer transferV4 IOS_ALIGN; 
+	/* v5 transfer message, from the IPC heap while the device has one */
+	struct usb_hid_v5_message *messageV5;
     WPADData_t wpadData;
+    /* Snapshot of wpadData handed to the game when sampling is VI synchronised */
+    WPADData_t latchedData;
+#ifdef USB_AGGREGATION
+    /* wpadData with the accessories merged in, on a host that has any */
+    WPADData_t aggregatedData;
+#endif
 } usb_input_device_t;
 
 static inline bool usb_driver_is_comaptible(uint16_t vid, uint16_t pid, const struct device_id_t *ids, int num)
@@ -156,12 +320,73 @@ static inline bool usb_driver_is_comaptible(uint16_t vid, uint16_t pid, const st
 
 extern const usb_device_driver_t gh_guitar_usb_device_driver;
 extern const usb_device_driver_t gh_drum_usb_device_driver;
+extern const usb_device_driver_t rb_guitar_usb_device_driver;
+extern const usb_device_driver_t rb_drum_usb_device_driver;
+extern const usb_device_driver_t rb4_guitar_usb_device_driver;
+extern const usb_device_driver_t rb4_drum_usb_device_driver;
 extern const usb_device_driver_t turntable_usb_device_driver;
 extern const usb_device_driver_t santroller_usb_device_driver;
 extern const usb_device_driver_t xbox_controller_usb_device_driver;
+extern const usb_device_driver_t xbox_one_usb_device_driver;
 extern const usb_device_driver_t ds3_usb_device_driver;
 extern const usb_device_driver_t ds4_usb_device_driver;
 extern const usb_device_driver_t switch_taiko_usb_device_driver;
+extern const usb_device_driver_t midi_drum_usb_device_driver;
+extern const usb_device_driver_t net_instrument_usb_device_driver;
+
+/* Instruments played over the network (NET_INSTRUMENT), a datagram per
+ * state. Big endian, as the Wii is. */
+#define NET_INSTRUMENT_MAGIC 0x5553424E /* "USBN" */
+/* Stands in for a vid, the type is the pid */
+#define NET_INSTRUMENT_VID 0x0000
+/* Instruments that can be played at once, by id */
+#define NET_INSTRUMENTS 4
+
+#define NET_INSTRUMENT_GUITAR 1
+#define NET_INSTRUMENT_DRUM 2
+#define NET_INSTRUMENT_TURNTABLE 3
+
+/* The colours are frets, pads, or the left platter's buttons, the right
+ * platter has buttons of its own */
+#define NET_BUTTON_GREEN (1 << 0)
+#define NET_BUTTON_RED (1 << 1)
+#define NET_BUTTON_YELLOW (1 << 2)
+#define NET_BUTTON_BLUE (1 << 3)
+#define NET_BUTTON_ORANGE (1 << 4)
+#define NET_BUTTON_PLUS (1 << 5)
+#define NET_BUTTON_MINUS (1 << 6)
+#define NET_BUTTON_HOME (1 << 7)
+#define NET_BUTTON_UP (1 << 8)
+#define NET_BUTTON_DOWN (1 << 9)
+#define NET_BUTTON_LEFT (1 << 10)
+#define NET_BUTTON_RIGHT (1 << 11)
+#define NET_BUTTON_KICK (1 << 12)
+#define NET_BUTTON_EUPHORIA (1 << 13)
+#define NET_BUTTON_RIGHT_GREEN (1 << 14)
+#define NET_BUTTON_RIGHT_RED (1 << 15)
+#define NET_BUTTON_RIGHT_BLUE (1 << 16)
+
+struct net_instrument_packet {
+	uint32_t magic;
+	/* Datagrams older than the last one are dropped */
+	uint16_t sequence;
+	uint8_t id;
+	uint8_t type;
+	uint32_t buttons;
+	int8_t stick[2];
+	/* 0 at rest */
+	uint8_t whammy;
+	/* 0 level, 127 with the neck straight up */
+	int8_t tilt;
+	/* By DRUM_PAD_*, 0 when not hit */
+	uint8_t velocity[DRUM_PAD_COUNT];
+	/* How far each platter turned since the last datagram */
+	int8_t platter[2];
+	/* 0 left to 0xFF right, and 0 to 0xFF around */
+	uint8_t cross_fader;
+	uint8_t effects_dial;
+	uint8_t pad[2];
+} ATTRIBUTE_PACKED;
 
 
 
@@ -169,6 +394,7 @@ extern const usb_device_driver_t switch_taiko_usb_device_driver;
 int usb_device_driver_issue_ctrl_transfer_async(usb_input_device_t *device, uint8_t requesttype,
 						uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length);
 int usb_device_driver_issue_intr_transfer_async(usb_input_device_t *device, bool out, void *data, uint16_t length);
+int usb_device_driver_issue_bulk_transfer_async(usb_input_device_t *device, bool out, void *data, uint16_t length);
 int usb_device_driver_issue_ctrl_transfer(usb_input_device_t *device, uint8_t requesttype,
 						uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length);
 int usb_device_driver_issue_intr_transfer(usb_input_device_t *device, bool out, void *data, uint16_t length);
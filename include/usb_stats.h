@@ -0,0 +1,112 @@
+#pragma once
+#include <stdint.h>
+
+/* Counters for tuning polling, exported from main.c as usb_stats. The layout
+ * is read from outside the module, by debuggers and tools/usb_stats.py, so
+ * fields are only ever added at the end of a struct, and the version goes up
+ * whenever they are. Everything is big endian, as the Wii is. */
+#define USB_STATS_MAGIC 0x55534253 /* "USBS" */
+#define USB_STATS_VERSION 3
+
+/* One per API_TYPE_*, 0 is unused */
+#define USB_STATS_TRANSPORTS 6
+/* One per device context, USB_MAX_DEVICES in main.c */
+#define USB_STATS_DEVICES 32
+/* A device's channel when it doesn't have one, on standby or as an
+ * accessory */
+#define USB_STATS_NO_CHANNEL 0xFF
+
+typedef struct {
+	/* Transfers issued, and how many of those were towards the device */
+	uint32_t transfers;
+	uint32_t writes;
+	uint32_t completions;
+	/* Transfers IOS wouldn't take, and ones that completed with an error */
+	uint32_t failed_submits;
+	uint32_t failed_transfers;
+	/* Device lists received */
+	uint32_t device_changes;
+} usb_transport_stats_t;
+
+typedef struct {
+	/* The device in the context, kept after it is gone. The counters
+	 * restart when a different device takes the context. */
+	uint16_t vid;
+	uint16_t pid;
+	uint8_t api_type;
+	uint8_t valid;
+	uint8_t last_error_stage;
+	/* The WPAD channel the game sees it on */
+	uint8_t channel;
+	int32_t last_error;
+	uint32_t attaches;
+	/* Transfers that completed into the driver, reads and writes alike */
+	uint32_t completions;
+	uint32_t writes;
+	/* Timebase ticks spent in the driver's handler */
+	uint32_t translate_ticks;
+	uint32_t translate_max_ticks;
+	/* Reads by the game, the ones that got nothing new since the last, and
+	 * the ones in a format without the device's extension */
+	uint32_t game_reads;
+	uint32_t stale_reads;
+	uint32_t partial_reads;
+	/* Completions that were replaced before the game read them */
+	uint32_t dropped_reports;
+	/* Watchdog cancels and resets */
+	uint32_t rearms;
+	uint32_t resets;
+	uint32_t errors;
+} usb_device_stats_t;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	/* sizeof(usb_stats_t) */
+	uint16_t size;
+	/* Timebase ticks per second, and the timebase at start and at the last
+	 * game read, to turn the counters into rates */
+	uint32_t tick_rate;
+	uint32_t start_tick;
+	uint32_t tick;
+	usb_transport_stats_t transports[USB_STATS_TRANSPORTS];
+	usb_device_stats_t devices[USB_STATS_DEVICES];
+} usb_stats_t;
+
+/* Datagrams sent by USB_TELEMETRY, read by tools/usb_telemetry.py. A header,
+ * then a usb_telemetry_device_t per context that has had a device. Counts are
+ * since the previous datagram. */
+#define USB_TELEMETRY_MAGIC 0x55534254 /* "USBT" */
+#define USB_TELEMETRY_VERSION 2
+/* Latency samples sent per device, the most recent ones */
+#define USB_TELEMETRY_SAMPLES 8
+
+typedef struct {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t devices;
+	uint16_t sequence;
+	/* Timebase ticks since the previous datagram, and per second */
+	uint32_t elapsed_ticks;
+	uint32_t tick_rate;
+} usb_telemetry_header_t;
+
+typedef struct {
+	uint8_t slot;
+	uint8_t api_type;
+	uint8_t valid;
+	/* How many of latency_us are filled in */
+	uint8_t samples;
+	uint16_t vid;
+	uint16_t pid;
+	uint16_t reports;
+	uint16_t reads;
+	uint16_t dropped_reports;
+	uint16_t stale_reads;
+	uint16_t errors;
+	uint8_t last_error_stage;
+	uint8_t channel;
+	int32_t last_error;
+	/* From a report landing to the game reading it */
+	uint16_t latency_us[USB_TELEMETRY_SAMPLES];
+} usb_telemetry_device_t;
@@ -1,11 +1,30 @@
 #pragma once
 #include "defines.h"
+#include "rvl/WPAD.h"
 #include <stdint.h>
 #include <stdbool.h>
 
 /* Acceleromter configuration */
 #define ACCEL_ZERO_G	(0x80 << 2)
 #define ACCEL_ONE_G	(0x9A << 2)
+/* What WPADGetAccGravityUnit reports, acceleration is signed around zero */
+#define ACCEL_G_UNIT	(ACCEL_ONE_G - ACCEL_ZERO_G)
+
+/* Accelerometer emulation. ACCEL_SCALE turns a sensor's counts per g into a
+ * fixed point factor to WPAD units. */
+#define ACCEL_SCALE_FRAC_BITS	12
+#define ACCEL_SCALE(res_per_g)	((ACCEL_G_UNIT << ACCEL_SCALE_FRAC_BITS) / (res_per_g))
+
+/* A pad held in both hands is a remote held sideways, IR end to the left.
+ * The remote's +X is to its right, +Y out of the IR end and +Z out of its
+ * face, so on a pad that is the pad's forward, left and up. The pad's axes
+ * are zero at rest and read +1g on the up axis when lying flat. */
+static inline void wiimote_acc_from_pad(WPADData_t *data, int32_t right, int32_t forward, int32_t up, int32_t scale)
+{
+	data->acceleration[0] = (forward * scale) >> ACCEL_SCALE_FRAC_BITS;
+	data->acceleration[1] = (-right * scale) >> ACCEL_SCALE_FRAC_BITS;
+	data->acceleration[2] = (up * scale) >> ACCEL_SCALE_FRAC_BITS;
+}
 
 /* IR data modes */
 #define IR_MODE_BASIC		1
@@ -27,3 +46,171 @@
 #define IR_DOT_CENTER_MAX_X (IR_HIGH_X - IR_HORIZONTAL_OFFSET)
 #define IR_DOT_CENTER_MIN_Y (IR_LOW_Y  + IR_VERTICAL_OFFSET)
 #define IR_DOT_CENTER_MAX_Y (IR_HIGH_Y - IR_VERTICAL_OFFSET)
+
+/* IR emulation, for devices that point with something other than a camera.
+ * The pointer is kept in IR units with IR_FRAC_BITS of fraction, from the top
+ * left of the range the centre of the dots can take. */
+#define IR_FRAC_BITS 8
+#define IR_POINTER_W ((IR_DOT_CENTER_MAX_X - IR_DOT_CENTER_MIN_X) << IR_FRAC_BITS)
+#define IR_POINTER_H ((IR_DOT_CENTER_MAX_Y - IR_DOT_CENTER_MIN_Y) << IR_FRAC_BITS)
+
+enum bm_ir_emulation_mode_e {
+	BM_IR_EMULATION_MODE_NONE,
+	BM_IR_EMULATION_MODE_DIRECT,
+	BM_IR_EMULATION_MODE_RELATIVE_TOUCH,
+	BM_IR_EMULATION_MODE_RELATIVE_ANALOG_AXIS,
+	BM_IR_EMULATION_MODE_ABSOLUTE_ANALOG_AXIS,
+	BM_IR_EMULATION_MODE__NUM,
+};
+enum bm_ir_axis_e {
+	BM_IR_AXIS_X,
+	BM_IR_AXIS_Y,
+	BM_IR_AXIS__NUM,
+};
+struct bm_ir_emulation_state_t {
+	uint8_t mode;
+	bool mode_held;
+	bool touching;
+	uint16_t last_touch[BM_IR_AXIS__NUM];
+	int32_t position[BM_IR_AXIS__NUM];
+};
+
+static inline void bm_ir_emulation_state_reset(struct bm_ir_emulation_state_t *state, uint8_t mode)
+{
+	state->mode = mode;
+	state->mode_held = false;
+	state->touching = false;
+	state->position[BM_IR_AXIS_X] = IR_POINTER_W / 2;
+	state->position[BM_IR_AXIS_Y] = IR_POINTER_H / 2;
+}
+
+static inline void bm_ir_emulation_move(struct bm_ir_emulation_state_t *state, int32_t dx, int32_t dy)
+{
+	int32_t x = state->position[BM_IR_AXIS_X] + dx;
+	int32_t y = state->position[BM_IR_AXIS_Y] + dy;
+	state->position[BM_IR_AXIS_X] = x < 0 ? 0 : x > IR_POINTER_W ? IR_POINTER_W : x;
+	state->position[BM_IR_AXIS_Y] = y < 0 ? 0 : y > IR_POINTER_H ? IR_POINTER_H : y;
+}
+
+/* Two dots either side of the pointer, as a sensor bar would show. The camera
+ * sees the bar move the opposite way to the remote, so both axes flip. */
+static inline void bm_ir_dots_set_from_state(WPADData_t *data, const struct bm_ir_emulation_state_t *state)
+{
+	int16_t x = IR_DOT_CENTER_MAX_X - (state->position[BM_IR_AXIS_X] >> IR_FRAC_BITS);
+	int16_t y = IR_DOT_CENTER_MAX_Y - (state->position[BM_IR_AXIS_Y] >> IR_FRAC_BITS);
+
+	for (int i = 0; i < IR_MAX_DOTS; i++) {
+		data->ir[i].x = 0;
+		data->ir[i].y = 0;
+		data->ir[i].size = 0;
+		data->ir[i].id = i;
+	}
+	if (state->mode == BM_IR_EMULATION_MODE_NONE)
+		return;
+	data->ir[0].x = x - IR_HORIZONTAL_OFFSET;
+	data->ir[0].y = y;
+	data->ir[0].size = IR_DOT_SIZE;
+	data->ir[1].x = x + IR_HORIZONTAL_OFFSET;
+	data->ir[1].y = y;
+	data->ir[1].size = IR_DOT_SIZE;
+}
+
+/* Turntable platters. The game reads how far each platter turned since its
+ * last sample, as a 6 bit signed value. Drivers add every report in fixed
+ * point and each game read takes the rounded whole part, leaving the rest
+ * for the next read. */
+#define TURNTABLE_FRAC_BITS	8
+#define TURNTABLE_DELTA_MIN	-32
+#define TURNTABLE_DELTA_MAX	31
+/* Motion still owed to the game is capped so a platter doesn't keep turning
+ * after it was stopped */
+#define TURNTABLE_CARRY_MAX	((2 * -TURNTABLE_DELTA_MIN) << TURNTABLE_FRAC_BITS)
+
+enum turntable_platter_e {
+	TURNTABLE_PLATTER_LEFT,
+	TURNTABLE_PLATTER_RIGHT,
+	TURNTABLE_PLATTER__NUM,
+};
+struct turntable_platter_state_t {
+	int32_t carry[TURNTABLE_PLATTER__NUM];
+};
+
+static inline void turntable_platter_add(struct turntable_platter_state_t *state, int platter, int32_t delta)
+{
+	int32_t carry = state->carry[platter] + delta;
+	state->carry[platter] = carry < -TURNTABLE_CARRY_MAX ? -TURNTABLE_CARRY_MAX : carry > TURNTABLE_CARRY_MAX ? TURNTABLE_CARRY_MAX : carry;
+}
+
+static inline int8_t turntable_platter_take(struct turntable_platter_state_t *state, int platter)
+{
+	int32_t delta = (state->carry[platter] + (1 << (TURNTABLE_FRAC_BITS - 1))) >> TURNTABLE_FRAC_BITS;
+	delta = delta < TURNTABLE_DELTA_MIN ? TURNTABLE_DELTA_MIN : delta > TURNTABLE_DELTA_MAX ? TURNTABLE_DELTA_MAX : delta;
+	state->carry[platter] -= delta * (1 << TURNTABLE_FRAC_BITS);
+	return delta;
+}
+
+static inline void turntable_platters_set_from_state(WPADData_t *data, struct turntable_platter_state_t *state)
+{
+	int8_t ltt = turntable_platter_take(state, TURNTABLE_PLATTER_LEFT);
+	data->extension_data.turntable.ltt_sign = ltt >= 0;
+	data->extension_data.turntable.ltt = ltt;
+	int8_t rtt = turntable_platter_take(state, TURNTABLE_PLATTER_RIGHT);
+	data->extension_data.turntable.rtt_sign = rtt < 0;
+	data->extension_data.turntable.rtt = rtt;
+}
+
+/* Drum hits. The extension reports one hit at a time, as the MIDI note of the
+ * pad and its velocity, both 0-0x7F, spread over bits of the report. */
+static inline void wiimote_drum_hit(WPADData_t *data, uint8_t note, uint8_t velocity)
+{
+	velocity = 0x7F - velocity;
+	note = 0x7F - note;
+	data->extension_data.drum.velocity0 = ~velocity;
+	data->extension_data.drum.velocity1 = ~velocity >> 1;
+	data->extension_data.drum.velocity2 = velocity >> 2;
+	data->extension_data.drum.velocity3 = velocity >> 3;
+	data->extension_data.drum.velocity4 = velocity >> 4;
+	data->extension_data.drum.velocity5 = velocity >> 5;
+	data->extension_data.drum.velocity6 = velocity >> 6;
+	data->extension_data.drum.note0 = note;
+	data->extension_data.drum.note1 = note >> 1;
+	data->extension_data.drum.note2 = note >> 2;
+	data->extension_data.drum.note3 = note >> 3;
+	data->extension_data.drum.note4 = note >> 4;
+	data->extension_data.drum.note5 = note >> 5;
+	data->extension_data.drum.note6 = note >> 6;
+}
+
+/* Kits that send hits as events rather than as a state queue them, and each
+ * game read takes the oldest. A hit that doesn't fit is dropped. */
+#define DRUM_HIT_QUEUE_SIZE	16
+
+struct drum_hit_t {
+	uint8_t pad;
+	uint8_t velocity;
+};
+struct drum_hit_queue_t {
+	uint8_t head;
+	uint8_t tail;
+	struct drum_hit_t hits[DRUM_HIT_QUEUE_SIZE];
+};
+
+static inline bool drum_hit_push(struct drum_hit_queue_t *queue, uint8_t pad, uint8_t velocity)
+{
+	uint8_t next = (queue->tail + 1) % DRUM_HIT_QUEUE_SIZE;
+	if (next == queue->head)
+		return false;
+	queue->hits[queue->tail].pad = pad;
+	queue->hits[queue->tail].velocity = velocity;
+	queue->tail = next;
+	return true;
+}
+
+static inline bool drum_hit_pop(struct drum_hit_queue_t *queue, struct drum_hit_t *hit)
+{
+	if (queue->head == queue->tail)
+		return false;
+	*hit = queue->hits[queue->head];
+	queue->head = (queue->head + 1) % DRUM_HIT_QUEUE_SIZE;
+	return true;
+}
@@ -0,0 +1,254 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/* XInput report layouts and the translation from them to WPAD, for the Xbox
+ * 360 driver and the drivers that convert their own reports to these. Include
+ * after usb_hid.h. */
+
+/* XInput sub types, from the controller's descriptor or link report */
+#define XINPUT_GAMEPAD 1
+#define XINPUT_WHEEL 2
+#define XINPUT_ARCADE_STICK 3
+#define XINPUT_FLIGHT_STICK 4
+#define XINPUT_DANCE_PAD 5
+#define XINPUT_GUITAR 6
+#define XINPUT_GUITAR_ALTERNATE 7
+#define XINPUT_DRUMS 8
+#define XINPUT_STAGE_KIT 9
+#define XINPUT_GUITAR_BASS 11
+#define XINPUT_PRO_KEYS 15
+#define XINPUT_ARCADE_PAD 19
+#define XINPUT_TURNTABLE 23
+#define XINPUT_PRO_GUITAR 25
+#define XINPUT_GUITAR_WT 26
+/* Not reported by the controller: both kits claim XINPUT_DRUMS, their reports
+ * narrow it down to one of these */
+#define XINPUT_DRUMS_GH 0x88
+#define XINPUT_DRUMS_RB 0x89
+/* Reports in a row with the GH kit's bit held before it is taken for one. On
+ * an RB kit the same bit is the second kick pedal, which won't stay held
+ * through that many hits from when the kit is plugged in. */
+#define XINPUT_DRUMS_GH_REPORTS 200
+
+typedef struct {
+    uint8_t rid;
+    uint8_t rsize;
+
+    uint8_t rightThumbClick : 1;
+    uint8_t leftThumbClick : 1;
+    uint8_t back : 1;
+    uint8_t start : 1;
+
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;
+    uint8_t dpadUp : 1;
+
+    uint8_t y : 1;
+    uint8_t x : 1;
+    uint8_t b : 1;
+    uint8_t a : 1;
+
+    uint8_t : 1;
+    uint8_t guide : 1;
+    uint8_t rightShoulder : 1;
+    uint8_t leftShoulder : 1;
+
+    uint8_t leftTrigger;
+    uint8_t rightTrigger;
+    int16_t leftStickX;
+    int16_t leftStickY;
+    int16_t rightStickX;
+    int16_t rightStickY;
+    uint8_t reserved_1[6];
+} __attribute__((packed)) XInputGamepad_Data_t;
+
+typedef struct
+{
+    uint8_t rid;
+    uint8_t rsize;
+
+    uint8_t padFlag : 1;  // right thumb click
+    uint8_t pedal2 : 1;   // pedal2
+    uint8_t back : 1;
+    uint8_t start : 1;
+
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;
+    uint8_t dpadUp : 1;
+
+    uint8_t yellow : 1;  // yellow
+    uint8_t blue : 1;    // blue
+    uint8_t red : 1;     // red
+    uint8_t green : 1;   // green
+
+    uint8_t : 1;
+    uint8_t guide : 1;
+    uint8_t cymbalFlag : 1;  // right shoulder click
+    uint8_t pedal1 : 1;      // pedal1
+
+    uint8_t unused[2];
+    int16_t redVelocity;
+    int16_t yellowVelocity;
+    int16_t blueVelocity;
+    int16_t greenVelocity;
+    uint8_t reserved_1[6];
+} __attribute__((packed)) XInputRockBandDrums_Data_t;
+
+typedef struct
+{
+    uint8_t rid;
+    uint8_t rsize;
+    uint8_t : 1;
+    uint8_t leftThumbClick : 1;  // isGuitarHero
+    uint8_t start : 1;
+    uint8_t back : 1;
+
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;
+    uint8_t dpadUp : 1;
+
+    uint8_t yellow : 1;  // yellow
+    uint8_t blue : 1;    // blue
+    uint8_t red : 1;     // red
+    uint8_t green : 1;   // green
+
+    uint8_t : 1;
+    uint8_t guide : 1;
+    uint8_t orange : 1;  // orange
+    uint8_t kick : 1;    // kick
+
+    // TODO: The hi-hat pedal data is probably here somewhere
+    uint8_t unused1[2];
+    int16_t unused2;
+    uint8_t greenVelocity;
+    uint8_t redVelocity;
+    uint8_t yellowVelocity;
+    uint8_t blueVelocity;
+    uint8_t orangeVelocity;
+    uint8_t kickVelocity;
+    uint8_t reserved_1[6];
+} __attribute__((packed)) XInputGuitarHeroDrums_Data_t;
+
+typedef struct
+{
+    uint8_t rid;
+    uint8_t rsize;
+
+    uint8_t : 1;
+    uint8_t : 1;
+    uint8_t back : 1;
+    uint8_t start : 1;
+
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;  // dpadStrumDown
+    uint8_t dpadUp : 1;    // dpadStrumUp
+
+    uint8_t yellow : 1;  // yellow
+    uint8_t blue : 1;    // blue
+    uint8_t red : 1;     // red
+    uint8_t green : 1;   // green
+
+    uint8_t : 1;
+    uint8_t guide : 1;
+    uint8_t pedal : 1;   // pedal
+    uint8_t orange : 1;  // orange
+
+    uint8_t accelZ;
+    uint8_t accelX;
+    int16_t slider;
+    int16_t unused;
+    int16_t whammy;
+    int16_t tilt;
+    uint8_t reserved_1[6];
+} __attribute__((packed)) XInputGuitarHeroGuitar_Data_t;
+
+typedef struct
+{
+    uint8_t rid;
+    uint8_t rsize;
+    uint8_t : 1;
+    uint8_t solo : 1;  // leftThumbClick
+    uint8_t back : 1;
+    uint8_t start : 1;
+
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;  // dpadStrumDown
+    uint8_t dpadUp : 1;    // dpadStrumUp
+
+    uint8_t yellow : 1;  // yellow
+    uint8_t blue : 1;    // blue
+    uint8_t red : 1;     // red
+    uint8_t green : 1;   // green
+
+    uint8_t : 1;
+    uint8_t guide : 1;
+    uint8_t : 1;
+    uint8_t orange : 1;  // orange
+
+    uint8_t pickup;
+    uint8_t unused1;
+    int16_t calibrationSensor;
+    int16_t unused2;
+    int16_t whammy;
+    int16_t tilt;
+    uint8_t reserved_1[6];
+} __attribute__((packed)) XInputRockBandGuitar_Data_t;
+
+typedef struct
+{
+    uint8_t rid;
+    uint8_t rsize;
+
+    uint8_t : 1;
+    uint8_t : 1;
+    uint8_t back : 1;
+    uint8_t start : 1;
+
+    uint8_t dpadRight : 1;
+    uint8_t dpadLeft : 1;
+    uint8_t dpadDown : 1;
+    uint8_t dpadUp : 1;
+
+    uint8_t y : 1;  // euphoria
+    uint8_t x : 1;
+    uint8_t b : 1;
+    uint8_t a : 1;
+
+    uint8_t : 1;
+    uint8_t guide : 1;
+    uint8_t : 1;
+    uint8_t : 1;
+
+    uint8_t : 5;
+    uint8_t leftBlue : 1;
+    uint8_t leftRed : 1;
+    uint8_t leftGreen : 1;
+
+    uint8_t : 5;
+    uint8_t rightBlue : 1;
+    uint8_t rightRed : 1;
+    uint8_t rightGreen : 1;
+
+    int16_t leftTableVelocity;
+    int16_t rightTableVelocity;
+
+    int16_t effectsKnob;  // Whether or not this is signed doesn't really matter, as either way it's gonna loop over when it reaches min/max
+    int16_t crossfader;
+    uint8_t reserved_1[6];
+} __attribute__((packed)) XInputTurntable_Data_t;
+
+/* Translation of XInput reports, shared by every driver speaking some form of
+ * XInput. They all fill device->wpadData from one report. */
+void xbox_controller_set_extension(usb_input_device_t *device, uint8_t sub_type);
+bool xbox_controller_report_turntable_input(const XInputTurntable_Data_t *report, usb_input_device_t *device);
+bool xbox_controller_report_gh_guitar_input(const XInputGuitarHeroGuitar_Data_t *report, usb_input_device_t *device);
+bool xbox_controller_report_rb_guitar_input(const XInputRockBandGuitar_Data_t *report, usb_input_device_t *device);
+bool xbox_controller_report_drums_input(const XInputGuitarHeroDrums_Data_t *report, usb_input_device_t *device);
+bool xbox_controller_report_rb_drums_input(const XInputRockBandDrums_Data_t *report, usb_input_device_t *device);
+bool xbox_controller_report_gamepad_input(const XInputGamepad_Data_t *report, usb_input_device_t *device);
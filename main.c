@@ -36,14 +36,17 @@
 #include <rvl/cache.h>
 #include <rvl/ipc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "defines.h"
 #include "rvl/OSInterrupts.h"
+#include "rvl/vi.h"
 #include "usb.h"
 #include "usb_hid.h"
+#include "usb_stats.h"
 
 BSLUG_MODULE_GAME("????");
 BSLUG_MODULE_NAME("Guitar Hero USB Instrument Support");
@@ -55,10 +58,98 @@ BSLUG_MODULE_LICENSE("BSD");
 /* Macros */
 /*============================================================================*/
 
-/* If you don't want to support both interfaces, remove one of these two
- * defines. */
-#define SUPPORT_DEV_USB_HID4
-#define SUPPORT_DEV_USB_HID5
+/* The interfaces to support, SUPPORT_DEV_USB_HID4 and SUPPORT_DEV_USB_HID5,
+ * come from BACKENDS in makefile.mk. SUPPORT_DEV_USB_VENDOR is set when a
+ * driver for a non-HID device is built in, and brings in oh0 on v4 and ven on
+ * v5 to reach it. oh0 only lists vendor class devices, so it is only of use to
+ * XInput and GIP; USB-MIDI kits (SUPPORT_USB_MIDI) are ven only. */
+#if !defined(SUPPORT_DEV_USB_HID4) && !defined(SUPPORT_DEV_USB_HID5)
+#error "No USB interface selected, set BACKENDS in makefile.mk"
+#endif
+#if defined(SUPPORT_DEV_USB_VENDOR) && defined(SUPPORT_DEV_USB_HID4) && (defined(SUPPORT_XINPUT) || defined(SUPPORT_GIP))
+#define SUPPORT_DEV_USB_OH0
+#endif
+#if defined(SUPPORT_DEV_USB_VENDOR) && defined(SUPPORT_DEV_USB_HID5)
+#define SUPPORT_DEV_USB_VEN
+#endif
+/* Buffers that IOS must find in MEM2, or that are only wanted for a while,
+ * come from a heap of our own */
+#if defined(SUPPORT_DEV_USB_HID5) || defined(SUPPORT_DEV_USB_OH0)
+#define USB_HEAP
+#endif
+
+/* With this define, reports are latched once per frame and the game's
+ * callbacks are fired from the latch instead of from every USB completion.
+ * The latch takes the first report to land in the last VI_LATCH_OFFSET_US
+ * before the retrace, or the latest one at the retrace if none does. Remove
+ * it to go back to the old behaviour. */
+#define VI_SYNCHRONISED_SAMPLING
+#define VI_LATCH_OFFSET_US 1500
+
+/* A streaming device that hasn't completed a transfer within this many of its
+ * report intervals has its endpoint cancelled and re-armed, and if that
+ * doesn't help, the device gets reset. */
+#define USB_WATCHDOG_INTERVALS 25
+
+/* A backend whose device change keeps failing asks for it again up to
+ * USB_ERROR_RETRIES times, is then closed and opened again up to
+ * USB_ERROR_REOPENS times, and after that is left closed. Devices on the
+ * other backend carry on regardless. */
+#define USB_ERROR_RETRIES 3
+#define USB_ERROR_REOPENS 2
+
+/* With this define, the counters in usb_stats are also printed every
+ * USB_STATS_DUMP_MS. They are kept up to date either way. */
+// #define USB_STATS_DUMP
+#define USB_STATS_DUMP_MS 5000
+
+/* With this define, report rates, errors and the latency from a report landing
+ * to the game reading it are sent to USB_TELEMETRY_HOST in a UDP datagram
+ * USB_TELEMETRY_RATE times a second, for tools/usb_telemetry.py. The console's
+ * network is brought up for it. */
+// #define USB_TELEMETRY
+#define USB_TELEMETRY_HOST 192, 168, 1, 100
+#define USB_TELEMETRY_PORT 28400
+#define USB_TELEMETRY_RATE 4
+
+/* With NET_INSTRUMENT, instruments can also be played over the network, as
+ * UDP datagrams to NET_INSTRUMENT_PORT, from a PC side bridge or
+ * tools/net_instrument.py. Each one gets a wiimote like a USB device does,
+ * and goes away after NET_INSTRUMENT_TIMEOUT_MS without a datagram. It is
+ * defined by makefile.mk, which only builds in its driver then. */
+#define NET_INSTRUMENT_PORT 28401
+#define NET_INSTRUMENT_TIMEOUT_MS 2000
+
+#if defined(USB_TELEMETRY) || defined(NET_INSTRUMENT)
+#define USB_NETWORK
+#endif
+
+/* With this define, USB is brought up as soon as the game initialises VI,
+ * rather than waiting for WPADInit, so instruments are already attached and
+ * streaming by the time the game first looks for them. */
+#define USB_EARLY_INIT
+
+/* With this define, each USB device also shows up as a GameCube controller on
+ * the port matching its wiimote slot, for games and menus that read PAD. Real
+ * controllers plugged into a port take priority. */
+// #define PAD_EMULATION
+
+/* With USB_AGGREGATION, devices listed in aggregate_accessories don't get a
+ * wiimote of their own, their input is merged into another device's. It is
+ * defined by makefile.mk when AGGREGATE lists any. */
+
+/* With this define, a USB device that finds every free channel taken rides
+ * along with a real wiimote that has nothing plugged into it: the game gets the
+ * wiimote's buttons, motion and IR and the USB device's extension. Without it
+ * USB devices keep away from channels with a wiimote. */
+// #define USB_OVERLAY_REAL_WIIMOTE
+
+/* With this define, a device that turns up when every channel is taken is
+ * brought up anyway and kept on standby, its reports taken at most every
+ * USB_STANDBY_POLL_MS. When a channel's device goes away, one on standby takes
+ * the channel over straight away. Without it such a device is ignored. */
+#define USB_STANDBY
+#define USB_STANDBY_POLL_MS 100
 
 #define IOS_ALIGN __attribute__((aligned(32)))
 #define MAX_FAKE_WIIMOTES 4
@@ -66,9 +157,24 @@ BSLUG_MODULE_LICENSE("BSD");
 #define DEV_USB_HID_PATH "/dev/usb/hid"
 #define DEV_USB_VEN_PATH "/dev/usb/ven"
 #define DEV_USB_OH0_PATH "/dev/usb/oh0"
+/* Size of the watchdog's scratch buffer (in words). */
+#define DEV_USB_WATCHDOG_BUFFER_SIZE 0x8
+/* Size of the v5 DeviceChange ioctl's return (in strctures), and of one of
+ * them (in bytes). */
+#define DEV_USB_HID5_DEVICE_CHANGE_SIZE 0x20
+#define DEV_USB_HID5_DEVICE_SIZE 12
+/* Total size of all IOS buffers (in words). */
+#define DEV_USB_HID5_TMP_BUFFER_SIZE 0x20
+/* Largest oh0 configuration descriptor read (in bytes). */
+#define DEV_USB_OH0_DESC_MAX 0x600
 
 #define BUFFER_SIZE 5
+/* Device contexts, whether or not the game sees them. Each is a bit in a
+ * uint32_t in places. */
 #define USB_MAX_DEVICES 32
+#if USB_STATS_DEVICES != USB_MAX_DEVICES
+#error "usb_stats.h needs a device per context"
+#endif
 #define USBV0_IOCTL_CTRLMSG 0
 #define USBV0_IOCTL_BLKMSG 1
 #define USBV0_IOCTL_INTRMSG 2
@@ -118,719 +224,1968 @@ static int8_t started = 0;
 #define HAVE_VERSION
 static int8_t version;
 #endif
-int8_t error;
-int8_t errorMethod;
+/* Errors on the backends' fds, devices keep their own */
+static usb_error_ring_t usb_errors;
+/* Errors on each backend since its last successful device change */
+static uint8_t dev_usb_hid_failures;
+static uint8_t dev_usb_ven_failures;
+/* Exported for debuggers and tools/usb_stats.py, which finds it in a memory
+ * dump by its magic */
+usb_stats_t usb_stats = {
+    .magic = USB_STATS_MAGIC,
+    .version = USB_STATS_VERSION,
+    .size = sizeof(usb_stats_t),
+};
 static bool initCalled = false;
+/* Generated from DRIVERS in makefile.mk */
 static const usb_device_driver_t *usb_device_drivers[] = {
-    &gh_guitar_usb_device_driver,
-    &gh_drum_usb_device_driver,
-    &turntable_usb_device_driver,
-    &santroller_usb_device_driver,
-    &xbox_controller_usb_device_driver,
-    &ds3_usb_device_driver,
-    &ds4_usb_device_driver,
-    &switch_taiko_usb_device_driver};
+#include "usb_device_drivers.inc"
+};
+
+static usb_input_device_t usb_devices[USB_MAX_DEVICES];
+
+/* What the game has set up on a WPAD channel, which stays put whichever device
+ * is on it. device is the one the game sees there, kept while the channel is
+ * reserved for it after it goes away. */
+typedef struct {
+    usb_input_device_t *device;
+    bool real;
+    WPADExtension_t real_extension;
+    bool dpdEnabled;
+    bool rumble_on;
+    bool euphoria_led;
+    WPADDataFormat_t currentFormat;
+    WPADConnectCallback_t connectCallback;
+    WPADExtensionCallback_t extensionCallback;
+    WPADSamplingCallback_t samplingCallback;
+    WPADControlDpdCallback_t controlDpdCallback;
+    void *autoSamplingBuffer;
+    int autoSamplingBufferCount;
+    int autoSamplingBufferIndex;
+    int autoSamplingOverlaid;
+} wpad_channel_t;
+
+static wpad_channel_t channels[MAX_FAKE_WIIMOTES];
+
+static inline int usbDeviceIndex(usb_input_device_t *device) {
+    return device - usb_devices;
+}
+
+/* Is the game seeing this device on its channel? */
+static inline bool usbDeviceBound(usb_input_device_t *device) {
+    return channels[device->wiimote].device == device;
+}
+
+static inline usb_device_stats_t *deviceStats(usb_input_device_t *device) {
+    return &usb_stats.devices[usbDeviceIndex(device)];
+}
 
-static usb_input_device_t fake_devices[MAX_FAKE_WIIMOTES];
+static inline usb_transport_stats_t *transportStats(uint8_t api_type) {
+    return &usb_stats.transports[api_type];
+}
+
+#ifdef VI_SYNCHRONISED_SAMPLING
+/* Tick of the last retrace and the measured frame length. vi_period stays 0
+ * until two retraces have been seen, and until then we sample as USB
+ * completions arrive. */
+static uint32_t vi_last_tick;
+static uint32_t vi_period;
+#endif
 
+#ifdef SUPPORT_DEV_USB_OH0
 static uint32_t dev_oh0_devices[DEV_USB_HID4_DEVICE_CHANGE_SIZE] IOS_ALIGN;
+#endif
+static void callbackIgnore(ios_ret_t ret, usr_t unused);
+static void usbDeviceError(usb_input_device_t *device, uint8_t stage, int ret);
+static void usbBackendError(bool ven, uint8_t stage, int ret);
 /*============================================================================*/
-/* Top level interface to game */
+/* Game profiles */
 /*============================================================================*/
-static void onDevOpen(ios_fd_t fd, usr_t unused);
-static void onDevOpenUsb(ios_fd_t fd, usr_t unused);
-uint16_t last = 0;
-uint8_t last_ext = 0;
 
-// Some wii games don't include printf, so we just call vprintf instead
-void printf_v(const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
+#define DEFAULT_DRUM_NOTES {GREEN, RED, YELLOW, BLUE, ORANGE, KICK_PEDAL}
+
+/* First match wins, so more specific IDs go above less specific ones. The
+ * last row is the default. */
+static const game_profile_t game_profiles[] = {
+    /* Guitar Hero III */
+    {"RGH", 0x00, 2, DEFAULT_DRUM_NOTES},
+    /* Guitar Hero: Aerosmith */
+    {"RGV", 0x00, 2, DEFAULT_DRUM_NOTES},
+    {"", 0x80, 2, DEFAULT_DRUM_NOTES},
+};
+
+const game_profile_t *game_profile = &game_profiles[ARRAY_SIZE(game_profiles) - 1];
+
+static void gameProfileSelect(void) {
+    const char *gameid = (const char *)0x80000000;
+    for (int i = 0; i < ARRAY_SIZE(game_profiles); i++) {
+        const char *id = game_profiles[i].id;
+        if (strncmp(gameid, id, strlen(id)) == 0) {
+            game_profile = &game_profiles[i];
+            break;
+        }
+    }
+    printf_v("Game profile: %.6s -> %s\r\n", gameid, game_profile->id);
 }
 
-// Some wii games don't include snprintf, so we just call vsnprintf instead
-void snprintf_v(char *dest, size_t len, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    vsnprintf(dest, len, format, args);
-    va_end(args);
+#ifdef USB_AGGREGATION
+/*============================================================================*/
+/* Device aggregation */
+/*============================================================================*/
+
+/* Devices that only make sense alongside another one, like a separate star
+ * power pedal or hi-hat controller. Each is merged into the first device with
+ * the same extension, and waits for one if there is none yet. */
+static const struct device_id_t aggregate_accessories[] = {
+/* Generated from AGGREGATE in makefile.mk */
+#include "usb_aggregate_accessories.inc"
+};
+
+static void aggregatePlanAdd(usb_input_device_t *accessory, uint8_t offset, uint8_t size, uint8_t op, uint16_t mask) {
+    aggregate_field_t *field = &accessory->aggregate_plan[accessory->aggregate_plan_len++];
+    field->offset = offset;
+    field->size = size;
+    field->op = op;
+    field->mask = mask;
 }
+#define AGGREGATE_FIELD(accessory, member, op, mask) \
+    aggregatePlanAdd(accessory, offsetof(WPADData_t, member), sizeof(((WPADData_t *)0)->member), op, mask)
 
-static void MyWPADRead(int wiiremote, WPADData_t *data) {
-    if (fake_devices[wiiremote].valid) {
-        uint32_t isr = OSDisableInterrupts();
-        memset(data, 0, WPADDataFormatSize(fake_devices[wiiremote].currentFormat));
-        if (fake_devices[wiiremote].currentFormat == fake_devices[wiiremote].format) {
-            memcpy(data, &fake_devices[wiiremote].wpadData, WPADDataFormatSize(fake_devices[wiiremote].currentFormat));
-        } else {
-            // Copy the fields common to all formats.
-            memcpy(data, &fake_devices[wiiremote].wpadData, WPADDataFormatSize(WPAD_FORMAT_NONE));
+/* Which fields of its extension an accessory contributes. Buttons are ORed,
+ * leaving out bits that carry data rather than buttons, and analog values
+ * take whichever of the two is further from rest. A drum hit's velocity stays
+ * the host's, the accessory's pads still come through without it. */
+static void aggregatePlan(usb_input_device_t *accessory) {
+    WPADData_t bits;
+    accessory->aggregate_plan_len = 0;
+    AGGREGATE_FIELD(accessory, buttons, AGGREGATE_OR, 0xFFFF);
+    switch (accessory->extension) {
+        case WPAD_EXTENSION_GUITAR:
+            AGGREGATE_FIELD(accessory, extension_data.guitar.buttons, AGGREGATE_OR, 0xFFFF);
+            AGGREGATE_FIELD(accessory, extension_data.guitar.stick[0], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.guitar.stick[1], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.guitar.whammy, AGGREGATE_MAX, 0);
+            break;
+        case WPAD_EXTENSION_DRUM:
+            bits.extension_data.drum.buttons = 0xFFFF;
+            bits.extension_data.drum.velocity0 = 0;
+            bits.extension_data.drum.velocity1 = 0;
+            AGGREGATE_FIELD(accessory, extension_data.drum.buttons, AGGREGATE_OR, bits.extension_data.drum.buttons);
+            AGGREGATE_FIELD(accessory, extension_data.drum.stick[0], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.drum.stick[1], AGGREGATE_MAX_ABS, 0);
+            break;
+        case WPAD_EXTENSION_TURNTABLE:
+            bits.extension_data.turntable.buttons = 0xFFFF;
+            bits.extension_data.turntable.ltt_sign = 0;
+            AGGREGATE_FIELD(accessory, extension_data.turntable.buttons, AGGREGATE_OR, bits.extension_data.turntable.buttons);
+            AGGREGATE_FIELD(accessory, extension_data.turntable.stick[0], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.turntable.stick[1], AGGREGATE_MAX_ABS, 0);
+            break;
+        case WPAD_EXTENSION_CLASSIC:
+            AGGREGATE_FIELD(accessory, extension_data.classic.buttons, AGGREGATE_OR, 0xFFFF);
+            AGGREGATE_FIELD(accessory, extension_data.classic.leftStick[0], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.classic.leftStick[1], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.classic.rightStick[0], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.classic.rightStick[1], AGGREGATE_MAX_ABS, 0);
+            AGGREGATE_FIELD(accessory, extension_data.classic.trigger[0], AGGREGATE_MAX, 0);
+            AGGREGATE_FIELD(accessory, extension_data.classic.trigger[1], AGGREGATE_MAX, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+/* There's no abs() without the C library. Widened so -32768 stays positive. */
+static inline int32_t aggregateMagnitude(int16_t value) {
+    return value < 0 ? -(int32_t)value : value;
+}
+
+/* Rebuilds what the game sees of a host from its own report and its
+ * accessories' latest ones. */
+static void aggregatePublish(usb_input_device_t *host) {
+    uint32_t isr = OSDisableInterrupts();
+    uint8_t *dst = (uint8_t *)&host->aggregatedData;
+    memcpy(dst, &host->wpadData, sizeof(host->aggregatedData));
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        if (!(host->aggregate_accessories & (1u << i))) {
+            continue;
+        }
+        usb_input_device_t *accessory = &usb_devices[i];
+        const uint8_t *src = (const uint8_t *)&accessory->wpadData;
+        for (int j = 0; j < accessory->aggregate_plan_len; j++) {
+            const aggregate_field_t *field = &accessory->aggregate_plan[j];
+            uint8_t *d = dst + field->offset;
+            const uint8_t *s = src + field->offset;
+            switch (field->op) {
+                case AGGREGATE_OR:
+                    if (field->size == 2) {
+                        *(uint16_t *)d |= *(const uint16_t *)s & field->mask;
+                    } else {
+                        *d |= *s & field->mask;
+                    }
+                    break;
+                case AGGREGATE_MAX:
+                    if (*s > *d) {
+                        *d = *s;
+                    }
+                    break;
+                case AGGREGATE_MAX_ABS:
+                    if (aggregateMagnitude(*(const int16_t *)s) > aggregateMagnitude(*(int16_t *)d)) {
+                        *(int16_t *)d = *(const int16_t *)s;
+                    }
+                    break;
+            }
         }
-        OSRestoreInterrupts(isr);
-    } else {
-        WPADRead(wiiremote, data);
     }
+    OSRestoreInterrupts(isr);
 }
 
-static WPADStatus_t MyWPADProbe(int wiimote, WPADExtension_t *extension) {
-    if (fake_devices[wiimote].valid) {
-        uint32_t isr = OSDisableInterrupts();
-        if (extension) {
-            *extension = fake_devices[wiimote].extension;
+static void aggregateLink(usb_input_device_t *host, usb_input_device_t *accessory) {
+    printf_v("Aggregate: %d into %d\r\n", usbDeviceIndex(accessory), usbDeviceIndex(host));
+    accessory->aggregate_host = usbDeviceIndex(host);
+    aggregatePlan(accessory);
+    host->aggregate_accessories |= 1u << usbDeviceIndex(accessory);
+    aggregatePublish(host);
+}
+
+/* Called once a device is up. An accessory looks for a host, anything else
+ * takes in the accessories that were waiting for one. */
+static void aggregateAttach(usb_input_device_t *device) {
+    uint32_t isr = OSDisableInterrupts();
+    device->accessory = usb_driver_is_comaptible(device->vid, device->pid, aggregate_accessories, ARRAY_SIZE(aggregate_accessories));
+    device->aggregate_host = AGGREGATE_NO_HOST;
+    device->aggregate_accessories = 0;
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *other = &usb_devices[i];
+        if (other == device || !other->valid || other->extension != device->extension) {
+            continue;
+        }
+        if (device->accessory && !other->accessory) {
+            aggregateLink(other, device);
+            break;
+        }
+        if (!device->accessory && other->accessory && other->aggregate_host == AGGREGATE_NO_HOST) {
+            aggregateLink(device, other);
         }
-        OSRestoreInterrupts(isr);
-        return WPAD_STATUS_OK;
     }
-    WPADStatus_t ret = WPADProbe(wiimote, extension);
-    fake_devices[wiimote].real = ret == WPAD_STATUS_OK;
-    return ret;
+    OSRestoreInterrupts(isr);
 }
 
-#define NUM_DESC 1
-static void MyWPADInit(void) {
-    WPADInit();
-    initCalled = true;
-    printf_v("Instrument Support Starting\r\n");
-    char *gameid = (char *)0x80000000;
-    for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
-        memset(&fake_devices[i], 0, sizeof(usb_input_device_t));
-        fake_devices[i].valid = 0;
-        fake_devices[i].real = 0;
-        fake_devices[i].wiimote = 0;
-        fake_devices[i].autoSamplingBuffer = 0;
-        // GH3 and GH:A predate WPADGtr, and thus the whammy works differently
-        fake_devices[i].old_wpad = gameid[0] == 'R' && gameid[1] == 'G' && (gameid[2] == 'H' || gameid[2] == 'V');
-    }
-    /* On first call only, initialise USB and globals. */
-    started = 1;
+/* Unhooks a device that is no longer valid from whatever it was merged with.
+ * Accessories left without a host go to another one if there is one. */
+static void aggregateDetach(usb_input_device_t *device) {
+    uint32_t isr = OSDisableInterrupts();
+    if (device->accessory && device->aggregate_host != AGGREGATE_NO_HOST) {
+        usb_input_device_t *host = &usb_devices[device->aggregate_host];
+        host->aggregate_accessories &= ~(1u << usbDeviceIndex(device));
+        aggregatePublish(host);
+    }
+    uint32_t orphans = device->aggregate_accessories;
+    device->accessory = false;
+    device->aggregate_host = AGGREGATE_NO_HOST;
+    device->aggregate_accessories = 0;
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        if (orphans & (1u << i)) {
+            aggregateAttach(&usb_devices[i]);
+        }
+    }
+    OSRestoreInterrupts(isr);
+}
+#endif
 
-    printf_v("OpenAsync: %d\r\n", IOS_OpenAsync(DEV_USB_HID_PATH, 0, onDevOpen, NULL));
+/*============================================================================*/
+/* Wiimote slot allocation */
+/*============================================================================*/
+
+/* One bit per WPAD channel, for channels owned by USB devices and channels
+ * with a real wiimote. Only ever touched with interrupts disabled. */
+static uint8_t slots_used;
+static uint8_t slots_real;
+
+/* When a device goes away its slot is held for a little while. If the same
+ * kind of device comes back in that time (a flaky cable, a dongle re-pairing)
+ * it gets the slot back and the game never hears about it. */
+#define SLOT_RESERVATION_MS 2000
+static struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t tick;
+} slot_reservations[MAX_FAKE_WIIMOTES];
+
+static inline bool slotReserved(int wiimote) {
+    return slot_reservations[wiimote].tick != 0;
 }
 
-static WPADConnectCallback_t MyWPADSetConnectCallback(int wiimote, WPADConnectCallback_t newCallback) {
-    printf_v("Set sc\r\n");
-    fake_devices[wiimote].connectCallback = newCallback;
-    // return 0;
-    return WPADSetConnectCallback(wiimote, newCallback);
+/* Is there a USB device on this channel, as far as the game is concerned? */
+static inline bool slotOwned(int wiimote) {
+    usb_input_device_t *device = channels[wiimote].device;
+    return device && (device->valid || slotReserved(wiimote));
 }
 
-static WPADExtensionCallback_t MyWPADSetExtensionCallback(int wiimote, WPADExtensionCallback_t newCallback) {
-    printf_v("Set ec\r\n");
-    fake_devices[wiimote].extensionCallback = newCallback;
-    return WPADSetExtensionCallback(wiimote, newCallback);
+/* Is this channel a real wiimote with our extension overlaid on it? */
+static inline bool isOverlay(int wiimote) {
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+    return channels[wiimote].real && slotOwned(wiimote);
+#else
+    return false;
+#endif
 }
 
-static WPADSamplingCallback_t MyWPADSetSamplingCallback(int wiimote, WPADSamplingCallback_t newCallback) {
-    // remember their callback
-    // printf_v("set auto sample cb! %d %d\r\n", wiimote, fake_devices[wiimote].valid);
-    if (fake_devices[wiimote].valid) {
-        fake_devices[wiimote].samplingCallback = newCallback;
-    }
-    return WPADSetSamplingCallback(wiimote, newCallback);
+/* Is this channel ours, rather than something to pass through to WPAD? */
+static inline bool isFake(int wiimote) {
+    return slotOwned(wiimote) && !isOverlay(wiimote);
 }
 
-static void MyWPADSetAutoSamplingBuf(int wiimote, void *buffer, int count) {
-    // printf_v("set auto sample buf! %d %d\r\n", wiimote, count);
-    if (!fake_devices[wiimote].valid) {
-        WPADSetAutoSamplingBuf(wiimote, buffer, count);
-        return;
+static int slotAlloc(uint16_t vid, uint16_t pid, bool *reclaimed) {
+    int slot = -1;
+    uint32_t isr = OSDisableInterrupts();
+    *reclaimed = false;
+    for (int i = 0; i < ARRAY_SIZE(slot_reservations); i++) {
+        // The reservation stays until the device is back up, see
+        // usbDeviceInit. One a device is already coming back to is taken.
+        usb_input_device_t *holder = channels[i].device;
+        if (holder && (holder->attaching || holder->valid)) {
+            continue;
+        }
+        if (slotReserved(i) && slot_reservations[i].vid == vid && slot_reservations[i].pid == pid) {
+            *reclaimed = true;
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        uint8_t free = ~(slots_used | slots_real) & ((1 << MAX_FAKE_WIIMOTES) - 1);
+        if (free) {
+            slot = __builtin_ctz(free);
+            slots_used |= 1 << slot;
+        }
+    }
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+    if (slot < 0) {
+        // Pair up with a wiimote that doesn't have a device yet, and has no
+        // extension of its own for ours to hide
+        for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+            if ((slots_real & ~slots_used & (1 << i)) && channels[i].real_extension == WPAD_EXTENSION_NONE) {
+                slot = i;
+                slots_used |= 1 << slot;
+                break;
+            }
+        }
     }
+#endif
+    OSRestoreInterrupts(isr);
+    return slot;
+}
+
+static void slotFree(int slot) {
     uint32_t isr = OSDisableInterrupts();
-    fake_devices[wiimote].autoSamplingBuffer = buffer;
-    fake_devices[wiimote].autoSamplingBufferCount = count;
+    slot_reservations[slot].tick = 0;
+    slots_used &= ~(1 << slot);
+    if (channels[slot].device) {
+        deviceStats(channels[slot].device)->channel = USB_STATS_NO_CHANNEL;
+        channels[slot].device = NULL;
+    }
     OSRestoreInterrupts(isr);
 }
 
-static int MyWPADGetLatestIndexInBuf(int wiimote) {
-    // printf_v("get auto sample buf! %d\r\n", wiimote);
-    if (!fake_devices[wiimote].valid) {
-        return WPADGetLatestIndexInBuf(wiimote);
+/* Gives back the slot of a device that never came up. One that a device came
+ * back to stays reserved, the game is told when the reservation runs out. */
+static void slotAbandon(int slot) {
+    if (!slotReserved(slot)) {
+        slotFree(slot);
     }
-    return fake_devices[wiimote].autoSamplingBufferIndex;
 }
-static void MyWPADGetAccGravityUnit(int wiimote, WPADExtension_t extension, WPADAccGravityUnit_t *result) {
-    if (!fake_devices[wiimote].valid) {
-        WPADGetAccGravityUnit(wiimote, extension, result);
+
+/* Copies what the game set up on a channel to its device, for the fields
+ * drivers look at */
+static void channelSync(int wiimote) {
+    wpad_channel_t *channel = &channels[wiimote];
+    usb_input_device_t *device = channel->device;
+    if (!device) {
         return;
     }
+    device->currentFormat = channel->currentFormat;
+    device->rumble_on = channel->rumble_on;
+    device->euphoria_led = channel->euphoria_led;
+    device->extensionCallback = channel->extensionCallback;
+}
+
+/* Puts a device on a channel allocated for it. The game was told about
+ * whatever was there before, so the new device carries on from that, and only
+ * a different extension is news. */
+static void channelBind(int wiimote, usb_input_device_t *device) {
     uint32_t isr = OSDisableInterrupts();
-    if (extension == WPAD_EXTENSION_NONE) {
-        *result = fake_devices[wiimote].gravityUnit[0];
-    } else if (extension == WPAD_EXTENSION_NUNCHUCK) {
-        *result = fake_devices[wiimote].gravityUnit[1];
-    } else {
-        result->acceleration[0] = 0;
-        result->acceleration[1] = 0;
-        result->acceleration[2] = 0;
+    usb_input_device_t *prev = channels[wiimote].device;
+    if (prev != device) {
+        device->state = prev ? prev->state : 0;
+        if (prev && device->valid && device->state == 2 && prev->extension != device->extension) {
+            device->state = 1;
+        }
+        if (prev) {
+            deviceStats(prev)->channel = USB_STATS_NO_CHANNEL;
+        }
     }
+    device->wiimote = wiimote;
+    // Drivers that show the channel on their LEDs set them again
+    device->led_state = 1;
+    channels[wiimote].device = device;
+    channelSync(wiimote);
+    deviceStats(device)->channel = wiimote;
     OSRestoreInterrupts(isr);
 }
 
-static int MyWPADSetDataFormat(int wiimote, WPADDataFormat_t format) {
-    // printf_v("set df! %d %d %d\r\n", wiimote, format, fake_devices[wiimote].valid);
-    if (fake_devices[wiimote].valid) {
-        fake_devices[wiimote].currentFormat = format;
-        return WPAD_STATUS_OK;
+/* Hold the slot of a device that went away, the game keeps seeing it idle. */
+static void slotRelease(usb_input_device_t *device) {
+    uint32_t isr = OSDisableInterrupts();
+    slot_reservations[device->wiimote].vid = device->vid;
+    slot_reservations[device->wiimote].pid = device->pid;
+    slot_reservations[device->wiimote].tick = OSGetTick() | 1;
+    device->wpadData.buttons = 0;
+    device->wpadData.extension_data.classic.buttons = 0;
+    if (device->extension == WPAD_EXTENSION_DRUM) {
+        device->wpadData.extension_data.drum.connected = WPAD_DRUM_NO_VELOCITY;
     }
-    return WPADSetDataFormat(wiimote, format);
+    memcpy(&device->latchedData, &device->wpadData, sizeof(device->latchedData));
+    OSRestoreInterrupts(isr);
 }
 
-static WPADDataFormat_t MyWPADGetDataFormat(int wiimote) {
-    // printf_v("get df! %d %d %d\r\n", wiimote, fake_devices[wiimote].currentFormat, WPADGetDataFormat(wiimote));
-    if (!fake_devices[wiimote].valid) {
-        return WPADGetDataFormat(wiimote);
+#ifdef USB_STANDBY
+static void onDevReport(usb_input_device_t *device);
+
+/* Up and polled, but not seen by the game */
+static inline bool usbDeviceStandby(usb_input_device_t *device) {
+    return device->valid && !device->accessory && !usbDeviceBound(device);
+}
+
+/* The channel a device on standby backs up: one with the same kind of device
+ * on it if there is one. */
+static int standbyChannel(uint16_t vid, uint16_t pid) {
+    for (int i = 0; i < ARRAY_SIZE(channels); i++) {
+        usb_input_device_t *device = channels[i].device;
+        if (device && device->vid == vid && device->pid == pid) {
+            return i;
+        }
     }
-    return fake_devices[wiimote].currentFormat;
+    return 0;
 }
 
-static int MyWPADControlDpd(int wiimote, int command, WPADControlDpdCallback_t callback) {
-    if (!fake_devices[wiimote].valid) {
-        return WPADControlDpd(wiimote, command, callback);
+/* Hands a channel whose device went away to one on standby, preferring one
+ * that was backing up this channel. It is already up, so the game only sees
+ * the extension change if it is a different one. */
+static bool standbyTakeover(int wiimote) {
+    usb_input_device_t *standby = NULL;
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if (!usbDeviceStandby(device)) {
+            continue;
+        }
+        if (!standby || (device->wiimote == wiimote && standby->wiimote != wiimote)) {
+            standby = device;
+        }
     }
-    fake_devices[wiimote].dpdEnabled = command > 0;
-    fake_devices[wiimote].controlDpdCallback = callback;
-    if (callback) {
-        callback(wiimote, WPAD_STATUS_OK);
+    if (!standby) {
+        return false;
     }
-    return WPAD_STATUS_OK;
-}
-static bool MyWPADIsDpdEnabled(int wiimote) {
-    if (!fake_devices[wiimote].valid) {
-        return WPADIsDpdEnabled(wiimote);
+    uint32_t isr = OSDisableInterrupts();
+    printf_v("Standby %d takes channel %d\r\n", usbDeviceIndex(standby), wiimote);
+    slot_reservations[wiimote].tick = 0;
+    slots_used |= 1 << wiimote;
+    channelBind(wiimote, standby);
+    // Back to its full rate, starting with the report it was holding
+    standby->watchdog_tick = OSGetTick();
+    standby->watchdog_stage = WATCHDOG_IDLE;
+    if (standby->report_deferred) {
+        onDevReport(standby);
     }
-    return fake_devices[wiimote].dpdEnabled;
+    OSRestoreInterrupts(isr);
+    return true;
 }
-static bool MySCGetScreenSaverMode() {
-    return false;
+
+/* Takes the reports devices on standby have been holding, once they are due.
+ * Their drivers only ask for the next one once the last is taken. */
+static void standbyTick(uint32_t now) {
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        uint32_t isr = OSDisableInterrupts();
+        if (device->report_deferred && usbDeviceStandby(device) && now - device->standby_tick >= ms_to_ticks(USB_STANDBY_POLL_MS)) {
+            onDevReport(device);
+        }
+        OSRestoreInterrupts(isr);
+    }
 }
-static void MyWPADControlMotor(int wiimote, int cmd) {
-    if (!fake_devices[wiimote].valid) {
-        WPADControlMotor(wiimote, cmd);
-        return;
+#endif
+
+/* Tell the game about devices that didn't come back in time, unless one on
+ * standby can take their place. */
+static void slotExpireReservations(void) {
+    uint32_t now = OSGetTick();
+    for (int i = 0; i < ARRAY_SIZE(slot_reservations); i++) {
+        if (!slotReserved(i) || now - slot_reservations[i].tick < ms_to_ticks(SLOT_RESERVATION_MS)) {
+            continue;
+        }
+        // The device that came back either makes it or is abandoned
+        if (channels[i].device && channels[i].device->attaching) {
+            continue;
+        }
+#ifdef USB_STANDBY
+        if (standbyTakeover(i)) {
+            continue;
+        }
+#endif
+        wpad_channel_t *channel = &channels[i];
+        slotFree(i);
+        if (channel->connectCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
+            printf_v("call sc disconnect: %d %d\r\n", i, WPADGetStatus());
+            channel->connectCallback(i, WPAD_STATUS_DISCONNECTED);
+        }
+        channel->extensionCallback = NULL;
     }
-    fake_devices[wiimote].rumble_on = cmd;
-    // GH games pulse rumble when star power is ready or active
-    printf_v("motor! %d %d\r\n", wiimote, cmd);
 }
-static void MyWPADWriteExtReg(int wiimote, void *buffer, int size, WPADPeripheralSpace_t space, int address, WPADMemoryCallback_t callback) {
-    WPADWriteExtReg(wiimote, buffer, size, space, address, callback);
-    // DJH writes to this address to turn the euphoria led on and off
-    if (address == 0xFB && size == 1 && fake_devices[wiimote].valid) {
-        fake_devices[wiimote].euphoria_led = ((uint8_t *)buffer)[0];
-        printf_v("DJH Euphoria LED: %d %d\r\n", wiimote, ((uint8_t *)buffer)[0]);
+
+/* Returns the bit of the device with this id if it is one of ours, so a
+ * device change can tell which of ours are still plugged in. */
+static uint32_t usbDevicePresent(uint8_t api_type, uint32_t dev_id) {
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if ((device->valid || device->attaching) && device->api_type == api_type && device->dev_id == dev_id) {
+            return 1u << i;
+        }
     }
+    return 0;
 }
-BSLUG_REPLACE(WPADControlMotor, MyWPADControlMotor);
-BSLUG_MUST_REPLACE(WPADRead, MyWPADRead);
-BSLUG_MUST_REPLACE(WPADInit, MyWPADInit);
-BSLUG_MUST_REPLACE(WPADSetConnectCallback, MyWPADSetConnectCallback);
-BSLUG_MUST_REPLACE(WPADSetExtensionCallback, MyWPADSetExtensionCallback);
-BSLUG_REPLACE(WPADSetSamplingCallback, MyWPADSetSamplingCallback);
-BSLUG_REPLACE(WPADSetAutoSamplingBuf, MyWPADSetAutoSamplingBuf);
-BSLUG_REPLACE(WPADGetLatestIndexInBuf, MyWPADGetLatestIndexInBuf);
-BSLUG_MUST_REPLACE(WPADSetDataFormat, MyWPADSetDataFormat);
-BSLUG_REPLACE(WPADGetDataFormat, MyWPADGetDataFormat);
-BSLUG_MUST_REPLACE(WPADProbe, MyWPADProbe);
-BSLUG_MUST_REPLACE(WPADGetAccGravityUnit, MyWPADGetAccGravityUnit);
-BSLUG_REPLACE(WPADControlDpd, MyWPADControlDpd);
-BSLUG_MUST_REPLACE(WPADIsDpdEnabled, MyWPADIsDpdEnabled);
-BSLUG_REPLACE(SCGetScreenSaverMode, MySCGetScreenSaverMode);
-BSLUG_REPLACE(WPADWriteExtReg, MyWPADWriteExtReg);
-/*============================================================================*/
-/* USB support */
-/*============================================================================*/
 
-static void callbackIgnore(ios_ret_t ret, usr_t unused);
-static void onDevUsbPoll(ios_ret_t ret, usr_t unused);
+/* A context nothing refers to any more: no device in it, nothing of the last
+ * one in flight, and not what the game still sees on a reserved channel */
+static usb_input_device_t *usbDeviceAlloc(void) {
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if (!device->valid && !device->attaching && !device->transfers_pending && !usbDeviceBound(device)) {
+            return device;
+        }
+    }
+    return NULL;
+}
 
+/* Claims a context, and a channel if there is one, for a newly found device.
+ * Returns NULL if it is one we already have or there is no room left. The
+ * returned device is attaching until it either becomes valid or is given
+ * back with usbDeviceAbandon. */
+static usb_input_device_t *usbDeviceClaim(uint16_t vid, uint16_t pid, uint8_t api_type, uint32_t dev_id) {
+    if (usbDevicePresent(api_type, dev_id)) {
+        return NULL;
+    }
+    slotExpireReservations();
+    bool reclaimed;
+    int slot = slotAlloc(vid, pid, &reclaimed);
+#ifndef USB_STANDBY
+    if (slot < 0) {
+        return NULL;
+    }
+#endif
+    // A returning device goes back into the context it left if it can, the
+    // game still sees that one
+    usb_input_device_t *prev = slot >= 0 ? channels[slot].device : NULL;
+    usb_input_device_t *device = prev && !prev->attaching && !prev->valid && !prev->transfers_pending ? prev : usbDeviceAlloc();
+    if (!device) {
+        if (slot >= 0) {
+            slotAbandon(slot);
+        }
+        return NULL;
+    }
+    device->vid = vid;
+    device->pid = pid;
+    device->api_type = api_type;
+    device->dev_id = dev_id;
+    device->host_fd = -1;
+    device->attaching = true;
+    device->waiting = false;
+    device->driver = NULL;
+    device->type = 0;
+    device->sub_type = 0;
+    device->endpoint_address_in = 0;
+    device->endpoint_address_out = 0;
+    device->max_packet_len_in = 0;
+    device->max_packet_len_out = 0;
+    device->led_state = 0;
+    device->last_rumble_on = false;
+    device->last_euphoria_led = false;
+    device->latched = false;
+    device->report_unread = false;
+    memset(&device->platters, 0, sizeof(device->platters));
+    memset(&device->drum_hits, 0, sizeof(device->drum_hits));
+    device->accessory = false;
+    device->aggregate_host = AGGREGATE_NO_HOST;
+    device->aggregate_accessories = 0;
+    device->watchdog_stage = WATCHDOG_IDLE;
+    device->watchdog_tick = 0;
+    device->report_deferred = false;
+    device->standby_tick = 0;
+    usb_device_stats_t *stats = deviceStats(device);
+    if (device != prev) {
+        memset(stats, 0, sizeof(*stats));
+        stats->channel = USB_STATS_NO_CHANNEL;
+        if (prev) {
+            // Until it is up the game keeps seeing the idle input prev left
+            memcpy(&device->wpadData, &prev->wpadData, sizeof(device->wpadData));
+            memcpy(&device->latchedData, &prev->latchedData, sizeof(device->latchedData));
+        } else {
+            memset(&device->wpadData, 0, sizeof(device->wpadData));
+        }
+    }
+    stats->vid = vid;
+    stats->pid = pid;
+    stats->api_type = api_type;
+    stats->attaches++;
+    if (slot >= 0) {
+        // A returning device is already connected as far as the game knows
+        channelBind(slot, device);
+    }
+#ifdef USB_STANDBY
+    else {
+        device->wiimote = standbyChannel(vid, pid);
+        device->state = 0;
+    }
+#endif
+    printf_v("device %d, channel %d: %x%s\r\n", usbDeviceIndex(device), slot, dev_id, reclaimed ? " (reclaimed)" : "");
+    return device;
+}
+
+/* Gives back the slot of a claimed device that we couldn't bring up. */
+static void usbDeviceAbandon(usb_input_device_t *device) {
+    if (!device->attaching) {
+        return;
+    }
+    device->attaching = false;
+    device->waiting = false;
 #ifdef SUPPORT_DEV_USB_HID4
-/* The basic flow for version 4:
- *  1) ioctl GET_VERSION
- *       Check the return value is 0x00040001.
- *  2) ioctl GET_DEVICE_CHANGE
- *       Returns immediately + every time a device is added or removed. Output
- *       describes what is connected.
- *  3) Find an interesting device.
- *  4) ioctl INTERRUPT_OUT
- *       USB interrupt packet to send initialise command to WUP-028.
- *  5) ioctl INTERRUPT_IN
- *       USB interrupt packet to poll device for inputs.
- */
+    if (device->api_type == API_TYPE_OH0 && device->host_fd >= 0) {
+        IOS_CloseAsync(device->host_fd, callbackIgnore, NULL);
+    }
+#endif
+    device->host_fd = -1;
+    if (usbDeviceBound(device)) {
+        slotAbandon(device->wiimote);
+    }
+}
 
-/* Size of the DeviceChange ioctl's return (in words). */
-#define DEV_USB_HID4_DEVICE_CHANGE_SIZE 0x180
-/* IOCTL numbering for the device. */
-#define DEV_USB_HID4_IOCTL_GET_DEVICE_CHANGE 0
-#define DEV_USB_HID4_IOCTL_CONTROL 2
-#define DEV_USB_HID4_IOCTL_INTERRUPT_IN 3
-#define DEV_USB_HID4_IOCTL_INTERRUPT_OUT 4
-#define DEV_USB_HID4_IOCTL_GET_VERSION 6
-/* Version id. */
-#define DEV_USB_HID4_VERSION 0x00040001
+/* Runs the driver's init for a claimed device, and on success hands it to the game. */
+static void usbDeviceInit(usb_input_device_t *device) {
+    // Unplugged while we were still looking at it
+    if (!device->attaching) {
+        return;
+    }
+    if (device->driver == NULL) {
+        usbDeviceAbandon(device);
+        return;
+    }
+    int ret = device->driver->init(device);
+    if (ret < 0) {
+        usbDeviceError(device, USB_STAGE_INIT, ret);
+        return;
+    }
+    printf_v("init done! %d\r\n", usbDeviceIndex(device));
+    device->valid = true;
+    deviceStats(device)->valid = true;
+    device->attaching = false;
+#ifdef USB_AGGREGATION
+    aggregateAttach(device);
+    if (device->accessory && usbDeviceBound(device)) {
+        // Seen through its host, its channel is free for someone else
+        slotFree(device->wiimote);
+    }
+#endif
+#ifdef USB_STANDBY
+    if (!device->accessory && !usbDeviceBound(device)) {
+        // A channel may have come free while this one was attaching
+        bool reclaimed;
+        int slot = slotAlloc(device->vid, device->pid, &reclaimed);
+        if (slot >= 0) {
+            channelBind(slot, device);
+        } else {
+            printf_v("standby %d, backing up %d\r\n", usbDeviceIndex(device), device->wiimote);
+        }
+    }
+#endif
+    if (usbDeviceBound(device)) {
+        // Back for good, so the reservation it came back to is done with
+        slot_reservations[device->wiimote].tick = 0;
+    }
+}
 
-static uint32_t dev_usb_hid4_devices[DEV_USB_HID4_DEVICE_CHANGE_SIZE] IOS_ALIGN;
-struct interrupt_msg4 {
-    uint8_t padding[16];
-    uint32_t device;
-    uint32_t endpoint;
-    uint32_t length;
-    void *ptr;
-};
+/*============================================================================*/
+/* Top level interface to game */
+/*============================================================================*/
+static void onDevOpen(ios_fd_t fd, usr_t unused);
+#ifdef SUPPORT_DEV_USB_OH0
+static void onDevOpenUsb(ios_fd_t fd, usr_t unused);
+#endif
+static void onDevWatchdog(usb_input_device_t *device);
+#ifdef USB_NETWORK
+static void netStart(void);
+static void netTick(uint32_t now);
+#endif
+#ifdef USB_TELEMETRY
+static void telemetryLatency(usb_input_device_t *device, uint32_t ticks);
+#endif
+#ifdef USB_AGGREGATION
+/* Accessories aren't read by the game, so their host keeps an eye on them */
+static void aggregateWatchdog(usb_input_device_t *host) {
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        if ((host->aggregate_accessories & (1u << i)) && usb_devices[i].valid) {
+            onDevWatchdog(&usb_devices[i]);
+        }
+    }
+}
+#endif
+uint16_t last = 0;
+uint8_t last_ext = 0;
 
-static void onDevGetVersion4(ios_ret_t ret, usr_t unused);
-static void onDevUsbChange4(ios_ret_t ret, usr_t unused);
+// Some wii games don't include printf, so we just call vprintf instead
+void printf_v(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
 
-static int checkVersion4(ios_cb_t cb, usr_t data) {
-    return IOS_IoctlAsync(
-        dev_usb_hid_fd, DEV_USB_HID4_IOCTL_GET_VERSION,
-        NULL, 0,
-        NULL, 0,
-        cb, data);
+// Some wii games don't include snprintf, so we just call vsnprintf instead
+void snprintf_v(char *dest, size_t len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(dest, len, format, args);
+    va_end(args);
 }
-static int getDeviceChange4(ios_cb_t cb, usr_t data) {
-    return IOS_IoctlAsync(
-        dev_usb_hid_fd, DEV_USB_HID4_IOCTL_GET_DEVICE_CHANGE,
-        NULL, 0,
-        dev_usb_hid4_devices, sizeof(dev_usb_hid4_devices),
-        cb, data);
+
+/* The device's input as the game should see it, before any latching */
+static inline const WPADData_t *deviceData(usb_input_device_t *device) {
+#ifdef USB_AGGREGATION
+    if (device->aggregate_accessories) {
+        return &device->aggregatedData;
+    }
+#endif
+    return &device->wpadData;
 }
+
+static inline const WPADData_t *currentData(usb_input_device_t *device) {
+#ifdef VI_SYNCHRONISED_SAMPLING
+    if (vi_period) {
+        return &device->latchedData;
+    }
 #endif
+    return deviceData(device);
+}
 
-#ifdef SUPPORT_DEV_USB_HID5
-/* The basic flow for version 5:
- *  1) ioctl GET_VERSION
- *       Check the return value is 0x00050001.
- *  2) ioctl GET_DEVICE_CHANGE
- *       Returns immediately + every time a device is added or removed. Output
- *       describes what is connected.
- *  3) ioctl ATTACH_FINISH
- *       Don't know why, but you have to do this!
- *  4) Find an interesting device.
- *  5) ioctl SET_RESUME
- *       Turn the device on.
- *  5) ioctl GET_DEVICE_PARAMETERS
- *       You have to do this, even if you don't care about the result.
- *  6) ioctl INTERRUPT
- *       USB interrupt packet to send initialise command to WUP-028.
- *  7) ioctl INTERRUPT
- *       USB interrupt packet to  poll device for inputs.
- */
+/* Input that is handed out per game read rather than per report: platter
+ * motion, and queued drum hits which show as the pad held for that one read. */
+static void takeReadInput(usb_input_device_t *device, WPADData_t *data) {
+    struct drum_hit_t hit;
+    if (device->extension == WPAD_EXTENSION_TURNTABLE) {
+        turntable_platters_set_from_state(data, &device->platters);
+    } else if (device->extension == WPAD_EXTENSION_DRUM && drum_hit_pop(&device->drum_hits, &hit)) {
+        switch (hit.pad) {
+            case DRUM_PAD_GREEN:
+                data->extension_data.drum.green = 1;
+                break;
+            case DRUM_PAD_RED:
+                data->extension_data.drum.red = 1;
+                break;
+            case DRUM_PAD_YELLOW:
+                data->extension_data.drum.yellow = 1;
+                break;
+            case DRUM_PAD_BLUE:
+                data->extension_data.drum.blue = 1;
+                break;
+            case DRUM_PAD_ORANGE:
+                data->extension_data.drum.orange = 1;
+                break;
+            case DRUM_PAD_KICK:
+                data->extension_data.drum.pedal = 1;
+                break;
+        }
+        data->extension_data.drum.connected = WPAD_DRUM_HAS_VELOCITY;
+        wiimote_drum_hit(data, game_profile->drum_notes[hit.pad], hit.velocity);
+    }
+}
 
-/* Size of the DeviceChange ioctl's return (in strctures). */
-#define DEV_USB_HID5_DEVICE_CHANGE_SIZE 0x20
-/* Total size of all IOS buffers (in words). */
-#define DEV_USB_HID5_TMP_BUFFER_SIZE 0x20
-/* IOCTL numbering for the device. */
-#define DEV_USB_HID5_IOCTL_GET_VERSION 0
-#define DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE 1
-#define DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS 3
-#define DEV_USB_HID5_IOCTL_ATTACH_FINISH 6
-#define DEV_USB_HID5_IOCTL_SET_RESUME 16
-#define DEV_USB_HID5_IOCTL_CONTROL 18
-#define DEV_USB_HID5_IOCTL_INTERRUPT 19
-/* Version id. */
-#define DEV_USB_HID5_VERSION 0x00050001
+#ifdef USB_STATS_DUMP
+static void usbStatsDump(void) {
+    for (int i = 0; i < ARRAY_SIZE(usb_stats.devices); i++) {
+        usb_device_stats_t *stats = &usb_stats.devices[i];
+        if (!stats->attaches) {
+            continue;
+        }
+        printf_v("Stats %d %04x:%04x on %d: %u done, %u writes, %u reads, %u stale, %u partial, %u dropped, %u/%u ticks, %u rearms, %u resets, %u errors\r\n",
+                 i, stats->vid, stats->pid, stats->channel == USB_STATS_NO_CHANNEL ? -1 : stats->channel, stats->completions, stats->writes,
+                 stats->game_reads, stats->stale_reads, stats->partial_reads, stats->dropped_reports,
+                 stats->translate_ticks, stats->translate_max_ticks,
+                 stats->rearms, stats->resets, stats->errors);
+    }
+}
+#endif
 
-#define OS_IPC_HEAP_HIGH ((void **)0x80003134)
+/* Counts a game read of a device, the caller has interrupts disabled */
+static void usbStatsRead(usb_input_device_t *device, bool partial) {
+    usb_device_stats_t *stats = deviceStats(device);
+    stats->game_reads++;
+    if (!device->report_unread) {
+        stats->stale_reads++;
+    }
+#ifdef USB_TELEMETRY
+    else {
+        telemetryLatency(device, OSGetTick() - device->report_tick);
+    }
+#endif
+    if (partial) {
+        stats->partial_reads++;
+    }
+    device->report_unread = false;
+}
 
-static struct {
-    uint32_t id;
-    uint32_t vid_pid;
-    uint16_t number;
-    uint8_t interface_number;
-    uint8_t num_altsettings;
-} *dev_usb_hid5_devices;
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+/* Puts the USB device's extension into a report the real wiimote filled in.
+ * The wiimote's motion and IR are left alone, the device's buttons (its home
+ * button, mostly) are added to the wiimote's. */
+static void overlayExtension(usb_input_device_t *device, WPADData_t *data) {
+    size_t size = WPADDataFormatSize(device->currentFormat);
+    if (size != WPADDataFormatSize(device->format) || size <= offsetof(WPADData_t, extension_data)) {
+        // The game didn't ask for an extension, or not one with our layout
+        return;
+    }
+    uint32_t isr = OSDisableInterrupts();
+    const WPADData_t *src = currentData(device);
+    if (device->valid) {
+        usbStatsRead(device, false);
+    }
+    data->buttons |= src->buttons;
+    data->extension = src->extension;
+    memcpy(&data->extension_data, &src->extension_data, size - offsetof(WPADData_t, extension_data));
+    takeReadInput(device, data);
+    OSRestoreInterrupts(isr);
+}
 
-/* This buffer gets managed pretty carefully. During init it's split 0x20 bytes
- * to 0x60 bytes to store the descriptor. The rest of the time it's split
- * evenly, one half for rumble messages and one half for polls. Be careful! */
-static uint32_t *dev_usb_hid5_buffer;
+/* The game's extension callbacks as WPAD would call them. Separate from the
+ * devices' copies, which are dropped when a device goes away. */
+static WPADExtensionCallback_t overlay_extension_callbacks[MAX_FAKE_WIIMOTES];
 
-static struct {
-    uint32_t id;
-    uint32_t vid_pid;
-    uint16_t number;
-    uint8_t interface_number;
-    uint8_t num_altsettings;
-} *dev_usb_ven_devices;
+/* WPAD tells the game about the wiimote's own extension, which on an overlaid
+ * channel is ours instead. */
+static void overlayExtensionCallback(int wiimote, WPADExtension_t extension) {
+    channels[wiimote].real_extension = extension;
+    if (isOverlay(wiimote)) {
+        extension = channels[wiimote].device->extension;
+    }
+    if (overlay_extension_callbacks[wiimote]) {
+        overlay_extension_callbacks[wiimote](wiimote, extension);
+    }
+}
+#endif
 
-/* This buffer gets managed pretty carefully. During init it's split 0x20 bytes
- * to 0x60 bytes to store the descriptor. The rest of the time it's split
- * evenly, one half for rumble messages and one half for polls. Be careful! */
-static uint32_t *dev_usb_ven_buffer;
+static void MyWPADRead(int wiiremote, WPADData_t *data) {
+    uint32_t now = OSGetTick();
+#ifdef USB_STATS_DUMP
+    static uint32_t last_dump;
+    if (now - last_dump >= ms_to_ticks(USB_STATS_DUMP_MS)) {
+        last_dump = now;
+        usbStatsDump();
+    }
+#endif
+    usb_stats.tick = now;
+#ifdef USB_NETWORK
+    netTick(now);
+#endif
+#ifdef USB_STANDBY
+    standbyTick(now);
+#endif
+    WPADDataFormat_t format = channels[wiiremote].currentFormat;
+    usb_input_device_t *device = channels[wiiremote].device;
+    if (isFake(wiiremote)) {
+        if (device->valid) {
+            onDevWatchdog(device);
+#ifdef USB_AGGREGATION
+            aggregateWatchdog(device);
+#endif
+        }
+        uint32_t isr = OSDisableInterrupts();
+        memset(data, 0, WPADDataFormatSize(format));
+        // Formats of the same size share a layout, so e.g. CLASSIC_ACC_IR still gets the classic data
+        bool partial = WPADDataFormatSize(format) != WPADDataFormatSize(device->format);
+        if (!partial) {
+            memcpy(data, currentData(device), WPADDataFormatSize(format));
+            takeReadInput(device, data);
+        } else {
+            // Copy the fields common to all formats.
+            memcpy(data, currentData(device), WPADDataFormatSize(WPAD_FORMAT_NONE));
+        }
+        if (device->valid) {
+            usbStatsRead(device, partial);
+        }
+        OSRestoreInterrupts(isr);
+    } else {
+        WPADRead(wiiremote, data);
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+        if (isOverlay(wiiremote)) {
+            if (device->valid) {
+                onDevWatchdog(device);
+            }
+            overlayExtension(device, data);
+        }
+#endif
+    }
+}
 
-/* Annoyingly some of the buffers for v5 MUST be in MEM2, so we wrap _start to
- * allocate these before the application boots. */
-void _start(void);
+static void slotSetReal(int wiimote, bool real, WPADExtension_t extension) {
+    uint32_t isr = OSDisableInterrupts();
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+    if (channels[wiimote].real != real && slotOwned(wiimote)) {
+        // A wiimote came or went under one of our devices. Either way the
+        // game needs telling what is on this channel now.
+        printf_v("overlay %d: %d\r\n", wiimote, real);
+        channels[wiimote].device->state = 0;
+    }
+#endif
+    channels[wiimote].real = real;
+    channels[wiimote].real_extension = real ? extension : WPAD_EXTENSION_NONE;
+    if (real) {
+        slots_real |= 1 << wiimote;
+    } else {
+        slots_real &= ~(1 << wiimote);
+    }
+    OSRestoreInterrupts(isr);
+}
 
-static void my_start(void) {
-    /* Allocate some area in MEM2. */
-    dev_usb_hid5_devices = *OS_IPC_HEAP_HIGH;
-    dev_usb_hid5_devices -= DEV_USB_HID5_DEVICE_CHANGE_SIZE;
-    *OS_IPC_HEAP_HIGH = dev_usb_hid5_devices;
+static WPADStatus_t MyWPADProbe(int wiimote, WPADExtension_t *extension) {
+    slotExpireReservations();
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+    if (slotOwned(wiimote)) {
+        // A wiimote can connect on a channel we have a device on at any time
+        WPADExtension_t real_extension;
+        WPADStatus_t ret = WPADProbe(wiimote, &real_extension);
+        slotSetReal(wiimote, ret == WPAD_STATUS_OK, real_extension);
+        if (isOverlay(wiimote)) {
+            if (extension) {
+                *extension = channels[wiimote].device->extension;
+            }
+            return ret;
+        }
+    }
+#endif
+    if (isFake(wiimote)) {
+        uint32_t isr = OSDisableInterrupts();
+        if (extension) {
+            *extension = channels[wiimote].device->extension;
+        }
+        OSRestoreInterrupts(isr);
+        return WPAD_STATUS_OK;
+    }
+    WPADExtension_t real_extension = WPAD_EXTENSION_NONE;
+    WPADStatus_t ret = WPADProbe(wiimote, &real_extension);
+    slotSetReal(wiimote, ret == WPAD_STATUS_OK, real_extension);
+    if (extension) {
+        *extension = real_extension;
+    }
+    return ret;
+}
 
-    dev_usb_hid5_buffer = *OS_IPC_HEAP_HIGH;
-    dev_usb_hid5_buffer -= DEV_USB_HID5_TMP_BUFFER_SIZE;
-    *OS_IPC_HEAP_HIGH = dev_usb_hid5_buffer;
+#define NUM_DESC 1
+/* Resets our state and opens USB, which kicks off the whole attach chain. */
+static void usbStart(void) {
+    printf_v("Instrument Support Starting\r\n");
+    gameProfileSelect();
+    memset(usb_devices, 0, sizeof(usb_devices));
+    memset(channels, 0, sizeof(channels));
+    for (int i = 0; i < MAX_FAKE_WIIMOTES; i++) {
+        slot_reservations[i].tick = 0;
+        channels[i].autoSamplingOverlaid = -1;
+    }
+    slots_used = 0;
+    slots_real = 0;
+    started = 1;
+    memset(usb_stats.transports, 0, sizeof(usb_stats.transports));
+    memset(usb_stats.devices, 0, sizeof(usb_stats.devices));
+    usb_stats.tick_rate = OS_TIMER_CLOCK;
+    usb_stats.start_tick = OSGetTick();
+    usb_stats.tick = usb_stats.start_tick;
+#ifdef USB_NETWORK
+    netStart();
+#endif
 
-    dev_usb_ven_devices = *OS_IPC_HEAP_HIGH;
-    dev_usb_ven_devices -= DEV_USB_HID5_DEVICE_CHANGE_SIZE;
-    *OS_IPC_HEAP_HIGH = dev_usb_ven_devices;
+    printf_v("OpenAsync: %d\r\n", IOS_OpenAsync(DEV_USB_HID_PATH, 0, onDevOpen, NULL));
+}
 
-    dev_usb_ven_buffer = *OS_IPC_HEAP_HIGH;
-    dev_usb_ven_buffer -= DEV_USB_HID5_TMP_BUFFER_SIZE;
-    *OS_IPC_HEAP_HIGH = dev_usb_ven_buffer;
+static void MyWPADInit(void) {
+    WPADInit();
+    initCalled = true;
+    /* On first call only, initialise USB and globals. With early init the
+     * devices found so far are kept, and just get their connect callbacks. */
+    if (!started) {
+        usbStart();
+    }
+}
 
-    _start();
+#ifdef USB_EARLY_INIT
+/* _start is too early, IPC isn't up until OSInit has run, but every game
+ * initialises VI right after that and well before it gets to WPAD. */
+static void MyVIInit(void) {
+    VIInit();
+    if (!started) {
+        usbStart();
+    }
 }
+#endif
 
-BSLUG_MUST_REPLACE(_start, my_start);
+static WPADConnectCallback_t MyWPADSetConnectCallback(int wiimote, WPADConnectCallback_t newCallback) {
+    printf_v("Set sc\r\n");
+    channels[wiimote].connectCallback = newCallback;
+    // return 0;
+    return WPADSetConnectCallback(wiimote, newCallback);
+}
 
-static void onDevGetVersion5(ios_ret_t ret, usr_t unused);
-static void onDevUsbVenAttach5(ios_ret_t ret, usr_t vcount);
-static void onDevUsbVenChange5(ios_ret_t ret, usr_t unused);
-static void onDevUsbVenResume5(ios_ret_t ret, usr_t unused);
-static void onDevUsbVenParams5(ios_ret_t ret, usr_t unused);
-static void onDevUsbAttach5(ios_ret_t ret, usr_t vcount);
-static void onDevUsbChange5(ios_ret_t ret, usr_t unused);
-static void onDevUsbResume5(ios_ret_t ret, usr_t unused);
-static void onDevUsbParams5(ios_ret_t ret, usr_t unused);
-
-static inline int usb_oh0_ctrl_transfer_async(usb_input_device_t *device, uint8_t bmRequestType,
-                                              uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
-                                              void *rpData, void (*callback)(int, void *)) {
-    static ioctlv vectors[7];
-
-    static uint8_t bmRequestTypeData __attribute__((aligned(32)));
-    static uint8_t bmRequestData __attribute__((aligned(32)));
-    static uint16_t wValueData __attribute__((aligned(32)));
-    static uint16_t wIndexData __attribute__((aligned(32)));
-    static uint16_t wLengthData __attribute__((aligned(32)));
-    static uint8_t unknownData __attribute__((aligned(32))) = 0;
-    bmRequestTypeData = bmRequestType;
-    bmRequestData = bmRequest;
-    wValueData = __builtin_bswap16(wValue);
-    wIndexData = __builtin_bswap16(wIndex);
-    wLengthData = __builtin_bswap16(wLength);
-    vectors[0].data = &bmRequestTypeData;
-    vectors[0].len = sizeof(bmRequestTypeData);
-    vectors[1].data = &bmRequestData;
-    vectors[1].len = sizeof(bmRequestData);
-    vectors[2].data = &wValueData;
-    vectors[2].len = sizeof(wValueData);
-    vectors[3].data = &wIndexData;
-    vectors[3].len = sizeof(wIndexData);
-    vectors[4].data = &wLengthData;
-    vectors[4].len = sizeof(wLengthData);
-    vectors[5].data = &unknownData;
-    vectors[5].len = sizeof(unknownData);
-    vectors[6].data = rpData;
-    vectors[6].len = wLength;
-
-    return IOS_IoctlvAsync(device->host_fd, USBV0_IOCTL_CTRLMSG, 6, 1, vectors,
-                           callback, device);
+static WPADExtensionCallback_t MyWPADSetExtensionCallback(int wiimote, WPADExtensionCallback_t newCallback) {
+    printf_v("Set ec\r\n");
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+    WPADExtensionCallback_t oldCallback = overlay_extension_callbacks[wiimote];
+    channels[wiimote].extensionCallback = newCallback;
+    channelSync(wiimote);
+    overlay_extension_callbacks[wiimote] = newCallback;
+    WPADSetExtensionCallback(wiimote, newCallback ? overlayExtensionCallback : NULL);
+    return oldCallback;
+#else
+    channels[wiimote].extensionCallback = newCallback;
+    channelSync(wiimote);
+    return WPADSetExtensionCallback(wiimote, newCallback);
+#endif
 }
 
-static inline int usb_oh0_ctrl_transfer(usb_input_device_t *device, uint8_t bmRequestType, uint8_t bmRequest,
-                                        uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
-    static ioctlv vectors[7];
-    static uint8_t bmRequestTypeData __attribute__((aligned(32)));
-    static uint8_t bmRequestData __attribute__((aligned(32)));
-    static uint16_t wValueData __attribute__((aligned(32)));
-    static uint16_t wIndexData __attribute__((aligned(32)));
-    static uint16_t wLengthData __attribute__((aligned(32)));
-    static uint8_t unknownData __attribute__((aligned(32))) = 0;
-    bmRequestTypeData = bmRequestType;
-    bmRequestData = bmRequest;
-    wValueData = __builtin_bswap16(wValue);
-    wIndexData = __builtin_bswap16(wIndex);
-    wLengthData = __builtin_bswap16(wLength);
-    vectors[0].data = &bmRequestTypeData;
-    vectors[0].len = sizeof(bmRequestTypeData);
-    vectors[1].data = &bmRequestData;
-    vectors[1].len = sizeof(bmRequestData);
-    vectors[2].data = &wValueData;
-    vectors[2].len = sizeof(wValueData);
-    vectors[3].data = &wIndexData;
-    vectors[3].len = sizeof(wIndexData);
-    vectors[4].data = &wLengthData;
-    vectors[4].len = sizeof(wLengthData);
-    vectors[5].data = &unknownData;
-    vectors[5].len = sizeof(unknownData);
-    vectors[6].data = rpData;
-    vectors[6].len = wLength;
-
-    return IOS_Ioctlv(device->host_fd, USBV0_IOCTL_CTRLMSG, 6, 1, vectors);
+static WPADSamplingCallback_t MyWPADSetSamplingCallback(int wiimote, WPADSamplingCallback_t newCallback) {
+    // remember their callback
+    // printf_v("set auto sample cb! %d %d\r\n", wiimote, isFake(wiimote));
+    if (isFake(wiimote)) {
+        channels[wiimote].samplingCallback = newCallback;
+    }
+    return WPADSetSamplingCallback(wiimote, newCallback);
 }
 
-static inline int usb_oh0_intr_transfer(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
-    static ioctlv vectors[3];
-
-    static uint8_t endpoint __attribute__((aligned(32)));
-    static uint16_t len __attribute__((aligned(32)));
-    endpoint = out ? device->endpoint_address_out : device->endpoint_address_in;
-    len = wLength;
-    vectors[0].data = &endpoint;
-    vectors[0].len = sizeof(endpoint);
-    vectors[1].data = &len;
-    vectors[1].len = sizeof(len);
-    vectors[2].data = rpData;
-    vectors[2].len = wLength;
-    return IOS_Ioctlv(device->host_fd, USBV0_IOCTL_INTRMSG, 2, 1, vectors);
+static void MyWPADSetAutoSamplingBuf(int wiimote, void *buffer, int count) {
+    // printf_v("set auto sample buf! %d %d\r\n", wiimote, count);
+    uint32_t isr = OSDisableInterrupts();
+    channels[wiimote].autoSamplingBuffer = buffer;
+    channels[wiimote].autoSamplingBufferCount = count;
+    channels[wiimote].autoSamplingOverlaid = -1;
+    OSRestoreInterrupts(isr);
+    if (!isFake(wiimote)) {
+        WPADSetAutoSamplingBuf(wiimote, buffer, count);
+    }
 }
 
-static inline int usb_oh0_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
-    static ioctlv vectors[3];
-
-    static uint8_t endpoint __attribute__((aligned(32)));
-    static uint16_t len __attribute__((aligned(32)));
-    endpoint = out ? device->endpoint_address_out : device->endpoint_address_in;
-    len = wLength;
-    vectors[0].data = &endpoint;
-    vectors[0].len = sizeof(endpoint);
-    vectors[1].data = &len;
-    vectors[1].len = sizeof(len);
-    vectors[2].data = rpData;
-    vectors[2].len = wLength;
-
-    return IOS_IoctlvAsync(device->host_fd, USBV0_IOCTL_INTRMSG, 2, 1, vectors,
-                           onDevUsbPoll, device);
+static int MyWPADGetLatestIndexInBuf(int wiimote) {
+    // printf_v("get auto sample buf! %d\r\n", wiimote);
+    if (!isFake(wiimote)) {
+        int index = WPADGetLatestIndexInBuf(wiimote);
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+        // Every entry WPAD wrote since the last call gets our extension, games
+        // that read the whole run would otherwise see it flicker. Each entry
+        // only once, so hits aren't handed out into one the game has read.
+        wpad_channel_t *channel = &channels[wiimote];
+        int count = channel->autoSamplingBufferCount;
+        if (isOverlay(wiimote) && channel->autoSamplingBuffer && count > 0 && index >= 0 && index != channel->autoSamplingOverlaid) {
+            size_t size = WPADDataFormatSize(channel->currentFormat);
+            int next = channel->autoSamplingOverlaid < 0 ? index : (channel->autoSamplingOverlaid + 1) % count;
+            for (;;) {
+                overlayExtension(channel->device, (WPADData_t *)((char *)channel->autoSamplingBuffer + next * size));
+                if (next == index) {
+                    break;
+                }
+                next = (next + 1) % count;
+            }
+            channel->autoSamplingOverlaid = index;
+        }
+#endif
+        return index;
+    }
+    return channels[wiimote].autoSamplingBufferIndex;
 }
-
-static inline void build_v5_ctrl_transfer(struct usb_hid_v5_transfer *transfer, int dev_id,
-                                          uint8_t bmRequestType, uint8_t bmRequest, uint16_t wValue, uint16_t wIndex) {
-    memset(transfer, 0, sizeof(*transfer));
-    transfer->dev_id = dev_id;
-    transfer->ctrl.bmRequestType = bmRequestType;
-    transfer->ctrl.bmRequest = bmRequest;
-    transfer->ctrl.wValue = wValue;
-    transfer->ctrl.wIndex = wIndex;
+static void MyWPADGetAccGravityUnit(int wiimote, WPADExtension_t extension, WPADAccGravityUnit_t *result) {
+    if (!isFake(wiimote)) {
+        WPADGetAccGravityUnit(wiimote, extension, result);
+        return;
+    }
+    uint32_t isr = OSDisableInterrupts();
+    if (extension == WPAD_EXTENSION_NONE) {
+        *result = channels[wiimote].device->gravityUnit[0];
+    } else if (extension == WPAD_EXTENSION_NUNCHUCK) {
+        *result = channels[wiimote].device->gravityUnit[1];
+    } else {
+        result->acceleration[0] = 0;
+        result->acceleration[1] = 0;
+        result->acceleration[2] = 0;
+    }
+    OSRestoreInterrupts(isr);
 }
 
-static inline void build_hid_v5_intr_transfer(struct usb_hid_v5_transfer *transfer, int dev_id, int out) {
-    memset(transfer, 0, sizeof(*transfer));
-    transfer->dev_id = dev_id;
-    transfer->intr_hid.out = out;
+static int MyWPADSetDataFormat(int wiimote, WPADDataFormat_t format) {
+    // printf_v("set df! %d %d %d\r\n", wiimote, format, isFake(wiimote));
+    // Kept for real wiimotes too, an overlay needs to know what they were asked for
+    channels[wiimote].currentFormat = format;
+    channelSync(wiimote);
+    if (isFake(wiimote)) {
+        return WPAD_STATUS_OK;
+    }
+    return WPADSetDataFormat(wiimote, format);
 }
 
-static inline void build_ven_v5_intr_transfer(struct usb_hid_v5_transfer *transfer, int dev_id, int endpoint, uint16_t wLength,
-                                              void *rpData) {
-    memset(transfer, 0, sizeof(*transfer));
-    transfer->dev_id = dev_id;
-    transfer->intr.bEndpoint = endpoint;
-    transfer->intr.rpData = rpData;
-    transfer->intr.wLength = wLength;
+static WPADDataFormat_t MyWPADGetDataFormat(int wiimote) {
+    // printf_v("get df! %d %d %d\r\n", wiimote, channels[wiimote].currentFormat, WPADGetDataFormat(wiimote));
+    if (!isFake(wiimote)) {
+        return WPADGetDataFormat(wiimote);
+    }
+    return channels[wiimote].currentFormat;
 }
 
-static inline int usb_hid_v5_ctrl_transfer_async(usb_input_device_t *device, uint8_t bmRequestType,
-                                                 uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
-                                                 void *rpData, void (*callback)(int, void *)) {
-    static ioctlv vectors[2];
-    int out = !(bmRequestType & USB_ENDPOINT_IN);
-    struct usb_hid_v5_transfer *transfer = (struct usb_hid_v5_transfer *)dev_usb_hid5_buffer;
-
-    build_v5_ctrl_transfer(transfer, device->dev_id, bmRequestType, bmRequest, wValue, wIndex);
-    vectors[0].data = transfer;
-    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
-    vectors[1].data = rpData;
-    vectors[1].len = wLength;
-    printf("ctrl transfer id: %02x\r\n", device->dev_id);
-
-    return IOS_IoctlvAsync(device->host_fd, DEV_USB_HID5_IOCTL_CONTROL, 1 + out, 1 - out, vectors,
-                           callback, device);
+static int MyWPADControlDpd(int wiimote, int command, WPADControlDpdCallback_t callback) {
+    if (!isFake(wiimote)) {
+        return WPADControlDpd(wiimote, command, callback);
+    }
+    channels[wiimote].dpdEnabled = command > 0;
+    channels[wiimote].controlDpdCallback = callback;
+    if (callback) {
+        callback(wiimote, WPAD_STATUS_OK);
+    }
+    return WPAD_STATUS_OK;
 }
-
-static inline int usb_hid_v5_ctrl_transfer(usb_input_device_t *device, uint8_t bmRequestType, uint8_t bmRequest,
-                                           uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
-    static ioctlv vectors[2];
-    int out = !(bmRequestType & USB_ENDPOINT_IN);
-    struct usb_hid_v5_transfer *transfer = (struct usb_hid_v5_transfer *)dev_usb_hid5_buffer;
-
-    build_v5_ctrl_transfer(transfer, device->dev_id, bmRequestType, bmRequest, wValue, wIndex);
-    vectors[0].data = transfer;
-    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
-    vectors[1].data = rpData;
-    vectors[1].len = wLength;
-
-    return IOS_Ioctlv(device->host_fd, DEV_USB_HID5_IOCTL_CONTROL, 1 + out, 1 - out, vectors);
+static bool MyWPADIsDpdEnabled(int wiimote) {
+    if (!isFake(wiimote)) {
+        return WPADIsDpdEnabled(wiimote);
+    }
+    return channels[wiimote].dpdEnabled;
+}
+static bool MySCGetScreenSaverMode() {
+    return false;
+}
+static void MyWPADControlMotor(int wiimote, int cmd) {
+    if (!isFake(wiimote)) {
+        WPADControlMotor(wiimote, cmd);
+        return;
+    }
+    channels[wiimote].rumble_on = cmd;
+    channelSync(wiimote);
+    // GH games pulse rumble when star power is ready or active
+    printf_v("motor! %d %d\r\n", wiimote, cmd);
+}
+static void MyWPADWriteExtReg(int wiimote, void *buffer, int size, WPADPeripheralSpace_t space, int address, WPADMemoryCallback_t callback) {
+    WPADWriteExtReg(wiimote, buffer, size, space, address, callback);
+    // DJH writes to this address to turn the euphoria led on and off
+    if (address == 0xFB && size == 1 && (isFake(wiimote) || isOverlay(wiimote))) {
+        channels[wiimote].euphoria_led = ((uint8_t *)buffer)[0];
+        channelSync(wiimote);
+        printf_v("DJH Euphoria LED: %d %d\r\n", wiimote, ((uint8_t *)buffer)[0]);
+    }
 }
+#ifdef PAD_EMULATION
+#define PAD_CHANNELS 4
+#define PAD_MOTOR_RUMBLE 1
+/* Instrument sticks only ever report a d-pad push */
+#define PAD_INSTRUMENT_STICK_THRESHOLD 5
 
-static inline int usb_ven_v5_intr_transfer(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
-    static ioctlv vectors[2];
-    struct usb_hid_v5_transfer *transfer = (struct usb_hid_v5_transfer *)dev_usb_hid5_buffer;
-    build_ven_v5_intr_transfer(transfer, device->dev_id, out ? device->endpoint_address_out : device->endpoint_address_in, wLength, rpData);
-    vectors[0].data = transfer;
-    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
-    vectors[1].data = rpData;
-    vectors[1].len = wLength;
+static uint16_t padButtonsFromStick(int16_t x, int16_t y) {
+    uint16_t buttons = 0;
+    if (x <= -PAD_INSTRUMENT_STICK_THRESHOLD)
+        buttons |= PADData_BUTTON_DL;
+    if (x >= PAD_INSTRUMENT_STICK_THRESHOLD)
+        buttons |= PADData_BUTTON_DR;
+    if (y <= -PAD_INSTRUMENT_STICK_THRESHOLD)
+        buttons |= PADData_BUTTON_DD;
+    if (y >= PAD_INSTRUMENT_STICK_THRESHOLD)
+        buttons |= PADData_BUTTON_DU;
+    return buttons;
+}
 
-    return IOS_Ioctlv(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors);
+/* What a GameCube controller would report for the device's current state. The
+ * frets and pads follow the controller's A B Y X Z layout, left to right. */
+static void padFromDevice(usb_input_device_t *device, PADData_t *pad) {
+    const WPADData_t *data = currentData(device);
+    uint16_t buttons = 0;
+    memset(pad, 0, sizeof(*pad));
+    switch (device->extension) {
+        case WPAD_EXTENSION_GUITAR:
+            if (data->extension_data.guitar.green) buttons |= PADData_BUTTON_A;
+            if (data->extension_data.guitar.red) buttons |= PADData_BUTTON_B;
+            if (data->extension_data.guitar.yellow) buttons |= PADData_BUTTON_Y;
+            if (data->extension_data.guitar.blue) buttons |= PADData_BUTTON_X;
+            if (data->extension_data.guitar.orange) buttons |= PADData_BUTTON_Z;
+            if (data->extension_data.guitar.plus) buttons |= PADData_BUTTON_S;
+            if (data->extension_data.guitar.dpadUp) buttons |= PADData_BUTTON_DU;
+            if (data->extension_data.guitar.dpadDown) buttons |= PADData_BUTTON_DD;
+            buttons |= padButtonsFromStick(data->extension_data.guitar.stick[0], data->extension_data.guitar.stick[1]);
+            pad->sliderR = data->extension_data.guitar.whammy;
+            break;
+        case WPAD_EXTENSION_DRUM:
+            if (data->extension_data.drum.green) buttons |= PADData_BUTTON_A;
+            if (data->extension_data.drum.red) buttons |= PADData_BUTTON_B;
+            if (data->extension_data.drum.yellow) buttons |= PADData_BUTTON_Y;
+            if (data->extension_data.drum.blue) buttons |= PADData_BUTTON_X;
+            if (data->extension_data.drum.orange) buttons |= PADData_BUTTON_Z;
+            if (data->extension_data.drum.pedal) buttons |= PADData_BUTTON_L;
+            if (data->extension_data.drum.plus) buttons |= PADData_BUTTON_S;
+            buttons |= padButtonsFromStick(data->extension_data.drum.stick[0], data->extension_data.drum.stick[1]);
+            break;
+        case WPAD_EXTENSION_TURNTABLE:
+            if (data->extension_data.turntable.rightGreen || data->extension_data.turntable.leftGreen) buttons |= PADData_BUTTON_A;
+            if (data->extension_data.turntable.rightRed || data->extension_data.turntable.leftRed) buttons |= PADData_BUTTON_B;
+            if (data->extension_data.turntable.rightBlue || data->extension_data.turntable.leftBlue) buttons |= PADData_BUTTON_X;
+            if (data->extension_data.turntable.euphoria) buttons |= PADData_BUTTON_Y;
+            if (data->extension_data.turntable.plus) buttons |= PADData_BUTTON_S;
+            buttons |= padButtonsFromStick(data->extension_data.turntable.stick[0], data->extension_data.turntable.stick[1]);
+            break;
+        case WPAD_EXTENSION_CLASSIC:
+            if (data->extension_data.classic.a) buttons |= PADData_BUTTON_A;
+            if (data->extension_data.classic.b) buttons |= PADData_BUTTON_B;
+            if (data->extension_data.classic.x) buttons |= PADData_BUTTON_X;
+            if (data->extension_data.classic.y) buttons |= PADData_BUTTON_Y;
+            if (data->extension_data.classic.zr) buttons |= PADData_BUTTON_Z;
+            if (data->extension_data.classic.lt) buttons |= PADData_BUTTON_L;
+            if (data->extension_data.classic.rt) buttons |= PADData_BUTTON_R;
+            if (data->extension_data.classic.plus) buttons |= PADData_BUTTON_S;
+            if (data->extension_data.classic.dpadUp) buttons |= PADData_BUTTON_DU;
+            if (data->extension_data.classic.dpadDown) buttons |= PADData_BUTTON_DD;
+            if (data->extension_data.classic.dpadLeft) buttons |= PADData_BUTTON_DL;
+            if (data->extension_data.classic.dpadRight) buttons |= PADData_BUTTON_DR;
+            // Classic sticks are +-512, GameCube sticks +-128
+            pad->aStickX = data->extension_data.classic.leftStick[0] >> 2;
+            pad->aStickY = data->extension_data.classic.leftStick[1] >> 2;
+            pad->cStickX = data->extension_data.classic.rightStick[0] >> 2;
+            pad->cStickY = data->extension_data.classic.rightStick[1] >> 2;
+            pad->sliderL = data->extension_data.classic.trigger[0];
+            pad->sliderR = data->extension_data.classic.trigger[1];
+            break;
+        default:
+            break;
+    }
+    pad->buttons = buttons;
+    pad->error = PADData_ERROR_NONE;
 }
 
-static inline int usb_ven_v5_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
-    static ioctlv vectors[2];
-    struct usb_hid_v5_transfer *transfer = (struct usb_hid_v5_transfer *)dev_usb_hid5_buffer;
-    build_ven_v5_intr_transfer(transfer, device->dev_id, out ? device->endpoint_address_out : device->endpoint_address_in, length, rpData);
-    vectors[0].data = transfer;
-    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
-    vectors[1].data = rpData;
-    vectors[1].len = length;
-    return IOS_IoctlvAsync(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors,
-                           onDevUsbPoll, device);
+static void MyPADRead(PADData_t *result) {
+    PADRead(result);
+    uint32_t isr = OSDisableInterrupts();
+    for (int i = 0; i < PAD_CHANNELS; i++) {
+        usb_input_device_t *device = channels[i].device;
+        if (device && device->valid && result[i].error == PADData_ERROR_NO_CONNECTION) {
+            padFromDevice(device, &result[i]);
+        }
+    }
+    OSRestoreInterrupts(isr);
 }
 
-static inline int usb_hid_v5_intr_transfer(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
-    static ioctlv vectors[2];
-    struct usb_hid_v5_transfer *transfer = (struct usb_hid_v5_transfer *)dev_usb_hid5_buffer;
-    build_hid_v5_intr_transfer(transfer, device->dev_id, out);
-    vectors[0].data = transfer;
-    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
-    vectors[1].data = rpData;
-    vectors[1].len = wLength;
-    return IOS_Ioctlv(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors);
+static void MyPADControlMotor(int pad, int control) {
+    PADControlMotor(pad, control);
+    if (pad < 0 || pad >= PAD_CHANNELS || !channels[pad].device || !channels[pad].device->valid) {
+        return;
+    }
+    // The device's own poll picks this up and sends it on, as for WPAD
+    channels[pad].rumble_on = control == PAD_MOTOR_RUMBLE;
+    channelSync(pad);
 }
+#endif
 
-static inline int usb_hid_v5_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
-    static ioctlv vectors[2];
-    struct usb_hid_v5_transfer *transfer = (struct usb_hid_v5_transfer *)dev_usb_hid5_buffer;
-    build_hid_v5_intr_transfer(transfer, device->dev_id, out);
-    vectors[0].data = transfer;
-    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
-    vectors[1].data = rpData;
-    vectors[1].len = length;
-    return IOS_IoctlvAsync(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors,
-                           onDevUsbPoll, device);
-}
-
-static inline void build_v4_ctrl_transfer(struct usb_hid_v4_transfer *transfer, int dev_id,
-                                          uint8_t bmRequestType, uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
-    memset(transfer, 0, sizeof(*transfer));
-    transfer->dev_id = dev_id;
-    transfer->ctrl.bmRequestType = bmRequestType;
-    transfer->ctrl.bmRequest = bmRequest;
-    transfer->ctrl.wValue = wValue;
-    transfer->ctrl.wIndex = wIndex;
-    transfer->ctrl.wLength = wLength;
-    transfer->data = rpData;
-}
-
-static inline void build_v4_intr_transfer(struct usb_hid_v4_transfer *transfer, int dev_id, int out, int dLength, void *rpData) {
-    memset(transfer, 0, sizeof(*transfer));
-    transfer->dev_id = dev_id;
-    transfer->intr.out = out;
-    transfer->intr.dLength = dLength;
-    transfer->data = rpData;
-}
-
-static inline int usb_hid_v4_ctrl_transfer_async(usb_input_device_t *device, uint8_t bmRequestType,
-                                                 uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
-                                                 void *rpData, void (*callback)(int, void *)) {
-    build_v4_ctrl_transfer(&device->transferV4, device->dev_id, bmRequestType, bmRequest, wValue, wIndex, wLength, rpData);
-
-    return IOS_IoctlAsync(device->host_fd, DEV_USB_HID4_IOCTL_CONTROL, &device->transferV4, sizeof(device->transferV4), NULL, 0,
-                          callback, device);
-}
+BSLUG_REPLACE(WPADControlMotor, MyWPADControlMotor);
+BSLUG_MUST_REPLACE(WPADRead, MyWPADRead);
+BSLUG_MUST_REPLACE(WPADInit, MyWPADInit);
+#ifdef USB_EARLY_INIT
+BSLUG_REPLACE(VIInit, MyVIInit);
+#endif
+BSLUG_MUST_REPLACE(WPADSetConnectCallback, MyWPADSetConnectCallback);
+BSLUG_MUST_REPLACE(WPADSetExtensionCallback, MyWPADSetExtensionCallback);
+BSLUG_REPLACE(WPADSetSamplingCallback, MyWPADSetSamplingCallback);
+BSLUG_REPLACE(WPADSetAutoSamplingBuf, MyWPADSetAutoSamplingBuf);
+BSLUG_REPLACE(WPADGetLatestIndexInBuf, MyWPADGetLatestIndexInBuf);
+BSLUG_MUST_REPLACE(WPADSetDataFormat, MyWPADSetDataFormat);
+BSLUG_REPLACE(WPADGetDataFormat, MyWPADGetDataFormat);
+BSLUG_MUST_REPLACE(WPADProbe, MyWPADProbe);
+BSLUG_MUST_REPLACE(WPADGetAccGravityUnit, MyWPADGetAccGravityUnit);
+BSLUG_REPLACE(WPADControlDpd, MyWPADControlDpd);
+BSLUG_MUST_REPLACE(WPADIsDpdEnabled, MyWPADIsDpdEnabled);
+BSLUG_REPLACE(SCGetScreenSaverMode, MySCGetScreenSaverMode);
+BSLUG_REPLACE(WPADWriteExtReg, MyWPADWriteExtReg);
+#ifdef PAD_EMULATION
+BSLUG_REPLACE(PADRead, MyPADRead);
+BSLUG_REPLACE(PADControlMotor, MyPADControlMotor);
+#endif
+/*============================================================================*/
+/* USB support */
+/*============================================================================*/
 
-static inline int usb_hid_v4_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
-    if (out) {
-        build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_out, length, rpData);
-        return IOS_IoctlAsync(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_OUT, &device->transferV4, sizeof(device->transferV4), NULL, 0,
-                              onDevUsbPoll, device);
-    }
+static void onDevUsbPoll(ios_ret_t ret, usr_t unused);
+static void usbDeviceDetach(usb_input_device_t *device);
+static void usbDeviceDetachMissing(uint8_t api_type, uint32_t present);
 
-    build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_in, length, rpData);
-    return IOS_IoctlAsync(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_IN, &device->transferV4, sizeof(device->transferV4), NULL, 0,
-                          onDevUsbPoll, device);
-}
+#ifdef SUPPORT_DEV_USB_HID4
+/* The basic flow for version 4:
+ *  1) ioctl GET_VERSION
+ *       Check the return value is 0x00040001.
+ *  2) ioctl GET_DEVICE_CHANGE
+ *       Returns immediately + every time a device is added or removed. Output
+ *       describes what is connected.
+ *  3) Find an interesting device.
+ *  4) ioctl INTERRUPT_OUT
+ *       USB interrupt packet to send initialise command to WUP-028.
+ *  5) ioctl INTERRUPT_IN
+ *       USB interrupt packet to poll device for inputs.
+ */
 
-static inline int usb_hid_v4_intr_transfer(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
-    if (out) {
-        build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_out, length, rpData);
-        return IOS_Ioctl(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_OUT, &device->transferV4, sizeof(device->transferV4), NULL, 0);
-    }
+/* Size of the DeviceChange ioctl's return (in words). */
+#define DEV_USB_HID4_DEVICE_CHANGE_SIZE 0x180
+/* IOCTL numbering for the device. */
+#define DEV_USB_HID4_IOCTL_GET_DEVICE_CHANGE 0
+#define DEV_USB_HID4_IOCTL_CONTROL 2
+#define DEV_USB_HID4_IOCTL_INTERRUPT_IN 3
+#define DEV_USB_HID4_IOCTL_INTERRUPT_OUT 4
+#define DEV_USB_HID4_IOCTL_GET_VERSION 6
+/* Version id. */
+#define DEV_USB_HID4_VERSION 0x00040001
 
-    build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_in, length, rpData);
-    return IOS_Ioctl(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_IN, &device->transferV4, sizeof(device->transferV4), NULL, 0);
-}
+static uint32_t dev_usb_hid4_devices[DEV_USB_HID4_DEVICE_CHANGE_SIZE] IOS_ALIGN;
+struct interrupt_msg4 {
+    uint8_t padding[16];
+    uint32_t device;
+    uint32_t endpoint;
+    uint32_t length;
+    void *ptr;
+};
 
-static inline int usb_hid_v4_ctrl_transfer(usb_input_device_t *device, uint8_t bmRequestType, uint8_t bmRequest,
-                                           uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
-    build_v4_ctrl_transfer(&device->transferV4, device->dev_id, bmRequestType, bmRequest, wValue, wIndex, wLength, rpData);
-    int ret = IOS_Ioctl(device->host_fd, DEV_USB_HID4_IOCTL_CONTROL, &device->transferV4, sizeof(device->transferV4), NULL, 0);
-    return ret;
-}
+static void onDevGetVersion4(ios_ret_t ret, usr_t unused);
+static void onDevUsbChange4(ios_ret_t ret, usr_t unused);
 
-static int checkVersion5(ios_cb_t cb, usr_t data) {
+static int checkVersion4(ios_cb_t cb, usr_t data) {
     return IOS_IoctlAsync(
-        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_VERSION,
+        dev_usb_hid_fd, DEV_USB_HID4_IOCTL_GET_VERSION,
+        NULL, 0,
         NULL, 0,
-        dev_usb_hid5_buffer, 0x20,
         cb, data);
 }
-static int getVenDeviceChange5(ios_cb_t cb, usr_t data) {
+static int getDeviceChange4(ios_cb_t cb, usr_t data) {
     return IOS_IoctlAsync(
-        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE,
+        dev_usb_hid_fd, DEV_USB_HID4_IOCTL_GET_DEVICE_CHANGE,
         NULL, 0,
-        dev_usb_ven_devices, sizeof(dev_usb_ven_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE,
+        dev_usb_hid4_devices, sizeof(dev_usb_hid4_devices),
         cb, data);
 }
+#endif
 
-static int sendVenAttach5(ios_cb_t cb, usr_t data) {
-    return IOS_IoctlAsync(
-        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_ATTACH_FINISH,
-        NULL, 0,
-        NULL, 0,
-        cb, data);
+#ifdef USB_HEAP
+/*============================================================================*/
+/* IPC heap */
+/*============================================================================*/
+
+/* Some of the buffers for v5 MUST be in MEM2, so we wrap _start to set aside
+ * an arena for them before the application boots. That is before we know what
+ * will be plugged in, so it is sized for what the game can use at once: each
+ * v5 backend's device list and resume buffer, the watchdog's scratch, a
+ * transfer message for each of MAX_FAKE_WIIMOTES devices and, with oh0, one
+ * configuration descriptor at its largest. Every block is rounded up to
+ * USB_HEAP_ALIGN and has a header that size in front of it. Devices past that,
+ * on standby say, fail to attach with the heap full rather than the game
+ * giving up more MEM2 for them. */
+#define USB_HEAP_ALIGN 32
+#define USB_HEAP_BLOCK(size) ((((size) + USB_HEAP_ALIGN - 1) & ~(USB_HEAP_ALIGN - 1)) + USB_HEAP_ALIGN)
+#define USB_HEAP_BACKEND (USB_HEAP_BLOCK(DEV_USB_HID5_DEVICE_CHANGE_SIZE * DEV_USB_HID5_DEVICE_SIZE) + \
+                          USB_HEAP_BLOCK(DEV_USB_HID5_TMP_BUFFER_SIZE * sizeof(uint32_t)))
+#ifdef SUPPORT_DEV_USB_HID5
+#define USB_HEAP_HID5 (USB_HEAP_BACKEND + USB_HEAP_BLOCK(DEV_USB_WATCHDOG_BUFFER_SIZE * sizeof(uint32_t)) + \
+                       MAX_FAKE_WIIMOTES * USB_HEAP_BLOCK(sizeof(struct usb_hid_v5_transfer) + 2 * sizeof(ioctlv)))
+#else
+#define USB_HEAP_HID5 0
+#endif
+#ifdef SUPPORT_DEV_USB_VEN
+#define USB_HEAP_VEN USB_HEAP_BACKEND
+#else
+#define USB_HEAP_VEN 0
+#endif
+#ifdef SUPPORT_DEV_USB_OH0
+#define USB_HEAP_OH0 USB_HEAP_BLOCK(DEV_USB_OH0_DESC_MAX)
+#else
+#define USB_HEAP_OH0 0
+#endif
+#define USB_HEAP_SIZE (USB_HEAP_HID5 + USB_HEAP_VEN + USB_HEAP_OH0)
+#define OS_IPC_HEAP_HIGH ((void **)0x80003134)
+
+static void *usb_heap_arena;
+static int usb_heap = -1;
+
+void _start(void);
+
+static void my_start(void) {
+    uint8_t *arena = *OS_IPC_HEAP_HIGH;
+    arena -= USB_HEAP_SIZE;
+    usb_heap_arena = arena;
+    *OS_IPC_HEAP_HIGH = arena;
+
+    _start();
 }
 
-static int sendVenResume5(ios_cb_t cb, usr_t data) {
-    usb_input_device_t *device = (usb_input_device_t *)data;
-    dev_usb_ven_buffer[0] = device->dev_id;
-    dev_usb_ven_buffer[1] = 0;
-    dev_usb_ven_buffer[2] = 1;
-    dev_usb_ven_buffer[3] = 0;
-    dev_usb_ven_buffer[4] = 0;
-    dev_usb_ven_buffer[5] = 0;
-    dev_usb_ven_buffer[6] = 0;
-    dev_usb_ven_buffer[7] = 0;
-    return IOS_IoctlAsync(
-        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_SET_RESUME,
-        dev_usb_ven_buffer, 0x20,
-        NULL, 0,
-        cb, data);
+BSLUG_MUST_REPLACE(_start, my_start);
+
+/* The heap itself is made once the game is up, as its table lives in the
+ * game's IPC library, which _start clears. Safe from callbacks, IOS disables
+ * interrupts around its heap. */
+static void *usbHeapAlloc(size_t size) {
+    if (usb_heap < 0) {
+        usb_heap = iosCreateHeap(usb_heap_arena, USB_HEAP_SIZE);
+        if (usb_heap < 0) {
+            printf_v("IPC heap: %d\r\n", usb_heap);
+            return NULL;
+        }
+    }
+    void *ptr = iosAllocAligned(usb_heap, size, USB_HEAP_ALIGN);
+    if (!ptr) {
+        printf_v("IPC heap full: %d\r\n", size);
+    }
+    return ptr;
 }
 
-static int sendVenParams5(ios_cb_t cb, usr_t data) {
-    /* Assumes buffer still in state from sendVenResume5 */
-    return IOS_IoctlAsync(
-        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS,
-        dev_usb_ven_buffer, 0x20,
-        dev_usb_ven_buffer + 8, 0xc0,
-        cb, data);
+static void usbHeapFree(void *ptr) {
+    if (ptr && usb_heap >= 0) {
+        iosFree(usb_heap, ptr);
+    }
 }
-static int getDeviceChange5(ios_cb_t cb, usr_t data) {
-    return IOS_IoctlAsync(
-        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE,
-        NULL, 0,
-        dev_usb_hid5_devices, sizeof(dev_usb_hid5_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE,
-        cb, data);
+#endif
+
+#ifdef SUPPORT_DEV_USB_HID5
+/* The basic flow for version 5:
+ *  1) ioctl GET_VERSION
+ *       Check the return value is 0x00050001.
+ *  2) ioctl GET_DEVICE_CHANGE
+ *       Returns immediately + every time a device is added or removed. Output
+ *       describes what is connected.
+ *  3) ioctl ATTACH_FINISH
+ *       Don't know why, but you have to do this!
+ *  4) Find an interesting device.
+ *  5) ioctl SET_RESUME
+ *       Turn the device on.
+ *  5) ioctl GET_DEVICE_PARAMETERS
+ *       You have to do this, even if you don't care about the result.
+ *  6) ioctl INTERRUPT
+ *       USB interrupt packet to send initialise command to WUP-028.
+ *  7) ioctl INTERRUPT
+ *       USB interrupt packet to  poll device for inputs.
+ */
+
+/* IOCTL numbering for the device. */
+#define DEV_USB_HID5_IOCTL_GET_VERSION 0
+#define DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE 1
+#define DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS 3
+#define DEV_USB_HID5_IOCTL_ATTACH_FINISH 6
+#define DEV_USB_HID5_IOCTL_SET_RESUME 16
+#define DEV_USB_HID5_IOCTL_CONTROL 18
+#define DEV_USB_HID5_IOCTL_INTERRUPT 19
+/* Version id. */
+#define DEV_USB_HID5_VERSION 0x00050001
+
+static struct {
+    uint32_t id;
+    uint32_t vid_pid;
+    uint16_t number;
+    uint8_t interface_number;
+    uint8_t num_altsettings;
+} *dev_usb_hid5_devices;
+
+/* Used for the version, and split 0x20 bytes to 0x60 bytes to resume a device
+ * and store its parameters. Transfers have messages of their own. */
+static uint32_t *dev_usb_hid5_buffer;
+
+#ifdef SUPPORT_DEV_USB_VEN
+static struct {
+    uint32_t id;
+    uint32_t vid_pid;
+    uint16_t number;
+    uint8_t interface_number;
+    uint8_t num_altsettings;
+} *dev_usb_ven_devices;
+
+/* Split 0x20 bytes to 0xc0 bytes to resume a device and store its
+ * parameters. */
+static uint32_t *dev_usb_ven_buffer;
+#endif
+
+/* Scratch space for the watchdog's cancel and suspend/resume ioctls. */
+static uint32_t *dev_usb_watchdog_buffer;
+
+/* IOS reads a transfer's message after the ioctl has been queued, so each
+ * device has its own rather than them taking turns with one buffer. */
+struct usb_hid_v5_message {
+    struct usb_hid_v5_transfer transfer IOS_ALIGN;
+    ioctlv vectors[2];
+};
+
+/* Takes the backend's buffers from the IPC heap, the first time it is used. */
+static int usbHid5Buffers(void) {
+    if (!dev_usb_hid5_devices) {
+        dev_usb_hid5_devices = usbHeapAlloc(sizeof(dev_usb_hid5_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE);
+    }
+    if (!dev_usb_hid5_buffer) {
+        dev_usb_hid5_buffer = usbHeapAlloc(DEV_USB_HID5_TMP_BUFFER_SIZE * sizeof(uint32_t));
+    }
+    return dev_usb_hid5_devices && dev_usb_hid5_buffer ? 0 : -1;
 }
 
-static int sendAttach5(ios_cb_t cb, usr_t data) {
-    return IOS_IoctlAsync(
-        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_ATTACH_FINISH,
-        NULL, 0,
-        NULL, 0,
-        cb, data);
+/* Also wanted by v4 devices in a build with both */
+static int usbWatchdogBuffer(void) {
+    if (!dev_usb_watchdog_buffer) {
+        dev_usb_watchdog_buffer = usbHeapAlloc(DEV_USB_WATCHDOG_BUFFER_SIZE * sizeof(uint32_t));
+    }
+    return dev_usb_watchdog_buffer ? 0 : -1;
 }
 
-static int sendResume5(ios_cb_t cb, usr_t data) {
-    usb_input_device_t *device = (usb_input_device_t *)data;
-    dev_usb_hid5_buffer[0] = device->dev_id;
-    dev_usb_hid5_buffer[1] = 0;
-    dev_usb_hid5_buffer[2] = 1;
+#ifdef SUPPORT_DEV_USB_VEN
+static int usbVen5Buffers(void) {
+    if (!dev_usb_ven_devices) {
+        dev_usb_ven_devices = usbHeapAlloc(sizeof(dev_usb_ven_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE);
+    }
+    if (!dev_usb_ven_buffer) {
+        dev_usb_ven_buffer = usbHeapAlloc(DEV_USB_HID5_TMP_BUFFER_SIZE * sizeof(uint32_t));
+    }
+    return dev_usb_ven_devices && dev_usb_ven_buffer ? 0 : -1;
+}
+#endif
+
+/* A device keeps its message until it is gone and nothing of it is left in
+ * flight, a device that takes over the slot before then reuses it. */
+static int usbDeviceMessage5(usb_input_device_t *device) {
+    if (!device->messageV5) {
+        device->messageV5 = usbHeapAlloc(sizeof(struct usb_hid_v5_message));
+    }
+    return device->messageV5 ? 0 : -1;
+}
+
+static void usbDeviceMessage5Free(usb_input_device_t *device) {
+    if (device->messageV5 && !device->transfers_pending && !device->attaching && !device->valid) {
+        usbHeapFree(device->messageV5);
+        device->messageV5 = NULL;
+    }
+}
+
+static void onDevGetVersion5(ios_ret_t ret, usr_t unused);
+#ifdef SUPPORT_DEV_USB_VEN
+static void onDevUsbVenAttach5(ios_ret_t ret, usr_t vcount);
+static void onDevUsbVenChange5(ios_ret_t ret, usr_t unused);
+static void onDevUsbVenResume5(ios_ret_t ret, usr_t unused);
+static void onDevUsbVenParams5(ios_ret_t ret, usr_t unused);
+#endif
+static void onDevUsbAttach5(ios_ret_t ret, usr_t vcount);
+static void onDevUsbChange5(ios_ret_t ret, usr_t unused);
+static void onDevUsbResume5(ios_ret_t ret, usr_t unused);
+static void onDevUsbParams5(ios_ret_t ret, usr_t unused);
+#endif
+
+#ifdef SUPPORT_DEV_USB_OH0
+/* An oh0 transfer is a vector per field, and IOS reads them after the ioctl
+ * is queued. Each field has a cache line to itself, as IOS flushes them one
+ * by one. */
+struct usb_oh0_ctrl_message {
+    uint8_t bmRequestType IOS_ALIGN;
+    uint8_t bmRequest IOS_ALIGN;
+    uint16_t wValue IOS_ALIGN;
+    uint16_t wIndex IOS_ALIGN;
+    uint16_t wLength IOS_ALIGN;
+    uint8_t unknown IOS_ALIGN;
+    ioctlv vectors[7];
+};
+
+struct usb_oh0_intr_message {
+    uint8_t endpoint IOS_ALIGN;
+    uint16_t wLength IOS_ALIGN;
+    ioctlv vectors[3];
+};
+
+/* One per context, so devices attaching together don't share a message. Reads
+ * and writes can be in flight at once, so each has its own. */
+static struct {
+    struct usb_oh0_ctrl_message ctrl;
+    struct usb_oh0_intr_message intr[2];
+} dev_oh0_messages[USB_MAX_DEVICES];
+
+static inline int usb_oh0_ctrl_transfer_async(usb_input_device_t *device, uint8_t bmRequestType,
+                                              uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
+                                              void *rpData, void (*callback)(int, void *)) {
+    struct usb_oh0_ctrl_message *message = &dev_oh0_messages[usbDeviceIndex(device)].ctrl;
+    ioctlv *vectors = message->vectors;
+    message->bmRequestType = bmRequestType;
+    message->bmRequest = bmRequest;
+    message->wValue = __builtin_bswap16(wValue);
+    message->wIndex = __builtin_bswap16(wIndex);
+    message->wLength = __builtin_bswap16(wLength);
+    message->unknown = 0;
+    vectors[0].data = &message->bmRequestType;
+    vectors[0].len = sizeof(message->bmRequestType);
+    vectors[1].data = &message->bmRequest;
+    vectors[1].len = sizeof(message->bmRequest);
+    vectors[2].data = &message->wValue;
+    vectors[2].len = sizeof(message->wValue);
+    vectors[3].data = &message->wIndex;
+    vectors[3].len = sizeof(message->wIndex);
+    vectors[4].data = &message->wLength;
+    vectors[4].len = sizeof(message->wLength);
+    vectors[5].data = &message->unknown;
+    vectors[5].len = sizeof(message->unknown);
+    vectors[6].data = rpData;
+    vectors[6].len = wLength;
+
+    return IOS_IoctlvAsync(device->host_fd, USBV0_IOCTL_CTRLMSG, 6, 1, vectors,
+                           callback, device);
+}
+
+static inline int usb_oh0_ctrl_transfer(usb_input_device_t *device, uint8_t bmRequestType, uint8_t bmRequest,
+                                        uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
+    static ioctlv vectors[7];
+    static uint8_t bmRequestTypeData __attribute__((aligned(32)));
+    static uint8_t bmRequestData __attribute__((aligned(32)));
+    static uint16_t wValueData __attribute__((aligned(32)));
+    static uint16_t wIndexData __attribute__((aligned(32)));
+    static uint16_t wLengthData __attribute__((aligned(32)));
+    static uint8_t unknownData __attribute__((aligned(32))) = 0;
+    bmRequestTypeData = bmRequestType;
+    bmRequestData = bmRequest;
+    wValueData = __builtin_bswap16(wValue);
+    wIndexData = __builtin_bswap16(wIndex);
+    wLengthData = __builtin_bswap16(wLength);
+    vectors[0].data = &bmRequestTypeData;
+    vectors[0].len = sizeof(bmRequestTypeData);
+    vectors[1].data = &bmRequestData;
+    vectors[1].len = sizeof(bmRequestData);
+    vectors[2].data = &wValueData;
+    vectors[2].len = sizeof(wValueData);
+    vectors[3].data = &wIndexData;
+    vectors[3].len = sizeof(wIndexData);
+    vectors[4].data = &wLengthData;
+    vectors[4].len = sizeof(wLengthData);
+    vectors[5].data = &unknownData;
+    vectors[5].len = sizeof(unknownData);
+    vectors[6].data = rpData;
+    vectors[6].len = wLength;
+
+    return IOS_Ioctlv(device->host_fd, USBV0_IOCTL_CTRLMSG, 6, 1, vectors);
+}
+
+static inline int usb_oh0_intr_transfer(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
+    static ioctlv vectors[3];
+
+    static uint8_t endpoint __attribute__((aligned(32)));
+    static uint16_t len __attribute__((aligned(32)));
+    endpoint = out ? device->endpoint_address_out : device->endpoint_address_in;
+    len = wLength;
+    vectors[0].data = &endpoint;
+    vectors[0].len = sizeof(endpoint);
+    vectors[1].data = &len;
+    vectors[1].len = sizeof(len);
+    vectors[2].data = rpData;
+    vectors[2].len = wLength;
+    return IOS_Ioctlv(device->host_fd, USBV0_IOCTL_INTRMSG, 2, 1, vectors);
+}
+
+static inline int usb_oh0_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
+    struct usb_oh0_intr_message *message = &dev_oh0_messages[usbDeviceIndex(device)].intr[out];
+    ioctlv *vectors = message->vectors;
+    message->endpoint = out ? device->endpoint_address_out : device->endpoint_address_in;
+    message->wLength = wLength;
+    vectors[0].data = &message->endpoint;
+    vectors[0].len = sizeof(message->endpoint);
+    vectors[1].data = &message->wLength;
+    vectors[1].len = sizeof(message->wLength);
+    vectors[2].data = rpData;
+    vectors[2].len = wLength;
+
+    return IOS_IoctlvAsync(device->host_fd, USBV0_IOCTL_INTRMSG, 2, 1, vectors,
+                           onDevUsbPoll, device);
+}
+
+static inline int usb_oh0_bulk_transfer_async(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
+    struct usb_oh0_intr_message *message = &dev_oh0_messages[usbDeviceIndex(device)].intr[out];
+    ioctlv *vectors = message->vectors;
+    message->endpoint = out ? device->endpoint_address_out : device->endpoint_address_in;
+    message->wLength = wLength;
+    vectors[0].data = &message->endpoint;
+    vectors[0].len = sizeof(message->endpoint);
+    vectors[1].data = &message->wLength;
+    vectors[1].len = sizeof(message->wLength);
+    vectors[2].data = rpData;
+    vectors[2].len = wLength;
+
+    return IOS_IoctlvAsync(device->host_fd, USBV0_IOCTL_BLKMSG, 2, 1, vectors,
+                           onDevUsbPoll, device);
+}
+
+#endif
+
+#ifdef SUPPORT_DEV_USB_HID5
+static inline void build_v5_ctrl_transfer(struct usb_hid_v5_transfer *transfer, int dev_id,
+                                          uint8_t bmRequestType, uint8_t bmRequest, uint16_t wValue, uint16_t wIndex) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->dev_id = dev_id;
+    transfer->ctrl.bmRequestType = bmRequestType;
+    transfer->ctrl.bmRequest = bmRequest;
+    transfer->ctrl.wValue = wValue;
+    transfer->ctrl.wIndex = wIndex;
+}
+
+static inline void build_hid_v5_intr_transfer(struct usb_hid_v5_transfer *transfer, int dev_id, int out) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->dev_id = dev_id;
+    transfer->intr_hid.out = out;
+}
+
+#ifdef SUPPORT_DEV_USB_VEN
+static inline void build_ven_v5_intr_transfer(struct usb_hid_v5_transfer *transfer, int dev_id, int endpoint, uint16_t wLength,
+                                              void *rpData) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->dev_id = dev_id;
+    transfer->intr.bEndpoint = endpoint;
+    transfer->intr.rpData = rpData;
+    transfer->intr.wLength = wLength;
+}
+
+static inline void build_ven_v5_bulk_transfer(struct usb_hid_v5_transfer *transfer, int dev_id, int endpoint, uint16_t wLength,
+                                              void *rpData) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->dev_id = dev_id;
+    transfer->bulk.bEndpoint = endpoint;
+    transfer->bulk.rpData = rpData;
+    transfer->bulk.wLength = wLength;
+}
+
+#endif
+
+static inline int usb_hid_v5_ctrl_transfer_async(usb_input_device_t *device, uint8_t bmRequestType,
+                                                 uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
+                                                 void *rpData, void (*callback)(int, void *)) {
+    ioctlv *vectors = device->messageV5->vectors;
+    int out = !(bmRequestType & USB_ENDPOINT_IN);
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+
+    build_v5_ctrl_transfer(transfer, device->dev_id, bmRequestType, bmRequest, wValue, wIndex);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = wLength;
+    printf("ctrl transfer id: %02x\r\n", device->dev_id);
+
+    return IOS_IoctlvAsync(device->host_fd, DEV_USB_HID5_IOCTL_CONTROL, 1 + out, 1 - out, vectors,
+                           callback, device);
+}
+
+static inline int usb_hid_v5_ctrl_transfer(usb_input_device_t *device, uint8_t bmRequestType, uint8_t bmRequest,
+                                           uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
+    ioctlv *vectors = device->messageV5->vectors;
+    int out = !(bmRequestType & USB_ENDPOINT_IN);
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+
+    build_v5_ctrl_transfer(transfer, device->dev_id, bmRequestType, bmRequest, wValue, wIndex);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = wLength;
+
+    return IOS_Ioctlv(device->host_fd, DEV_USB_HID5_IOCTL_CONTROL, 1 + out, 1 - out, vectors);
+}
+
+#ifdef SUPPORT_DEV_USB_VEN
+static inline int usb_ven_v5_intr_transfer(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
+    ioctlv *vectors = device->messageV5->vectors;
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+    build_ven_v5_intr_transfer(transfer, device->dev_id, out ? device->endpoint_address_out : device->endpoint_address_in, wLength, rpData);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = wLength;
+
+    return IOS_Ioctlv(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors);
+}
+
+static inline int usb_ven_v5_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
+    ioctlv *vectors = device->messageV5->vectors;
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+    build_ven_v5_intr_transfer(transfer, device->dev_id, out ? device->endpoint_address_out : device->endpoint_address_in, length, rpData);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = length;
+    return IOS_IoctlvAsync(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors,
+                           onDevUsbPoll, device);
+}
+
+static inline int usb_ven_v5_bulk_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
+    ioctlv *vectors = device->messageV5->vectors;
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+    build_ven_v5_bulk_transfer(transfer, device->dev_id, out ? device->endpoint_address_out : device->endpoint_address_in, length, rpData);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = length;
+    return IOS_IoctlvAsync(device->host_fd, USBV5_IOCTL_BULKMSG, 1 + out, 1 - out, vectors,
+                           onDevUsbPoll, device);
+}
+
+#endif
+
+static inline int usb_hid_v5_intr_transfer(usb_input_device_t *device, bool out, uint16_t wLength, void *rpData) {
+    ioctlv *vectors = device->messageV5->vectors;
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+    build_hid_v5_intr_transfer(transfer, device->dev_id, out);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = wLength;
+    return IOS_Ioctlv(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors);
+}
+
+static inline int usb_hid_v5_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
+    ioctlv *vectors = device->messageV5->vectors;
+    struct usb_hid_v5_transfer *transfer = &device->messageV5->transfer;
+    build_hid_v5_intr_transfer(transfer, device->dev_id, out);
+    vectors[0].data = transfer;
+    vectors[0].len = sizeof(struct usb_hid_v5_transfer);
+    vectors[1].data = rpData;
+    vectors[1].len = length;
+    return IOS_IoctlvAsync(device->host_fd, DEV_USB_HID5_IOCTL_INTERRUPT, 1 + out, 1 - out, vectors,
+                           onDevUsbPoll, device);
+}
+
+#endif
+
+#ifdef SUPPORT_DEV_USB_HID4
+static inline void build_v4_ctrl_transfer(struct usb_hid_v4_transfer *transfer, int dev_id,
+                                          uint8_t bmRequestType, uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->dev_id = dev_id;
+    transfer->ctrl.bmRequestType = bmRequestType;
+    transfer->ctrl.bmRequest = bmRequest;
+    transfer->ctrl.wValue = wValue;
+    transfer->ctrl.wIndex = wIndex;
+    transfer->ctrl.wLength = wLength;
+    transfer->data = rpData;
+}
+
+static inline void build_v4_intr_transfer(struct usb_hid_v4_transfer *transfer, int dev_id, int out, int dLength, void *rpData) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->dev_id = dev_id;
+    transfer->intr.out = out;
+    transfer->intr.dLength = dLength;
+    transfer->data = rpData;
+}
+
+static inline int usb_hid_v4_ctrl_transfer_async(usb_input_device_t *device, uint8_t bmRequestType,
+                                                 uint8_t bmRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength,
+                                                 void *rpData, void (*callback)(int, void *)) {
+    build_v4_ctrl_transfer(&device->transferV4, device->dev_id, bmRequestType, bmRequest, wValue, wIndex, wLength, rpData);
+
+    return IOS_IoctlAsync(device->host_fd, DEV_USB_HID4_IOCTL_CONTROL, &device->transferV4, sizeof(device->transferV4), NULL, 0,
+                          callback, device);
+}
+
+static inline int usb_hid_v4_intr_transfer_async(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
+    if (out) {
+        build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_out, length, rpData);
+        return IOS_IoctlAsync(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_OUT, &device->transferV4, sizeof(device->transferV4), NULL, 0,
+                              onDevUsbPoll, device);
+    }
+
+    build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_in, length, rpData);
+    return IOS_IoctlAsync(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_IN, &device->transferV4, sizeof(device->transferV4), NULL, 0,
+                          onDevUsbPoll, device);
+}
+
+static inline int usb_hid_v4_intr_transfer(usb_input_device_t *device, bool out, uint16_t length, void *rpData) {
+    if (out) {
+        build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_out, length, rpData);
+        return IOS_Ioctl(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_OUT, &device->transferV4, sizeof(device->transferV4), NULL, 0);
+    }
+
+    build_v4_intr_transfer(&device->transferV4, device->dev_id, device->endpoint_address_in, length, rpData);
+    return IOS_Ioctl(device->host_fd, DEV_USB_HID4_IOCTL_INTERRUPT_IN, &device->transferV4, sizeof(device->transferV4), NULL, 0);
+}
+
+static inline int usb_hid_v4_ctrl_transfer(usb_input_device_t *device, uint8_t bmRequestType, uint8_t bmRequest,
+                                           uint16_t wValue, uint16_t wIndex, uint16_t wLength, void *rpData) {
+    build_v4_ctrl_transfer(&device->transferV4, device->dev_id, bmRequestType, bmRequest, wValue, wIndex, wLength, rpData);
+    int ret = IOS_Ioctl(device->host_fd, DEV_USB_HID4_IOCTL_CONTROL, &device->transferV4, sizeof(device->transferV4), NULL, 0);
+    return ret;
+}
+
+#endif
+
+#ifdef SUPPORT_DEV_USB_HID5
+static int checkVersion5(ios_cb_t cb, usr_t data) {
+    if (usbHid5Buffers() < 0) {
+        return -1;
+    }
+    return IOS_IoctlAsync(
+        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_VERSION,
+        NULL, 0,
+        dev_usb_hid5_buffer, 0x20,
+        cb, data);
+}
+#ifdef SUPPORT_DEV_USB_VEN
+static int getVenDeviceChange5(ios_cb_t cb, usr_t data) {
+    return IOS_IoctlAsync(
+        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE,
+        NULL, 0,
+        dev_usb_ven_devices, sizeof(dev_usb_ven_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE,
+        cb, data);
+}
+
+static int sendVenAttach5(ios_cb_t cb, usr_t data) {
+    return IOS_IoctlAsync(
+        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_ATTACH_FINISH,
+        NULL, 0,
+        NULL, 0,
+        cb, data);
+}
+
+static int sendVenResume5(ios_cb_t cb, usr_t data) {
+    usb_input_device_t *device = (usb_input_device_t *)data;
+    dev_usb_ven_buffer[0] = device->dev_id;
+    dev_usb_ven_buffer[1] = 0;
+    dev_usb_ven_buffer[2] = 1;
+    dev_usb_ven_buffer[3] = 0;
+    dev_usb_ven_buffer[4] = 0;
+    dev_usb_ven_buffer[5] = 0;
+    dev_usb_ven_buffer[6] = 0;
+    dev_usb_ven_buffer[7] = 0;
+    return IOS_IoctlAsync(
+        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_SET_RESUME,
+        dev_usb_ven_buffer, 0x20,
+        NULL, 0,
+        cb, data);
+}
+
+static int sendVenParams5(ios_cb_t cb, usr_t data) {
+    /* Assumes buffer still in state from sendVenResume5 */
+    return IOS_IoctlAsync(
+        dev_usb_ven_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS,
+        dev_usb_ven_buffer, 0x20,
+        dev_usb_ven_buffer + 8, 0xc0,
+        cb, data);
+}
+#endif
+static int getDeviceChange5(ios_cb_t cb, usr_t data) {
+    return IOS_IoctlAsync(
+        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE,
+        NULL, 0,
+        dev_usb_hid5_devices, sizeof(dev_usb_hid5_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE,
+        cb, data);
+}
+
+static int sendAttach5(ios_cb_t cb, usr_t data) {
+    return IOS_IoctlAsync(
+        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_ATTACH_FINISH,
+        NULL, 0,
+        NULL, 0,
+        cb, data);
+}
+
+static int sendResume5(ios_cb_t cb, usr_t data) {
+    usb_input_device_t *device = (usb_input_device_t *)data;
+    dev_usb_hid5_buffer[0] = device->dev_id;
+    dev_usb_hid5_buffer[1] = 0;
+    dev_usb_hid5_buffer[2] = 1;
     dev_usb_hid5_buffer[3] = 0;
     dev_usb_hid5_buffer[4] = 0;
     dev_usb_hid5_buffer[5] = 0;
@@ -843,854 +2198,1970 @@ static int sendResume5(ios_cb_t cb, usr_t data) {
         cb, data);
 }
 
-static int sendParams5(ios_cb_t cb, usr_t data) {
-    /* Assumes buffer still in state from sendResume5 */
-    return IOS_IoctlAsync(
-        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS,
-        dev_usb_hid5_buffer, 0x20,
-        dev_usb_hid5_buffer + 8, 0x60,
-        cb, data);
+static int sendParams5(ios_cb_t cb, usr_t data) {
+    /* Assumes buffer still in state from sendResume5 */
+    return IOS_IoctlAsync(
+        dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS,
+        dev_usb_hid5_buffer, 0x20,
+        dev_usb_hid5_buffer + 8, 0x60,
+        cb, data);
+}
+
+/* Set from a backend's resume until its device is done with the shared
+ * buffers, indexed like usbBackendError's ven */
+static bool resume5_in_flight[2];
+
+/* Devices are resumed one at a time, as they share the buffer. Moves on to the
+ * next one still waiting on this backend, if there is one and the backend
+ * isn't already busy with one. */
+static void resumeNext5(uint8_t api_type) {
+    bool *in_flight = &resume5_in_flight[api_type == API_TYPE_VEN];
+    if (*in_flight) {
+        return;
+    }
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if (!device->waiting || device->valid || device->api_type != api_type) {
+            continue;
+        }
+        printf_v("Resuming next device\r\n");
+        int ret = usbDeviceMessage5(device);
+#ifdef SUPPORT_DEV_USB_VEN
+        if (ret >= 0 && api_type == API_TYPE_VEN) {
+            ret = sendVenResume5(onDevUsbVenResume5, device);
+        } else
+#endif
+        if (ret >= 0) {
+            ret = sendResume5(onDevUsbResume5, device);
+        }
+        if (ret >= 0) {
+            *in_flight = true;
+            return;
+        }
+        usbDeviceError(device, USB_STAGE_RESUME, ret);
+    }
+}
+
+/* Ends a resume started by resumeNext5, whichever way it went */
+static void resumeDone5(uint8_t api_type) {
+    resume5_in_flight[api_type == API_TYPE_VEN] = false;
+    resumeNext5(api_type);
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_VEN
+/* Configuration descriptors of ven devices are read into here, they are
+ * resumed one at a time */
+static uint32_t dev_oh0_buffer[0x180] IOS_ALIGN;
+#endif
+
+#ifdef SUPPORT_DEV_USB_OH0
+/* oh0 devices attach all at once, so each reads its configuration descriptor
+ * into a buffer of its own from the IPC heap, given back once it is parsed.
+ * Longer ones are cut at DEV_USB_OH0_DESC_MAX. */
+
+static struct {
+    uint8_t *data;
+    uint16_t size;
+} dev_oh0_descriptors[USB_MAX_DEVICES];
+
+static void usbDeviceDescriptorFree(usb_input_device_t *device) {
+    usbHeapFree(dev_oh0_descriptors[usbDeviceIndex(device)].data);
+    dev_oh0_descriptors[usbDeviceIndex(device)].data = NULL;
+}
+
+static void onDevGetDesc2(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    printf_v("Get Desc2 ret: %d\r\n", ret);
+    if (ret < 0) {
+        usbDeviceDescriptorFree(device);
+        usbDeviceError(device, USB_STAGE_DESCRIPTOR, ret);
+        return;
+    }
+    uint16_t size = dev_oh0_descriptors[usbDeviceIndex(device)].size;
+    printf_v("Desc size2: %02x\r\n", size);
+    uint8_t *desc = dev_oh0_descriptors[usbDeviceIndex(device)].data;
+    uint8_t *end = desc + size;
+    while (desc < end) {
+        uint8_t bLength = desc[0];
+        uint8_t bDescriptorType = desc[1];
+        printf_v("Len: %01x\r\n", bLength);
+        printf_v("Type: %01x\r\n", bDescriptorType);
+        if (bDescriptorType == USB_DT_INTERFACE) {
+            usb_interfacedesc *intf = (usb_interfacedesc *)desc;
+            printf_v("Class: %02x %02x %02x\r\n", intf->bInterfaceClass, intf->bInterfaceSubClass, intf->bInterfaceProtocol);
+#ifdef SUPPORT_XINPUT
+            if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x01) {
+                printf_v("Found Xbox 360 Wired Controller!\r\n");
+                desc += bLength;
+                // Xbox desc directly follows interface desc
+                xboxiddesc *idf = (xboxiddesc *)desc;
+                printf_v("Subtype: %02x\r\n", idf->subtype);
+                device->endpoint_address_in = idf->bEndpointAddressIn;
+                device->endpoint_address_out = idf->bEndpointAddressOut;
+                device->max_packet_len_in = idf->bMaxDataSizeIn;
+                device->max_packet_len_out = idf->bMaxDataSizeOut;
+                device->sub_type = idf->subtype;
+                device->type = XINPUT_TYPE_WIRED;
+                device->driver = &xbox_controller_usb_device_driver;
+                // We found what we are looking for
+                break;
+            }
+            if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x81) {
+                printf_v("Found Xbox 360 Wireless receiver!\r\n");
+                desc += bLength;
+                bLength = desc[0];
+                bDescriptorType = desc[1];
+                // Skip over 0x22 descriptor
+                desc += bLength;
+                uint8_t endpoints = intf->bNumEndpoints;
+                while (endpoints--) {
+                    usb_endpointdesc *desc_ep = (usb_endpointdesc *)desc;
+                    if (desc_ep->bEndpointAddress & 0x80) {
+                        device->endpoint_address_in = desc_ep->bEndpointAddress;
+                        device->max_packet_len_in = __builtin_bswap16(desc_ep->wMaxPacketSize);
+                    } else {
+                        device->endpoint_address_out = desc_ep->bEndpointAddress;
+                        device->max_packet_len_out = __builtin_bswap16(desc_ep->wMaxPacketSize);
+                    }
+                    desc += desc_ep->bLength;
+                }
+                device->type = XINPUT_TYPE_WIRELESS;
+                device->driver = &xbox_controller_usb_device_driver;
+                // We found what we are looking for
+                break;
+            }
+#endif
+#ifdef SUPPORT_GIP
+            if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x47 && intf->bInterfaceProtocol == 0xD0 && intf->bNumEndpoints) {
+                printf_v("Found Xbox One controller!\r\n");
+                desc += bLength;
+                uint8_t endpoints = intf->bNumEndpoints;
+                while (endpoints-- && desc < end) {
+                    usb_endpointdesc *desc_ep = (usb_endpointdesc *)desc;
+                    if (desc_ep->bDescriptorType == USB_DT_ENDPOINT) {
+                        if (desc_ep->bEndpointAddress & 0x80) {
+                            device->endpoint_address_in = desc_ep->bEndpointAddress;
+                            device->max_packet_len_in = __builtin_bswap16(desc_ep->wMaxPacketSize);
+                        } else {
+                            device->endpoint_address_out = desc_ep->bEndpointAddress;
+                            device->max_packet_len_out = __builtin_bswap16(desc_ep->wMaxPacketSize);
+                        }
+                    }
+                    desc += desc_ep->bLength;
+                }
+                device->driver = &xbox_one_usb_device_driver;
+                // We found what we are looking for
+                break;
+            }
+#endif
+        }
+        desc += bLength;
+    }
+    usbDeviceDescriptorFree(device);
+    if (device->driver != NULL) {
+        usbDeviceInit(device);
+    } else {
+        usbDeviceAbandon(device);
+    }
+}
+static void onDevGetDesc1(ios_ret_t ret, usr_t user) {
+    printf_v("Get Desc ret: %d\r\n", ret);
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    if (ret < 0) {
+        usbDeviceError(device, USB_STAGE_DESCRIPTOR, ret);
+        return;
+    }
+    // The first read only had room for the header, in usb_async_resp
+    uint16_t size = __builtin_bswap16(*(uint16_t *)&device->usb_async_resp[2]);
+    printf_v("Desc size1: %02x\r\n", size);
+    if (size > DEV_USB_OH0_DESC_MAX) {
+        size = DEV_USB_OH0_DESC_MAX;
+    }
+    uint8_t *desc = usbHeapAlloc(size);
+    if (!desc) {
+        usbDeviceError(device, USB_STAGE_DESCRIPTOR, -1);
+        return;
+    }
+    dev_oh0_descriptors[usbDeviceIndex(device)].data = desc;
+    dev_oh0_descriptors[usbDeviceIndex(device)].size = size;
+    ret = usb_oh0_ctrl_transfer_async(device, 0b10000000, 0x06, USB_DT_CONFIG << 8, 0, size, desc, onDevGetDesc2);
+    if (ret < 0) {
+        onDevGetDesc2(ret, device);
+    }
+}
+
+static void onDevOpenUsbv0(ios_fd_t fd, usr_t usr) {
+    printf_v("USB FD: %02x\r\n", fd);
+    usb_input_device_t *device = (usb_input_device_t *)usr;
+    if (fd < 0) {
+        usbDeviceError(device, USB_STAGE_OPEN, fd);
+        return;
+    }
+    device->host_fd = fd;
+    // Picked once the descriptor says what this is
+    device->driver = NULL;
+    device->api_type = API_TYPE_OH0;
+    int ret = usb_oh0_ctrl_transfer_async(device, 0b10000000, 0x06, USB_DT_CONFIG << 8, 0, 4, device->usb_async_resp, onDevGetDesc1);
+    if (ret < 0) {
+        onDevGetDesc1(ret, device);
+    }
+}
+#endif
+/*============================================================================*/
+/* Start of USB callback chain. Each method calls another as a callback after an
+ * IOS command. */
+/*============================================================================*/
+#ifdef SUPPORT_DEV_USB_OH0
+static ios_fd_t usb_fd;
+static uint8_t num_descr __attribute__((aligned(32))) = 1;
+static uint8_t iclass __attribute__((aligned(32))) = 0xFF;
+static uint8_t cntdevs __attribute__((aligned(32))) = 0;
+static void onUsbV0DevList(ios_ret_t ret, usr_t user) {
+    IOS_CloseAsync(usb_fd, callbackIgnore, NULL);
+    usb_fd = -1;
+    const usb_device_driver_t *driver;
+    printf_v("Devices: %d\r\n", cntdevs);
+    transportStats(API_TYPE_OH0)->device_changes++;
+    while (cntdevs--) {
+        uint16_t vid = (uint16_t)(dev_oh0_devices[cntdevs * 2 + 1] >> 16);
+        uint16_t pid = (uint16_t)dev_oh0_devices[cntdevs * 2 + 1];
+
+        usb_input_device_t *device;
+        printf_v("Found device oh0 %04x %04x!\r\n", vid, pid);
+
+        driver = NULL;
+        for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
+            if (usb_device_drivers[i]->probe(vid, pid)) {
+                driver = usb_device_drivers[i];
+                break;
+            }
+        }
+        // If this is HID based, then we dont want to handle it via oh0
+        if (driver != NULL && driver->hid) {
+            continue;
+        }
+        // oh0 has no device ids, so the vid/pid stands in for one
+        device = usbDeviceClaim(vid, pid, API_TYPE_OH0, (vid << 16) | pid);
+        if (device) {
+            char devicepath[23];
+            printf_v("VID: %04x, PID: %04x\r\n", vid, pid);
+            snprintf_v(devicepath, sizeof(devicepath), "/dev/usb/oh0/%x/%x", vid, pid);
+            printf_v("Dev path: %s\r\n", devicepath);
+
+            printf_v("OpenAsync Dev: %d\r\n", IOS_OpenAsync(devicepath, 0, onDevOpenUsbv0, device));
+        }
+    }
+}
+
+static void onDevOpenUsb(ios_fd_t fd, usr_t unused) {
+    static ioctlv vectors[4];
+    vectors[0].data = &num_descr;
+    vectors[0].len = 1;
+    vectors[1].data = &iclass;
+    vectors[1].len = 1;
+    vectors[2].data = &cntdevs;
+    vectors[2].len = 1;
+    vectors[3].data = dev_oh0_devices;
+    vectors[3].len = num_descr << 3;
+    usb_fd = fd;
+    IOS_IoctlvAsync(fd, USBV0_IOCTL_GETDEVLIST, 2, 2, vectors, onUsbV0DevList, NULL);
+}
+#endif
+
+static void onDevOpen(ios_fd_t fd, usr_t unused) {
+    int ret;
+    (void)unused;
+    printf_v("    hid dev opened %d\r\n", fd);
+    dev_usb_hid_fd = fd;
+    if (fd >= 0)
+        ret =
+#if defined(SUPPORT_DEV_USB_HID4)
+            checkVersion4(onDevGetVersion4, NULL);
+#elif defined(SUPPORT_DEV_USB_HID5)
+            checkVersion5(onDevGetVersion5, NULL);
+#else
+            -1;
+#endif
+    else
+        ret = fd;
+    if (ret) {
+        printf_v("    ... error %d\r\n", fd);
+        usbBackendError(false, fd < 0 ? USB_STAGE_OPEN : USB_STAGE_VERSION, ret);
+    }
+}
+
+static void callbackIgnore(ios_ret_t ret, usr_t unused) {
+    (void)unused;
+    (void)ret;
+}
+
+#ifdef SUPPORT_DEV_USB_HID4
+static void onDevGetVersion4(ios_ret_t ret, usr_t unused) {
+    (void)unused;
+    uint8_t stage = USB_STAGE_VERSION;
+    printf_v("    onDevGetVersion4 %d\r\n", ret);
+    if (ret == DEV_USB_HID4_VERSION) {
+#ifdef HAVE_VERSION
+        version = 4;
+        printf_v("    Found hidv4\r\n");
+#endif
+
+#ifdef SUPPORT_DEV_USB_OH0
+        printf_v("Opening oh0: %d\r\n", IOS_OpenAsync(DEV_USB_OH0_PATH, 0, onDevOpenUsb, NULL));
+#endif
+        stage = USB_STAGE_CHANGE;
+        ret = getDeviceChange4(onDevUsbChange4, NULL);
+    } else {
+#ifdef SUPPORT_DEV_USB_HID5
+        ret = checkVersion5(onDevGetVersion5, NULL);
+#endif
+    }
+    if (ret) {
+        usbBackendError(false, stage, ret);
+    }
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_VEN
+static void onDevOpenVen(ios_fd_t fd, usr_t usr) {
+    printf_v("Opened ven: %d\r\n", fd);
+    dev_usb_ven_fd = fd;
+    int ret = fd;
+    if (ret >= 0) {
+        ret = usbVen5Buffers();
+    }
+    if (ret >= 0) {
+        ret = getVenDeviceChange5(onDevUsbVenChange5, NULL);
+    }
+    if (ret < 0) {
+        usbBackendError(true, fd < 0 ? USB_STAGE_OPEN : USB_STAGE_CHANGE, ret);
+    }
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_HID5
+static void onDevGetVersion5(ios_ret_t ret, usr_t unused) {
+    (void)unused;
+    uint8_t stage = USB_STAGE_VERSION;
+    if (ret == 0 && dev_usb_hid5_buffer[0] == DEV_USB_HID5_VERSION) {
+#ifdef HAVE_VERSION
+        version = 5;
+        printf_v("    Found hidv5\r\n");
+
+#endif
+#ifdef SUPPORT_DEV_USB_VEN
+        // Still open if it is only hid that is being reopened
+        if (dev_usb_ven_fd < 0) {
+            printf_v("Opening ven: %d\r\n", IOS_OpenAsync(DEV_USB_VEN_PATH, 0, onDevOpenVen, NULL));
+        }
+#endif
+        stage = USB_STAGE_CHANGE;
+        ret = getDeviceChange5(onDevUsbChange5, NULL);
+    } else if (ret == 0) {
+        ret = dev_usb_hid5_buffer[0];
+    }
+    if (ret) {
+        usbBackendError(false, stage, ret);
+    }
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_HID4
+static void onDevUsbChange4(ios_ret_t ret, usr_t unused) {
+    printf_v("onDevUsbChange4 %d\r\n", ret);
+    if (ret >= 0) {
+        dev_usb_hid_failures = 0;
+        transportStats(API_TYPE_HIDV4)->device_changes++;
+        usb_input_device_t *device;
+        const usb_device_driver_t *driver;
+        uint16_t packet_size_in = 128;
+        uint16_t packet_size_out = 128;
+        uint8_t endpoint_address_in = 0;
+        uint8_t endpoint_address_out = 0;
+        uint32_t vid_pid;
+        uint16_t vid, pid;
+        uint32_t present = 0;
+
+        for (int i = 0; i < DEV_USB_HID4_DEVICE_CHANGE_SIZE && dev_usb_hid4_devices[i] < sizeof(dev_usb_hid4_devices); i += dev_usb_hid4_devices[i] / 4) {
+            uint32_t device_id = dev_usb_hid4_devices[i + 1];
+            present |= usbDevicePresent(API_TYPE_HIDV4, device_id);
+            vid_pid = dev_usb_hid4_devices[i + 4];
+            vid = (vid_pid >> 16) & 0xFFFF;
+            pid = vid_pid & 0xFFFF;
+            printf_v("       Found device v4 %04x %04x!\r\n", vid_pid, device_id);
+            driver = NULL;
+            for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
+                if (usb_device_drivers[i]->probe(vid, pid)) {
+                    driver = usb_device_drivers[i];
+                    break;
+                }
+            }
+            if (driver != NULL) {
+                device = usbDeviceClaim(vid, pid, API_TYPE_HIDV4, device_id);
+                if (device) {
+                    present |= 1u << usbDeviceIndex(device);
+                    endpoint_address_in = 0;
+                    endpoint_address_out = 0;
+                    uint32_t total_len = dev_usb_hid4_devices[i] / 4;
+                    int j = 2;
+                    bool is_hid = false;
+                    while (j < total_len) {
+                        uint8_t len = (dev_usb_hid4_devices[i + j] >> 24) & 0xFF;
+                        uint8_t type = (dev_usb_hid4_devices[i + j] >> 16) & 0xFF;
+                        printf_v("Found desc: %02x %02x\r\n", type, len);
+                        if (type == USB_DT_ENDPOINT && is_hid) {
+                            uint8_t addr = (dev_usb_hid4_devices[i + j] >> 8) & 0xFF;
+                            int in = (addr & USB_ENDPOINT_IN);
+                            if (in) {
+                                packet_size_in = (dev_usb_hid4_devices[i + j + 1] >> 16) & 0xFFFF;
+                                endpoint_address_in = addr;
+                                printf_v("Found in endpoint %02x, size %04d\r\n", endpoint_address_in, packet_size_in);
+                            } else {
+                                packet_size_out = (dev_usb_hid4_devices[i + j + 1] >> 16) & 0xFFFF;
+                                endpoint_address_out = addr;
+                                printf_v("Found out endpoint %02x, size %04d\r\n", endpoint_address_out, packet_size_out);
+                            }
+                            if (endpoint_address_in && endpoint_address_out) {
+                                break;
+                            }
+                        }
+                        if (type == USB_DT_INTERFACE) {
+                            uint8_t class = (dev_usb_hid4_devices[i + j + 1] >> 16) & 0xFF;
+                            uint8_t subclass = (dev_usb_hid4_devices[i + j + 1] >> 8) & 0xFF;
+                            uint8_t protocol = (dev_usb_hid4_devices[i + j + 1]) & 0xFF;
+                            printf_v("Class: %02x, Subclass: %02x, Protocol: %02x\r\n", class, subclass, protocol);
+                            is_hid = class == USB_CLASS_HID;
+                        }
+                        j += (len / 4) + 1;
+                    }
+
+                    device->endpoint_address_in = endpoint_address_in;
+                    device->endpoint_address_out = endpoint_address_out;
+                    device->max_packet_len_in = packet_size_in;
+                    device->max_packet_len_out = packet_size_out;
+                    device->host_fd = dev_usb_hid_fd;
+                    printf_v("Found!\r\n");
+                    device->driver = driver;
+                    usbDeviceInit(device);
+                }
+            }
+        }
+        usbDeviceDetachMissing(API_TYPE_HIDV4, present);
+        ret = getDeviceChange4(onDevUsbChange4, NULL);
+    }
+    if (ret) {
+        usbBackendError(false, USB_STAGE_CHANGE, ret);
+    }
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_VEN
+static void onDevUsbVenChange5(ios_ret_t ret, usr_t unused) {
+    uint8_t stage = USB_STAGE_CHANGE;
+    if (ret >= 0) {
+        stage = USB_STAGE_ATTACH;
+        ret = sendVenAttach5(onDevUsbVenAttach5, (usr_t)ret);
+    }
+    if (ret) {
+        usbBackendError(true, stage, ret);
+    }
+}
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+static void onDevUsbChange5(ios_ret_t ret, usr_t unused) {
+    uint8_t stage = USB_STAGE_CHANGE;
+    if (ret >= 0) {
+        stage = USB_STAGE_ATTACH;
+        ret = sendAttach5(onDevUsbAttach5, (usr_t)ret);
+    }
+    if (ret) {
+        usbBackendError(false, stage, ret);
+    }
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_VEN
+static void onDevUsbVenAttach5(ios_ret_t ret, usr_t vcount) {
+    uint8_t stage = USB_STAGE_ATTACH;
+    if (ret == 0) {
+        dev_usb_ven_failures = 0;
+        transportStats(API_TYPE_VEN)->device_changes++;
+        uint32_t vid_pid;
+        uint16_t vid, pid;
+        usb_input_device_t *device;
+        const usb_device_driver_t *driver;
+        bool found = false;
+        uint32_t present = 0;
+        for (int i = 0; i < DEV_USB_HID5_DEVICE_CHANGE_SIZE && i < (ios_ret_t)vcount; i++) {
+            uint32_t device_id = dev_usb_ven_devices[i].id;
+            present |= usbDevicePresent(API_TYPE_VEN, device_id);
+            vid_pid = dev_usb_ven_devices[i].vid_pid;
+            vid = (vid_pid >> 16) & 0xFFFF;
+            pid = vid_pid & 0xFFFF;
+            printf_v("       Found device v5 %04x %04x!\r\n", vid_pid, device_id);
+            driver = NULL;
+            for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
+                if (usb_device_drivers[i]->probe(vid, pid)) {
+                    driver = usb_device_drivers[i];
+                    break;
+                }
+            }
+            // If this is HID based, then we dont want to handle it via /dev/usb/ven
+            if (driver != NULL && driver->hid) {
+                continue;
+            }
+            device = usbDeviceClaim(vid, pid, API_TYPE_VEN, device_id);
+            if (device) {
+                present |= 1u << usbDeviceIndex(device);
+                printf_v("Found!\r\n");
+                device->driver = driver;
+                device->waiting = true;
+                device->host_fd = dev_usb_ven_fd;
+                found = true;
+            }
+        }
+        if (found) {
+            resumeNext5(API_TYPE_VEN);
+        }
+        usbDeviceDetachMissing(API_TYPE_VEN, present);
+        stage = USB_STAGE_CHANGE;
+        ret = getVenDeviceChange5(onDevUsbVenChange5, NULL);
+    }
+    if (ret) {
+        usbBackendError(true, stage, ret);
+    }
+}
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+static void onDevUsbAttach5(ios_ret_t ret, usr_t vcount) {
+    uint8_t stage = USB_STAGE_ATTACH;
+    if (ret == 0) {
+        dev_usb_hid_failures = 0;
+        transportStats(API_TYPE_HIDV5)->device_changes++;
+        uint32_t vid_pid;
+        uint16_t vid, pid;
+        usb_input_device_t *device;
+        const usb_device_driver_t *driver;
+        bool found = false;
+        uint32_t present = 0;
+        for (int i = 0; i < DEV_USB_HID5_DEVICE_CHANGE_SIZE && i < (ios_ret_t)vcount; i++) {
+            uint32_t device_id = dev_usb_hid5_devices[i].id;
+            present |= usbDevicePresent(API_TYPE_HIDV5, device_id);
+            vid_pid = dev_usb_hid5_devices[i].vid_pid;
+            vid = (vid_pid >> 16) & 0xFFFF;
+            pid = vid_pid & 0xFFFF;
+            printf_v("       Found device hid v5 %04x %04x!\r\n", vid_pid, device_id);
+            driver = NULL;
+            for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
+                if (usb_device_drivers[i]->probe(vid, pid)) {
+                    driver = usb_device_drivers[i];
+                    break;
+                }
+            }
+            if (driver != NULL) {
+                device = usbDeviceClaim(vid, pid, API_TYPE_HIDV5, device_id);
+                if (device) {
+                    present |= 1u << usbDeviceIndex(device);
+                    printf_v("Found!\r\n");
+                    device->driver = driver;
+                    device->waiting = true;
+                    device->host_fd = dev_usb_hid_fd;
+                    found = true;
+                }
+            }
+        }
+        if (found) {
+            resumeNext5(API_TYPE_HIDV5);
+        }
+        usbDeviceDetachMissing(API_TYPE_HIDV5, present);
+        stage = USB_STAGE_CHANGE;
+        ret = getDeviceChange5(onDevUsbChange5, NULL);
+    }
+    if (ret) {
+        usbBackendError(false, stage, ret);
+    }
+}
+#endif
+
+#ifdef SUPPORT_DEV_USB_VEN
+static void onDevUsbVenResume5(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    printf_v("resume %d %02x\r\n", ret, device->dev_id);
+    if (ret == 0) {
+        device->waiting = false;
+        ret = sendVenParams5(onDevUsbVenParams5, device);
+    }
+    if (ret) {
+        usbDeviceError(device, USB_STAGE_RESUME, ret);
+        resumeDone5(API_TYPE_VEN);
+    }
 }
 #endif
-
-static void onError(void) {
-    IOS_CloseAsync(dev_usb_ven_fd, callbackIgnore, NULL);
-    dev_usb_ven_fd = -1;
-    IOS_CloseAsync(dev_usb_hid_fd, callbackIgnore, NULL);
-    dev_usb_hid_fd = -1;
+#ifdef SUPPORT_DEV_USB_HID5
+static void onDevUsbResume5(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    if (ret == 0) {
+        device->waiting = false;
+        ret = sendParams5(onDevUsbParams5, device);
+    }
+    if (ret) {
+        usbDeviceError(device, USB_STAGE_RESUME, ret);
+        resumeDone5(API_TYPE_HIDV5);
+    }
 }
+#endif
 
-static uint32_t dev_oh0_buffer[0x180] IOS_ALIGN;
-static void onDevGetDesc2(ios_ret_t ret, usr_t user) {
+#ifdef SUPPORT_DEV_USB_VEN
+static void onHidV5Desc(ios_ret_t ret, usr_t user) {
     usb_input_device_t *device = (usb_input_device_t *)user;
-    uint16_t size = __builtin_bswap16(dev_oh0_buffer[0]);
-    printf_v("Desc size2: %02x\r\n", size);
-    uint8_t *desc = (uint8_t *)dev_oh0_buffer;
-    uint8_t *end = desc + size;
-    while (desc < end) {
-        uint8_t bLength = desc[0];
-        uint8_t bDescriptorType = desc[1];
-        printf_v("Len: %01x\r\n", bLength);
-        printf_v("Type: %01x\r\n", bDescriptorType);
-        if (bDescriptorType == USB_DT_INTERFACE) {
-            usb_interfacedesc *intf = (usb_interfacedesc *)desc;
-            printf_v("Class: %02x %02x %02x\r\n", intf->bInterfaceClass, intf->bInterfaceSubClass, intf->bInterfaceProtocol);
-            if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x01) {
-                printf_v("Found Xbox 360 Wired Controller!\r\n");
-                desc += bLength;
-                // Xbox desc directly follows interface desc
-                xboxiddesc *idf = (xboxiddesc *)desc;
-                printf_v("Subtype: %02x\r\n", idf->subtype);
-                device->endpoint_address_in = idf->bEndpointAddressIn;
-                device->endpoint_address_out = idf->bEndpointAddressOut;
-                device->max_packet_len_in = idf->bMaxDataSizeIn;
-                device->max_packet_len_out = idf->bMaxDataSizeOut;
-                device->sub_type = idf->subtype;
-                device->type = XINPUT_TYPE_WIRED;
-                // We found what we are looking for
+    printf_v("v5 desc %d, ", ret);
+    if (ret > 0) {
+        uint16_t size = __builtin_bswap16(dev_oh0_buffer[0]);
+        printf_v("Desc size2: %02x\r\n", size);
+        uint8_t *desc = (uint8_t *)dev_oh0_buffer;
+        uint8_t *end = desc + (size < ret ? size : ret);
+#ifdef SUPPORT_USB_MIDI
+        bool midi = false;
+#endif
+        while (desc < end) {
+            uint8_t bLength = desc[0];
+            uint8_t bDescriptorType = desc[1];
+            printf_v("Len: %01x\r\n", bLength);
+            printf_v("Type: %01x\r\n", bDescriptorType);
+            if (bLength == 0) {
                 break;
             }
-            if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x81) {
-                printf_v("Found Xbox 360 Wireless receiver!\r\n");
-                desc += bLength;
-                bLength = desc[0];
-                bDescriptorType = desc[1];
-                // Skip over 0x22 descriptor
-                desc += bLength;
-                uint8_t endpoints = intf->bNumEndpoints;
-                while (endpoints--) {
-                    usb_endpointdesc *desc_ep = (usb_endpointdesc *)desc;
-                    if (desc_ep->bEndpointAddress & 0x80) {
-                        device->endpoint_address_in = desc_ep->bEndpointAddress;
-                        device->max_packet_len_in = __builtin_bswap16(desc_ep->wMaxPacketSize);
+            if (bDescriptorType == USB_DT_INTERFACE) {
+                usb_interfacedesc *intf = (usb_interfacedesc *)desc;
+                printf_v("Class: %02x %02x %02x\r\n", intf->bInterfaceClass, intf->bInterfaceSubClass, intf->bInterfaceProtocol);
+#ifdef SUPPORT_XINPUT
+                if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x01) {
+                    printf_v("Found Xbox 360 Wired Controller descriptor!\r\n");
+                    desc += bLength;
+                    // Xbox desc directly follows interface desc
+                    xboxiddesc *idf = (xboxiddesc *)desc;
+                    printf_v("Subtype: %02x\r\n", idf->subtype);
+                    device->endpoint_address_in = idf->bEndpointAddressIn;
+                    device->endpoint_address_out = idf->bEndpointAddressOut;
+                    device->max_packet_len_in = idf->bMaxDataSizeIn;
+                    device->max_packet_len_out = idf->bMaxDataSizeOut;
+                    device->sub_type = idf->subtype;
+                    usbDeviceInit(device);
+                    // We found what we are looking for
+                    break;
+                }
+#endif
+#ifdef SUPPORT_USB_MIDI
+                // The event endpoints follow the MIDI streaming interface,
+                // after its class specific descriptors
+                midi = intf->bInterfaceClass == USB_CLASS_AUDIO && intf->bInterfaceSubClass == USB_SUBCLASS_AUDIO_MIDISTREAMING;
+#endif
+            }
+#ifdef SUPPORT_USB_MIDI
+            if (bDescriptorType == USB_DT_ENDPOINT && midi) {
+                usb_endpointdesc *endp = (usb_endpointdesc *)desc;
+                if ((endp->bmAttributes & USB_ENDPOINT_TYPE_MASK) == USB_ENDPOINT_BULK) {
+                    if (endp->bEndpointAddress & USB_ENDPOINT_IN) {
+                        device->endpoint_address_in = endp->bEndpointAddress;
+                        device->max_packet_len_in = __builtin_bswap16(endp->wMaxPacketSize);
                     } else {
-                        device->endpoint_address_out = desc_ep->bEndpointAddress;
-                        device->max_packet_len_out = __builtin_bswap16(desc_ep->wMaxPacketSize);
+                        device->endpoint_address_out = endp->bEndpointAddress;
+                        device->max_packet_len_out = __builtin_bswap16(endp->wMaxPacketSize);
                     }
-                    desc += desc_ep->bLength;
                 }
-                device->type = XINPUT_TYPE_WIRELESS;
-                // We found what we are looking for
-                break;
-            }
-        }
-        desc += bLength;
-    }
-    if (device->type != 0) {
-        if (device->driver->init(device) >= 0) {
-            printf_v("init done!\r\n");
-            // If it initialised, look for the next free slot
-            int lowest_free_slot = 0;
-            for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                usb_input_device_t *device2 = &fake_devices[i];
-                if (device2->valid) {
-                    lowest_free_slot = device2->wiimote + 1;
+                // A kit has nothing to be told, the IN endpoint is all it needs
+                if (device->endpoint_address_in) {
+                    printf_v("Found USB-MIDI endpoint %02x, size %04d\r\n", device->endpoint_address_in, device->max_packet_len_in);
+                    device->driver = &midi_drum_usb_device_driver;
+                    usbDeviceInit(device);
                     break;
                 }
             }
-            printf_v("slot: %d\r\n", lowest_free_slot);
-            device->wiimote = lowest_free_slot;
-            device->valid = true;
+#endif
+            desc += bLength;
         }
     }
+    if (ret < 0) {
+        usbDeviceError(device, USB_STAGE_DESCRIPTOR, ret);
+    }
+    if (device->attaching) {
+        usbDeviceAbandon(device);
+    }
+    resumeDone5(API_TYPE_VEN);
 }
-static void onDevGetDesc1(ios_ret_t ret, usr_t user) {
-    printf_v("Get Desc ret: %d\r\n", ret);
+static void onDevUsbVenParams5(ios_ret_t ret, usr_t user) {
     usb_input_device_t *device = (usb_input_device_t *)user;
-    uint16_t size = __builtin_bswap16(dev_oh0_buffer[0]);
-    printf_v("Desc size1: %02x\r\n", size);
-    usb_oh0_ctrl_transfer_async(device, 0b10000000, 0x06, USB_DT_CONFIG << 8, 0, size, dev_oh0_buffer, onDevGetDesc2);
-}
-
-static void onDevOpenUsbv0(ios_fd_t fd, usr_t usr) {
-    printf_v("USB FD: %02x\r\n", fd);
-    usb_input_device_t *device = (usb_input_device_t *)usr;
-    const usb_device_driver_t *driver = &xbox_controller_usb_device_driver;
-    device->host_fd = fd;
-    device->driver = driver;
-    device->api_type = API_TYPE_OH0;
-    usb_oh0_ctrl_transfer_async(device, 0b10000000, 0x06, USB_DT_CONFIG << 8, 0, 4, dev_oh0_buffer, onDevGetDesc1);
-}
-/*============================================================================*/
-/* Start of USB callback chain. Each method calls another as a callback after an
- * IOS command. */
-/*============================================================================*/
-static ios_fd_t usb_fd;
-static uint8_t num_descr __attribute__((aligned(32))) = 1;
-static uint8_t iclass __attribute__((aligned(32))) = 0xFF;
-static uint8_t cntdevs __attribute__((aligned(32))) = 0;
-static void onUsbV0DevList(ios_ret_t ret, usr_t user) {
-    IOS_CloseAsync(usb_fd, callbackIgnore, NULL);
-    usb_fd = -1;
-    const usb_device_driver_t *driver;
-    printf_v("Devices: %d\r\n", cntdevs);
-    while (cntdevs--) {
-        uint16_t vid = (uint16_t)(dev_oh0_devices[cntdevs * 2 + 1] >> 16);
-        uint16_t pid = (uint16_t)dev_oh0_devices[cntdevs * 2 + 1];
-
-        usb_input_device_t *device;
-        printf_v("Found device oh0 %04x %04x!\r\n", vid, pid);
-
-        driver = NULL;
-        for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
-            if (usb_device_drivers[i]->probe(vid, pid)) {
-                driver = usb_device_drivers[i];
-                break;
-            }
+    printf_v("params %d %d %02x\r\n", ret, usbDeviceIndex(device), device->dev_id);
+    if (ret == 0) {
+        usb_configurationdesc *dev = (usb_configurationdesc *)(dev_usb_ven_buffer + 18);
+        usb_interfacedesc *intf = (usb_interfacedesc *)(dev_usb_ven_buffer + 21);
+        usb_endpointdesc *endp = (usb_endpointdesc *)(dev_usb_ven_buffer + 24);
+        printf_v("id: %02x\r\n", intf->bInterfaceNumber);
+        printf_v("len: %02x\r\n", dev->wTotalLength);
+        printf_v("class: %02x %02x %02x\r\n", intf->bInterfaceClass, intf->bInterfaceSubClass, intf->bInterfaceProtocol);
+        device->type = 0;
+        // Set for devices whose endpoints are only found in the full
+        // configuration descriptor, onHidV5Desc inits those
+        bool needs_config = false;
+#ifdef SUPPORT_XINPUT
+        if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x01) {
+            printf_v("Found Xbox 360 Wired Controller!\r\n");
+            device->type = XINPUT_TYPE_WIRED;
+            device->driver = &xbox_controller_usb_device_driver;
+            needs_config = true;
+        } else if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x81) {
+            printf_v("Found Xbox 360 Wireless receiver!\r\n");
+            device->driver = &xbox_controller_usb_device_driver;
+            device->type = XINPUT_TYPE_WIRELESS;
         }
-        // If this is HID based, then we dont want to handle it via oh0
-        if (driver != NULL && driver->hid) {
-            continue;
+#endif
+#ifdef SUPPORT_GIP
+        if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x47 && intf->bInterfaceProtocol == 0xD0) {
+            printf_v("Found Xbox One controller!\r\n");
+            device->driver = &xbox_one_usb_device_driver;
         }
-        for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-            device = &fake_devices[i];
-            if (device->valid || device->real)
-                continue;
-            break;
+#endif
+#ifdef SUPPORT_USB_MIDI
+        // The first interface is usually audio control, MIDI streaming follows it
+        if (intf->bInterfaceClass == USB_CLASS_AUDIO) {
+            printf_v("Found USB audio device!\r\n");
+            needs_config = true;
         }
-        if (!device->valid && !device->real) {
-            char devicepath[23];
-            printf_v("VID: %04x, PID: %04x\r\n", vid, pid);
-            snprintf_v(devicepath, sizeof(devicepath), "/dev/usb/oh0/%x/%x", vid, pid);
-            printf_v("Dev path: %s\r\n", devicepath);
+#endif
 
-            printf_v("OpenAsync Dev: %d\r\n", IOS_OpenAsync(devicepath, 0, onDevOpenUsbv0, device));
+        if (needs_config) {
+            uint16_t length = dev->wTotalLength < sizeof(dev_oh0_buffer) ? dev->wTotalLength : sizeof(dev_oh0_buffer);
+            ret = usb_hid_v5_ctrl_transfer_async(device, 0b10000000, 0x06, USB_DT_CONFIG << 8, 0, length, dev_oh0_buffer, onHidV5Desc);
+            if (ret >= 0) {
+                // dev_oh0_buffer is busy until onHidV5Desc, which moves on
+                return;
+            }
+            usbDeviceError(device, USB_STAGE_DESCRIPTOR, ret);
+            usbDeviceAbandon(device);
+        } else if (device->driver != NULL) {
+            for (int i = 0; i < intf->bNumEndpoints; i++) {
+                printf_v("Endpoint: %02x\r\n", endp->bEndpointAddress);
+                int in = (endp->bEndpointAddress & USB_ENDPOINT_IN);
+                if (in) {
+                    device->max_packet_len_in = endp->wMaxPacketSize;
+                    device->endpoint_address_in = endp->bEndpointAddress;
+                    printf_v("Found in endpoint %02x, size %04d\r\n", device->endpoint_address_in, device->max_packet_len_in);
+                } else {
+                    device->max_packet_len_out = endp->wMaxPacketSize;
+                    device->endpoint_address_out = endp->bEndpointAddress;
+                    printf_v("Found out endpoint %02x, size %04d\r\n", device->endpoint_address_out, device->max_packet_len_out);
+                }
+                if (device->endpoint_address_in && device->endpoint_address_out) {
+                    break;
+                }
+                endp = (usb_endpointdesc *)(((uint8_t *)endp) + ((endp->bLength + 3) & ~3));
+            }
+            usbDeviceInit(device);
+        } else {
+            usbDeviceAbandon(device);
         }
+        /* 0-7 are already correct :) */
+        dev_usb_ven_buffer[8] = 0;
+        dev_usb_ven_buffer[9] = 0;
+        dev_usb_ven_buffer[10] = 0;
+        dev_usb_ven_buffer[11] = 0;
+        dev_usb_ven_buffer[12] = 0;
+        dev_usb_ven_buffer[13] = 0;
+        dev_usb_ven_buffer[14] = 0;
+        dev_usb_ven_buffer[15] = 0;
+        dev_usb_ven_buffer[16] = device->dev_id;
+        dev_usb_ven_buffer[17] = 0;
+        dev_usb_ven_buffer[18] = 0;
+        dev_usb_ven_buffer[19] = 0;
+        dev_usb_ven_buffer[20] = 0;
+        dev_usb_ven_buffer[21] = 0;
+        dev_usb_ven_buffer[22] = 0;
+        dev_usb_ven_buffer[23] = 0;
+        dev_usb_ven_buffer[24] = 0;
+        dev_usb_ven_buffer[25] = 0;
+        dev_usb_ven_buffer[26] = 0;
+        dev_usb_ven_buffer[27] = 0;
+        dev_usb_ven_buffer[28] = 0;
+        dev_usb_ven_buffer[29] = 0;
+        dev_usb_ven_buffer[30] = 0;
+        dev_usb_ven_buffer[31] = 0;
+    } else {
+        usbDeviceError(device, USB_STAGE_PARAMS, ret);
+    }
+    resumeDone5(API_TYPE_VEN);
+}
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+static void onDevUsbParams5(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    if (ret == 0) {
+        /* 0-7 are already correct :) */
+        dev_usb_hid5_buffer[8] = 0;
+        dev_usb_hid5_buffer[9] = 0;
+        dev_usb_hid5_buffer[10] = 0;
+        dev_usb_hid5_buffer[11] = 0;
+        dev_usb_hid5_buffer[12] = 0;
+        dev_usb_hid5_buffer[13] = 0;
+        dev_usb_hid5_buffer[14] = 0;
+        dev_usb_hid5_buffer[15] = 0;
+        dev_usb_hid5_buffer[16] = device->dev_id;
+        dev_usb_hid5_buffer[17] = 0;
+        dev_usb_hid5_buffer[18] = 0;
+        dev_usb_hid5_buffer[19] = 0;
+        dev_usb_hid5_buffer[20] = 0;
+        dev_usb_hid5_buffer[21] = 0;
+        dev_usb_hid5_buffer[22] = 0;
+        dev_usb_hid5_buffer[23] = 0;
+        dev_usb_hid5_buffer[24] = 0;
+        dev_usb_hid5_buffer[25] = 0;
+        dev_usb_hid5_buffer[26] = 0;
+        dev_usb_hid5_buffer[27] = 0;
+        dev_usb_hid5_buffer[28] = 0;
+        dev_usb_hid5_buffer[29] = 0;
+        dev_usb_hid5_buffer[30] = 0;
+        dev_usb_hid5_buffer[31] = 0;
+        usbDeviceInit(device);
+    } else {
+        usbDeviceError(device, USB_STAGE_PARAMS, ret);
     }
+    resumeDone5(API_TYPE_HIDV5);
 }
+#endif
 
-static void onDevOpenUsb(ios_fd_t fd, usr_t unused) {
-    static ioctlv vectors[4];
-    vectors[0].data = &num_descr;
-    vectors[0].len = 1;
-    vectors[1].data = &iclass;
-    vectors[1].len = 1;
-    vectors[2].data = &cntdevs;
-    vectors[2].len = 1;
-    vectors[3].data = dev_oh0_devices;
-    vectors[3].len = num_descr << 3;
-    usb_fd = fd;
-    IOS_IoctlvAsync(fd, USBV0_IOCTL_GETDEVLIST, 2, 2, vectors, onUsbV0DevList, NULL);
+int usb_device_driver_issue_ctrl_transfer(usb_input_device_t *device, uint8_t requesttype,
+                                          uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length) {
+#ifdef SUPPORT_DEV_USB_HID5
+    if (device->api_type == API_TYPE_HIDV5 || device->api_type == API_TYPE_VEN) {
+        return usb_hid_v5_ctrl_transfer(device, requesttype, request, value, index, length, data);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_HID4
+    if (device->api_type == API_TYPE_HIDV4) {
+        return usb_hid_v4_ctrl_transfer(device, requesttype, request, value, index, length, data);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_OH0
+    if (device->api_type == API_TYPE_OH0) {
+        return usb_oh0_ctrl_transfer(device, requesttype, request, value, index, length, data);
+    }
+#endif
+    return -1;
 }
+int usb_device_driver_issue_intr_transfer(usb_input_device_t *device, bool out, void *data, uint16_t length) {
+#ifdef SUPPORT_DEV_USB_HID5
 
-static void onDevOpen(ios_fd_t fd, usr_t unused) {
-    int ret;
-    (void)unused;
-    printf_v("    hid dev opened %d\r\n", fd);
-    dev_usb_hid_fd = fd;
-    if (fd >= 0)
-        ret =
-#if defined(SUPPORT_DEV_USB_HID4)
-            checkVersion4(onDevGetVersion4, NULL);
-#elif defined(SUPPORT_DEV_USB_HID5)
-            checkVersion5(onDevGetVersion5, NULL);
-#else
-            -1;
+    if (device->api_type == API_TYPE_HIDV5) {
+        return usb_hid_v5_intr_transfer(device, out, length, data);
+    }
 #endif
-    else
-        ret = fd;
-    if (ret) {
-        printf_v("    ... error %d\r\n", fd);
-        error = ret;
-        errorMethod = 1;
+#ifdef SUPPORT_DEV_USB_VEN
+
+    if (device->api_type == API_TYPE_VEN) {
+        return usb_ven_v5_intr_transfer(device, out, length, data);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_OH0
+
+    if (device->api_type == API_TYPE_OH0) {
+        return usb_oh0_intr_transfer(device, out, length, data);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_HID4
+    if (device->api_type == API_TYPE_HIDV4) {
+        return usb_hid_v4_intr_transfer(device, out, length, data);
     }
+#endif
+    return -1;
 }
 
-static void callbackIgnore(ios_ret_t ret, usr_t unused) {
-    (void)unused;
-    (void)ret;
+/* Transfers completing into onDevUsbPoll are counted, so a detach knows how
+ * many completions still belong to the device that went away. The count goes
+ * up first as the completion can land before the ioctl returns. */
+static int usb_device_driver_issued(usb_input_device_t *device, bool out, int ret, uint32_t isr) {
+    usb_transport_stats_t *transport = transportStats(device->api_type);
+    transport->transfers++;
+    if (out) {
+        transport->writes++;
+        deviceStats(device)->writes++;
+    }
+    if (ret < 0) {
+        device->transfers_pending--;
+        transport->failed_submits++;
+    }
+    OSRestoreInterrupts(isr);
+    return ret;
 }
 
+int usb_device_driver_issue_ctrl_transfer_async(usb_input_device_t *device, uint8_t requesttype,
+                                                uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length) {
+    bool out = !(requesttype & USB_ENDPOINT_IN);
+    uint32_t isr = OSDisableInterrupts();
+    device->transfers_pending++;
+#ifdef SUPPORT_DEV_USB_HID5
+    if (device->api_type == API_TYPE_HIDV5 || device->api_type == API_TYPE_VEN) {
+        return usb_device_driver_issued(device, out, usb_hid_v5_ctrl_transfer_async(device, requesttype, request, value, index, length, data, onDevUsbPoll), isr);
+    }
+#endif
 #ifdef SUPPORT_DEV_USB_HID4
-static void onDevGetVersion4(ios_ret_t ret, usr_t unused) {
-    (void)unused;
-    printf_v("    onDevGetVersion4 %d\r\n", ret);
-    if (ret == DEV_USB_HID4_VERSION) {
-#ifdef HAVE_VERSION
-        version = 4;
-        printf_v("    Found hidv4\r\n");
+    if (device->api_type == API_TYPE_HIDV4) {
+        return usb_device_driver_issued(device, out, usb_hid_v4_ctrl_transfer_async(device, requesttype, request, value, index, length, data, onDevUsbPoll), isr);
+    }
 #endif
-
-        printf_v("Opening oh0: %d\r\n", IOS_OpenAsync(DEV_USB_OH0_PATH, 0, onDevOpenUsb, NULL));
-        ret = getDeviceChange4(onDevUsbChange4, NULL);
-    } else {
+#ifdef SUPPORT_DEV_USB_OH0
+    if (device->api_type == API_TYPE_OH0) {
+        return usb_device_driver_issued(device, out, usb_oh0_ctrl_transfer_async(device, requesttype, request, value, index, length, data, onDevUsbPoll), isr);
+    }
+#endif
+    return usb_device_driver_issued(device, out, -1, isr);
+}
+int usb_device_driver_issue_intr_transfer_async(usb_input_device_t *device, bool out, void *data, uint16_t length) {
+    uint32_t isr = OSDisableInterrupts();
+    device->transfers_pending++;
 #ifdef SUPPORT_DEV_USB_HID5
-        ret = checkVersion5(onDevGetVersion5, NULL);
+    if (device->api_type == API_TYPE_HIDV5) {
+        return usb_device_driver_issued(device, out, usb_hid_v5_intr_transfer_async(device, out, length, data), isr);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_VEN
+
+    if (device->api_type == API_TYPE_VEN) {
+        return usb_device_driver_issued(device, out, usb_ven_v5_intr_transfer_async(device, out, length, data), isr);
+    }
 #endif
+#ifdef SUPPORT_DEV_USB_OH0
+
+    if (device->api_type == API_TYPE_OH0) {
+        return usb_device_driver_issued(device, out, usb_oh0_intr_transfer_async(device, out, length, data), isr);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 2;
-        onError();
+#endif
+#ifdef SUPPORT_DEV_USB_HID4
+    if (device->api_type == API_TYPE_HIDV4) {
+        return usb_device_driver_issued(device, out, usb_hid_v4_intr_transfer_async(device, out, length, data), isr);
+    }
+#endif
+    return usb_device_driver_issued(device, out, -1, isr);
+}
+/* Bulk endpoints are only reached through ven or oh0, HID devices have none */
+int usb_device_driver_issue_bulk_transfer_async(usb_input_device_t *device, bool out, void *data, uint16_t length) {
+    uint32_t isr = OSDisableInterrupts();
+    device->transfers_pending++;
+#ifdef SUPPORT_DEV_USB_VEN
+    if (device->api_type == API_TYPE_VEN) {
+        return usb_device_driver_issued(device, out, usb_ven_v5_bulk_transfer_async(device, out, length, data), isr);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_OH0
+    if (device->api_type == API_TYPE_OH0) {
+        return usb_device_driver_issued(device, out, usb_oh0_bulk_transfer_async(device, out, length, data), isr);
     }
+#endif
+    return usb_device_driver_issued(device, out, -1, isr);
 }
+/*============================================================================*/
+/* Transfer watchdog */
+/*============================================================================*/
+
+#ifndef SUPPORT_DEV_USB_HID5
+static uint32_t dev_usb_watchdog_buffer[DEV_USB_WATCHDOG_BUFFER_SIZE] IOS_ALIGN;
 #endif
+/* Only one device is recovered at a time, as they share the scratch buffer. */
+static usb_input_device_t *watchdog_device;
 
+static void onWatchdogCancel(ios_ret_t ret, usr_t user);
 #ifdef SUPPORT_DEV_USB_HID5
-static void onDevOpenVen(ios_fd_t fd, usr_t usr) {
-    printf_v("Opened ven: %d\r\n", fd);
-    dev_usb_ven_fd = fd;
-    getVenDeviceChange5(onDevUsbVenChange5, NULL);
+static void onWatchdogSuspend(ios_ret_t ret, usr_t user);
+#endif
+
+static int watchdogRearm(usb_input_device_t *device) {
+    uint16_t length = device->max_packet_len_in;
+    if (length == 0 || length > sizeof(device->usb_async_resp)) {
+        length = sizeof(device->usb_async_resp);
+    }
+    return usb_device_driver_issue_intr_transfer_async(device, false, device->usb_async_resp, length);
 }
-static void onDevGetVersion5(ios_ret_t ret, usr_t unused) {
-    (void)unused;
-    if (ret == 0 && dev_usb_hid5_buffer[0] == DEV_USB_HID5_VERSION) {
-#ifdef HAVE_VERSION
-        version = 5;
-        printf_v("    Found hidv5\r\n");
 
+static int watchdogCancel(usb_input_device_t *device) {
+#ifdef SUPPORT_DEV_USB_HID5
+    if (usbWatchdogBuffer() < 0) {
+        return -1;
+    }
 #endif
-        printf_v("Opening ven: %d\r\n", IOS_OpenAsync(DEV_USB_VEN_PATH, 0, onDevOpenVen, NULL));
-        ret = getDeviceChange5(onDevUsbChange5, NULL);
-    } else if (ret == 0) {
-        ret = dev_usb_hid5_buffer[0];
+    memset(dev_usb_watchdog_buffer, 0, DEV_USB_WATCHDOG_BUFFER_SIZE * sizeof(uint32_t));
+    dev_usb_watchdog_buffer[0] = device->dev_id;
+#ifdef SUPPORT_DEV_USB_HID4
+    if (device->api_type == API_TYPE_HIDV4) {
+        dev_usb_watchdog_buffer[1] = device->endpoint_address_in << 24;
+        return IOS_IoctlAsync(device->host_fd, USBV4_IOCTL_CANCELINTERRUPT,
+                              dev_usb_watchdog_buffer, 8, NULL, 0,
+                              onWatchdogCancel, device);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 3;
-        onError();
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+    if (device->api_type == API_TYPE_HIDV5 || device->api_type == API_TYPE_VEN) {
+        // hid numbers its endpoints (1 is interrupt in), ven takes the address
+        uint8_t endpoint = device->api_type == API_TYPE_HIDV5 ? 1 : device->endpoint_address_in;
+        dev_usb_watchdog_buffer[2] = endpoint << 24;
+        return IOS_IoctlAsync(device->host_fd, USBV5_IOCTL_CANCELENDPOINT,
+                              dev_usb_watchdog_buffer, 0x20, NULL, 0,
+                              onWatchdogCancel, device);
     }
-}
 #endif
+    return -1;
+}
 
+static int watchdogReset(usb_input_device_t *device) {
 #ifdef SUPPORT_DEV_USB_HID4
-static void onDevUsbChange4(ios_ret_t ret, usr_t unused) {
-    printf_v("onDevUsbChange4 %d\r\n", ret);
-    if (ret >= 0) {
-        usb_input_device_t *device;
-        const usb_device_driver_t *driver;
-        uint16_t packet_size_in = 128;
-        uint16_t packet_size_out = 128;
-        uint8_t endpoint_address_in = 0;
-        uint8_t endpoint_address_out = 0;
-        uint32_t vid_pid;
-        uint16_t vid, pid;
-
-        for (int i = 0; i < DEV_USB_HID4_DEVICE_CHANGE_SIZE && dev_usb_hid4_devices[i] < sizeof(dev_usb_hid4_devices); i += dev_usb_hid4_devices[i] / 4) {
-            uint32_t device_id = dev_usb_hid4_devices[i + 1];
-            vid_pid = dev_usb_hid4_devices[i + 4];
-            vid = (vid_pid >> 16) & 0xFFFF;
-            pid = vid_pid & 0xFFFF;
-            printf_v("       Found device v4 %04x %04x!\r\n", vid_pid, device_id);
-            driver = NULL;
-            for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
-                if (usb_device_drivers[i]->probe(vid, pid)) {
-                    driver = usb_device_drivers[i];
-                    break;
-                }
-            }
-            if (driver != NULL) {
-                for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                    device = &fake_devices[i];
-                    if (device->dev_id == device_id && device->api_type == API_TYPE_HIDV4) {
-                        break;
-                    }
-                    if (device->valid || device->real)
-                        continue;
-                    break;
-                }
-                if (!device->valid && !device->real) {
-                    endpoint_address_in = 0;
-                    endpoint_address_out = 0;
-                    uint32_t total_len = dev_usb_hid4_devices[i] / 4;
-                    int j = 2;
-                    bool is_hid = false;
-                    while (j < total_len) {
-                        uint8_t len = (dev_usb_hid4_devices[i + j] >> 24) & 0xFF;
-                        uint8_t type = (dev_usb_hid4_devices[i + j] >> 16) & 0xFF;
-                        printf_v("Found desc: %02x %02x\r\n", type, len);
-                        if (type == USB_DT_ENDPOINT && is_hid) {
-                            uint8_t addr = (dev_usb_hid4_devices[i + j] >> 8) & 0xFF;
-                            int in = (addr & USB_ENDPOINT_IN);
-                            if (in) {
-                                packet_size_in = (dev_usb_hid4_devices[i + j + 1] >> 16) & 0xFFFF;
-                                endpoint_address_in = addr;
-                                printf_v("Found in endpoint %02x, size %04d\r\n", endpoint_address_in, packet_size_in);
-                            } else {
-                                packet_size_out = (dev_usb_hid4_devices[i + j + 1] >> 16) & 0xFFFF;
-                                endpoint_address_out = addr;
-                                printf_v("Found out endpoint %02x, size %04d\r\n", endpoint_address_out, packet_size_out);
-                            }
-                            if (endpoint_address_in && endpoint_address_out) {
-                                break;
-                            }
-                        }
-                        if (type == USB_DT_INTERFACE) {
-                            uint8_t class = (dev_usb_hid4_devices[i + j + 1] >> 16) & 0xFF;
-                            uint8_t subclass = (dev_usb_hid4_devices[i + j + 1] >> 8) & 0xFF;
-                            uint8_t protocol = (dev_usb_hid4_devices[i + j + 1]) & 0xFF;
-                            printf_v("Class: %02x, Subclass: %02x, Protocol: %02x\r\n", class, subclass, protocol);
-                            is_hid = class == USB_CLASS_HID;
-                        }
-                        j += (len / 4) + 1;
-                    }
+    if (device->api_type == API_TYPE_OH0) {
+        // Like every other oh0 request, an ioctlv, just with no vectors
+        return IOS_IoctlvAsync(device->host_fd, USBV0_IOCTL_RESETDEVICE, 0, 0, NULL,
+                               onWatchdogCancel, device);
+    }
+    /* /dev/usb/hid v4 has no way to reset a device, so just try again. */
+    if (device->api_type == API_TYPE_HIDV4) {
+        return watchdogCancel(device);
+    }
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+    if (device->api_type == API_TYPE_HIDV5 || device->api_type == API_TYPE_VEN) {
+        /* Suspending and resuming the device is as close to a reset as v5 gets */
+        if (usbWatchdogBuffer() < 0) {
+            return -1;
+        }
+        memset(dev_usb_watchdog_buffer, 0, DEV_USB_WATCHDOG_BUFFER_SIZE * sizeof(uint32_t));
+        dev_usb_watchdog_buffer[0] = device->dev_id;
+        return IOS_IoctlAsync(device->host_fd, USBV5_IOCTL_SUSPEND_RESUME,
+                              dev_usb_watchdog_buffer, 0x20, NULL, 0,
+                              onWatchdogSuspend, device);
+    }
+#endif
+    return -1;
+}
 
-                    device->endpoint_address_in = endpoint_address_in;
-                    device->endpoint_address_out = endpoint_address_out;
-                    device->max_packet_len_in = packet_size_in;
-                    device->max_packet_len_out = packet_size_out;
-                    device->api_type = API_TYPE_HIDV4;
-                    device->host_fd = dev_usb_hid_fd;
-                    printf_v("Found!\r\n");
-                    device->dev_id = device_id;
-                    device->driver = driver;
+/* A reset after a failed transfer was the device's last chance */
+static void onWatchdogError(usb_input_device_t *device, int ret) {
+    // Cancels for a device that was detached are expected to fail
+    if (!device->valid) {
+        return;
+    }
+    usbDeviceError(device, USB_STAGE_WATCHDOG, ret);
+    if (device->watchdog_stage == WATCHDOG_FAILED) {
+        usbDeviceDetach(device);
+    }
+}
 
-                    if (device->driver->init(device) >= 0) {
-                        printf_v("init done!\r\n");
-                        // If it initialised, look for the next free slot
-                        int lowest_free_slot = 0;
-                        for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                            usb_input_device_t *device2 = &fake_devices[i];
-                            if (device2->valid) {
-                                lowest_free_slot = device2->wiimote + 1;
-                                break;
-                            }
-                        }
-                        printf_v("slot: %d\r\n", lowest_free_slot);
-                        device->wiimote = lowest_free_slot;
-                        device->valid = true;
-                    }
-                }
-                break;
-            }
-        }
-        ret = getDeviceChange4(onDevUsbChange4, NULL);
+#ifdef SUPPORT_DEV_USB_HID5
+static void onWatchdogSuspend(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    if (ret >= 0) {
+        dev_usb_watchdog_buffer[2] = 1;
+        ret = IOS_IoctlAsync(device->host_fd, USBV5_IOCTL_SUSPEND_RESUME,
+                             dev_usb_watchdog_buffer, 0x20, NULL, 0,
+                             onWatchdogCancel, device);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 5;
-        onError();
+    if (ret < 0) {
+        watchdog_device = NULL;
+        onWatchdogError(device, ret);
     }
 }
 #endif
 
-#ifdef SUPPORT_DEV_USB_HID5
-static void onDevUsbVenChange5(ios_ret_t ret, usr_t unused) {
-    if (ret >= 0) {
-        ret = sendVenAttach5(onDevUsbVenAttach5, (usr_t)ret);
+static void onWatchdogCancel(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    printf_v("Watchdog %d: %d %d\r\n", usbDeviceIndex(device), device->watchdog_stage, ret);
+    watchdog_device = NULL;
+    // If a report turned up in the meantime the driver has already re-armed
+    if (ret >= 0 && device->valid && device->watchdog_stage != WATCHDOG_IDLE) {
+        if (device->watchdog_stage == WATCHDOG_CANCELLED || device->api_type == API_TYPE_HIDV4) {
+            ret = watchdogRearm(device);
+        } else {
+            // A reset device has forgotten whatever init set up, so run it
+            // again. Every driver's init ends in a transfer that starts the
+            // reports again.
+            printf_v("Watchdog %d: init again\r\n", usbDeviceIndex(device));
+            ret = device->driver->init(device);
+        }
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 4;
-        onError();
+    if (ret < 0) {
+        onWatchdogError(device, ret);
     }
 }
-static void onDevUsbChange5(ios_ret_t ret, usr_t unused) {
-    if (ret >= 0) {
-        ret = sendAttach5(onDevUsbAttach5, (usr_t)ret);
+
+static void onDevWatchdog(usb_input_device_t *device) {
+    uint16_t interval = device->driver ? device->driver->report_interval_ms : 0;
+    if (!interval || !device->watchdog_tick || watchdog_device) {
+        return;
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 4;
-        onError();
+    uint32_t isr = OSDisableInterrupts();
+    uint32_t now = OSGetTick();
+    if (now - device->watchdog_tick < ms_to_ticks(interval * USB_WATCHDOG_INTERVALS) || watchdog_device) {
+        OSRestoreInterrupts(isr);
+        return;
     }
+    int ret = 0;
+    device->watchdog_tick = now;
+    if (device->watchdog_stage == WATCHDOG_IDLE && device->api_type != API_TYPE_OH0) {
+        device->watchdog_stage = WATCHDOG_CANCELLED;
+        device->watchdog_swallow++;
+        watchdog_device = device;
+        deviceStats(device)->rearms++;
+        ret = watchdogCancel(device);
+    } else if (device->watchdog_stage != WATCHDOG_RESET || device->api_type == API_TYPE_HIDV4) {
+        device->watchdog_stage = WATCHDOG_RESET;
+        device->watchdog_swallow++;
+        watchdog_device = device;
+        deviceStats(device)->resets++;
+        ret = watchdogReset(device);
+    }
+    // Otherwise a reset didn't help either, leave it be until it reports again
+    if (ret < 0) {
+        device->watchdog_swallow--;
+        watchdog_device = NULL;
+        usbDeviceError(device, USB_STAGE_WATCHDOG, ret);
+    }
+    OSRestoreInterrupts(isr);
 }
-#endif
 
-#ifdef SUPPORT_DEV_USB_HID5
-static void onDevUsbVenAttach5(ios_ret_t ret, usr_t vcount) {
-    if (ret == 0) {
-        uint32_t vid_pid;
-        uint16_t vid, pid;
-        usb_input_device_t *device;
-        const usb_device_driver_t *driver;
-        bool found = false;
-        for (int i = 0; i < DEV_USB_HID5_DEVICE_CHANGE_SIZE && i < (ios_ret_t)vcount; i++) {
-            uint32_t device_id = dev_usb_ven_devices[i].id;
-            vid_pid = dev_usb_ven_devices[i].vid_pid;
-            vid = (vid_pid >> 16) & 0xFFFF;
-            pid = vid_pid & 0xFFFF;
-            printf_v("       Found device v5 %04x %04x!\r\n", vid_pid, device_id);
-            driver = NULL;
-            for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
-                if (usb_device_drivers[i]->probe(vid, pid)) {
-                    driver = usb_device_drivers[i];
-                    break;
-                }
-            }
-            // If this is HID based, then we dont want to handle it via /dev/usb/ven
-            if (driver != NULL && driver->hid) {
-                continue;
-            }
-            for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                device = &fake_devices[i];
-                if (device->dev_id == device_id && device->api_type == API_TYPE_VEN) {
-                    break;
-                }
-                if (device->valid || device->real || device->waiting)
-                    continue;
-                break;
-            }
-            if (!device->valid && !device->real) {
-                printf_v("Found!\r\n");
-                device->dev_id = device_id;
-                device->driver = driver;
-                device->waiting = true;
-                device->api_type = API_TYPE_VEN;
-                device->host_fd = dev_usb_ven_fd;
-                if (!found) {
-                    ret = sendVenResume5(onDevUsbVenResume5, device);
-                    found = true;
-                }
-            }
+/*============================================================================*/
+/* Device teardown */
+/*============================================================================*/
+
+/* Tears down a device that was unplugged or whose transfers started failing.
+ * Both can happen for the same unplug, only the first call does anything. */
+static void usbDeviceDetach(usb_input_device_t *device) {
+    uint32_t isr = OSDisableInterrupts();
+    bool was_valid = device->valid;
+    if (!was_valid && !device->attaching) {
+        OSRestoreInterrupts(isr);
+        return;
+    }
+    printf_v("Detach %d %x\r\n", usbDeviceIndex(device), device->dev_id);
+    deviceStats(device)->valid = false;
+    device->valid = false;
+    device->attaching = false;
+    device->waiting = false;
+#ifdef USB_AGGREGATION
+    aggregateDetach(device);
+#endif
+    if (was_valid && device->driver && device->driver->disconnect) {
+        device->driver->disconnect(device);
+    }
+    // Whatever is still in flight completes into onDevUsbPoll for a device
+    // that is gone. The context isn't handed to another device until then.
+    device->transfers_stale = device->transfers_pending;
+    device->watchdog_swallow = 0;
+    device->watchdog_stage = WATCHDOG_IDLE;
+    device->watchdog_tick = 0;
+    if (device->transfers_pending && !watchdog_device && device->api_type != API_TYPE_OH0) {
+        watchdog_device = device;
+        if (watchdogCancel(device) < 0) {
+            watchdog_device = NULL;
         }
-        ret = getVenDeviceChange5(onDevUsbVenChange5, NULL);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 5;
-        onError();
+#ifdef SUPPORT_DEV_USB_HID4
+    // oh0 devices have an fd of their own, closing it cancels their transfers
+    if (device->api_type == API_TYPE_OH0 && device->host_fd >= 0) {
+        IOS_CloseAsync(device->host_fd, callbackIgnore, NULL);
+    }
+#endif
+    device->host_fd = -1;
+    device->dev_id = 0;
+#ifdef SUPPORT_DEV_USB_HID5
+    usbDeviceMessage5Free(device);
+#endif
+    device->led_state = 0;
+    device->rumble_on = false;
+    device->last_rumble_on = false;
+    device->euphoria_led = false;
+    device->last_euphoria_led = false;
+    device->report_deferred = false;
+    // Accessories and devices on standby have no channel to give up
+    if (usbDeviceBound(device)) {
+        bool taken = false;
+#ifdef USB_STANDBY
+        taken = was_valid && standbyTakeover(device->wiimote);
+#endif
+        if (!was_valid) {
+            slotAbandon(device->wiimote);
+        } else if (!taken) {
+            // The game is told once the reservation runs out
+            slotRelease(device);
+        }
     }
+    OSRestoreInterrupts(isr);
 }
-static void onDevUsbAttach5(ios_ret_t ret, usr_t vcount) {
-    if (ret == 0) {
-        uint32_t vid_pid;
-        uint16_t vid, pid;
-        usb_input_device_t *device;
-        const usb_device_driver_t *driver;
-        bool found = false;
-        for (int i = 0; i < DEV_USB_HID5_DEVICE_CHANGE_SIZE && i < (ios_ret_t)vcount; i++) {
-            uint32_t device_id = dev_usb_hid5_devices[i].id;
-            vid_pid = dev_usb_hid5_devices[i].vid_pid;
-            vid = (vid_pid >> 16) & 0xFFFF;
-            pid = vid_pid & 0xFFFF;
-            printf_v("       Found device hid v5 %04x %04x!\r\n", vid_pid, device_id);
-            driver = NULL;
-            for (int i = 0; i < ARRAY_SIZE(usb_device_drivers); i++) {
-                if (usb_device_drivers[i]->probe(vid, pid)) {
-                    driver = usb_device_drivers[i];
-                    break;
-                }
-            }
-            if (driver != NULL) {
-                for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                    device = &fake_devices[i];
-                    if (device->dev_id == device_id && device->api_type == API_TYPE_HIDV5) {
-                        break;
-                    }
-                    if (device->valid || device->real || device->waiting)
-                        continue;
-                    break;
-                }
-                if (!device->valid && !device->real) {
-                    printf_v("Found!\r\n");
-                    device->dev_id = device_id;
-                    device->driver = driver;
-                    device->waiting = true;
-                    device->api_type = API_TYPE_HIDV5;
-                    device->host_fd = dev_usb_hid_fd;
-                    if (!found) {
-                        ret = sendResume5(onDevUsbResume5, device);
-                        found = true;
-                    }
-                }
-            }
+
+/* Detaches the devices on one backend that a device change no longer lists. */
+static void usbDeviceDetachMissing(uint8_t api_type, uint32_t present) {
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if (device->api_type == api_type && !(present & (1u << i))) {
+            usbDeviceDetach(device);
         }
-        ret = getDeviceChange5(onDevUsbChange5, NULL);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 5;
-        onError();
+}
+
+/*============================================================================*/
+/* Error recovery */
+/*============================================================================*/
+
+#define USB_RECOVER_NONE 0
+#define USB_RECOVER_RETRY 1
+#define USB_RECOVER_REENUMERATE 2
+#define USB_RECOVER_RESET_DEVICE 3
+
+/* What is done about an error, by where it happened. On a backend, retrying
+ * asks for the device change again and re-enumerating closes and reopens the
+ * fd; nothing left to try closes it. A device that is still attaching gives its
+ * slot back whatever the policy, as it will be offered again if it is still
+ * plugged in. */
+static const uint8_t usb_stage_recovery[USB_STAGE__NUM] = {
+    [USB_STAGE_OPEN] = USB_RECOVER_REENUMERATE,
+    // The IOS doesn't have the interface, asking again won't change that
+    [USB_STAGE_VERSION] = USB_RECOVER_NONE,
+    [USB_STAGE_CHANGE] = USB_RECOVER_RETRY,
+    [USB_STAGE_ATTACH] = USB_RECOVER_RETRY,
+    [USB_STAGE_RESUME] = USB_RECOVER_RESET_DEVICE,
+    [USB_STAGE_PARAMS] = USB_RECOVER_RESET_DEVICE,
+    [USB_STAGE_DESCRIPTOR] = USB_RECOVER_RESET_DEVICE,
+    [USB_STAGE_POLL] = USB_RECOVER_RESET_DEVICE,
+    // The watchdog is recovery already
+    [USB_STAGE_WATCHDOG] = USB_RECOVER_NONE,
+    [USB_STAGE_INIT] = USB_RECOVER_RESET_DEVICE,
+};
+
+static void usbErrorRecord(usb_error_ring_t *ring, uint8_t stage, int ret) {
+    uint32_t isr = OSDisableInterrupts();
+    usb_error_t *entry = &ring->entries[ring->head];
+    entry->ret = ret;
+    entry->stage = stage;
+    entry->tick = OSGetTick();
+    ring->head = (ring->head + 1) % USB_ERROR_RING_SIZE;
+    if (ring->count != 0xFFFF) {
+        ring->count++;
     }
+    OSRestoreInterrupts(isr);
 }
-#endif
 
-#ifdef SUPPORT_DEV_USB_HID5
-static void onDevUsbVenResume5(ios_ret_t ret, usr_t user) {
-    usb_input_device_t *device = (usb_input_device_t *)user;
-    printf_v("resume %d %02x\r\n", ret, device->dev_id);
-    if (ret == 0) {
-        device->waiting = false;
-        ret = sendVenParams5(onDevUsbVenParams5, device);
+/* A device whose transfer failed gets one reset, through the watchdog, to come
+ * back with. If that was already tried, or can't be sent, it is detached. */
+static void usbDeviceReset(usb_input_device_t *device) {
+    uint32_t isr = OSDisableInterrupts();
+    int ret = -1;
+    if (device->watchdog_stage != WATCHDOG_FAILED && !watchdog_device) {
+        device->watchdog_stage = WATCHDOG_FAILED;
+        watchdog_device = device;
+        deviceStats(device)->resets++;
+        ret = watchdogReset(device);
+        if (ret < 0) {
+            watchdog_device = NULL;
+        }
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 6;
+    if (ret < 0) {
+        usbDeviceDetach(device);
     }
+    OSRestoreInterrupts(isr);
 }
-static void onDevUsbResume5(ios_ret_t ret, usr_t user) {
-    usb_input_device_t *device = (usb_input_device_t *)user;
-    if (ret == 0) {
-        device->waiting = false;
-        ret = sendParams5(onDevUsbParams5, device);
+
+/* Records an error against one device, and deals with it without touching
+ * any other. */
+static void usbDeviceError(usb_input_device_t *device, uint8_t stage, int ret) {
+    printf_v("Device error %d: stage %d, %d\r\n", usbDeviceIndex(device), stage, ret);
+    usbErrorRecord(&device->errors, stage, ret);
+    usb_device_stats_t *stats = deviceStats(device);
+    stats->errors++;
+    stats->last_error = ret;
+    stats->last_error_stage = stage;
+    if (usb_stage_recovery[stage] == USB_RECOVER_NONE) {
+        return;
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 6;
+    if (device->attaching) {
+        usbDeviceAbandon(device);
+    } else if (device->valid) {
+        usbDeviceReset(device);
     }
 }
-#endif
 
-#ifdef SUPPORT_DEV_USB_HID5
-static void onHidV5Desc(ios_ret_t ret, usr_t user) {
-    usb_input_device_t *device = (usb_input_device_t *)user;
-    printf_v("v5 desc %d, ", ret);
-    if (ret > 0) {
-        uint16_t size = __builtin_bswap16(dev_oh0_buffer[0]);
-        printf_v("Desc size2: %02x\r\n", size);
-        uint8_t *desc = (uint8_t *)dev_oh0_buffer;
-        uint8_t *end = desc + size;
-        while (desc < end) {
-            uint8_t bLength = desc[0];
-            uint8_t bDescriptorType = desc[1];
-            printf_v("Len: %01x\r\n", bLength);
-            printf_v("Type: %01x\r\n", bDescriptorType);
-            if (bDescriptorType == USB_DT_INTERFACE) {
-                usb_interfacedesc *intf = (usb_interfacedesc *)desc;
-                printf_v("Class: %02x %02x %02x\r\n", intf->bInterfaceClass, intf->bInterfaceSubClass, intf->bInterfaceProtocol);
-                if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x01) {
-                    printf_v("Found Xbox 360 Wired Controller descriptor!\r\n");
-                    desc += bLength;
-                    // Xbox desc directly follows interface desc
-                    xboxiddesc *idf = (xboxiddesc *)desc;
-                    printf_v("Subtype: %02x\r\n", idf->subtype);
-                    device->endpoint_address_in = idf->bEndpointAddressIn;
-                    device->endpoint_address_out = idf->bEndpointAddressOut;
-                    device->max_packet_len_in = idf->bMaxDataSizeIn;
-                    device->max_packet_len_out = idf->bMaxDataSizeOut;
-                    device->sub_type = idf->subtype;
-                    device->type = XINPUT_TYPE_WIRED;
-                    if (device->driver->init(device) >= 0) {
-                        printf_v("init done!\r\n");
-                        // If it initialised, look for the next free slot
-                        int lowest_free_slot = 0;
-                        for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                            usb_input_device_t *device2 = &fake_devices[i];
-                            if (device2->valid) {
-                                lowest_free_slot = device2->wiimote + 1;
-                                break;
-                            }
-                        }
-                        printf_v("slot: %d\r\n", lowest_free_slot);
-                        device->wiimote = lowest_free_slot;
-                        device->valid = true;
-                    }
-                    // We found what we are looking for
-                    break;
-                }
-            }
-            desc += bLength;
-        }
+/* Waits for the next device change on a backend */
+static int usbBackendListen(bool ven) {
+#ifdef SUPPORT_DEV_USB_VEN
+    if (ven) {
+        return getVenDeviceChange5(onDevUsbVenChange5, NULL);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 6;
+#endif
+#if defined(HAVE_VERSION)
+    if (version == 4) {
+        return getDeviceChange4(onDevUsbChange4, NULL);
     }
+    return getDeviceChange5(onDevUsbChange5, NULL);
+#elif defined(SUPPORT_DEV_USB_HID4)
+    return getDeviceChange4(onDevUsbChange4, NULL);
+#else
+    return getDeviceChange5(onDevUsbChange5, NULL);
+#endif
 }
-static void onDevUsbVenParams5(ios_ret_t ret, usr_t user) {
-    usb_input_device_t *device = (usb_input_device_t *)user;
-    printf_v("params %d %d %02x\r\n", ret, device->wiimote, device->dev_id);
-    if (ret == 0) {
-        usb_configurationdesc *dev = (usb_configurationdesc *)(dev_usb_ven_buffer + 18);
-        usb_interfacedesc *intf = (usb_interfacedesc *)(dev_usb_ven_buffer + 21);
-        usb_endpointdesc *endp = (usb_endpointdesc *)(dev_usb_ven_buffer + 24);
-        printf_v("id: %02x\r\n", intf->bInterfaceNumber);
-        printf_v("len: %02x\r\n", dev->wTotalLength);
-        printf_v("class: %02x %02x %02x\r\n", intf->bInterfaceClass, intf->bInterfaceSubClass, intf->bInterfaceProtocol);
-        device->type = 0;
-        if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x01) {
-            printf_v("Found Xbox 360 Wired Controller!\r\n");
-            device->type = XINPUT_TYPE_WIRED;
-            device->driver = &xbox_controller_usb_device_driver;
-            usb_hid_v5_ctrl_transfer_async(device, 0b10000000, 0x06, USB_DT_CONFIG << 8, 0, dev->wTotalLength, dev_oh0_buffer, onHidV5Desc);
-        } else if (intf->bInterfaceClass == 0xFF && intf->bInterfaceSubClass == 0x5D && intf->bInterfaceProtocol == 0x81) {
-            printf_v("Found Xbox 360 Wireless receiver!\r\n");
-            device->driver = &xbox_controller_usb_device_driver;
-            device->type = XINPUT_TYPE_WIRELESS;
-        }
 
-        // X360 Wired will handle endpoints and init itself later
-        if (device->driver != NULL && device->type != XINPUT_TYPE_WIRED) {
-            for (int i = 0; i < intf->bNumEndpoints; i++) {
-                printf_v("Endpoint: %02x\r\n", endp->bEndpointAddress);
-                int in = (endp->bEndpointAddress & USB_ENDPOINT_IN);
-                if (in) {
-                    device->max_packet_len_in = endp->wMaxPacketSize;
-                    device->endpoint_address_in = endp->bEndpointAddress;
-                    printf_v("Found in endpoint %02x, size %04d\r\n", device->endpoint_address_in, device->max_packet_len_in);
-                } else {
-                    device->max_packet_len_out = endp->wMaxPacketSize;
-                    device->endpoint_address_out = endp->bEndpointAddress;
-                    printf_v("Found out endpoint %02x, size %04d\r\n", device->endpoint_address_out, device->max_packet_len_out);
-                }
-                if (device->endpoint_address_in && device->endpoint_address_out) {
-                    break;
-                }
-                endp = (usb_endpointdesc *)(((uint8_t *)endp) + ((endp->bLength + 3) & ~3));
-            }
-            if (device->driver->init(device) >= 0) {
-                printf_v("init done!\r\n");
-                // If it initialised, look for the next free slot
-                int lowest_free_slot = 0;
-                for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                    usb_input_device_t *device2 = &fake_devices[i];
-                    if (device2->valid) {
-                        lowest_free_slot = device2->wiimote + 1;
-                        break;
-                    }
-                }
-                printf_v("slot: %d %x\r\n", lowest_free_slot, device->dev_id);
-                device->wiimote = lowest_free_slot;
-                device->valid = true;
-            }
-        }   
-        /* 0-7 are already correct :) */
-        dev_usb_ven_buffer[8] = 0;
-        dev_usb_ven_buffer[9] = 0;
-        dev_usb_ven_buffer[10] = 0;
-        dev_usb_ven_buffer[11] = 0;
-        dev_usb_ven_buffer[12] = 0;
-        dev_usb_ven_buffer[13] = 0;
-        dev_usb_ven_buffer[14] = 0;
-        dev_usb_ven_buffer[15] = 0;
-        dev_usb_ven_buffer[16] = device->dev_id;
-        dev_usb_ven_buffer[17] = 0;
-        dev_usb_ven_buffer[18] = 0;
-        dev_usb_ven_buffer[19] = 0;
-        dev_usb_ven_buffer[20] = 0;
-        dev_usb_ven_buffer[21] = 0;
-        dev_usb_ven_buffer[22] = 0;
-        dev_usb_ven_buffer[23] = 0;
-        dev_usb_ven_buffer[24] = 0;
-        dev_usb_ven_buffer[25] = 0;
-        dev_usb_ven_buffer[26] = 0;
-        dev_usb_ven_buffer[27] = 0;
-        dev_usb_ven_buffer[28] = 0;
-        dev_usb_ven_buffer[29] = 0;
-        dev_usb_ven_buffer[30] = 0;
-        dev_usb_ven_buffer[31] = 0;
-        for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-            device = &fake_devices[i];
-            if (device->waiting && !device->valid && device->api_type == API_TYPE_VEN) {
-                printf_v("Resuming next device\r\n");
-                ret = sendVenResume5(onDevUsbVenResume5, device);
-                break;
-            }
-        }
+/* Detaches the devices on a backend and closes its fd. oh0 devices have an fd
+ * of their own, so hid going away doesn't take them with it. */
+static void usbBackendClose(bool ven) {
+    ios_fd_t *fd = ven ? &dev_usb_ven_fd : &dev_usb_hid_fd;
+    if (ven) {
+        usbDeviceDetachMissing(API_TYPE_VEN, 0);
+    } else {
+        usbDeviceDetachMissing(API_TYPE_HIDV4, 0);
+        usbDeviceDetachMissing(API_TYPE_HIDV5, 0);
+    }
+    if (*fd >= 0) {
+        IOS_CloseAsync(*fd, callbackIgnore, NULL);
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 7;
+    *fd = -1;
+#ifdef SUPPORT_DEV_USB_HID5
+    // Whatever was being resumed went with the fd
+    resume5_in_flight[ven] = false;
+#endif
+}
+
+static void usbBackendReopen(bool ven) {
+    usbBackendClose(ven);
+    int ret = -1;
+#ifdef SUPPORT_DEV_USB_VEN
+    if (ven) {
+        ret = IOS_OpenAsync(DEV_USB_VEN_PATH, 0, onDevOpenVen, NULL);
+    } else
+#endif
+    {
+        ret = IOS_OpenAsync(DEV_USB_HID_PATH, 0, onDevOpen, NULL);
+    }
+    printf_v("Reopening %s: %d\r\n", ven ? "ven" : "hid", ret);
+    if (ret < 0) {
+        usbErrorRecord(&usb_errors, USB_STAGE_OPEN, ret);
     }
 }
-static void onDevUsbParams5(ios_ret_t ret, usr_t user) {
-    usb_input_device_t *device = (usb_input_device_t *)user;
-    if (ret == 0) {
-        /* 0-7 are already correct :) */
-        dev_usb_hid5_buffer[8] = 0;
-        dev_usb_hid5_buffer[9] = 0;
-        dev_usb_hid5_buffer[10] = 0;
-        dev_usb_hid5_buffer[11] = 0;
-        dev_usb_hid5_buffer[12] = 0;
-        dev_usb_hid5_buffer[13] = 0;
-        dev_usb_hid5_buffer[14] = 0;
-        dev_usb_hid5_buffer[15] = 0;
-        dev_usb_hid5_buffer[16] = device->dev_id;
-        dev_usb_hid5_buffer[17] = 0;
-        dev_usb_hid5_buffer[18] = 0;
-        dev_usb_hid5_buffer[19] = 0;
-        dev_usb_hid5_buffer[20] = 0;
-        dev_usb_hid5_buffer[21] = 0;
-        dev_usb_hid5_buffer[22] = 0;
-        dev_usb_hid5_buffer[23] = 0;
-        dev_usb_hid5_buffer[24] = 0;
-        dev_usb_hid5_buffer[25] = 0;
-        dev_usb_hid5_buffer[26] = 0;
-        dev_usb_hid5_buffer[27] = 0;
-        dev_usb_hid5_buffer[28] = 0;
-        dev_usb_hid5_buffer[29] = 0;
-        dev_usb_hid5_buffer[30] = 0;
-        dev_usb_hid5_buffer[31] = 0;
-        if (device->driver != NULL) {
-            if (device->driver->init(device) >= 0) {
-                printf_v("hidv5 init done!\r\n");
-                // If it initialised, look for the next free slot
-                int lowest_free_slot = 0;
-                for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-                    usb_input_device_t *device2 = &fake_devices[i];
-                    if (device2->valid) {
-                        lowest_free_slot = device2->wiimote + 1;
-                        break;
-                    }
-                }
 
-                printf_v("slot: %d %x\r\n", lowest_free_slot, device->dev_id);
-                device->wiimote = lowest_free_slot;
-                device->valid = true;
-            }
-        }
-        for (int i = 0; i < ARRAY_SIZE(fake_devices); i++) {
-            device = &fake_devices[i];
-            if (device->waiting && device->valid && device->api_type == API_TYPE_HIDV5) {
-                printf_v("Sending resume\r\n");
-                ret = sendResume5(onDevUsbResume5, device);
-                break;
-            }
+/* Records an error on a backend's fd, and recovers that backend alone. */
+static void usbBackendError(bool ven, uint8_t stage, int ret) {
+    uint8_t *failures = ven ? &dev_usb_ven_failures : &dev_usb_hid_failures;
+    uint8_t recovery = usb_stage_recovery[stage];
+    printf_v("Backend error %s: stage %d, %d\r\n", ven ? "ven" : "hid", stage, ret);
+    usbErrorRecord(&usb_errors, stage, ret);
+    (*failures)++;
+    if (recovery == USB_RECOVER_RETRY && *failures <= USB_ERROR_RETRIES && usbBackendListen(ven) >= 0) {
+        return;
+    }
+    if (recovery != USB_RECOVER_NONE && *failures <= USB_ERROR_RETRIES + USB_ERROR_REOPENS) {
+        usbBackendReopen(ven);
+        return;
+    }
+    usbBackendClose(ven);
+}
+
+/* Everything the game sees of a new sample: the auto sampling buffer, the
+ * sampling callback and the deferred connect/extension callbacks. */
+static void onDevSample(usb_input_device_t *device) {
+    if (!usbDeviceBound(device)) {
+        return;
+    }
+    wpad_channel_t *channel = &channels[device->wiimote];
+#ifdef USB_OVERLAY_REAL_WIIMOTE
+    if (isOverlay(device->wiimote)) {
+        // WPAD samples and connects the wiimote itself, all that is ours is
+        // the extension
+        if (device->state != 2 && channel->extensionCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
+            printf_v("call overlay ec: %d %d\r\n", device->extension, WPADGetStatus());
+            channel->extensionCallback(device->wiimote, device->extension);
+            device->state = 2;
         }
+        return;
     }
-    if (ret) {
-        error = ret;
-        errorMethod = 7;
+#endif
+    if (channel->autoSamplingBuffer) {
+        int autoSampleIndex = channel->autoSamplingBufferIndex;
+        int autoSampleNext = (autoSampleIndex + 1) % channel->autoSamplingBufferCount;
+        WPADData_t *nextPos = (WPADData_t *)((char *)channel->autoSamplingBuffer + autoSampleNext * WPADDataFormatSize(channel->currentFormat));
+        MyWPADRead(device->wiimote, nextPos);
+        channel->autoSamplingBufferIndex = autoSampleNext;
+    }
+    if (channel->samplingCallback != 0) {
+        channel->samplingCallback(device->wiimote);
+    }
+    if (device->state == 1 && channel->extensionCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
+        printf_v("call ec: %d %d\r\n", device->extension, WPADGetStatus());
+        channel->extensionCallback(device->wiimote, device->extension);
+        device->state = 2;
     }
+    if (device->state == 0 && channel->connectCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
+        printf_v("call sc: %d %d\r\n", device->wiimote, WPADGetStatus());
+        channel->connectCallback(device->wiimote, WPAD_STATUS_OK);
+        device->state = 1;
+    }
+}
+
+#ifdef VI_SYNCHRONISED_SAMPLING
+static void onDevLatch(usb_input_device_t *device) {
+    uint32_t isr = OSDisableInterrupts();
+    memcpy(&device->latchedData, deviceData(device), sizeof(device->latchedData));
+    device->latched = true;
+    onDevSample(device);
+    OSRestoreInterrupts(isr);
 }
 #endif
 
-int usb_device_driver_issue_ctrl_transfer(usb_input_device_t *device, uint8_t requesttype,
-                                          uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length) {
-#ifdef SUPPORT_DEV_USB_HID5
-    if (device->api_type == API_TYPE_HIDV5 || device->api_type == API_TYPE_VEN) {
-        return usb_hid_v5_ctrl_transfer(device, requesttype, request, value, index, length, data);
+/* A report has landed in usb_async_resp, has the driver translate it and
+ * hands it on to the game */
+static void onDevReport(usb_input_device_t *device) {
+    usb_device_stats_t *stats = deviceStats(device);
+    uint32_t now = OSGetTick();
+#ifdef USB_STANDBY
+    if (usbDeviceStandby(device)) {
+        // Left in usb_async_resp for standbyTick, nothing is asked of the
+        // device until then
+        if (now - device->standby_tick < ms_to_ticks(USB_STANDBY_POLL_MS)) {
+            device->report_deferred = true;
+            return;
+        }
+        device->standby_tick = now;
     }
+    device->report_deferred = false;
 #endif
-#ifdef SUPPORT_DEV_USB_HID4
-    if (device->api_type == API_TYPE_HIDV4) {
-        return usb_hid_v4_ctrl_transfer(device, requesttype, request, value, index, length, data);
+    device->watchdog_tick = now;
+    device->watchdog_stage = WATCHDOG_IDLE;
+    if (device->report_unread) {
+        stats->dropped_reports++;
     }
-    if (device->api_type == API_TYPE_OH0) {
-        return usb_oh0_ctrl_transfer(device, requesttype, request, value, index, length, data);
+    device->report_unread = true;
+    device->report_tick = now;
+    device->driver->usb_async_resp(device);
+    uint32_t cost = OSGetTick() - now;
+    stats->completions++;
+    stats->translate_ticks += cost;
+    if (cost > stats->translate_max_ticks) {
+        stats->translate_max_ticks = cost;
+    }
+#ifdef USB_AGGREGATION
+    if (device->accessory) {
+        // The game only sees this through the host's samples
+        if (device->aggregate_host != AGGREGATE_NO_HOST) {
+            aggregatePublish(&usb_devices[device->aggregate_host]);
+        }
+        return;
+    }
+    if (device->aggregate_accessories) {
+        aggregatePublish(device);
     }
 #endif
-    return -1;
+#ifdef VI_SYNCHRONISED_SAMPLING
+    if (vi_period) {
+        // Latch the first report that lands inside the window before the
+        // next retrace, the retrace itself picks up anything we missed.
+        // Later ones in the window wait for the next frame.
+        uint32_t elapsed = OSGetTick() - vi_last_tick;
+        if (!device->latched && device->valid && elapsed + us_to_ticks(VI_LATCH_OFFSET_US) >= vi_period) {
+            onDevLatch(device);
+        }
+        return;
+    }
+#endif
+    onDevSample(device);
 }
-int usb_device_driver_issue_intr_transfer(usb_input_device_t *device, bool out, void *data, uint16_t length) {
+
+static void onDevUsbPoll(ios_ret_t ret, usr_t user) {
+    usb_input_device_t *device = (usb_input_device_t *)user;
+    device->transfers_pending--;
+    if (device->transfers_stale) {
+        // Left over from before a detach, not ours to act on
+        device->transfers_stale--;
 #ifdef SUPPORT_DEV_USB_HID5
+        usbDeviceMessage5Free(device);
+#endif
+        return;
+    }
+    transportStats(device->api_type)->completions++;
+    if (ret >= 0) {
+        onDevReport(device);
+        return;
+    }
+    transportStats(device->api_type)->failed_transfers++;
+    if (device->watchdog_swallow) {
+        // This is the transfer the watchdog cancelled, it re-arms the endpoint itself
+        device->watchdog_swallow--;
+        return;
+    }
+    printf_v("Poll Error: %d\r\n", ret);
+    usbDeviceError(device, USB_STAGE_POLL, ret);
+}
 
-    if (device->api_type == API_TYPE_HIDV5) {
-        return usb_hid_v5_intr_transfer(device, out, length, data);
+#ifdef VI_SYNCHRONISED_SAMPLING
+/*============================================================================*/
+/* VI synchronised sampling */
+/*============================================================================*/
+
+static void MyVIWaitForRetrace(void) {
+    VIWaitForRetrace();
+    uint32_t now = OSGetTick();
+    uint32_t isr = OSDisableInterrupts();
+    if (vi_last_tick) {
+        uint32_t delta = now - vi_last_tick;
+        // Ignore gaps from loading screens, they aren't a frame.
+        if (delta < ms_to_ticks(50)) {
+            vi_period = vi_period ? vi_period + ((int32_t)(delta - vi_period) >> 3) : delta;
+        }
+    }
+    vi_last_tick = now;
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if (device->valid && usbDeviceBound(device) && !device->latched && vi_period) {
+            onDevLatch(device);
+        }
+        device->latched = false;
     }
+    OSRestoreInterrupts(isr);
+}
 
-    if (device->api_type == API_TYPE_VEN) {
-        return usb_ven_v5_intr_transfer(device, out, length, data);
+BSLUG_REPLACE(VIWaitForRetrace, MyVIWaitForRetrace);
+#endif
+
+#ifdef USB_NETWORK
+/*============================================================================*/
+/* Network */
+/*============================================================================*/
+
+/* Straight to IOS like USB is, rather than through the game's SO library, as
+ * not every game links it and SOStartup blocks until DHCP is done. Telemetry
+ * and the network instruments share the bring up and the fd, each has a
+ * socket of its own. */
+#define DEV_NET_KD_PATH "/dev/net/kd/request"
+#define DEV_NET_TOP_PATH "/dev/net/ip/top"
+#define DEV_NET_KD_IOCTL_STARTUP 6
+#define DEV_NET_TOP_IOCTL_BIND 2
+#define DEV_NET_TOP_IOCTL_RECVFROM 12
+#define DEV_NET_TOP_IOCTL_SENDTO 13
+#define DEV_NET_TOP_IOCTL_SOCKET 15
+#define DEV_NET_TOP_IOCTL_GET_HOST_ID 16
+#define DEV_NET_TOP_IOCTL_STARTUP 31
+#define DEV_NET_AF_INET 2
+#define DEV_NET_SOCK_DGRAM 2
+
+#define NET_OFF 0
+#define NET_STARTING 1
+#define NET_WAIT_IP 2
+#define NET_READY 3
+#define NET_FAILED 4
+
+/* How often we ask whether DHCP is done */
+#define NET_HOST_ID_MS 250
+
+/* A sockaddr_in, in the 28 bytes IOS leaves for any address */
+typedef struct {
+    uint8_t len;
+    uint8_t family;
+    uint16_t port;
+    uint8_t addr[4];
+    uint8_t zero[20];
+} net_addr_t;
+
+static uint32_t net_ioctl[8] IOS_ALIGN;
+static ios_fd_t net_kd_fd = -1;
+static ios_fd_t net_fd = -1;
+static uint8_t net_state;
+/* Only one bring up ioctl is in flight at a time */
+static bool net_busy;
+static uint32_t net_last_tick;
+
+#ifdef USB_TELEMETRY
+static void telemetryOnline(void);
+static void telemetryTick(uint32_t now);
+#endif
+#ifdef NET_INSTRUMENT
+static void netInstrumentOnline(void);
+static void netInstrumentTick(uint32_t now);
+#endif
+
+static void netFailed(const char *step, int ret) {
+    printf_v("Net %s: %d\r\n", step, ret);
+    net_state = NET_FAILED;
+    net_busy = false;
+}
+
+static void onNetHostId(ios_ret_t ret, usr_t unused) {
+    // Our address, which is 0 until DHCP is done. Asked again on the next tick.
+    net_busy = false;
+    if (ret == 0) {
+        return;
     }
+    net_state = NET_READY;
+#ifdef USB_TELEMETRY
+    telemetryOnline();
 #endif
-#ifdef SUPPORT_DEV_USB_HID4
+#ifdef NET_INSTRUMENT
+    netInstrumentOnline();
+#endif
+}
 
-    if (device->api_type == API_TYPE_OH0) {
-        return usb_oh0_intr_transfer(device, out, length, data);
+static void onNetStartup(ios_ret_t ret, usr_t unused) {
+    // Fails if the game already did it, the host id tells us if we're online
+    printf_v("Net startup: %d\r\n", ret);
+    net_state = NET_WAIT_IP;
+    net_busy = false;
+}
+
+static void onNetTopOpen(ios_fd_t fd, usr_t unused) {
+    if (fd < 0) {
+        netFailed("open", fd);
+        return;
     }
-    if (device->api_type == API_TYPE_HIDV4) {
-        return usb_hid_v4_intr_transfer(device, out, length, data);
+    net_fd = fd;
+    int ret = IOS_IoctlAsync(fd, DEV_NET_TOP_IOCTL_STARTUP, NULL, 0, NULL, 0, onNetStartup, NULL);
+    if (ret < 0) {
+        netFailed("startup", ret);
     }
-#endif
-    return -1;
 }
 
-int usb_device_driver_issue_ctrl_transfer_async(usb_input_device_t *device, uint8_t requesttype,
-                                                uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length) {
-#ifdef SUPPORT_DEV_USB_HID5
-    if (device->api_type == API_TYPE_HIDV5 || device->api_type == API_TYPE_VEN) {
-        return usb_hid_v5_ctrl_transfer_async(device, requesttype, request, value, index, length, data, onDevUsbPoll);
+static void onNetKdStartup(ios_ret_t ret, usr_t unused) {
+    IOS_CloseAsync(net_kd_fd, callbackIgnore, NULL);
+    net_kd_fd = -1;
+    ret = IOS_OpenAsync(DEV_NET_TOP_PATH, 0, onNetTopOpen, NULL);
+    if (ret < 0) {
+        netFailed("open", ret);
     }
-#endif
-#ifdef SUPPORT_DEV_USB_HID4
-    if (device->api_type == API_TYPE_HIDV4) {
-        return usb_hid_v4_ctrl_transfer_async(device, requesttype, request, value, index, length, data, onDevUsbPoll);
+}
+
+static void onNetKdOpen(ios_fd_t fd, usr_t unused) {
+    if (fd < 0) {
+        netFailed("kd", fd);
+        return;
     }
-    if (device->api_type == API_TYPE_OH0) {
-        return usb_oh0_ctrl_transfer_async(device, requesttype, request, value, index, length, data, onDevUsbPoll);
+    net_kd_fd = fd;
+    int ret = IOS_IoctlAsync(fd, DEV_NET_KD_IOCTL_STARTUP, NULL, 0, net_ioctl, 0x20, onNetKdStartup, NULL);
+    if (ret < 0) {
+        onNetKdStartup(ret, NULL);
     }
-#endif
-    return -1;
 }
-int usb_device_driver_issue_intr_transfer_async(usb_input_device_t *device, bool out, void *data, uint16_t length) {
-#ifdef SUPPORT_DEV_USB_HID5
-    if (device->api_type == API_TYPE_HIDV5) {
-        return usb_hid_v5_intr_transfer_async(device, out, length, data);
+
+static void netStart(void) {
+    if (net_state != NET_OFF) {
+        return;
+    }
+    net_state = NET_STARTING;
+    net_busy = true;
+    int ret = IOS_OpenAsync(DEV_NET_KD_PATH, 0, onNetKdOpen, NULL);
+    if (ret < 0) {
+        netFailed("kd", ret);
     }
+}
 
-    if (device->api_type == API_TYPE_VEN) {
-        return usb_ven_v5_intr_transfer_async(device, out, length, data);
+static void netTick(uint32_t now) {
+    if (net_state == NET_WAIT_IP && !net_busy && now - net_last_tick >= ms_to_ticks(NET_HOST_ID_MS)) {
+        net_last_tick = now;
+        net_busy = true;
+        int ret = IOS_IoctlAsync(net_fd, DEV_NET_TOP_IOCTL_GET_HOST_ID, NULL, 0, NULL, 0, onNetHostId, NULL);
+        if (ret < 0) {
+            netFailed("host id", ret);
+        }
+    }
+    if (net_state != NET_READY) {
+        return;
     }
+#ifdef USB_TELEMETRY
+    telemetryTick(now);
+#endif
+#ifdef NET_INSTRUMENT
+    netInstrumentTick(now);
+#endif
+}
 #endif
-#ifdef SUPPORT_DEV_USB_HID4
 
-    if (device->api_type == API_TYPE_OH0) {
-        return usb_oh0_intr_transfer_async(device, out, length, data);
+#ifdef USB_TELEMETRY
+/*============================================================================*/
+/* Telemetry */
+/*============================================================================*/
+
+static struct {
+    uint32_t socket;
+    uint32_t flags;
+    uint32_t has_addr;
+    net_addr_t addr;
+} telemetry_sendto IOS_ALIGN = {
+    .has_addr = 1,
+    .addr = {
+        .len = 8,
+        .family = DEV_NET_AF_INET,
+        .port = USB_TELEMETRY_PORT,
+        .addr = {USB_TELEMETRY_HOST},
+    },
+};
+static uint8_t telemetry_buffer[sizeof(usb_telemetry_header_t) + USB_STATS_DEVICES * sizeof(usb_telemetry_device_t)] IOS_ALIGN;
+static uint32_t telemetry_socket[3] IOS_ALIGN;
+static ioctlv telemetry_vectors[2];
+static bool telemetry_ready;
+/* Only one datagram is in flight at a time */
+static bool telemetry_busy;
+static uint16_t telemetry_sequence;
+static uint32_t telemetry_last_tick;
+/* The counters as they were in the last datagram */
+static usb_device_stats_t telemetry_last[USB_STATS_DEVICES];
+static uint16_t telemetry_latency[USB_STATS_DEVICES][USB_TELEMETRY_SAMPLES];
+static uint16_t telemetry_samples[USB_STATS_DEVICES];
+
+static void onTelemetrySent(ios_ret_t ret, usr_t unused) {
+    // A lost datagram is no reason to stop, the next one carries on
+    telemetry_busy = false;
+}
+
+static void onTelemetrySocket(ios_ret_t ret, usr_t unused) {
+    if (ret < 0) {
+        printf_v("Telemetry socket: %d\r\n", ret);
+        return;
     }
-    if (device->api_type == API_TYPE_HIDV4) {
-        return usb_hid_v4_intr_transfer_async(device, out, length, data);
+    telemetry_sendto.socket = ret;
+    telemetry_last_tick = OSGetTick();
+    telemetry_ready = true;
+}
+
+static void telemetryOnline(void) {
+    telemetry_socket[0] = DEV_NET_AF_INET;
+    telemetry_socket[1] = DEV_NET_SOCK_DGRAM;
+    telemetry_socket[2] = 0;
+    int ret = IOS_IoctlAsync(net_fd, DEV_NET_TOP_IOCTL_SOCKET, telemetry_socket, sizeof(telemetry_socket), NULL, 0, onTelemetrySocket, NULL);
+    if (ret < 0) {
+        onTelemetrySocket(ret, NULL);
+    }
+}
+
+/* Keeps the most recent samples, the caller has interrupts disabled */
+static void telemetryLatency(usb_input_device_t *device, uint32_t ticks) {
+    uint16_t *count = &telemetry_samples[usbDeviceIndex(device)];
+    uint16_t us = 0xFFFF;
+    if (ticks < ms_to_ticks(65)) {
+        us = ticks * 1000 / (OS_TIMER_CLOCK / 1000);
+    }
+    telemetry_latency[usbDeviceIndex(device)][*count % USB_TELEMETRY_SAMPLES] = us;
+    if (*count < 0xFFFF) {
+        (*count)++;
+    }
+}
+
+/* A counter's change since the last datagram. It starts again from 0 when a
+ * different device takes the context. */
+static uint16_t telemetryDelta(uint32_t now, uint32_t last) {
+    uint32_t delta = now >= last ? now - last : now;
+    return delta > 0xFFFF ? 0xFFFF : delta;
+}
+
+static void telemetryTick(uint32_t now) {
+    if (!telemetry_ready || telemetry_busy || now - telemetry_last_tick < OS_TIMER_CLOCK / USB_TELEMETRY_RATE) {
+        return;
+    }
+    usb_telemetry_header_t *header = (usb_telemetry_header_t *)telemetry_buffer;
+    usb_telemetry_device_t *out = (usb_telemetry_device_t *)(header + 1);
+    header->magic = USB_TELEMETRY_MAGIC;
+    header->version = USB_TELEMETRY_VERSION;
+    header->devices = 0;
+    header->sequence = telemetry_sequence++;
+    header->elapsed_ticks = now - telemetry_last_tick;
+    header->tick_rate = OS_TIMER_CLOCK;
+    telemetry_last_tick = now;
+    uint32_t isr = OSDisableInterrupts();
+    for (int i = 0; i < USB_STATS_DEVICES; i++) {
+        usb_device_stats_t *stats = &usb_stats.devices[i];
+        usb_device_stats_t *last = &telemetry_last[i];
+        if (!stats->attaches) {
+            continue;
+        }
+        memset(out, 0, sizeof(*out));
+        out->slot = i;
+        out->api_type = stats->api_type;
+        out->valid = stats->valid;
+        out->vid = stats->vid;
+        out->pid = stats->pid;
+        out->reports = telemetryDelta(stats->completions, last->completions);
+        out->reads = telemetryDelta(stats->game_reads, last->game_reads);
+        out->dropped_reports = telemetryDelta(stats->dropped_reports, last->dropped_reports);
+        out->stale_reads = telemetryDelta(stats->stale_reads, last->stale_reads);
+        out->errors = telemetryDelta(stats->errors, last->errors);
+        out->last_error_stage = stats->last_error_stage;
+        out->channel = stats->channel;
+        out->last_error = stats->last_error;
+        out->samples = telemetry_samples[i] < USB_TELEMETRY_SAMPLES ? telemetry_samples[i] : USB_TELEMETRY_SAMPLES;
+        memcpy(out->latency_us, telemetry_latency[i], sizeof(out->latency_us));
+        telemetry_samples[i] = 0;
+        *last = *stats;
+        header->devices++;
+        out++;
+    }
+    OSRestoreInterrupts(isr);
+    telemetry_vectors[0].data = telemetry_buffer;
+    telemetry_vectors[0].len = (uint8_t *)out - telemetry_buffer;
+    telemetry_vectors[1].data = &telemetry_sendto;
+    telemetry_vectors[1].len = sizeof(telemetry_sendto);
+    telemetry_busy = true;
+    if (IOS_IoctlvAsync(net_fd, DEV_NET_TOP_IOCTL_SENDTO, 2, 0, telemetry_vectors, onTelemetrySent, NULL) < 0) {
+        telemetry_busy = false;
     }
+}
 #endif
-    return -1;
+
+#ifdef NET_INSTRUMENT
+/*============================================================================*/
+/* Network instruments */
+/*============================================================================*/
+
+/* A sequence this far behind the last one means the sender started again,
+ * rather than that the datagram was overtaken */
+#define NET_INSTRUMENT_RESTART 0x100
+
+static struct {
+    uint32_t socket;
+    uint32_t has_addr;
+    net_addr_t addr;
+} net_instrument_bind IOS_ALIGN = {
+    .has_addr = 1,
+    .addr = {
+        .len = 8,
+        .family = DEV_NET_AF_INET,
+        .port = NET_INSTRUMENT_PORT,
+    },
+};
+/* Room for datagrams from newer senders, which only ever add to the end */
+static uint8_t net_instrument_buffer[64] IOS_ALIGN;
+static uint32_t net_instrument_recv[2] IOS_ALIGN;
+static net_addr_t net_instrument_from IOS_ALIGN;
+static uint32_t net_instrument_socket[3] IOS_ALIGN;
+static ioctlv net_instrument_vectors[3];
+static bool net_instrument_bound;
+static bool net_instrument_receiving;
+static uint32_t net_instrument_retry_tick;
+/* By id, the last datagram taken and when it came */
+static uint16_t net_instrument_sequence[NET_INSTRUMENTS];
+static uint32_t net_instrument_tick[NET_INSTRUMENTS];
+
+static void netInstrumentReceive(void);
+
+static usb_input_device_t *netInstrumentFind(uint8_t id) {
+    for (int i = 0; i < ARRAY_SIZE(usb_devices); i++) {
+        usb_input_device_t *device = &usb_devices[i];
+        if (device->valid && device->api_type == API_TYPE_NET && device->dev_id == id) {
+            return device;
+        }
+    }
+    return NULL;
 }
-static void onDevUsbPoll(ios_ret_t ret, usr_t user) {
-    usb_input_device_t *device = (usb_input_device_t *)user;
-    if (ret >= 0) {
-        device->driver->usb_async_resp(device);
-        if (device->autoSamplingBuffer) {
-            int autoSampleIndex = device->autoSamplingBufferIndex;
-            int autoSampleNext = (autoSampleIndex + 1) % device->autoSamplingBufferCount;
-            WPADData_t *nextPos = (WPADData_t *)((char *)device->autoSamplingBuffer + autoSampleNext * WPADDataFormatSize(device->currentFormat));
-            MyWPADRead(device->wiimote, nextPos);
-            device->autoSamplingBufferIndex = autoSampleNext;
-        }
-        if (device->samplingCallback != 0) {
-            device->samplingCallback(device->wiimote);
-        }
-        if (device->state == 1 && device->extensionCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
-            printf_v("call ec: %d %d\r\n", device->extension, WPADGetStatus());
-            device->extensionCallback(device->wiimote, device->extension);
-            device->state = 2;
+
+/* Hands a datagram on as a report, attaching its instrument first if it is
+ * new or has changed type. Runs from the IOS callback, as reports do. */
+static void netInstrumentPacket(int len) {
+    const struct net_instrument_packet *packet = (const void *)net_instrument_buffer;
+    if (len < sizeof(*packet) || packet->magic != NET_INSTRUMENT_MAGIC || packet->id >= NET_INSTRUMENTS) {
+        return;
+    }
+    if (packet->type < NET_INSTRUMENT_GUITAR || packet->type > NET_INSTRUMENT_TURNTABLE) {
+        return;
+    }
+    uint8_t id = packet->id;
+    usb_input_device_t *device = netInstrumentFind(id);
+    if (device && device->pid != packet->type) {
+        usbDeviceDetach(device);
+        device = NULL;
+    }
+    if (device) {
+        // Overtaken or repeated on the way
+        int16_t age = packet->sequence - net_instrument_sequence[id];
+        if (age <= 0 && age > -NET_INSTRUMENT_RESTART) {
+            return;
         }
-        if (device->state == 0 && device->connectCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
-            printf_v("call sc: %d %d\r\n", device->wiimote, WPADGetStatus());
-            device->connectCallback(device->wiimote, WPAD_STATUS_OK);
-            device->state = 1;
+    } else {
+        device = usbDeviceClaim(NET_INSTRUMENT_VID, packet->type, API_TYPE_NET, id);
+        if (!device) {
+            return;
+        }
+        transportStats(API_TYPE_NET)->device_changes++;
+        device->driver = &net_instrument_usb_device_driver;
+        usbDeviceInit(device);
+        if (!device->valid) {
+            return;
         }
     }
+    net_instrument_sequence[id] = packet->sequence;
+    net_instrument_tick[id] = OSGetTick();
+    memcpy(device->usb_async_resp, packet, sizeof(*packet));
+    onDevReport(device);
+}
+
+static void onNetInstrumentReceive(ios_ret_t ret, usr_t unused) {
+    usb_transport_stats_t *transport = transportStats(API_TYPE_NET);
+    transport->completions++;
     if (ret < 0) {
-        printf_v("Poll Error: %d\r\n", ret);
-        if (device->connectCallback && WPADGetStatus() == WPAD_STATE_SETUP) {
-            printf_v("call sc disconnect: %d %d\r\n", device->wiimote, WPADGetStatus());
-            device->connectCallback(device->wiimote, WPAD_STATUS_DISCONNECTED);
-            device->state = 1;
-        }
-        device->valid = false;
-        device->extensionCallback = NULL;
-        device->state = 0;
+        // Tried again from the tick, rather than spinning on a dead socket
+        printf_v("Net instrument recvfrom: %d\r\n", ret);
+        transport->failed_transfers++;
+        net_instrument_receiving = false;
+        return;
+    }
+    netInstrumentPacket(ret);
+    netInstrumentReceive();
+}
+
+static void netInstrumentReceive(void) {
+    net_instrument_recv[0] = net_instrument_bind.socket;
+    net_instrument_recv[1] = 0;
+    net_instrument_from.len = sizeof(net_instrument_from);
+    net_instrument_vectors[0].data = net_instrument_recv;
+    net_instrument_vectors[0].len = sizeof(net_instrument_recv);
+    net_instrument_vectors[1].data = net_instrument_buffer;
+    net_instrument_vectors[1].len = sizeof(net_instrument_buffer);
+    net_instrument_vectors[2].data = &net_instrument_from;
+    net_instrument_vectors[2].len = sizeof(net_instrument_from);
+    usb_transport_stats_t *transport = transportStats(API_TYPE_NET);
+    transport->transfers++;
+    net_instrument_receiving = true;
+    int ret = IOS_IoctlvAsync(net_fd, DEV_NET_TOP_IOCTL_RECVFROM, 1, 2, net_instrument_vectors, onNetInstrumentReceive, NULL);
+    if (ret < 0) {
+        transport->failed_submits++;
+        net_instrument_receiving = false;
+    }
+}
+
+static void onNetInstrumentBind(ios_ret_t ret, usr_t unused) {
+    if (ret < 0) {
+        printf_v("Net instrument bind: %d\r\n", ret);
+        return;
+    }
+    net_instrument_bound = true;
+    netInstrumentReceive();
+}
+
+static void onNetInstrumentSocket(ios_ret_t ret, usr_t unused) {
+    if (ret < 0) {
+        printf_v("Net instrument socket: %d\r\n", ret);
+        return;
+    }
+    net_instrument_bind.socket = ret;
+    ret = IOS_IoctlAsync(net_fd, DEV_NET_TOP_IOCTL_BIND, &net_instrument_bind, sizeof(net_instrument_bind), NULL, 0, onNetInstrumentBind, NULL);
+    if (ret < 0) {
+        onNetInstrumentBind(ret, NULL);
+    }
+}
+
+static void netInstrumentOnline(void) {
+    net_instrument_socket[0] = DEV_NET_AF_INET;
+    net_instrument_socket[1] = DEV_NET_SOCK_DGRAM;
+    net_instrument_socket[2] = 0;
+    int ret = IOS_IoctlAsync(net_fd, DEV_NET_TOP_IOCTL_SOCKET, net_instrument_socket, sizeof(net_instrument_socket), NULL, 0, onNetInstrumentSocket, NULL);
+    if (ret < 0) {
+        onNetInstrumentSocket(ret, NULL);
+    }
+}
 
-        error = ret;
-        errorMethod = 9;
+/* Instruments that went quiet are unplugged, as far as the game can tell */
+static void netInstrumentTick(uint32_t now) {
+    for (uint8_t id = 0; id < NET_INSTRUMENTS; id++) {
+        usb_input_device_t *device = netInstrumentFind(id);
+        if (device && now - net_instrument_tick[id] >= ms_to_ticks(NET_INSTRUMENT_TIMEOUT_MS)) {
+            usbDeviceDetach(device);
+        }
+    }
+    if (net_instrument_bound && !net_instrument_receiving && now - net_instrument_retry_tick >= ms_to_ticks(NET_HOST_ID_MS)) {
+        net_instrument_retry_tick = now;
+        netInstrumentReceive();
     }
 }
+#endif
@@ -1,8 +1,50 @@
 ###############################################################################
 # Source files
 
+# The device drivers to build in, by the name of their usb_device_driver_t
+# (without the _usb_device_driver). They are probed in this order. xbox_one
+# translates its input with xbox_controller's code, so needs it built in too.
+DRIVERS  ?= gh_guitar gh_drum rb_guitar rb_drum rb4_guitar rb4_drum turntable santroller xbox_controller xbox_one ds3 ds4 switch_taiko midi_drum
+# The IOS USB interfaces to support. hid4 is /dev/usb/hid v4 (IOS 57 and
+# older), hid5 is /dev/usb/hid v5 (IOS 58). Non-HID devices are reached over
+# oh0 or ven alongside them, but only when a driver needs it.
+BACKENDS ?= hid4 hid5
+# Set to 1 to also play instruments over the network, see NET_INSTRUMENT in
+# main.c. Its driver is only built in then.
+NET_INSTRUMENT ?=
+# Devices that only make sense alongside another one, like a separate star
+# power pedal, as vid:pid in hex. Each is merged into the first device with
+# the same extension instead of getting a wiimote, see aggregate_accessories in
+# main.c. Nothing is merged if this is empty.
+AGGREGATE ?=
+
+DRIVER_SRC_gh_guitar       := device_drivers/guitar_hero_guitar.c
+DRIVER_SRC_gh_drum         := device_drivers/guitar_hero_drums.c
+DRIVER_SRC_rb_guitar       := device_drivers/rock_band_guitar.c
+DRIVER_SRC_rb_drum         := device_drivers/rock_band_drums.c
+DRIVER_SRC_rb4_guitar      := device_drivers/rock_band_4_guitar.c
+DRIVER_SRC_rb4_drum        := device_drivers/rock_band_4_drums.c
+DRIVER_SRC_turntable       := device_drivers/dj_hero_turntable.c
+DRIVER_SRC_santroller      := device_drivers/santroller.c
+DRIVER_SRC_xbox_controller := device_drivers/xbox_controller.c
+DRIVER_SRC_xbox_one        := device_drivers/xbox_one_controller.c
+DRIVER_SRC_ds3             := device_drivers/sony_ds3.c
+DRIVER_SRC_ds4             := device_drivers/sony_ds4.c
+DRIVER_SRC_switch_taiko    := device_drivers/switch_taiko.c
+DRIVER_SRC_midi_drum       := device_drivers/midi_drum.c
+
+BACKEND_FLAGS_hid4 := -DSUPPORT_DEV_USB_HID4
+BACKEND_FLAGS_hid5 := -DSUPPORT_DEV_USB_HID5
+# Xbox 360 and One controllers and USB-MIDI kits aren't HID, everything else is.
+VENDOR_DRIVERS     := xbox_controller xbox_one midi_drum
+# main.c finds these itself, from their descriptors rather than the VID/PID.
+DRIVER_FLAGS_xbox_controller := -DSUPPORT_XINPUT
+DRIVER_FLAGS_xbox_one        := -DSUPPORT_GIP
+DRIVER_FLAGS_midi_drum       := -DSUPPORT_USB_MIDI
+
 # The source files to compile.
-SRC      := main.c device_drivers/dj_hero_turntable.c device_drivers/guitar_hero_drums.c device_drivers/guitar_hero_guitar.c device_drivers/santroller.c device_drivers/xbox_controller.c device_drivers/sony_ds3.c device_drivers/sony_ds4.c device_drivers/ps3_3rd_party.c device_drivers/switch_taiko.c
+SRC      := main.c device_drivers/ps3_3rd_party.c $(foreach d,$(DRIVERS),$(DRIVER_SRC_$(d))) \
+            $(if $(NET_INSTRUMENT),device_drivers/net_instrument.c)
 # Include directories
 INC_DIRS :=
 # Library directories
@@ -14,4 +56,8 @@ BIN      := bin
 # The name of the output file to generate.
 TARGET 	 := $(BIN)/$(notdir $(CURDIR)).mod
 # C compiler flags
-CFLAGS   :=
+CFLAGS   := $(foreach b,$(BACKENDS),$(BACKEND_FLAGS_$(b))) \
+            $(foreach d,$(DRIVERS),$(DRIVER_FLAGS_$(d))) \
+            $(if $(filter $(VENDOR_DRIVERS),$(DRIVERS)),-DSUPPORT_DEV_USB_VENDOR) \
+            $(if $(NET_INSTRUMENT),-DNET_INSTRUMENT) \
+            $(if $(AGGREGATE),-DUSB_AGGREGATION)
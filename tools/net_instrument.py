@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Plays an instrument on a console running a module built with NET_INSTRUMENT.
+
+Sends a datagram per state to NET_INSTRUMENT_PORT. On its own it plays a demo
+pattern, which is enough to see the instrument turn up and check its latency
+with tools/usb_telemetry.py. Bridges for real instruments on a PC send the
+same datagrams, laid out as struct net_instrument_packet in usb_hid.h.
+
+    tools/net_instrument.py --host 192.168.1.50
+    tools/net_instrument.py --host 192.168.1.50 --type drum --id 1 --rate 120
+
+The console drops the instrument after NET_INSTRUMENT_TIMEOUT_MS without a
+datagram, so stopping this unplugs it.
+"""
+
+import argparse
+import itertools
+import socket
+import struct
+import time
+
+MAGIC = 0x5553424E
+
+PACKET = struct.Struct(">IHBBIbbBb6BbbBB2x")
+
+TYPES = {"guitar": 1, "drum": 2, "turntable": 3}
+
+GREEN = 1 << 0
+RED = 1 << 1
+YELLOW = 1 << 2
+BLUE = 1 << 3
+ORANGE = 1 << 4
+PLUS = 1 << 5
+MINUS = 1 << 6
+HOME = 1 << 7
+UP = 1 << 8
+DOWN = 1 << 9
+LEFT = 1 << 10
+RIGHT = 1 << 11
+KICK = 1 << 12
+EUPHORIA = 1 << 13
+RIGHT_GREEN = 1 << 14
+RIGHT_RED = 1 << 15
+RIGHT_BLUE = 1 << 16
+
+COLOURS = [GREEN, RED, YELLOW, BLUE, ORANGE]
+
+
+class State:
+    def __init__(self):
+        self.buttons = 0
+        self.stick = [0, 0]
+        self.whammy = 0
+        self.tilt = 0
+        # By DRUM_PAD_*: green, red, yellow, blue, orange, kick
+        self.velocity = [0] * 6
+        self.platter = [0, 0]
+        self.cross_fader = 0x80
+        self.effects_dial = 0
+
+
+def pack(sequence, instrument, kind, state):
+    return PACKET.pack(MAGIC, sequence & 0xFFFF, instrument, kind, state.buttons,
+                       state.stick[0], state.stick[1], state.whammy, state.tilt,
+                       *state.velocity, state.platter[0], state.platter[1],
+                       state.cross_fader, state.effects_dial)
+
+
+def demo(kind, step):
+    """The state for one step of the demo, stepping through each colour."""
+    state = State()
+    beat = step // 8
+    held = step % 8 < 4
+    colour = beat % len(COLOURS)
+    if kind == TYPES["guitar"]:
+        if held:
+            state.buttons = COLOURS[colour] | DOWN
+        state.whammy = (step * 16) % 256
+        state.tilt = 127 if beat % 8 == 7 else 0
+    elif kind == TYPES["drum"]:
+        # A hit is only the first datagram of the beat, as it is from a pad
+        if step % 8 == 0:
+            state.buttons = COLOURS[colour]
+            state.velocity[colour] = 200
+            if beat % 2:
+                state.buttons |= KICK
+                state.velocity[5] = 200
+    elif kind == TYPES["turntable"]:
+        if held:
+            state.buttons = [GREEN, RED, BLUE][colour % 3]
+            state.buttons |= [RIGHT_GREEN, RIGHT_RED, RIGHT_BLUE][colour % 3]
+        state.platter = [4, -4] if beat % 2 else [-4, 4]
+        state.cross_fader = (step * 4) % 256
+        state.effects_dial = (step * 2) % 256
+    return state
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", required=True, help="the console's address")
+    parser.add_argument("--port", type=int, default=28401)
+    parser.add_argument("--id", type=int, default=0, choices=range(4),
+                        help="which of the console's instruments this is")
+    parser.add_argument("--type", default="guitar", choices=sorted(TYPES))
+    parser.add_argument("--rate", type=float, default=60, help="datagrams a second")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    kind = TYPES[args.type]
+    interval = 1 / args.rate
+    next_send = time.monotonic()
+    for sequence in itertools.count():
+        sock.sendto(pack(sequence, args.id, kind, demo(kind, sequence)), (args.host, args.port))
+        next_send += interval
+        time.sleep(max(0, next_send - time.monotonic()))
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,735 @@
+#!/usr/bin/env python3
+"""Checks the patterns in symbols/*.xml against game images, and shortens them.
+
+Every <data> pattern is looked for in every DOL and ELF found under the given
+paths, at word aligned addresses in every section the image loads. The report
+lists patterns that match more than once in a game, symbols whose patterns
+disagree on where they are, and patterns that match in none of the games:
+
+    tools/symbol_patterns.py ~/wii/dols
+    tools/symbol_patterns.py ~/wii/dols --out symbols.min
+
+With --out, a copy of each XML file is written with duplicate patterns and
+patterns whose games are all covered by another one left out, and each of the
+rest cut down to the shortest run of its symbol's words that still finds the
+symbol in each of its games and nothing anywhere else. Branches to other
+functions and what look like address loads are left as ?, as they change
+from game to game. Patterns that match nowhere are kept as they are, the
+games scanned are rarely all the games there are, unless --drop-dead is given.
+
+    tools/symbol_patterns.py --self-test
+
+builds synthetic DOLs with known symbols in them and checks all of the above
+against them.
+"""
+
+import argparse
+import bisect
+import os
+import random
+import re
+import struct
+import sys
+import tempfile
+import xml.etree.ElementTree as ET
+
+SYMBOLS_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "symbols")
+
+DOL_HEADER = struct.Struct(">18I18I18IIII")
+DOL_SECTIONS = 18
+
+# Registers a call may change, and those the small data areas hang off
+VOLATILE_REGS = {0} | set(range(3, 13))
+SDA_REGS = {2, 13}
+# D-form instructions that take a base register in rA: addi, the loads and stores
+D_FORM_OPS = {14} | set(range(32, 56))
+D_FORM_STORES = {36, 37, 38, 39, 44, 45, 47, 52, 53, 54, 55}
+
+RELOC_MASKS = {"b": 0xFC000003, "bc": 0xFFFF0003, "lo": 0xFFFF0000, "hi": 0xFFFF0000,
+               "ha": 0xFFFF0000, "sda21": 0xFFFF0000, "addr": 0}
+
+
+class Pattern:
+    """Bytes to match, with a mask of the bits that have to match."""
+
+    def __init__(self, value, mask):
+        self.value = bytes(value)
+        self.mask = bytes(mask)
+        self.value_int = int.from_bytes(self.value, "big")
+        self.mask_int = int.from_bytes(self.mask, "big")
+        # Whole words without a ?, by their offset in the pattern
+        self.fixed = [(i, self.value[i:i + 4]) for i in range(0, len(self) - 3, 4)
+                      if self.mask[i:i + 4] == b"\xff\xff\xff\xff"]
+
+    @classmethod
+    def parse(cls, text):
+        digits = "".join(text.split())
+        if len(digits) % 2:
+            raise ValueError("odd number of digits in %r" % text)
+        value = bytearray()
+        mask = bytearray()
+        for i in range(0, len(digits), 2):
+            v = m = 0
+            for digit in digits[i:i + 2]:
+                v <<= 4
+                m <<= 4
+                if digit != "?":
+                    v |= int(digit, 16)
+                    m |= 0xF
+            value.append(v)
+            mask.append(m)
+        return cls(value, mask)
+
+    def __len__(self):
+        return len(self.value)
+
+    def __eq__(self, other):
+        return self.value == other.value and self.mask == other.mask
+
+    def __hash__(self):
+        return hash((self.value, self.mask))
+
+    def matches(self, data):
+        return (int.from_bytes(data, "big") & self.mask_int) == self.value_int
+
+    def fixed_nibbles(self):
+        return sum(bin(m).count("1") // 4 for m in self.mask)
+
+    def words(self):
+        return (len(self) + 3) // 4
+
+    def format(self):
+        """As written in <data>, a word at a time."""
+        digits = []
+        for v, m in zip(self.value, self.mask):
+            for shift in (4, 0):
+                digits.append("%X" % ((v >> shift) & 0xF) if (m >> shift) & 0xF else "?")
+        text = "".join(digits)
+        return " ".join(text[i:i + 8] for i in range(0, len(text), 8))
+
+
+class Entry:
+    """One <symbol> element, one of possibly several for its name."""
+
+    def __init__(self, path, index, element, comments):
+        self.path = path
+        self.index = index
+        self.name = element.get("name")
+        self.attrib = dict(element.attrib)
+        self.size = int(element.get("size"), 0) if element.get("size") else None
+        self.offset = int(element.get("offset", "0"), 0)
+        data = element.find("data")
+        self.data = " ".join((data.text or "").split()) if data is not None else ""
+        self.pattern = Pattern.parse(self.data)
+        self.relocs = [dict(reloc.attrib) for reloc in element.findall("reloc")]
+        self.comments = comments
+
+    def where(self):
+        return "%s#%d" % (os.path.basename(self.path), self.index)
+
+    def key(self):
+        return (self.name, self.offset, self.pattern)
+
+
+class SymbolFile:
+    def __init__(self, path):
+        self.path = path
+        parser = ET.XMLParser(target=ET.TreeBuilder(insert_comments=True))
+        with open(path, "rb") as f:
+            root = ET.fromstring(f.read(), parser=parser)
+        self.attrib = dict(root.attrib)
+        # The comment above <symbols> says what the file is for
+        self.heading = None
+        with open(path, encoding="utf-8") as f:
+            match = re.search(r"<!--((?:(?!-->).)*)-->\s*<symbols", f.read(), re.S)
+            if match:
+                self.heading = match.group(1).strip()
+        self.entries = []
+        comments = []
+        for child in root:
+            if child.tag is ET.Comment:
+                comments.append(child.text.strip())
+            elif child.tag == "symbol":
+                self.entries.append(Entry(path, len(self.entries), child, comments))
+                comments = []
+
+
+class Image:
+    """The sections a DOL or ELF loads, with an index of their words."""
+
+    def __init__(self, path, sections):
+        self.path = path
+        self.sections = sorted((addr, data) for addr, data in sections if data)
+        self.starts = [addr for addr, _ in self.sections]
+        self.index = {}
+        for addr, data in self.sections:
+            for i in range(0, len(data) - 3, 4):
+                self.index.setdefault(data[i:i + 4], []).append(addr + i)
+
+    @classmethod
+    def load(cls, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] == b"\x7fELF":
+            return cls(path, elf_sections(data))
+        return cls(path, dol_sections(data))
+
+    def name(self):
+        return os.path.basename(self.path)
+
+    def section(self, addr):
+        i = bisect.bisect_right(self.starts, addr) - 1
+        if i < 0:
+            return None
+        start, data = self.sections[i]
+        return (start, data) if addr < start + len(data) else None
+
+    def read(self, addr, size):
+        section = self.section(addr)
+        if section is None:
+            return None
+        start, data = section
+        if addr + size > start + len(data):
+            return None
+        return data[addr - start:addr - start + size]
+
+    def find(self, pattern):
+        """Addresses where the pattern starts."""
+        if not len(pattern):
+            return []
+        if pattern.fixed:
+            # Only look where its rarest whole word is
+            offset, word = min(pattern.fixed, key=lambda fixed: len(self.index.get(fixed[1], ())))
+            hits = []
+            for addr in self.index.get(word, ()):
+                data = self.read(addr - offset, len(pattern))
+                if data is not None and pattern.matches(data):
+                    hits.append(addr - offset)
+            return hits
+        hits = []
+        for start, data in self.sections:
+            for i in range(0, len(data) - len(pattern) + 1, 4):
+                if pattern.matches(data[i:i + len(pattern)]):
+                    hits.append(start + i)
+        return hits
+
+
+def dol_sections(data):
+    fields = DOL_HEADER.unpack_from(data)
+    offsets = fields[0:DOL_SECTIONS]
+    addresses = fields[DOL_SECTIONS:2 * DOL_SECTIONS]
+    sizes = fields[2 * DOL_SECTIONS:3 * DOL_SECTIONS]
+    return [(addresses[i], data[offsets[i]:offsets[i] + sizes[i]])
+            for i in range(DOL_SECTIONS) if sizes[i]]
+
+
+def elf_sections(data):
+    if data[4] != 1 or data[5] != 2:
+        raise ValueError("not a 32 bit big endian ELF")
+    phoff, shoff = struct.unpack_from(">II", data, 0x1C)
+    phentsize, phnum, shentsize, shnum = struct.unpack_from(">HHHH", data, 0x2A)
+    sections = []
+    for i in range(phnum):
+        p_type, p_offset, p_vaddr, _, p_filesz = struct.unpack_from(">5I", data, phoff + i * phentsize)
+        if p_type == 1 and p_filesz:
+            sections.append((p_vaddr, data[p_offset:p_offset + p_filesz]))
+    if sections:
+        return sections
+    # Relocatable objects have no program headers, take what they would load
+    for i in range(shnum):
+        _, sh_type, sh_flags, sh_addr, sh_offset, sh_size = struct.unpack_from(">6I", data, shoff + i * shentsize)
+        if sh_type == 1 and sh_flags & 2 and sh_size:
+            sections.append((sh_addr, data[sh_offset:sh_offset + sh_size]))
+    return sections
+
+
+def make_dol(sections, entry=0x80004000):
+    """A DOL with the given (address, data) sections, text first."""
+    offsets = [0] * DOL_SECTIONS
+    addresses = [0] * DOL_SECTIONS
+    sizes = [0] * DOL_SECTIONS
+    body = b""
+    for i, (addr, data) in enumerate(sections):
+        offsets[i] = 0x100 + len(body)
+        addresses[i] = addr
+        sizes[i] = len(data)
+        body += data
+    header = DOL_HEADER.pack(*(offsets + addresses + sizes + [0, 0, entry]))
+    return header.ljust(0x100, b"\0") + body
+
+
+def find_images(paths):
+    images = []
+    for path in paths:
+        if os.path.isfile(path):
+            images.append(path)
+            continue
+        for root, _, files in os.walk(path):
+            for name in sorted(files):
+                if name.lower().endswith((".dol", ".elf")):
+                    images.append(os.path.join(root, name))
+    return sorted(images)
+
+
+def nibble_mask(mask):
+    """Only whole hex digits can be ? in a pattern."""
+    out = 0
+    for shift in range(0, 32, 4):
+        if (mask >> shift) & 0xF == 0xF:
+            out |= 0xF << shift
+    return out
+
+
+def relocation_masks(words, start, symbol_size, relocs):
+    """Which bits of each word to keep, given the symbol's words from offset
+    start. Relocations the XML lists are dropped, and so are calls and
+    branches out of the symbol, small data loads, and the halves of addresses
+    loaded with lis. It is a guess made reading straight through, which is
+    why differences between games are dropped as well."""
+    masks = []
+    high = set()
+    for i, word in enumerate(words):
+        offset = start + 4 * i
+        op = word >> 26
+        rd = (word >> 21) & 31
+        ra = (word >> 16) & 31
+        mask = 0xFFFFFFFF
+        if op == 18:
+            target = offset + (((word & 0x03FFFFFC) ^ 0x02000000) - 0x02000000)
+            if word & 1 or word & 2 or symbol_size is None or not 0 <= target < symbol_size:
+                mask = 0xFC000003
+            if word & 1:
+                high -= VOLATILE_REGS
+        elif op == 15 and ra == 0:
+            mask = 0xFFFF0000
+            high.add(rd)
+        elif op == 24 and rd in high:
+            mask = 0xFFFF0000
+            high.discard(ra)
+        elif op in D_FORM_OPS:
+            if ra in SDA_REGS or ra in high:
+                mask = 0xFFFF0000
+            if op not in D_FORM_STORES:
+                high.discard(rd)
+        masks.append(mask)
+    for reloc in relocs:
+        i = (int(reloc.get("offset", "0"), 0) - start) // 4
+        if 0 <= i < len(masks):
+            masks[i] &= RELOC_MASKS.get(reloc.get("type"), 0)
+    return [nibble_mask(mask) for mask in masks]
+
+
+class Analysis:
+    def __init__(self, files, images):
+        self.files = files
+        self.images = images
+        self.entries = [entry for f in files for entry in f.entries]
+        # entry -> image -> symbol addresses its pattern gives
+        self.hits = {}
+        for entry in self.entries:
+            self.hits[entry] = {}
+            for image in images:
+                found = image.find(entry.pattern)
+                if found:
+                    self.hits[entry][image] = sorted({addr - entry.offset for addr in found})
+        # (name, image) -> the address, where the patterns that found it once agree
+        self.known = {}
+        self.conflicts = {}
+        unique = {}
+        for entry in self.entries:
+            for image, addrs in self.hits[entry].items():
+                if len(addrs) == 1:
+                    unique.setdefault((entry.name, image), set()).add(addrs[0])
+        for key, addrs in unique.items():
+            if len(addrs) == 1:
+                self.known[key] = next(iter(addrs))
+            else:
+                self.conflicts[key] = sorted(addrs)
+
+    def targets(self, entry):
+        """The games where this entry finds its symbol and nothing else."""
+        out = {}
+        for image, addrs in self.hits[entry].items():
+            known = self.known.get((entry.name, image))
+            if known is not None and addrs == [known]:
+                out[image] = known
+        return out
+
+    def dead(self):
+        return [entry for entry in self.entries if not self.hits[entry]]
+
+    def ambiguous(self):
+        return [(entry, image, addrs) for entry in self.entries
+                for image, addrs in self.hits[entry].items() if len(addrs) > 1]
+
+    def plan(self):
+        """Splits the entries into those to keep and those that add nothing:
+        duplicates, and ones whose games the kept ones already cover."""
+        keep = []
+        dropped = {}
+        seen = {}
+        by_name = {}
+        for entry in self.entries:
+            if entry.key() in seen:
+                dropped[entry] = "duplicate of %s" % seen[entry.key()].where()
+                continue
+            seen[entry.key()] = entry
+            by_name.setdefault(entry.name, []).append(entry)
+        for name, entries in by_name.items():
+            live = [entry for entry in entries if self.hits[entry]]
+            # Entries that are ambiguous somewhere are kept, the games they
+            # are ambiguous in aren't covered by anything else
+            covered = set()
+            chosen = [entry for entry in live if len(self.targets(entry)) < len(self.hits[entry])]
+            for entry in chosen:
+                covered |= set(self.targets(entry))
+            rest = [entry for entry in live if entry not in chosen]
+            while rest:
+                best = max(rest, key=lambda entry: (len(set(self.targets(entry)) - covered), -self.entries.index(entry)))
+                gain = set(self.targets(best)) - covered
+                if not gain:
+                    break
+                chosen.append(best)
+                covered |= gain
+                rest.remove(best)
+            for entry in rest:
+                dropped[entry] = "covered by the other %s patterns" % name
+            keep.extend(entry for entry in entries if entry in chosen or not self.hits[entry])
+        keep.sort(key=self.entries.index)
+        return keep, dropped
+
+    def unique(self, entry, pattern, offset, targets):
+        """Does the pattern find the symbol in each target and nowhere else?"""
+        for image in self.images:
+            found = {addr - offset for addr in image.find(pattern)}
+            if image in targets:
+                if found != {targets[image]}:
+                    return False
+            elif found - {self.known.get((entry.name, image))}:
+                return False
+            elif found and (entry.name, image) not in self.known:
+                return False
+        return True
+
+    def shorten(self, entry, min_words, max_words):
+        """The shortest pattern that does what the entry's does, as (offset,
+        pattern), or None if there isn't a better one."""
+        targets = self.targets(entry)
+        if not targets:
+            return None
+        original_unique = len(targets) == len(self.hits[entry])
+        # Within the symbol, and wherever the original pattern looked, keeping
+        # to the words the original was matched on
+        start = entry.offset - (entry.offset - min(0, entry.offset) + 3) // 4 * 4
+        end = max(entry.size or 0, entry.offset + len(entry.pattern))
+        for image, addr in targets.items():
+            section_start, data = image.section(addr + entry.offset)
+            while start < section_start - addr:
+                start += 4
+            end = min(end, section_start + len(data) - addr)
+        end = start + (end - start) // 4 * 4
+        if end <= start:
+            return None
+        images = list(targets.items())
+        words = [struct.unpack(">%dI" % ((end - start) // 4), image.read(addr + start, end - start))
+                 for image, addr in images]
+        masks = relocation_masks(words[0], start, entry.size, entry.relocs)
+        for other in words[1:]:
+            masks = [mask & ~nibble_mask(a ^ b) for mask, a, b in zip(masks, words[0], other)]
+        # The original's ? stay, whoever wrote it knew why
+        for i in range(len(entry.pattern)):
+            word = (entry.offset + i - start) // 4
+            if 0 <= word < len(masks) and entry.pattern.mask[i] != 0xFF:
+                shift = 8 * (3 - (entry.offset + i - start) % 4)
+                masks[word] &= ~((~entry.pattern.mask[i] & 0xFF) << shift) & 0xFFFFFFFF
+        masks = [nibble_mask(mask) for mask in masks]
+        limit = entry.pattern.words() - 1 if original_unique else max_words
+        for length in range(min_words, min(limit, len(masks)) + 1):
+            best = None
+            for i in range(len(masks) - length + 1):
+                window = masks[i:i + length]
+                if sum(mask == 0xFFFFFFFF for mask in window) < min_words:
+                    continue
+                value = b"".join(struct.pack(">I", w & m) for w, m in zip(words[0][i:i + length], window))
+                pattern = Pattern(value, b"".join(struct.pack(">I", m) for m in window))
+                offset = start + 4 * i
+                # Words the original was made of are known to be the same
+                # across games, beyond the ones scanned
+                outside = offset < entry.offset or offset + 4 * length > entry.offset + len(entry.pattern)
+                score = (outside, -pattern.fixed_nibbles(), offset < 0, abs(offset - entry.offset))
+                if best and score >= best[0]:
+                    continue
+                if self.unique(entry, pattern, offset, targets):
+                    best = (score, offset, pattern)
+            if best:
+                return best[1], best[2]
+        return None
+
+
+def print_table(headings, rows):
+    widths = [max(len(str(row[i])) for row in [headings] + rows) for i in range(len(headings))]
+    for row in [headings] + rows:
+        print("  ".join(str(cell).rjust(width) for cell, width in zip(row, widths)))
+
+
+def report(analysis):
+    print("%d patterns for %d symbols, %d images" % (
+        len(analysis.entries), len({entry.name for entry in analysis.entries}), len(analysis.images)))
+    print()
+    rows = []
+    for name in sorted({entry.name for entry in analysis.entries}):
+        entries = [entry for entry in analysis.entries if entry.name == name]
+        found = sum((name, image) in analysis.known for image in analysis.images)
+        ambiguous = sum(1 for entry in entries for addrs in analysis.hits[entry].values() if len(addrs) > 1)
+        conflicts = sum(1 for image in analysis.images if (name, image) in analysis.conflicts)
+        dead = sum(1 for entry in entries if not analysis.hits[entry])
+        rows.append([name, len(entries), "%d/%d" % (found, len(analysis.images)), ambiguous, conflicts, dead])
+    print_table(["symbol", "patterns", "found", "ambiguous", "conflicts", "dead"], rows)
+    ambiguous = analysis.ambiguous()
+    if ambiguous:
+        print()
+        print("Matching more than once:")
+        for entry, image, addrs in ambiguous:
+            print("  %s %s in %s: %s" % (entry.where(), entry.name, image.name(),
+                                        " ".join("0x%08X" % addr for addr in addrs)))
+    if analysis.conflicts:
+        print()
+        print("Patterns that disagree:")
+        for (name, image), addrs in sorted(analysis.conflicts.items(), key=lambda item: (item[0][0], item[0][1].path)):
+            print("  %s in %s: %s" % (name, image.name(), " ".join("0x%08X" % addr for addr in addrs)))
+    dead = analysis.dead()
+    if dead:
+        print()
+        print("Matching nowhere:")
+        for entry in dead:
+            print("  %s %s: %s" % (entry.where(), entry.name, entry.pattern.format()))
+
+
+def format_offset(offset):
+    return "-0x%X" % -offset if offset < 0 else "0x%X" % offset
+
+
+def write_symbols(symbol_file, entries, patterns, path):
+    lines = ['<?xml version="1.0" encoding="UTF-8"?>']
+    if symbol_file.heading:
+        lines.append("<!-- %s -->" % symbol_file.heading)
+    attrib = "".join(' %s="%s"' % item for item in symbol_file.attrib.items())
+    lines.append("<symbols%s>" % attrib)
+    for entry in entries:
+        for comment in entry.comments:
+            lines.append("    <!-- %s -->" % comment)
+        attrib = dict(entry.attrib)
+        data = entry.data
+        if entry in patterns:
+            offset, pattern = patterns[entry]
+            attrib["offset"] = format_offset(offset)
+            data = pattern.format()
+        lines.append("    <symbol%s>" % "".join(' %s="%s"' % item for item in attrib.items()))
+        lines.append("        <data>")
+        lines.append("            %s" % data)
+        lines.append("        </data>")
+        for reloc in entry.relocs:
+            lines.append("        <reloc%s />" % "".join(' %s="%s"' % item for item in reloc.items()))
+        lines.append("    </symbol>")
+    lines.append("</symbols>")
+    with open(path, "w", encoding="utf-8") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+def minimise(analysis, out, min_words, max_words, drop_dead):
+    keep, dropped = analysis.plan()
+    if drop_dead:
+        for entry in analysis.dead():
+            dropped.setdefault(entry, "matches nowhere")
+        keep = [entry for entry in keep if entry not in dropped]
+    patterns = {}
+    rows = []
+    for entry in keep:
+        shorter = analysis.shorten(entry, min_words, max_words)
+        if shorter:
+            patterns[entry] = shorter
+            offset, pattern = shorter
+            rows.append([entry.where(), entry.name, "%d @ %s" % (entry.pattern.words(), format_offset(entry.offset)),
+                         "%d @ %s" % (pattern.words(), format_offset(offset)), pattern.format()])
+    os.makedirs(out, exist_ok=True)
+    for symbol_file in analysis.files:
+        entries = [entry for entry in keep if entry.path == symbol_file.path]
+        write_symbols(symbol_file, entries, patterns, os.path.join(out, os.path.basename(symbol_file.path)))
+    print()
+    print("Written to %s: %d of %d patterns, %d shortened" % (out, len(keep), len(analysis.entries), len(patterns)))
+    if dropped:
+        print()
+        for entry in analysis.entries:
+            if entry in dropped:
+                print("  dropped %s %s: %s" % (entry.where(), entry.name, dropped[entry]))
+    if rows:
+        print()
+        print_table(["pattern", "symbol", "words", "now", "data"], rows)
+    return keep, patterns
+
+
+def self_test():
+    """Plants known functions at random places in random code and checks that
+    the report and the minimised patterns come out as they should."""
+    rng = random.Random(1)
+
+    def words(count):
+        # Random, but nothing the relocation guesses would touch
+        return [0x7C000000 | rng.getrandbits(24) for _ in range(count)]
+
+    base = words(24)
+    functions = {
+        # The same function in every game, calling out at 0x10
+        "Common": base,
+        # Two versions, one for each half of the games
+        "OldOnly": words(16),
+        "NewOnly": words(16),
+        # Appears twice in every game, only the second copy is told apart
+        "Twice": words(12),
+    }
+    functions["Common"][4] = 0x48000001
+    # Only the copy that is the symbol has this in it
+    functions["TwiceMarked"] = list(functions["Twice"])
+    functions["TwiceMarked"][8] = 0x7F00BEEF
+    xml = """<?xml version="1.0" encoding="UTF-8"?>
+<!-- Synthetic -->
+<symbols>
+    <symbol name="Common" size="0x60" offset="0x8">
+        <data>%s</data>
+        <reloc type="b" offset="0x10" symbol="Somewhere" />
+    </symbol>
+    <symbol name="Common" size="0x60" offset="0x8">
+        <data>%s</data>
+    </symbol>
+    <symbol name="Common" size="0x60" offset="0x20">
+        <data>%s</data>
+    </symbol>
+    <!-- One pattern per version -->
+    <symbol name="Version" size="0x40" offset="0x4">
+        <data>%s</data>
+    </symbol>
+    <symbol name="Version" size="0x40" offset="0x4">
+        <data>%s</data>
+    </symbol>
+    <symbol name="Twice" size="0x30" offset="0x0">
+        <data>%s</data>
+    </symbol>
+    <symbol name="Twice" size="0x30" offset="0x10">
+        <data>%s</data>
+    </symbol>
+    <symbol name="Missing" offset="0x0">
+        <data>DEADBEEF CAFEBABE</data>
+    </symbol>
+</symbols>
+"""
+
+    def data(function, start, count):
+        return " ".join("%08X" % w for w in function[start:start + count])
+
+    pattern = data(functions["Common"], 2, 6).split()
+    pattern[2] = "????????"
+    text = xml % (" ".join(pattern), " ".join(pattern), data(functions["Common"], 8, 6),
+                  data(functions["OldOnly"], 1, 6), data(functions["NewOnly"], 1, 6),
+                  data(functions["Twice"], 0, 4), data(functions["TwiceMarked"], 4, 6))
+    with tempfile.TemporaryDirectory() as tmp:
+        symbols = os.path.join(tmp, "synthetic.xml")
+        with open(symbols, "w") as f:
+            f.write(text)
+        expected = {}
+        for game in range(6):
+            code = words(0x4000)
+            places = rng.sample(range(64, 0x4000 - 64, 64), 4)
+            layout = [("Common", functions["Common"]),
+                      ("Version", functions["OldOnly"] if game % 2 else functions["NewOnly"]),
+                      ("Twice", functions["TwiceMarked"]), (None, functions["Twice"])]
+            for (name, function), place in zip(layout, places):
+                function = list(function)
+                if name == "Common":
+                    # Each game calls somewhere else
+                    function[4] = 0x48000001 | rng.getrandbits(20) << 2
+                code[place:place + len(function)] = function
+                if name:
+                    expected[(name, game)] = 0x80004000 + 4 * place
+            path = os.path.join(tmp, "game%d.dol" % game)
+            with open(path, "wb") as f:
+                f.write(make_dol([(0x80004000, struct.pack(">%dI" % len(code), *code)),
+                                  (0x80200000, b"\0" * 0x100)]))
+        images = [Image.load(path) for path in find_images([tmp])]
+        analysis = Analysis([SymbolFile(symbols)], images)
+        names = {entry.where(): entry for entry in analysis.entries}
+        failures = []
+
+        def check(condition, message):
+            if not condition:
+                failures.append(message)
+
+        for (name, game), addr in expected.items():
+            check(analysis.known.get((name, images[game])) == addr, "%s not found in game %d" % (name, game))
+        check([entry.name for entry in analysis.dead()] == ["Missing"], "dead patterns: %s" % analysis.dead())
+        check({(entry.where(), len(addrs)) for entry, _, addrs in analysis.ambiguous()} == {("synthetic.xml#5", 2)},
+              "ambiguous patterns: %s" % analysis.ambiguous())
+        check(not analysis.conflicts, "conflicts: %s" % analysis.conflicts)
+        keep, dropped = analysis.plan()
+        check("duplicate" in dropped.get(names["synthetic.xml#1"], ""), "duplicate kept")
+        check("covered" in dropped.get(names["synthetic.xml#2"], ""), "covered pattern kept")
+        check(names["synthetic.xml#3"] in keep and names["synthetic.xml#4"] in keep, "version patterns dropped")
+        check(names["synthetic.xml#7"] in keep, "dead pattern dropped")
+        out = os.path.join(tmp, "out")
+        with open(os.devnull, "w") as devnull:
+            stdout, sys.stdout = sys.stdout, devnull
+            try:
+                minimise(analysis, out, 2, 8, False)
+            finally:
+                sys.stdout = stdout
+        shortened = Analysis([SymbolFile(os.path.join(out, "synthetic.xml"))], images)
+        for (name, game), addr in expected.items():
+            check(shortened.known.get((name, images[game])) == addr, "%s lost in game %d" % (name, game))
+        check(not shortened.ambiguous() or all(entry.name == "Twice" for entry, _, _ in shortened.ambiguous()),
+              "minimising made patterns ambiguous")
+        for entry in shortened.entries:
+            if entry.name == "Common":
+                check(entry.pattern.words() < 6, "Common not shortened")
+                word = 4 - entry.offset // 4
+                check(not 0 <= word < entry.pattern.words() or entry.pattern.mask[4 * word:4 * word + 4] != b"\xff" * 4,
+                      "call left in Common's pattern")
+        check(sum(entry.name == "Missing" for entry in shortened.entries) == 1, "dead pattern not kept")
+    for failure in failures:
+        print("FAIL: %s" % failure)
+    print("self test %s" % ("failed" if failures else "passed"))
+    return not failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("images", nargs="*", help="DOL and ELF files, or directories of them")
+    parser.add_argument("--symbols", default=SYMBOLS_DIR, help="directory of symbol XML files (default: symbols/)")
+    parser.add_argument("--out", help="write minimised XML files to this directory")
+    parser.add_argument("--min-words", type=int, default=2,
+                        help="whole words a shortened pattern keeps at least (default 2)")
+    parser.add_argument("--max-words", type=int, default=8,
+                        help="longest pattern tried in place of an ambiguous one (default 8)")
+    parser.add_argument("--drop-dead", action="store_true", help="leave out patterns that match nowhere")
+    parser.add_argument("--self-test", action="store_true", help="check the tool against synthetic DOLs")
+    args = parser.parse_args()
+
+    if args.self_test:
+        sys.exit(0 if self_test() else 1)
+    paths = find_images(args.images)
+    if not paths:
+        parser.error("no DOL or ELF images given")
+    files = [SymbolFile(os.path.join(args.symbols, name))
+             for name in sorted(os.listdir(args.symbols)) if name.endswith(".xml")]
+    images = []
+    for path in paths:
+        try:
+            images.append(Image.load(path))
+        except (ValueError, struct.error) as e:
+            sys.stderr.write("%s: %s\n" % (path, e))
+    analysis = Analysis(files, images)
+    report(analysis)
+    if args.out:
+        minimise(analysis, args.out, args.min_words, args.max_words, args.drop_dead)
+
+
+if __name__ == "__main__":
+    main()
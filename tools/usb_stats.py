@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Prints the module's usb_stats from Dolphin memory dumps.
+
+Dump MEM1 (or MEM2, depending on where the loader put the module) from
+Dolphin's debugger, then run:
+
+    tools/usb_stats.py mem1.raw
+    tools/usb_stats.py before.raw after.raw
+
+With one dump, rates are since the module started. With two, they are for the
+time between the dumps. The module is stripped, so usb_stats is found by its
+magic rather than its symbol.
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = 0x55534253
+VERSION = 3
+
+HEADER = struct.Struct(">IHHIII")
+TRANSPORT = struct.Struct(">6I")
+DEVICE = struct.Struct(">HHBBBBi12I")
+TRANSPORTS = 6
+DEVICES = 32
+NO_CHANNEL = 0xFF
+SIZE = HEADER.size + TRANSPORTS * TRANSPORT.size + DEVICES * DEVICE.size
+
+API_TYPES = ["-", "VEN", "OH0", "HIDV4", "HIDV5", "NET"]
+STAGES = ["-", "OPEN", "VERSION", "-", "CHANGE", "ATTACH", "RESUME", "PARAMS",
+          "DESCRIPTOR", "POLL", "WATCHDOG", "INIT"]
+
+TRANSPORT_FIELDS = ["transfers", "writes", "completions", "failed_submits",
+                    "failed_transfers", "device_changes"]
+DEVICE_FIELDS = ["vid", "pid", "api_type", "valid", "last_error_stage",
+                 "channel", "last_error", "attaches", "completions", "writes",
+                 "translate_ticks", "translate_max_ticks", "game_reads",
+                 "stale_reads", "partial_reads", "dropped_reports", "rearms",
+                 "resets", "errors"]
+
+
+def find(data, base):
+    """Returns the offset of the stats in a dump, or None."""
+    needle = struct.pack(">I", MAGIC)
+    offset = data.find(needle)
+    while offset >= 0:
+        if offset % 4 == 0 and offset + SIZE <= len(data):
+            _, version, size = HEADER.unpack_from(data, offset)[:3]
+            if version == VERSION and size == SIZE:
+                return offset
+            if size >= HEADER.size and version > VERSION:
+                sys.stderr.write("0x%08x: version %d is newer than this tool\n"
+                                 % (base + offset, version))
+        offset = data.find(needle, offset + 4)
+    return None
+
+
+def parse(path, base):
+    with open(path, "rb") as f:
+        data = f.read()
+    offset = find(data, base)
+    if offset is None:
+        sys.exit("%s: no usb_stats found" % path)
+    stats = {"address": base + offset}
+    (_, _, _, stats["tick_rate"], stats["start_tick"],
+     stats["tick"]) = HEADER.unpack_from(data, offset)
+    offset += HEADER.size
+    stats["transports"] = []
+    for _ in range(TRANSPORTS):
+        stats["transports"].append(dict(zip(TRANSPORT_FIELDS, TRANSPORT.unpack_from(data, offset))))
+        offset += TRANSPORT.size
+    stats["devices"] = []
+    for _ in range(DEVICES):
+        stats["devices"].append(dict(zip(DEVICE_FIELDS, DEVICE.unpack_from(data, offset))))
+        offset += DEVICE.size
+    return stats
+
+
+def delta(after, before, fields):
+    """The counters in after less those in before, wrapping as uint32 does."""
+    out = dict(after)
+    for field in fields:
+        out[field] = (after[field] - before[field]) & 0xFFFFFFFF
+    return out
+
+
+def rate(count, seconds):
+    return "%.1f" % (count / seconds) if seconds > 0 else "-"
+
+
+def name(table, index):
+    return table[index] if index < len(table) else str(index)
+
+
+def print_table(headings, rows):
+    widths = [max(len(str(row[i])) for row in [headings] + rows) for i in range(len(headings))]
+    for row in [headings] + rows:
+        print("  ".join(str(cell).rjust(width) for cell, width in zip(row, widths)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", nargs="+", help="one dump, or two taken a while apart")
+    parser.add_argument("--base", type=lambda x: int(x, 0), default=0x80000000,
+                        help="address of the dump's first byte (default 0x80000000)")
+    args = parser.parse_args()
+    if len(args.dump) > 2:
+        parser.error("at most two dumps")
+
+    stats = parse(args.dump[-1], args.base)
+    transports = stats["transports"]
+    devices = stats["devices"]
+    start = stats["start_tick"]
+    if len(args.dump) == 2:
+        before = parse(args.dump[0], args.base)
+        start = before["tick"]
+        transports = [delta(a, b, TRANSPORT_FIELDS) for a, b in zip(transports, before["transports"])]
+        counters = [field for field in DEVICE_FIELDS[7:] if field != "translate_max_ticks"]
+        # A device that changed in between has restarted its counters
+        devices = [delta(a, b, counters) if (a["vid"], a["pid"]) == (b["vid"], b["pid"]) else a
+                   for a, b in zip(devices, before["devices"])]
+    seconds = ((stats["tick"] - start) & 0xFFFFFFFF) / stats["tick_rate"] if stats["tick_rate"] else 0
+    ticks_per_us = stats["tick_rate"] / 1e6
+
+    print("usb_stats at 0x%08x, %.1f s" % (stats["address"], seconds))
+    print()
+    rows = []
+    for api_type, transport in enumerate(transports):
+        if api_type == 0 or not (transport["transfers"] or transport["device_changes"]):
+            continue
+        rows.append([API_TYPES[api_type], transport["transfers"], rate(transport["completions"], seconds),
+                     transport["writes"], transport["failed_submits"], transport["failed_transfers"],
+                     transport["device_changes"]])
+    print_table(["transport", "transfers", "done/s", "writes", "failed", "errored", "changes"], rows)
+    print()
+    rows = []
+    for index, device in enumerate(devices):
+        if not stats["devices"][index]["attaches"]:
+            continue
+        completions = device["completions"]
+        average = device["translate_ticks"] / completions / ticks_per_us if completions and ticks_per_us else 0
+        maximum = device["translate_max_ticks"] / ticks_per_us if ticks_per_us else 0
+        error = "-"
+        if device["last_error_stage"]:
+            error = "%d@%s" % (device["last_error"], name(STAGES, device["last_error_stage"]))
+        channel = "-" if device["channel"] == NO_CHANNEL else device["channel"]
+        rows.append([index, channel, "%04x:%04x" % (device["vid"], device["pid"]), name(API_TYPES, device["api_type"]),
+                     "yes" if device["valid"] else "no", rate(completions, seconds),
+                     "%.1f" % average, "%.1f" % maximum, device["writes"], device["game_reads"],
+                     device["stale_reads"], device["dropped_reports"], device["partial_reads"],
+                     device["rearms"], device["resets"], device["errors"], error])
+    print_table(["#", "channel", "device", "api", "valid", "reports/s", "avg us", "max us", "writes", "reads",
+                 "stale", "dropped", "partial", "rearms", "resets", "errors", "last error"], rows)
+
+
+if __name__ == "__main__":
+    main()
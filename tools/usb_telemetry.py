@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+"""Shows the datagrams sent by modules built with USB_TELEMETRY.
+
+Set USB_TELEMETRY_HOST in main.c to the address of the machine running this,
+then:
+
+    tools/usb_telemetry.py
+    tools/usb_telemetry.py --port 28400
+
+Every console sending to the port gets its own rows, redrawn once a second.
+"""
+
+import argparse
+import select
+import socket
+import struct
+import sys
+import time
+
+MAGIC = 0x55534254
+VERSION = 2
+
+HEADER = struct.Struct(">IBBHII")
+DEVICE = struct.Struct(">BBBBHHHHHHHBBi8H")
+NO_CHANNEL = 0xFF
+
+API_TYPES = ["-", "VEN", "OH0", "HIDV4", "HIDV5", "NET"]
+STAGES = ["-", "OPEN", "VERSION", "-", "CHANGE", "ATTACH", "RESUME", "PARAMS",
+          "DESCRIPTOR", "POLL", "WATCHDOG", "INIT"]
+COUNTERS = ["reports", "reads", "dropped", "stale", "errors"]
+
+
+class Device:
+    def __init__(self):
+        self.seconds = 0.0
+        self.counts = dict.fromkeys(COUNTERS, 0)
+        self.latency = []
+        self.info = None
+
+    def add(self, seconds, fields):
+        (_, api_type, valid, samples, vid, pid, reports, reads, dropped, stale,
+         errors, stage, channel, error) = fields[:14]
+        self.seconds += seconds
+        for name, value in zip(COUNTERS, (reports, reads, dropped, stale, errors)):
+            self.counts[name] += value
+        self.latency.extend(fields[14:14 + samples])
+        self.info = (vid, pid, api_type, valid, channel, stage, error)
+
+
+def name(table, index):
+    return table[index] if index < len(table) else str(index)
+
+
+def parse(data, consoles, source):
+    if len(data) < HEADER.size:
+        return
+    magic, version, count, _, elapsed, tick_rate = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or not tick_rate:
+        return
+    seconds = elapsed / tick_rate
+    devices = consoles.setdefault(source, {})
+    for i in range(count):
+        offset = HEADER.size + i * DEVICE.size
+        if offset + DEVICE.size > len(data):
+            break
+        fields = DEVICE.unpack_from(data, offset)
+        devices.setdefault(fields[0], Device()).add(seconds, fields)
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+
+def draw(consoles):
+    headings = ["console", "#", "channel", "device", "api", "valid", "reports/s", "reads/s",
+                "p50 ms", "p95 ms", "max ms", "dropped", "stale", "errors", "last error"]
+    rows = []
+    for source in sorted(consoles):
+        for index in sorted(consoles[source]):
+            device = consoles[source][index]
+            vid, pid, api_type, valid, channel, stage, error = device.info
+            latency = sorted(device.latency)
+            if latency:
+                p50, p95, top = ("%.2f" % (percentile(latency, f) / 1000) for f in (0.5, 0.95, 1))
+            else:
+                p50 = p95 = top = "-"
+            rate = lambda count: "%.1f" % (count / device.seconds) if device.seconds else "-"
+            rows.append([source, index, "-" if channel == NO_CHANNEL else channel, "%04x:%04x" % (vid, pid), name(API_TYPES, api_type),
+                         "yes" if valid else "no", rate(device.counts["reports"]),
+                         rate(device.counts["reads"]), p50, p95, top, device.counts["dropped"],
+                         device.counts["stale"], device.counts["errors"],
+                         "%d@%s" % (error, name(STAGES, stage)) if stage else "-"])
+    widths = [max(len(str(row[i])) for row in [headings] + rows) for i in range(len(headings))]
+    sys.stdout.write("\x1b[H\x1b[2J")
+    for row in [headings] + rows:
+        sys.stdout.write("  ".join(str(cell).rjust(width) for cell, width in zip(row, widths)) + "\n")
+    sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--port", type=int, default=28400)
+    parser.add_argument("--bind", default="0.0.0.0")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.bind, args.port))
+    consoles = {}
+    next_draw = time.monotonic()
+    while True:
+        timeout = max(0, next_draw - time.monotonic())
+        if select.select([sock], [], [], timeout)[0]:
+            data, (address, _) = sock.recvfrom(2048)
+            parse(data, consoles, address)
+        if time.monotonic() >= next_draw:
+            draw(consoles)
+            # Rates are over the last second, the device and its error stay
+            for devices in consoles.values():
+                for device in devices.values():
+                    device.seconds = 0.0
+                    device.counts = dict.fromkeys(COUNTERS, 0)
+                    device.latency = []
+            next_draw += 1
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        pass